@@ -1,11 +1,15 @@
 from distutils.core import setup
 from distutils.extension import Extension
 from Cython.Build import cythonize
+import os
 import numpy
 
 ext_modules = [
     Extension("pymultimedia",
-              sources=["src/pymultimedia.pyx", "src/camera.c", "src/imageprocessing.c"])
+              sources=["src/pymultimedia.pyx", "src/camera.c", "src/imageprocessing.c", "src/simd.c", "src/threadpool.c", "src/taskgraph.c", "src/pipeline.c", "src/workspace.c", "src/asyncwriter.c", "src/recording.c", "src/replay.c", "src/stagestats.c"],
+              define_macros=[("NO_STAGE_STATS", None)] if os.environ.get("STAGE_STATS") == "0" else [],
+              extra_compile_args=["-pthread"],
+              extra_link_args=["-pthread"])
 ]
 
 setup(name="PyMultimedia",
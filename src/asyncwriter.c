@@ -0,0 +1,586 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+#include "asyncwriter.h"
+
+
+/* Each job is an open, a write and a close: all of them fit in the ring. */
+#define RING_ENTRIES        (4*WRITER_MAX_JOBS)
+#define JOB_STEPS           (3)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void unmap_ring(writer_ring* ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+/*
+*  Sets up the ring, and a table of WRITER_MAX_JOBS registered file slots:
+*  job i opens its file straight into slot i, so the write and the close
+*  after it can name the file before the open has run.
+*
+*  Returns 0, or -1 if the kernel does not have what the writer needs.
+*/
+static int init_ring(writer_ring* ring)
+{
+    struct io_uring_params params;
+    unsigned char* sq;
+    unsigned char* cq;
+    int slots[WRITER_MAX_JOBS];
+    int i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = io_uring_setup(RING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        unmap_ring(ring);
+        return -1;
+    }
+    ring->cqRing = ring->sqRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            unmap_ring(ring);
+            return -1;
+        }
+    }
+    ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        unmap_ring(ring);
+        return -1;
+    }
+
+    sq = (unsigned char*)ring->sqRing;
+    cq = (unsigned char*)ring->cqRing;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    for(i=0; i < WRITER_MAX_JOBS; i++)
+        slots[i] = -1;
+    if (io_uring_register(ring->fd, IORING_REGISTER_FILES, slots, WRITER_MAX_JOBS) < 0) {
+        unmap_ring(ring);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe* next_sqe(writer_ring* ring, unsigned long long user_data)
+{
+    unsigned index = ring->tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sqArray[index] = index;
+    ring->tail++;
+
+    return sqe;
+}
+
+/*
+*  Queues the open of path into slot, the write of iov to it and its close
+*  as one linked chain, with user_data numbering the steps from base.
+*/
+static void queue_chain(writer_ring* ring, int slot, const char* path, const struct iovec* iov, unsigned long long base)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = next_sqe(ring, base);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->len = 0666;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = next_sqe(ring, base + 1);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = slot;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 2;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    // A failed open or a short write cancels the close; the slot is then
+    // closed by the next open into it, or when the writer is destroyed.
+    sqe = next_sqe(ring, base + 2);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+}
+
+/*
+*  Writes a few bytes to /dev/null through the first slot, with the very
+*  chain a job uses, and checks every step. The chain needs a kernel that
+*  both opens into a slot (Linux 5.15) and looks the slot up for the write
+*  only once the open has run (5.18): before 5.15 the open ignores
+*  file_index and returns a plain descriptor, and before 5.18 the write
+*  finds the slot still empty. Either way the write fails with EBADF, which
+*  also cancels the close, so the close never names descriptor 0.
+*
+*  Returns 0, or -1 if the ring cannot write files as the jobs do.
+*/
+static int probe_ring(writer_ring* ring)
+{
+    struct io_uring_cqe* cqe;
+    unsigned char bytes[16];
+    struct iovec iov[2];
+    int results[JOB_STEPS];
+    unsigned head;
+    int seen = 0, submit = JOB_STEPS, result, step;
+
+    for(step=0; step < JOB_STEPS; step++)
+        results[step] = -1;
+    memset(bytes, 0, sizeof(bytes));
+    iov[0].iov_base = bytes;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = bytes + 8;
+    iov[1].iov_len = 8;
+    queue_chain(ring, 0, "/dev/null", iov, 0);
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+
+    while (seen < JOB_STEPS) {
+        result = io_uring_enter(ring->fd, submit, JOB_STEPS - seen, IORING_ENTER_GETEVENTS);
+        if (result < 0 && errno != EINTR)
+            return -1;
+        if (result > 0)
+            submit -= result;
+
+        head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cqMask];
+            step = (int)cqe->user_data;
+            if (step >= 0 && step < JOB_STEPS)
+                results[step] = cqe->res;
+            head++;
+            seen++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Into a slot the open returns 0, a plain open the descriptor.
+    if (results[0] > 0)
+        close(results[0]);
+
+    return (results[0] == 0 && results[1] == (int)sizeof(bytes) && results[2] == 0) ? 0 : -1;
+}
+
+// Queues the open, write and close of job as one linked chain.
+static void queue_ring_job(async_writer* writer, int job)
+{
+    write_job* p = &writer->jobs[job];
+
+    queue_chain(&writer->ring, job, p->path, p->iov, (unsigned long long)job*JOB_STEPS);
+
+    p->pending = JOB_STEPS;
+    writer->ring.outstanding += JOB_STEPS;
+}
+
+static void finish_job(async_writer* writer, int job)
+{
+    write_job* p = &writer->jobs[job];
+
+    writer->inFlight -= p->size;
+    writer->jobsInFlight--;
+    if (p->result < 0)
+        writer->failed++;
+    else
+        writer->written++;
+
+    p->next = writer->freeJobs;
+    writer->freeJobs = job;
+
+    if (p->done != NULL)
+        p->done(p->context, p->result);
+}
+
+// Submits what is queued, waiting for at least complete completions.
+static int enter_ring(async_writer* writer, unsigned complete)
+{
+    writer_ring* ring = &writer->ring;
+    unsigned queued;
+    int result;
+
+    // Whatever the kernel has not taken yet, from this call or an earlier one.
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    queued = ring->tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (queued == 0 && complete == 0)
+        return 0;
+
+    do {
+        writer->enters++;
+        result = io_uring_enter(ring->fd, queued, complete, (complete > 0) ? IORING_ENTER_GETEVENTS : 0);
+    } while (result < 0 && errno == EINTR);
+
+    return (result < 0) ? -1 : 0;
+}
+
+static int reap_ring(async_writer* writer)
+{
+    writer_ring* ring = &writer->ring;
+    struct io_uring_cqe* cqe;
+    unsigned head, tail;
+    int job, step, reaped = 0;
+
+    head = *ring->cqHead;
+    tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cqe = &ring->cqes[head & *ring->cqMask];
+        job = (int)(cqe->user_data / JOB_STEPS);
+        step = (int)(cqe->user_data % JOB_STEPS);
+        head++;
+        ring->outstanding--;
+
+        // The first failure of a chain is its result; the steps after it
+        // only report being cancelled.
+        if (writer->jobs[job].result == 0) {
+            if (cqe->res < 0)
+                writer->jobs[job].result = cqe->res;
+            else if (step == 1 && (size_t)cqe->res != writer->jobs[job].size)
+                writer->jobs[job].result = -EIO;
+        }
+        if (--writer->jobs[job].pending == 0) {
+            finish_job(writer, job);
+            reaped++;
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return reaped;
+}
+
+static void* writer_thread(void* context)
+{
+    async_writer* writer = (async_writer*)context;
+    write_job* p;
+    ssize_t written;
+    int job, fd;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queueCount == 0 && !writer->stopping)
+            pthread_cond_wait(&writer->queued, &writer->lock);
+        if (writer->queueCount == 0)
+            break;
+
+        job = writer->queue[writer->queueHead];
+        writer->queueHead = (writer->queueHead + 1) % WRITER_MAX_JOBS;
+        writer->queueCount--;
+        pthread_mutex_unlock(&writer->lock);
+
+        p = &writer->jobs[job];
+        p->result = 0;
+        fd = open(p->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            p->result = -errno;
+        } else {
+            do {
+                written = writev(fd, p->iov, 2);
+            } while (written == -1 && errno == EINTR);
+            if (written == -1)
+                p->result = -errno;
+            else if ((size_t)written != p->size)
+                p->result = -EIO;
+            if (close(fd) == -1 && p->result == 0)
+                p->result = -errno;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        p->next = writer->finishedJobs;
+        writer->finishedJobs = job;
+        pthread_cond_signal(&writer->finished);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+// Runs the done callbacks of the jobs the threads have finished.
+static int reap_threads(async_writer* writer, int wait)
+{
+    int job, next, reaped = 0;
+
+    pthread_mutex_lock(&writer->lock);
+    while (wait && writer->finishedJobs < 0)
+        pthread_cond_wait(&writer->finished, &writer->lock);
+    job = writer->finishedJobs;
+    writer->finishedJobs = -1;
+    pthread_mutex_unlock(&writer->lock);
+
+    for(; job >= 0; job=next) {
+        next = writer->jobs[job].next;
+        finish_job(writer, job);
+        reaped++;
+    }
+
+    return reaped;
+}
+
+/*
+*  Function: writer_init
+*  ---------------------
+*
+*  backend  WRITER_AUTO for io_uring where the kernel has it, threads
+*           where it does not; writer->backend says which it got.
+*  budget   The bytes writer_submit lets be in flight before it waits for
+*           files to finish. A file bigger than the budget is still written,
+*           on its own.
+*
+*  Returns 0, or -1 if the backend asked for is not available, or with
+*  errno set if the threads cannot be started.
+*/
+int writer_init(async_writer* writer, enum writer_backend backend, size_t budget)
+{
+    int i, result;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->ring.fd = -1;
+    writer->budget = budget;
+    writer->finishedJobs = -1;
+    for(i=0; i < WRITER_MAX_JOBS; i++)
+        writer->jobs[i].next = (i + 1 < WRITER_MAX_JOBS) ? i + 1 : -1;
+    writer->freeJobs = 0;
+
+    if (backend != WRITER_THREADS_ONLY) {
+        if (init_ring(&writer->ring) == 0) {
+            if (probe_ring(&writer->ring) == 0) {
+                writer->backend = WRITER_IO_URING;
+                return 0;
+            }
+            unmap_ring(&writer->ring);
+            writer->ring.fd = -1;
+        }
+        if (backend == WRITER_IO_URING)
+            return -1;
+    }
+
+    writer->backend = WRITER_THREADS_ONLY;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->queued, NULL);
+    pthread_cond_init(&writer->finished, NULL);
+    for(i=0; i < WRITER_THREADS; i++) {
+        result = pthread_create(&writer->threads[i], NULL, writer_thread, writer);
+        if (result != 0)
+            break;
+    }
+    if (i == WRITER_THREADS)
+        return 0;
+
+    // Stop the threads that did start.
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_broadcast(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    while (i-- > 0)
+        pthread_join(writer->threads[i], NULL);
+    pthread_cond_destroy(&writer->finished);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+    errno = result;
+
+    return -1;
+}
+
+/*
+*  Function: writer_destroy
+*  ------------------------
+*
+*  Waits for every file still in flight, then stops the writer.
+*/
+void writer_destroy(async_writer* writer)
+{
+    int i;
+
+    writer_flush(writer);
+
+    if (writer->backend == WRITER_IO_URING) {
+        unmap_ring(&writer->ring);
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = 1;
+    pthread_cond_broadcast(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    for(i=0; i < WRITER_THREADS; i++)
+        pthread_join(writer->threads[i], NULL);
+    pthread_cond_destroy(&writer->finished);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+}
+
+/*
+*  Function: writer_submit
+*  -----------------------
+*
+*  Queues header followed by data to be written to path, waiting first if
+*  the budget or the jobs are used up. header and data must stay as they
+*  are until done is called. With io_uring the job only goes to the kernel
+*  on the next writer_poll, writer_wait or writer_flush, so submitting the
+*  files of a frame and then polling sends them all in one system call.
+*
+*  Returns 0, or -1 with errno set if path is too long or the writer
+*  cannot get the job to the kernel.
+*/
+int writer_submit(async_writer* writer, const char* path, void* header, size_t headerSize, void* data, size_t dataSize,
+                  write_done done, void* context)
+{
+    write_job* p;
+    size_t size = headerSize + dataSize;
+    int job;
+
+    if (strlen(path) >= WRITER_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    while (writer->jobsInFlight == WRITER_MAX_JOBS || (writer->jobsInFlight > 0 && writer->inFlight + size > writer->budget)) {
+        if (writer_wait(writer) == -1)
+            return -1;
+    }
+
+    job = writer->freeJobs;
+    p = &writer->jobs[job];
+    writer->freeJobs = p->next;
+
+    strcpy(p->path, path);
+    p->iov[0].iov_base = header;
+    p->iov[0].iov_len = headerSize;
+    p->iov[1].iov_base = data;
+    p->iov[1].iov_len = dataSize;
+    p->size = size;
+    p->done = done;
+    p->context = context;
+    p->result = 0;
+    writer->inFlight += size;
+    writer->jobsInFlight++;
+
+    if (writer->backend == WRITER_IO_URING) {
+        queue_ring_job(writer, job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->queue[(writer->queueHead + writer->queueCount) % WRITER_MAX_JOBS] = job;
+    writer->queueCount++;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+
+    return 0;
+}
+
+/*
+*  Function: writer_poll
+*  ---------------------
+*
+*  Sends the jobs queued since the last call on their way and finishes
+*  those already written, without waiting.
+*
+*  Returns the number of files finished, or -1 if the ring failed.
+*/
+int writer_poll(async_writer* writer)
+{
+    if (writer->backend == WRITER_THREADS_ONLY)
+        return reap_threads(writer, 0);
+
+    if (enter_ring(writer, 0) == -1)
+        return -1;
+
+    return reap_ring(writer);
+}
+
+/*
+*  Function: writer_wait
+*  ---------------------
+*
+*  writer_poll, waiting for at least one file to finish if any are in
+*  flight.
+*/
+int writer_wait(async_writer* writer)
+{
+    int reaped;
+
+    if (writer->jobsInFlight == 0)
+        return 0;
+
+    if (writer->backend == WRITER_THREADS_ONLY)
+        return reap_threads(writer, 1);
+
+    reaped = writer_poll(writer);
+    while (reaped == 0) {
+        if (enter_ring(writer, 1) == -1)
+            return -1;
+        reaped = reap_ring(writer);
+    }
+
+    return reaped;
+}
+
+void writer_flush(async_writer* writer)
+{
+    // One wait for everything, rather than one per completion.
+    if (writer->backend == WRITER_IO_URING && writer->jobsInFlight > 0) {
+        if (enter_ring(writer, writer->ring.outstanding) == 0)
+            reap_ring(writer);
+    }
+
+    while (writer->jobsInFlight > 0) {
+        if (writer_wait(writer) == -1)
+            break;
+    }
+}
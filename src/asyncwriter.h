@@ -0,0 +1,100 @@
+#ifndef ASYNCWRITER_H_   /* Include guard */
+#define ASYNCWRITER_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+
+/* The most files a writer has in flight at once. */
+#define WRITER_MAX_JOBS           (64)
+#define WRITER_PATH_MAX           (256)
+
+/* The threads writing the files when io_uring is not available. */
+#define WRITER_THREADS            (2)
+
+enum writer_backend {
+        WRITER_AUTO,        /* io_uring if the kernel has it, threads otherwise. */
+        WRITER_IO_URING,
+        WRITER_THREADS_ONLY,
+};
+
+/*
+*  Called when a file is written, with 0 or a negative errno; from then on
+*  its header and data are the caller's again.
+*/
+typedef void (*write_done)(void* context, int result);
+
+typedef struct write_job_ {
+    char path[WRITER_PATH_MAX];
+    struct iovec iov[2];
+    size_t size;
+    write_done done;
+    void* context;
+    int result;
+    int pending;            /* Completions still to come. */
+    int next;               /* The next job on a free or finished list. */
+} write_job;
+
+typedef struct writer_ring_ {
+    int fd;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned tail;          /* Our submission tail, ahead of *sqTail until io_uring_enter. */
+    unsigned outstanding;   /* Completions still to come. */
+} writer_ring;
+
+/*
+*  Writes files in the background: each job opens, writes and closes one
+*  file, header and data in a single write. With io_uring the three are one
+*  linked chain of submissions, and the chains of every job queued since the
+*  last call go to the kernel together; without it, WRITER_THREADS threads
+*  do the same with plain system calls.
+*
+*  A writer is used from one thread: the done callbacks run on it, from
+*  writer_submit, writer_poll, writer_wait and writer_flush, and must not
+*  call the writer themselves.
+*/
+typedef struct async_writer_ {
+    enum writer_backend backend;    /* The one in use, never WRITER_AUTO. */
+    size_t budget;                  /* Bytes in flight before writer_submit waits. */
+    size_t inFlight;
+    int jobsInFlight;
+    write_job jobs[WRITER_MAX_JOBS];
+    int freeJobs;
+    writer_ring ring;
+    pthread_t threads[WRITER_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    int queue[WRITER_MAX_JOBS];     /* Jobs waiting for a thread. */
+    int queueHead;
+    int queueCount;
+    int finishedJobs;
+    int stopping;
+    long written;                   /* Files written, and files that failed. */
+    long failed;
+    long enters;                    /* io_uring_enter calls made. */
+} async_writer;
+
+int writer_init(async_writer* writer, enum writer_backend backend, size_t budget);
+void writer_destroy(async_writer* writer);
+int writer_submit(async_writer* writer, const char* path, void* header, size_t headerSize, void* data, size_t dataSize,
+                  write_done done, void* context);
+int writer_poll(async_writer* writer);
+int writer_wait(async_writer* writer);
+void writer_flush(async_writer* writer);
+
+#endif
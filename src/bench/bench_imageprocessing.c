@@ -0,0 +1,608 @@
+#define _GNU_SOURCE             /* sched_setaffinity() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+
+#include <getopt.h>             /* getopt_long() */
+
+#include "imageprocessing.h"
+
+
+/*
+*  Times the kernels of imageprocessing.h on synthetic frames, the same at
+*  every run: for each kernel and resolution, BENCH_WARMUP untimed calls and
+*  then up to BENCH_ITERATIONS timed ones, stopping early once the kernel has
+*  had BENCH_BUDGET seconds and BENCH_MIN_SAMPLES samples. Each result is the
+*  median and 99th percentile of the samples, in ns per pixel, and the bytes
+*  of the kernel's input and output images over the median, in MB/s. With
+*  few samples the 99th percentile is the slowest one.
+*
+*  The public entry points are timed, as callers use them, so the kernels
+*  that allocate their intermediates are timed with the allocation.
+*/
+#define BENCH_WARMUP        (2)
+#define BENCH_ITERATIONS    (30)
+#define BENCH_MIN_SAMPLES   (5)
+#define BENCH_BUDGET        (2.0)
+#define BENCH_MAX_KEYPOINTS (1000)
+
+typedef struct bench_resolution_ {
+    const char* name;
+    int width;
+    int height;
+} bench_resolution;
+
+static const bench_resolution resolutions[] = {
+    {"480p", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+};
+
+#define N_RESOLUTIONS ((int)(sizeof(resolutions)/sizeof(resolutions[0])))
+
+/* One synthetic frame, its derived inputs, and room for every output. */
+typedef struct bench_frame_ {
+    int width;
+    int height;
+    unsigned char* pYUYV;
+    unsigned char* pRGB;
+    unsigned char* pGray;
+    unsigned char* pOut;        /* Grayscale or RGB output. */
+    double* pDouble;            /* pGray as doubles. */
+    double* pDoubleOut;
+    double* DX;
+    double* DY;
+    double* magnitude;
+    derivative_bank bank;
+    keypoint* keypoints;
+    double kernel2D[25];
+    double kernel1D[7];
+} bench_frame;
+
+typedef void (*bench_function)(bench_frame* f);
+
+typedef struct bench_kernel_ {
+    const char* name;
+    double bytesPerPixel;       /* Of the input and output images together. */
+    bench_function run;
+} bench_kernel;
+
+
+static void benchYUYV2RGB24(bench_frame* f)
+{
+    YUYV2RGB24(f->pYUYV, f->width, f->height, f->pOut);
+}
+
+static void benchYUYV2Grayscale(bench_frame* f)
+{
+    YUYV2Grayscale(f->pYUYV, f->width, f->height, f->pOut);
+}
+
+static void benchRGB24toGrayscale(bench_frame* f)
+{
+    RGB24toGrayscale(f->pRGB, f->width, f->height, f->pOut);
+}
+
+static void benchCropRGB24(bench_frame* f)
+{
+    cropRGB24(f->pRGB, f->width, f->height, f->width/4, f->height/4, 3*f->width/4, 3*f->height/4, f->pOut);
+}
+
+static void benchConvolve2D(bench_frame* f)
+{
+    convolve2D(f->kernel2D, 5, f->pGray, f->width, f->height, f->pDoubleOut);
+}
+
+static void benchConvolve2Dwith1DkernelBorder(bench_frame* f)
+{
+    convolve2Dwith1DkernelBorder(f->kernel1D, 7, f->pDouble, f->width, f->height, f->pDoubleOut, HORIZONTAL, BORDER_REPLICATE);
+}
+
+static void benchBoxBlur(bench_frame* f)
+{
+    BoxBlur(f->pGray, f->width, f->height, f->pOut, 2);
+}
+
+static void benchUniformBlur(bench_frame* f)
+{
+    UniformBlur(f->pGray, f->width, f->height, f->pOut);
+}
+
+static void benchGaussianBlur2DKernel(bench_frame* f)
+{
+    GaussianBlur2DKernel(f->pGray, f->width, f->height, f->pOut, 1.0);
+}
+
+static void benchGaussianBlur(bench_frame* f)
+{
+    GaussianBlur(f->pGray, f->width, f->height, f->pOut, 1.0);
+}
+
+static void benchGaussianBlurInteger(bench_frame* f)
+{
+    GaussianBlurInteger(f->pGray, f->width, f->height, f->pOut, 1.0);
+}
+
+static void benchRecursiveGaussian1D(bench_frame* f)
+{
+    recursiveGaussian1D(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0, 0, HORIZONTAL);
+}
+
+static void benchGaussianFilterFIR(bench_frame* f)
+{
+    GaussianFilter(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0, 0, 0, GAUSSIAN_FIR);
+}
+
+static void benchGaussianFilterIIR(bench_frame* f)
+{
+    GaussianFilter(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0, 0, 0, GAUSSIAN_IIR);
+}
+
+static void benchGaussianDerivativeX(bench_frame* f)
+{
+    GaussianDerivativeX(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchGaussianDerivativeY(bench_frame* f)
+{
+    GaussianDerivativeY(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchGaussianDerivativeXX(bench_frame* f)
+{
+    GaussianDerivativeXX(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchGaussianDerivativeYY(bench_frame* f)
+{
+    GaussianDerivativeYY(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchGaussianDerivativeXY(bench_frame* f)
+{
+    GaussianDerivativeXY(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchGaussianDerivativeBank(bench_frame* f)
+{
+    GaussianDerivativeBank(f->pDouble, f->width, f->height, 2.0, DERIVATIVE_ALL, &f->bank);
+}
+
+static void benchGaussianWindow(bench_frame* f)
+{
+    GaussianWindow(f->pDouble, f->width, f->height, f->pDoubleOut, 2.0);
+}
+
+static void benchNonMaximumSuppression(bench_frame* f)
+{
+    NonMaximumSuppression(f->DX, f->DY, f->magnitude, f->width, f->height, f->pDoubleOut);
+}
+
+static void benchHysteresisThreshold(bench_frame* f)
+{
+    HysteresisThreshold(f->magnitude, f->width, f->height, 10.0, 5.0, f->pOut);
+}
+
+static void benchHysteresisThresholdParallel(bench_frame* f)
+{
+    HysteresisThresholdParallel(f->magnitude, f->width, f->height, 10.0, 5.0, f->pOut, getThreadCount());
+}
+
+static void benchCornerResponse(bench_frame* f)
+{
+    CornerResponse(f->DX, f->DY, f->width, f->height, 2.0, 0.06, 1000.0, CORNER_HARRIS, f->pDoubleOut);
+}
+
+static void benchDifferentialEdgeDetector(bench_frame* f)
+{
+    DifferentialEdgeDetector(f->pGray, f->width, f->height, f->pOut, 2.0, 10.0, 5.0);
+}
+
+static void benchCannyEdgeDetector(bench_frame* f)
+{
+    CannyEdgeDetector(f->pGray, f->width, f->height, f->pOut, 2.0, 10.0, 5.0);
+}
+
+static void benchCornerDetector(bench_frame* f)
+{
+    CornerDetector(f->pGray, f->width, f->height, f->pOut, 2.0, 2.0, 0.06, 1000.0);
+}
+
+static void benchCornerKeypoints(bench_frame* f)
+{
+    CornerKeypoints(f->pGray, f->width, f->height, 2.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, BENCH_MAX_KEYPOINTS, 8.0, f->keypoints);
+}
+
+static void benchConvertUcharToDoubleGrayscale(bench_frame* f)
+{
+    convertUcharToDoubleGrayscale(f->pGray, f->width, f->height, f->pDoubleOut);
+}
+
+static void benchConvertDoubleToUcharGrayscale(bench_frame* f)
+{
+    convertDoubleToUcharGrayscale(f->pDouble, f->width, f->height, f->pOut);
+}
+
+/* The parameters are those of the capture stages where they have one. */
+static const bench_kernel kernels[] = {
+    {"YUYV2RGB24", 5, benchYUYV2RGB24},
+    {"YUYV2Grayscale", 3, benchYUYV2Grayscale},
+    {"RGB24toGrayscale", 4, benchRGB24toGrayscale},
+    {"cropRGB24", 1.5, benchCropRGB24},
+    {"convolve2D", 9, benchConvolve2D},
+    {"convolve2Dwith1DkernelBorder", 16, benchConvolve2Dwith1DkernelBorder},
+    {"BoxBlur", 2, benchBoxBlur},
+    {"UniformBlur", 2, benchUniformBlur},
+    {"GaussianBlur2DKernel", 2, benchGaussianBlur2DKernel},
+    {"GaussianBlur", 2, benchGaussianBlur},
+    {"GaussianBlurInteger", 2, benchGaussianBlurInteger},
+    {"recursiveGaussian1D", 16, benchRecursiveGaussian1D},
+    {"GaussianFilterFIR", 16, benchGaussianFilterFIR},
+    {"GaussianFilterIIR", 16, benchGaussianFilterIIR},
+    {"GaussianDerivativeX", 16, benchGaussianDerivativeX},
+    {"GaussianDerivativeY", 16, benchGaussianDerivativeY},
+    {"GaussianDerivativeXX", 16, benchGaussianDerivativeXX},
+    {"GaussianDerivativeYY", 16, benchGaussianDerivativeYY},
+    {"GaussianDerivativeXY", 16, benchGaussianDerivativeXY},
+    {"GaussianDerivativeBank", 48, benchGaussianDerivativeBank},
+    {"GaussianWindow", 16, benchGaussianWindow},
+    {"NonMaximumSuppression", 32, benchNonMaximumSuppression},
+    {"HysteresisThreshold", 9, benchHysteresisThreshold},
+    {"HysteresisThresholdParallel", 9, benchHysteresisThresholdParallel},
+    {"CornerResponse", 24, benchCornerResponse},
+    {"DifferentialEdgeDetector", 2, benchDifferentialEdgeDetector},
+    {"CannyEdgeDetector", 2, benchCannyEdgeDetector},
+    {"CornerDetector", 2, benchCornerDetector},
+    {"CornerKeypoints", 1, benchCornerKeypoints},
+    {"convertUcharToDoubleGrayscale", 9, benchConvertUcharToDoubleGrayscale},
+    {"convertDoubleToUcharGrayscale", 9, benchConvertDoubleToUcharGrayscale},
+};
+
+#define N_KERNELS ((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+typedef struct bench_options_ {
+    int warmup;
+    int iterations;
+    double budget;
+    int cpu;                    /* Pinned to, or -1. */
+    const char* resolutions;    /* Comma separated names, or NULL for all. */
+    const char* kernels;
+    const char* output;         /* The JSON file, or NULL. */
+} bench_options;
+
+
+static unsigned int hash(unsigned int x, unsigned int y)
+{
+    unsigned int h = x*73856093u ^ y*19349663u;
+
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+
+    return h ^ (h >> 15);
+}
+
+/*
+*  A frame with something in it for every kernel: a gradient under a grid
+*  of squares of different contrast, for edges and corners, and a little
+*  noise. It depends on nothing but its size.
+*/
+static void makeSyntheticYUYV(unsigned char* pYUYV, int width, int height)
+{
+    int x, y, value, block;
+
+    for(y=0; y < height; y++) {
+        for(x=0; x < width; x++) {
+            value = 40 + (x*80)/width + (y*60)/height;
+            block = (x/48)*7 + (y/48)*13;
+            if ((x % 48) >= 8 && (x % 48) < 40 && (y % 48) >= 8 && (y % 48) < 40)
+                value += 20 + (block % 6)*20;
+            value += (int)(hash(x, y) % 9) - 4;
+            pYUYV[(y*width + x)*2] = (unsigned char)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+            pYUYV[(y*width + x)*2 + 1] = (unsigned char)(128 + ((x & 1) ? (y*32)/height : (x*32)/width) - 16);
+        }
+    }
+}
+
+static int allocBenchFrame(bench_frame* f, int width, int height)
+{
+    size_t pixels = (size_t)width*height;
+    int i;
+
+    memset(f, 0, sizeof(*f));
+    f->width = width;
+    f->height = height;
+    f->pYUYV = (unsigned char*)malloc(pixels*2);
+    f->pRGB = (unsigned char*)malloc(ALIGN_TO_FOUR(width*3)*(size_t)height);
+    f->pGray = (unsigned char*)malloc(pixels);
+    f->pOut = (unsigned char*)malloc(ALIGN_TO_FOUR(width*3)*(size_t)height);
+    f->pDouble = (double*)malloc(pixels*sizeof(double));
+    f->pDoubleOut = (double*)malloc(pixels*sizeof(double));
+    f->DX = (double*)malloc(pixels*sizeof(double));
+    f->DY = (double*)malloc(pixels*sizeof(double));
+    f->magnitude = (double*)malloc(pixels*sizeof(double));
+    f->keypoints = (keypoint*)malloc(BENCH_MAX_KEYPOINTS*sizeof(keypoint));
+    allocDerivativeBank(&f->bank, width, height, DERIVATIVE_ALL);
+    if (!f->pYUYV || !f->pRGB || !f->pGray || !f->pOut || !f->pDouble || !f->pDoubleOut || !f->DX || !f->DY
+        || !f->magnitude || !f->keypoints || !f->bank.DX || !f->bank.DY || !f->bank.DXX || !f->bank.DYY || !f->bank.DXY)
+        return -1;
+
+    makeSyntheticYUYV(f->pYUYV, width, height);
+    YUYV2RGB24(f->pYUYV, width, height, f->pRGB);
+    YUYV2Grayscale(f->pYUYV, width, height, f->pGray);
+    convertUcharToDoubleGrayscale(f->pGray, width, height, f->pDouble);
+    GaussianDerivativeX(f->pDouble, width, height, f->DX, 2.0);
+    GaussianDerivativeY(f->pDouble, width, height, f->DY, 2.0);
+    for(i=0; i < width*height; i++)
+        f->magnitude[i] = sqrt(f->DX[i]*f->DX[i] + f->DY[i]*f->DY[i]);
+
+    getGaussianKernel2D(f->kernel2D, 1.0, 5);
+    getGaussianKernel1D(f->kernel1D, 1.0, 7);
+
+    return 0;
+}
+
+static void freeBenchFrame(bench_frame* f)
+{
+    free(f->pYUYV);
+    free(f->pRGB);
+    free(f->pGray);
+    free(f->pOut);
+    free(f->pDouble);
+    free(f->pDoubleOut);
+    free(f->DX);
+    free(f->DY);
+    free(f->magnitude);
+    free(f->keypoints);
+    freeDerivativeBank(&f->bank);
+}
+
+// Whether name is one of the comma separated names of list; a NULL list names everything.
+static int listed(const char* list, const char* name)
+{
+    const char* start = list;
+    size_t length = strlen(name);
+
+    if (list == NULL)
+        return 1;
+
+    while (start != NULL && *start != '\0') {
+        if (strncmp(start, name, length) == 0 && (start[length] == ',' || start[length] == '\0'))
+            return 1;
+        start = strchr(start, ',');
+        if (start != NULL)
+            start++;
+    }
+
+    return 0;
+}
+
+static double nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec*1e9 + now.tv_nsec;
+}
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+typedef struct bench_result_ {
+    int samples;
+    double medianNs;
+    double p99Ns;
+    double minNs;
+} bench_result;
+
+static bench_result runKernel(const bench_kernel* kernel, bench_frame* f, bench_options opts)
+{
+    double* samples;
+    double start, spent = 0;
+    bench_result result;
+    int i, n = 0;
+
+    samples = (double*)malloc(opts.iterations*sizeof(double));
+
+    for(i=0; i < opts.warmup; i++)
+        kernel->run(f);
+
+    while (n < opts.iterations && (n < BENCH_MIN_SAMPLES || spent < opts.budget*1e9)) {
+        start = nowNs();
+        kernel->run(f);
+        samples[n] = nowNs() - start;
+        spent += samples[n++];
+    }
+
+    qsort(samples, n, sizeof(double), compareDoubles);
+    result.samples = n;
+    result.minNs = samples[0];
+    result.medianNs = (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2])/2;
+    result.p99Ns = samples[(int)ceil(0.99*n) - 1];
+    free(samples);
+
+    return result;
+}
+
+static const char* simdName(enum simd_level level)
+{
+    switch (level) {
+    case SIMD_SSE2:
+        return "sse2";
+    case SIMD_SSSE3:
+        return "ssse3";
+    case SIMD_AVX2:
+        return "avx2";
+    default:
+        return "none";
+    }
+}
+
+static void usage(FILE* fp, char* name)
+{
+    fprintf(fp,
+             "Usage: %s [options]\n"
+             "Options:\n"
+             "-r  | --resolutions list  Resolutions to run: 480p,720p,1080p,4k [all]\n"
+             "-k  | --kernels list      Kernels to run, by name [all]\n"
+             "-l  | --list              List the kernels\n"
+             "-w  | --warmup n          Untimed calls before timing [%d]\n"
+             "-n  | --iterations n      Most timed calls of each kernel [%d]\n"
+             "-s  | --seconds s         Stop timing a kernel after this long, once it has %d samples [%.1f]\n"
+             "-c  | --cpu n             Pin to this CPU\n"
+             "-t  | --threads n         Threads of the image processing pool [MULTIMEDIA_THREADS or one per CPU]\n"
+             "-o  | --output file       Write the results as JSON to file\n"
+             "-h  | --help              Print this message\n"
+             "",
+             name, BENCH_WARMUP, BENCH_ITERATIONS, BENCH_MIN_SAMPLES, BENCH_BUDGET);
+}
+
+static const char short_options[] = "r:k:lw:n:s:c:t:o:h";
+
+static const struct option
+long_options[] = {
+        { "resolutions", required_argument, NULL, 'r' },
+        { "kernels",     required_argument, NULL, 'k' },
+        { "list",        no_argument,       NULL, 'l' },
+        { "warmup",      required_argument, NULL, 'w' },
+        { "iterations",  required_argument, NULL, 'n' },
+        { "seconds",     required_argument, NULL, 's' },
+        { "cpu",         required_argument, NULL, 'c' },
+        { "threads",     required_argument, NULL, 't' },
+        { "output",      required_argument, NULL, 'o' },
+        { "help",        no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+};
+
+int main(int argc, char** argv)
+{
+    bench_options opts = {BENCH_WARMUP, BENCH_ITERATIONS, BENCH_BUDGET, -1, NULL, NULL, NULL};
+    bench_frame frame;
+    bench_result result;
+    cpu_set_t cpus;
+    FILE* json = NULL;
+    double pixels;
+    int r, k, c, first = 1;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'r':
+            opts.resolutions = optarg;
+            break;
+        case 'k':
+            opts.kernels = optarg;
+            break;
+        case 'l':
+            for(k=0; k < N_KERNELS; k++)
+                printf("%s\n", kernels[k].name);
+            return 0;
+        case 'w':
+            opts.warmup = atoi(optarg);
+            break;
+        case 'n':
+            opts.iterations = atoi(optarg);
+            break;
+        case 's':
+            opts.budget = atof(optarg);
+            break;
+        case 'c':
+            opts.cpu = atoi(optarg);
+            break;
+        case 't':
+            setThreadCount(atoi(optarg));
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'h':
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (opts.iterations < 1) {
+        fprintf(stderr, "At least one iteration is needed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opts.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(opts.cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("sched_setaffinity");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (opts.output != NULL) {
+        json = fopen(opts.output, "w");
+        if (json == NULL) {
+            perror(opts.output);
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"cpu\": %d,\n  \"warmup\": %d,\n"
+                      "  \"iterations\": %d,\n  \"seconds\": %g,\n  \"results\": [",
+                simdName(getSIMDLevel()), getThreadCount(), opts.cpu, opts.warmup, opts.iterations, opts.budget);
+    }
+
+    printf("SIMD %s, %d threads\n", simdName(getSIMDLevel()), getThreadCount());
+    printf("%-30s %-6s %8s %12s %12s %10s\n", "kernel", "size", "samples", "median ns/px", "p99 ns/px", "MB/s");
+
+    for(r=0; r < N_RESOLUTIONS; r++) {
+        if (!listed(opts.resolutions, resolutions[r].name))
+            continue;
+
+        if (allocBenchFrame(&frame, resolutions[r].width, resolutions[r].height) == -1) {
+            fprintf(stderr, "Out of memory for %s\n", resolutions[r].name);
+            freeBenchFrame(&frame);
+            continue;
+        }
+        pixels = (double)resolutions[r].width*resolutions[r].height;
+
+        for(k=0; k < N_KERNELS; k++) {
+            if (!listed(opts.kernels, kernels[k].name))
+                continue;
+
+            result = runKernel(&kernels[k], &frame, opts);
+            printf("%-30s %-6s %8d %12.3f %12.3f %10.1f\n", kernels[k].name, resolutions[r].name, result.samples,
+                   result.medianNs/pixels, result.p99Ns/pixels, kernels[k].bytesPerPixel*pixels*1e3/result.medianNs);
+            fflush(stdout);
+
+            if (json != NULL) {
+                fprintf(json, "%s\n    {\"kernel\": \"%s\", \"resolution\": \"%s\", \"width\": %d, \"height\": %d, "
+                              "\"samples\": %d, \"median_ns\": %.0f, \"p99_ns\": %.0f, \"min_ns\": %.0f, "
+                              "\"median_ns_per_pixel\": %.4f, \"p99_ns_per_pixel\": %.4f, \"mb_per_s\": %.1f}",
+                        first ? "" : ",", kernels[k].name, resolutions[r].name, resolutions[r].width, resolutions[r].height,
+                        result.samples, result.medianNs, result.p99Ns, result.minNs, result.medianNs/pixels,
+                        result.p99Ns/pixels, kernels[k].bytesPerPixel*pixels*1e3/result.medianNs);
+                first = 0;
+            }
+        }
+
+        freeBenchFrame(&frame);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    return 0;
+}
@@ -13,13 +13,28 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include <linux/videodev2.h>
 
 #include "imageprocessing.h"
+#include "taskgraph.h"
+#include "pipeline.h"
+#include "asyncwriter.h"
+#include "recording.h"
+#include "replay.h"
+#include "stagestats.h"
 #include "camera.h"
 
 
+/*
+*  With opts.async_writes, the bytes of output a capture lets be in flight,
+*  and the sets of frame outputs a serial capture takes turns with, so that
+*  one frame is processed while the files of the ones before it are written.
+*/
+#define ASYNC_WRITE_BUDGET  (64*1024*1024)
+#define ASYNC_FRAME_SETS    (3)
+
 void errno_exit(const char *s)
 {
         fprintf(stderr, "%s error %d, %s\\n", s, errno, strerror(errno));
@@ -37,75 +52,459 @@ int xioctl(int fh, int request, void *arg)
         return r;
 }
 
-void process_image(const void *p, int size, unsigned int width, unsigned int height, char* output_filestring,
-                   int frame_number, crop_window c_window)
-{
-    char output_filename[50], output_cropped_filename[50],
-         output_grayscale_filename[50],
-         output_blurred_uniform_filename[50], output_blurred_gaussian_filename[50],
-         output_blurred_gaussian2d_filename[50], output_differential_edge_detector_filename[50],
-         output_canny_edge_detector_filename[50], output_corner_detector_filename[50];
-    unsigned char *pRGB24, *pCroppedRGB24, *pGrayscale, *pGrayscalePadded, *pGrayscaleBlurred, *pGrayscaleBlurredGaussian,
-        *pGrayscaleBlurredGaussian2d, *pDifferentialEdges, *pCannyEdges, *pCorners;
-    pRGB24 = (unsigned char*)malloc(ALIGN_TO_FOUR(3*width)*height);
-    pGrayscale = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pGrayscalePadded = (unsigned char*)malloc(ALIGN_TO_FOUR(ALIGN_TO_FOUR(width + 2*1)*(height + 2*1)));
-    pGrayscaleBlurred = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pGrayscaleBlurredGaussian = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pGrayscaleBlurredGaussian2d = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pDifferentialEdges = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pCannyEdges = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pCorners = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
-    pCroppedRGB24 = (unsigned char*)malloc(ALIGN_TO_FOUR(3*(c_window.end_x - c_window.start_x))*(c_window.end_y - c_window.start_y));
-
-    sprintf(output_filename, "%s-%d.bmp", output_filestring, frame_number);
-    sprintf(output_cropped_filename, "%s-%d-cropped.bmp", output_filestring, frame_number);
-    sprintf(output_grayscale_filename, "%s-%d-gray.bmp", output_filestring, frame_number);
-    sprintf(output_blurred_uniform_filename, "%s-%d-gray-blurred-uniform.bmp", output_filestring, frame_number);
-    sprintf(output_blurred_gaussian_filename, "%s-%d-gray-blurred-gaussian.bmp", output_filestring, frame_number);
-    sprintf(output_blurred_gaussian2d_filename, "%s-%d-gray-blurred-gaussian-2d.bmp", output_filestring, frame_number);
-    sprintf(output_differential_edge_detector_filename, "%s-%d-differential-edges.bmp", output_filestring, frame_number);
-    sprintf(output_canny_edge_detector_filename, "%s-%d-canny-edges.bmp", output_filestring, frame_number);
-    sprintf(output_corner_detector_filename, "%s-%d-corners.bmp", output_filestring, frame_number);
-
-    YUYV2RGB24((unsigned char *)p, width, height, pRGB24);
-    RGB24toGrayscale(pRGB24, width, height, pGrayscale);
-    UniformBlur(pGrayscale, width, height, pGrayscaleBlurred);
-    GaussianBlur2DKernel(pGrayscale, width, height, pGrayscaleBlurredGaussian2d, 1.0);
-    GaussianBlur(pGrayscale, width, height, pGrayscaleBlurredGaussian, 1.0);
-    DifferentialEdgeDetector(pGrayscale, width, height, pDifferentialEdges, 2.0, 10.0, 5.0);
-    CannyEdgeDetector(pGrayscale, width, height, pCannyEdges, 2.0, 10.0, 5.0);
-    CornerDetector(pGrayscale, width, height, pCorners, 2.0, 2.0, 0.06, 1000.0);
-
-    GrayScaleWriter(pGrayscale, width, height, output_grayscale_filename);
-    GrayScaleWriter(pGrayscaleBlurred, width, height, output_blurred_uniform_filename);
-    GrayScaleWriter(pGrayscaleBlurredGaussian, width, height, output_blurred_gaussian_filename);
-    GrayScaleWriter(pGrayscaleBlurredGaussian2d, width, height, output_blurred_gaussian2d_filename);
-    GrayScaleWriter(pDifferentialEdges, width, height, output_differential_edge_detector_filename);
-    GrayScaleWriter(pCannyEdges, width, height, output_canny_edge_detector_filename);
-    GrayScaleWriter(pCorners, width, height, output_corner_detector_filename);
-    cropRGB24(pRGB24, width, height, c_window.start_x, c_window.start_y, c_window.end_x, c_window.end_y, pCroppedRGB24);
-    BMPwriter(pCroppedRGB24, 24, (c_window.end_x - c_window.start_x), (c_window.end_y - c_window.start_y), output_cropped_filename);
-    BMPwriter(pRGB24, 24, width, height, output_filename);
-    free(pRGB24);
-    free(pCroppedRGB24);
-    free(pGrayscale);
-    free(pGrayscalePadded);
-    free(pGrayscaleBlurred);
-    free(pGrayscaleBlurredGaussian);
-    free(pGrayscaleBlurredGaussian2d);
-    free(pDifferentialEdges);
-    free(pCannyEdges);
-    free(pCorners);
+/*
+*  The work of process_image on one frame: its images, and the file each
+*  one is written to.
+*/
+typedef struct frame_output_ {
+    unsigned char* image;
+    int bitNum;
+    int width;
+    int height;
+    char filename[50];
+    unsigned char header[BMP_MAX_HEADER_SIZE];  /* Made once, for every frame. */
+    int headerSize;
+    int* pendingWrites;                         /* Of its frame, while it is being written. */
+    uint64_t submitted;                         /* When it was handed to the writer, for STAGE_WRITE. */
+} frame_output;
+
+enum frame_outputs {
+        OUTPUT_RGB,
+        OUTPUT_CROPPED,
+        OUTPUT_GRAYSCALE,
+        OUTPUT_BLURRED_UNIFORM,
+        OUTPUT_BLURRED_GAUSSIAN,
+        OUTPUT_BLURRED_GAUSSIAN_2D,
+        OUTPUT_DIFFERENTIAL_EDGES,
+        OUTPUT_CANNY_EDGES,
+        OUTPUT_CORNERS,
+        FRAME_OUTPUTS,
+};
+
+typedef struct frame_stages_ {
+    unsigned char* pYUYV;
+    unsigned int width;
+    unsigned int height;
+    crop_window c_window;
+    frame_output outputs[FRAME_OUTPUTS];
+    unsigned char* pCopy;           /* Where the frame is copied to with REQUEUE_AFTER_COPY. */
+    graph_function converted;       /* Run as soon as pYUYV is no longer needed, if set. */
+    void* convertedContext;
+    async_writer* writer;           /* Where the outputs are written, or NULL to write them in the graph. */
+    int pendingWrites;              /* Outputs the writer has not finished with. */
+    recording_writer* recording;    /* Where the frame is recorded instead, or NULL. */
+    unsigned int sequence;          /* The driver's, for the recording. */
+    struct timeval timestamp;
+} frame_stages;
+
+/*
+*  The stages take their scratch from a workspace of the thread they run on:
+*  a stage runs start to finish on one thread and the kernels give back all
+*  they take, so every stage a thread runs shares one workspace. It is set
+*  up for the frame resolution on first use, grows to what the stages the
+*  thread runs need, and is freed when the thread exits.
+*/
+static pthread_key_t workspace_key;
+static pthread_once_t workspace_once = PTHREAD_ONCE_INIT;
+
+static void freeStageWorkspace(void* ws)
+{
+    freeWorkspace((ip_workspace*)ws);
+    free(ws);
+}
+
+static void makeWorkspaceKey(void)
+{
+    pthread_key_create(&workspace_key, freeStageWorkspace);
+}
+
+static ip_workspace* stageWorkspace(frame_stages* frame)
+{
+    ip_workspace* ws;
+
+    pthread_once(&workspace_once, makeWorkspaceKey);
+    ws = (ip_workspace*)pthread_getspecific(workspace_key);
+    if (ws == NULL) {
+        ws = (ip_workspace*)calloc(1, sizeof(ip_workspace));
+        pthread_setspecific(workspace_key, ws);
+    }
+
+    if (ws->width != frame->width || ws->height != frame->height) {
+        freeWorkspace(ws);
+        initWorkspace(ws, frame->width, frame->height);
+    }
+
+    return ws;
+}
+
+static void stageYUYV2Grayscale(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    YUYV2Grayscale(frame->pYUYV, frame->width, frame->height, frame->outputs[OUTPUT_GRAYSCALE].image);
+    STAGE_RECORD(STAGE_CONVERT_GRAY, start);
+}
+
+static void stageYUYV2RGB24(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
 
+    YUYV2RGB24(frame->pYUYV, frame->width, frame->height, frame->outputs[OUTPUT_RGB].image);
+    STAGE_RECORD(STAGE_CONVERT_RGB, start);
+}
+
+static void stageRGB24toGrayscale(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    RGB24toGrayscale(frame->outputs[OUTPUT_RGB].image, frame->width, frame->height, frame->outputs[OUTPUT_GRAYSCALE].image);
+    STAGE_RECORD(STAGE_CONVERT_GRAY, start);
+}
+
+static void stageCrop(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    cropRGB24(frame->outputs[OUTPUT_RGB].image, frame->width, frame->height, frame->c_window.start_x, frame->c_window.start_y,
+              frame->c_window.end_x, frame->c_window.end_y, frame->outputs[OUTPUT_CROPPED].image);
+    STAGE_RECORD(STAGE_CROP, start);
+}
+
+static void stageUniformBlur(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    UniformBlur_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height, frame->outputs[OUTPUT_BLURRED_UNIFORM].image,
+                   stageWorkspace(frame));
+    STAGE_RECORD(STAGE_UNIFORM_BLUR, start);
+}
+
+static void stageGaussianBlur2D(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    GaussianBlur2DKernel_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height,
+                            frame->outputs[OUTPUT_BLURRED_GAUSSIAN_2D].image, 1.0, stageWorkspace(frame));
+    STAGE_RECORD(STAGE_GAUSSIAN_BLUR_2D, start);
+}
+
+static void stageGaussianBlur(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    GaussianBlur_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height, frame->outputs[OUTPUT_BLURRED_GAUSSIAN].image, 1.0,
+                    stageWorkspace(frame));
+    STAGE_RECORD(STAGE_GAUSSIAN_BLUR, start);
+}
+
+static void stageDifferentialEdges(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    DifferentialEdgeDetector_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height,
+                                frame->outputs[OUTPUT_DIFFERENTIAL_EDGES].image, 2.0, 10.0, 5.0, stageWorkspace(frame));
+    STAGE_RECORD(STAGE_DIFFERENTIAL_EDGES, start);
+}
+
+static void stageCannyEdges(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    CannyEdgeDetector_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height, frame->outputs[OUTPUT_CANNY_EDGES].image,
+                         2.0, 10.0, 5.0, stageWorkspace(frame));
+    STAGE_RECORD(STAGE_CANNY_EDGES, start);
+}
+
+static void stageCorners(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+    STAGE_CLOCK(start);
+
+    CornerDetector_ws(frame->outputs[OUTPUT_GRAYSCALE].image, frame->width, frame->height, frame->outputs[OUTPUT_CORNERS].image,
+                      2.0, 2.0, 0.06, 1000.0, stageWorkspace(frame));
+    STAGE_RECORD(STAGE_CORNERS, start);
+}
+
+static void stageWrite(void* context)
+{
+    frame_output* output = (frame_output*)context;
+    STAGE_CLOCK(start);
+
+    if (BMPWritev(output->header, output->headerSize, output->image, output->bitNum, output->width, output->height,
+                  output->filename) == -1)
+        perror(output->filename);
+    STAGE_RECORD(STAGE_WRITE, start);
+}
+
+static void record_plane(frame_stages* frame, int stream, enum recording_format format, unsigned char* image, int width, int height,
+                         int stride)
+{
+    recording_frame plane;
+
+    memset(&plane, 0, sizeof(plane));
+    plane.stream = stream;
+    plane.format = format;
+    plane.width = width;
+    plane.height = height;
+    plane.stride = stride;
+    plane.sequence = frame->sequence;
+    plane.timestampSec = frame->timestamp.tv_sec;
+    plane.timestampUsec = frame->timestamp.tv_usec;
+    plane.size = (uint64_t)stride*height;
+
+    STAGE_CLOCK(start);
+    if (recording_append(frame->recording, &plane, image) == -1)
+        perror("recording");
+    STAGE_RECORD(STAGE_RECORDING, start);
+}
+
+// Records the YUYV frame as stream 0 of the recording.
+static void stageRecordYUYV(void* context)
+{
+    frame_stages* frame = (frame_stages*)context;
+
+    record_plane(frame, 0, RECORDING_YUYV, frame->pYUYV, frame->width, frame->height, 2*frame->width);
+}
+
+// Records each output image as stream 1 + its frame_outputs number.
+static void record_frame_outputs(frame_stages* frame)
+{
+    frame_output* output;
+    int i;
+
+    for(i=0; i < FRAME_OUTPUTS; i++) {
+        output = &frame->outputs[i];
+        if (output->image != NULL)
+            record_plane(frame, 1 + i, (output->bitNum == 8) ? RECORDING_GRAY : RECORDING_RGB24, output->image, output->width,
+                         output->height, ALIGN_TO_FOUR(output->width*output->bitNum/8));
+    }
+}
+
+static const char* output_suffixes[FRAME_OUTPUTS] = {
+    "", "-cropped", "-gray", "-gray-blurred-uniform", "-gray-blurred-gaussian", "-gray-blurred-gaussian-2d",
+    "-differential-edges", "-canny-edges", "-corners"
+};
+
+static void alloc_frame_outputs(frame_stages* frame, unsigned int width, unsigned int height, crop_window c_window,
+                                capture_options opts)
+{
+    int i;
+
+    frame->width = width;
+    frame->height = height;
+    frame->c_window = c_window;
+    for(i=0; i < FRAME_OUTPUTS; i++) {
+        frame->outputs[i].bitNum = 8;
+        frame->outputs[i].width = width;
+        frame->outputs[i].height = height;
+        frame->outputs[i].image = NULL;
+        if (i >= OUTPUT_GRAYSCALE)
+            frame->outputs[i].image = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
+    }
+    frame->outputs[OUTPUT_RGB].bitNum = 24;
+    frame->outputs[OUTPUT_CROPPED].bitNum = 24;
+    frame->outputs[OUTPUT_CROPPED].width = c_window.end_x - c_window.start_x;
+    frame->outputs[OUTPUT_CROPPED].height = c_window.end_y - c_window.start_y;
+    for(i=0; i < FRAME_OUTPUTS; i++)
+        frame->outputs[i].headerSize = BMPHeader(frame->outputs[i].header, frame->outputs[i].bitNum, frame->outputs[i].width,
+                                                 frame->outputs[i].height);
+    frame->pCopy = NULL;
+    frame->converted = NULL;
+    frame->convertedContext = NULL;
+    frame->writer = NULL;
+    frame->pendingWrites = 0;
+    frame->recording = NULL;
+    frame->sequence = 0;
+    frame->timestamp.tv_sec = 0;
+    frame->timestamp.tv_usec = 0;
+    if (!opts.grayscale_only) {
+        frame->outputs[OUTPUT_RGB].image = (unsigned char*)malloc(ALIGN_TO_FOUR(3*width)*height);
+        frame->outputs[OUTPUT_CROPPED].image = (unsigned char*)malloc(ALIGN_TO_FOUR(3*(c_window.end_x - c_window.start_x))*
+                                                                      (c_window.end_y - c_window.start_y));
+    }
+}
+
+static void name_frame_outputs(frame_stages* frame, char* output_filestring, int frame_number)
+{
+    int i;
+
+    for(i=0; i < FRAME_OUTPUTS; i++)
+        sprintf(frame->outputs[i].filename, "%s-%d%s.bmp", output_filestring, frame_number, output_suffixes[i]);
+}
+
+static void free_frame_outputs(frame_stages* frame)
+{
+    int i;
+
+    for(i=0; i < FRAME_OUTPUTS; i++)
+        free(frame->outputs[i].image);
+}
+
+/*
+*  Runs the stages of one frame as a task graph, with a write task after
+*  each output if write_outputs is set, and frame->converted after the
+*  stages that read the YUYV frame. With a recording, write_outputs records
+*  the YUYV frame alongside the other stages instead, and the outputs are
+*  left for record_frame_outputs. The graph is left in graph, for its
+*  timings.
+*/
+static void run_frame_stages(frame_stages* frame, capture_options opts, int write_outputs, task_graph* graph)
+{
+    int i, rgb, gray, crop, record;
+    int producers[FRAME_OUTPUTS];
+    STAGE_CLOCK(start);
+
+    initTaskGraph(graph);
+
+    record = -1;
+    if (write_outputs && frame->recording != NULL) {
+        record = addTask(graph, "record", stageRecordYUYV, frame, 0);
+        write_outputs = 0;
+    }
+
+    // Without any RGB output the luminance is taken straight from the Y samples,
+    // skipping the RGB24 intermediate altogether.
+    rgb = crop = -1;
+    if (opts.grayscale_only) {
+        gray = addTask(graph, "yuyv2grayscale", stageYUYV2Grayscale, frame, 0);
+    } else {
+        rgb = addTask(graph, "yuyv2rgb24", stageYUYV2RGB24, frame, 0);
+        gray = addTask(graph, "rgb24togray", stageRGB24toGrayscale, frame, 1, rgb);
+    }
+    if (frame->converted != NULL) {
+        if (record >= 0)
+            addTask(graph, "requeue", frame->converted, frame->convertedContext, 2, (rgb >= 0) ? rgb : gray, record);
+        else
+            addTask(graph, "requeue", frame->converted, frame->convertedContext, 1, (rgb >= 0) ? rgb : gray);
+    }
+
+    // The slowest stages first, so they start first.
+    producers[OUTPUT_CANNY_EDGES] = addTask(graph, "canny", stageCannyEdges, frame, 1, gray);
+    producers[OUTPUT_DIFFERENTIAL_EDGES] = addTask(graph, "differential", stageDifferentialEdges, frame, 1, gray);
+    producers[OUTPUT_CORNERS] = addTask(graph, "corners", stageCorners, frame, 1, gray);
+    producers[OUTPUT_BLURRED_GAUSSIAN_2D] = addTask(graph, "gaussian2d", stageGaussianBlur2D, frame, 1, gray);
+    producers[OUTPUT_BLURRED_GAUSSIAN] = addTask(graph, "gaussian", stageGaussianBlur, frame, 1, gray);
+    producers[OUTPUT_BLURRED_UNIFORM] = addTask(graph, "uniform", stageUniformBlur, frame, 1, gray);
+    producers[OUTPUT_GRAYSCALE] = gray;
+    if (!opts.grayscale_only) {
+        crop = addTask(graph, "crop", stageCrop, frame, 1, rgb);
+        producers[OUTPUT_RGB] = rgb;
+        producers[OUTPUT_CROPPED] = crop;
+    }
+
+    if (write_outputs) {
+        for(i=0; i < FRAME_OUTPUTS; i++) {
+            if (frame->outputs[i].image != NULL)
+                addTask(graph, frame->outputs[i].filename, stageWrite, &frame->outputs[i], 1, producers[i]);
+        }
+    }
+
+    runTaskGraph(graph);
+    STAGE_RECORD(STAGE_FRAME, start);
+}
+
+static void report_frame(int frame_number, double milliseconds, double critical_path, capture_options opts)
+{
     fflush(stderr);
-    fprintf(stderr, ".");
+    if (opts.report_timing)
+        fprintf(stderr, "frame %d: %.2f ms, critical path %.2f ms\n", frame_number, milliseconds, critical_path);
+    else
+        fprintf(stderr, ".");
+    stage_stats_poll();
 }
 
-int read_frame(int device_handle, buffers buffs,
-                      char* output_filestring, int frame_number, crop_window c_window)
+static void output_written(void* context, int result)
+{
+    frame_output* output = (frame_output*)context;
+
+    STAGE_RECORD(STAGE_WRITE, output->submitted);
+    (*output->pendingWrites)--;
+    if (result < 0)
+        fprintf(stderr, "%s: %s\n", output->filename, strerror(-result));
+}
+
+// Hands the outputs of frame to its writer, all in one go.
+static void submit_frame_outputs(frame_stages* frame)
+{
+    frame_output* output;
+    int i;
+
+    for(i=0; i < FRAME_OUTPUTS; i++) {
+        output = &frame->outputs[i];
+        if (output->image == NULL)
+            continue;
+
+        output->pendingWrites = &frame->pendingWrites;
+        frame->pendingWrites++;
+        STAGE_MARK(output->submitted);
+        if (writer_submit(frame->writer, output->filename, output->header, output->headerSize, output->image,
+                          (size_t)ALIGN_TO_FOUR(output->width*output->bitNum/8)*output->height, output_written, output) == -1) {
+            perror(output->filename);
+            frame->pendingWrites--;
+        }
+    }
+
+    writer_poll(frame->writer);
+}
+
+/*
+*  process_image into output images allocated once for the resolution. With
+*  a writer the outputs are only on their way to disk when this returns:
+*  frame is not to be used again until frame->pendingWrites is back to 0.
+*/
+static void process_frame(frame_stages* frame, const void *p, char* output_filestring, int frame_number, capture_options opts)
+{
+    task_graph graph;
+
+    frame->pYUYV = (unsigned char *)p;
+    name_frame_outputs(frame, output_filestring, frame_number);
+    run_frame_stages(frame, opts, frame->writer == NULL || frame->recording != NULL, &graph);
+    if (frame->recording != NULL)
+        record_frame_outputs(frame);
+    else if (frame->writer != NULL)
+        submit_frame_outputs(frame);
+    report_frame(frame_number, graph.wallTime, graph.criticalPath, opts);
+}
+
+/*
+*  Function: process_image
+*  -----------------------
+*
+*  Converts a YUYV frame, runs the filters and detectors on its grayscale
+*  image and writes every result to a bitmap.
+*
+*  The stages are a task graph (see runTaskGraph): all the filters and
+*  detectors only need the grayscale image, and each write only the stage
+*  that makes its image, so they run side by side on the thread pool, with
+*  the writes overlapping the stages still computing. The frame takes about
+*  as long as its longest chain of stages rather than the sum of them all;
+*  opts.report_timing prints both figures for every frame.
+*/
+void process_image(const void *p, int size, unsigned int width, unsigned int height, char* output_filestring,
+                   int frame_number, crop_window c_window, capture_options opts)
+{
+    frame_stages frame;
+
+    alloc_frame_outputs(&frame, width, height, c_window, opts);
+    process_frame(&frame, p, output_filestring, frame_number, opts);
+    free_frame_outputs(&frame);
+}
+
+/*
+*  Takes the next filled buffer from the device: its data, and in buf what
+*  requeue_buffer needs to hand it back. Returns 0 if no frame is ready yet.
+*/
+static int dequeue_buffer(int device_handle, buffers buffs, struct v4l2_buffer* buf, void** start, unsigned int* bytesused)
 {
-        struct v4l2_buffer buf;
         unsigned int i;
 
         switch (buffs.io_selection) {
@@ -125,17 +524,17 @@ int read_frame(int device_handle, buffers buffs,
                         }
                 }
 
-                process_image(buffs.buffers[0].start, buffs.buffers[0].length, buffs.image_width, buffs.image_height,
-                              output_filestring, frame_number, c_window);
+                *start = buffs.buffers[0].start;
+                *bytesused = buffs.buffers[0].length;
                 break;
 
         case IO_METHOD_MMAP:
-                CLEAR(buf);
+                CLEAR(*buf);
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
+                buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf->memory = V4L2_MEMORY_MMAP;
 
-                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, &buf)) {
+                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, buf)) {
                         switch (errno) {
                         case EAGAIN:
                                 return 0;
@@ -150,22 +549,19 @@ int read_frame(int device_handle, buffers buffs,
                         }
                 }
 
-                assert(buf.index < buffs.n_buffers);
+                assert(buf->index < buffs.n_buffers);
 
-                process_image(buffs.buffers[buf.index].start, buf.bytesused, buffs.image_width, buffs.image_height,
-                              output_filestring, frame_number, c_window);
-
-                if (-1 == xioctl(device_handle, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
+                *start = buffs.buffers[buf->index].start;
+                *bytesused = buf->bytesused;
                 break;
 
         case IO_METHOD_USERPTR:
-                CLEAR(buf);
+                CLEAR(*buf);
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
+                buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf->memory = V4L2_MEMORY_USERPTR;
 
-                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, &buf)) {
+                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, buf)) {
                         switch (errno) {
                         case EAGAIN:
                                 return 0;
@@ -181,122 +577,248 @@ int read_frame(int device_handle, buffers buffs,
                 }
 
                 for (i = 0; i < buffs.n_buffers; ++i)
-                        if (buf.m.userptr == (unsigned long)buffs.buffers[i].start
-                            && buf.length == buffs.buffers[i].length)
+                        if (buf->m.userptr == (unsigned long)buffs.buffers[i].start
+                            && buf->length == buffs.buffers[i].length)
                                 break;
 
                 assert(i < buffs.n_buffers);
 
-                process_image((void *)buf.m.userptr, buf.bytesused, buffs.image_width, buffs.image_height,
-                              output_filestring, frame_number, c_window);
+                *start = (void *)buf->m.userptr;
+                *bytesused = buf->bytesused;
+                break;
+
+        case IO_METHOD_REPLAY:
+                CLEAR(*buf);
+
+                /* Any buffer not held by a borrowed_frame is free to use. */
+                for (i = 0; i < buffs.n_buffers; ++i)
+                        if (!__atomic_load_n(&buffs.buffers[i].borrowed, __ATOMIC_ACQUIRE))
+                                break;
 
-                if (-1 == xioctl(device_handle, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
+                assert(i < buffs.n_buffers);
+
+                switch (replay_next(buffs.replay, start, bytesused, &buf->sequence, &buf->timestamp)) {
+                case 0:
+                        return 0;
+
+                case -1:
+                        errno_exit("replay");
+                }
+
+                buf->index = i;
+                buf->bytesused = *bytesused;
                 break;
         }
 
         return 1;
 }
 
-int grab_frame(int device_handle, buffers buffs, unsigned char* image_buffer)
+static void requeue_buffer(int device_handle, buffers buffs, struct v4l2_buffer* buf)
+{
+        if (buffs.io_selection == IO_METHOD_READ || buffs.io_selection == IO_METHOD_REPLAY)
+                return;
+
+        if (-1 == xioctl(device_handle, VIDIOC_QBUF, buf))
+                errno_exit("VIDIOC_QBUF");
+}
+
+static unsigned int borrowed_buffers(buffers buffs)
 {
-        struct v4l2_buffer buf;
         unsigned int i;
+        unsigned int count = 0;
 
-        switch (buffs.io_selection) {
-        case IO_METHOD_READ:
-                if (-1 == read(device_handle, buffs.buffers[0].start, buffs.buffers[0].length)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+        for (i = 0; i < buffs.n_buffers; ++i)
+                count += __atomic_load_n(&buffs.buffers[i].borrowed, __ATOMIC_ACQUIRE);
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+        return count;
+}
 
-                                /* fall through */
+/*
+*  Function: borrow_frame
+*  ----------------------
+*
+*  Takes the next filled buffer from the device without copying it: frame
+*  points straight into the driver's buffer, which is ours until
+*  release_frame queues it again. With MMAP and USERPTR up to n_buffers -
+*  MIN_QUEUED_BUFFERS frames can be held at once, with READ only one, as
+*  the next read overwrites it. Frames may be released from any thread.
+*
+*  Returns 1 with frame filled in, 0 if no frame is ready yet, or -1 with
+*  errno set to EBUSY if too many frames are already held.
+*/
+int borrow_frame(int device_handle, buffers buffs, borrowed_frame* frame)
+{
+        struct v4l2_buffer buf;
+        unsigned int limit = 1;
 
-                        default:
-                                errno_exit("read");
-                        }
-                }
+        if (buffs.io_selection != IO_METHOD_READ)
+                limit = (buffs.n_buffers > MIN_QUEUED_BUFFERS) ? buffs.n_buffers - MIN_QUEUED_BUFFERS : 0;
 
-                // process_image(buffs.buffers[0].start, buffs.buffers[0].length, buffs.image_width, buffs.image_height,
-                //               output_filestring, frame_number, c_window);
-                memcpy(image_buffer, buffs.buffers[0].start, buffs.buffers[0].length);
+        if (borrowed_buffers(buffs) >= limit) {
+                errno = EBUSY;
+                return -1;
+        }
 
-                break;
+        STAGE_CLOCK(start);
+        if (!dequeue_buffer(device_handle, buffs, &buf, &frame->start, &frame->bytesused))
+                return 0;
+        STAGE_RECORD(STAGE_DEQUEUE, start);
 
-        case IO_METHOD_MMAP:
-                CLEAR(buf);
+        if (buffs.io_selection == IO_METHOD_READ) {
+                /* The driver only counts frames for streaming I/O. */
+                frame->index = 0;
+                frame->sequence = buffs.buffers[0].reads++;
+                gettimeofday(&frame->timestamp, NULL);
+        } else {
+                frame->index = buf.index;
+                frame->sequence = buf.sequence;
+                frame->timestamp = buf.timestamp;
+        }
+        __atomic_store_n(&buffs.buffers[frame->index].borrowed, 1, __ATOMIC_RELEASE);
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
+        return 1;
+}
 
-                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+/*
+*  Function: release_frame
+*  -----------------------
+*
+*  Queues the buffer of a frame from borrow_frame with the driver again.
+*  frame->start is no longer valid afterwards.
+*
+*  Returns 0, or -1 with errno set to EINVAL if the frame is not borrowed.
+*/
+int release_frame(int device_handle, buffers buffs, borrowed_frame* frame)
+{
+        struct v4l2_buffer buf;
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+        if (frame->index >= buffs.n_buffers
+            || !__atomic_load_n(&buffs.buffers[frame->index].borrowed, __ATOMIC_ACQUIRE)) {
+                errno = EINVAL;
+                return -1;
+        }
 
-                                /* fall through */
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.index = frame->index;
 
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
-                        }
-                }
+        if (buffs.io_selection == IO_METHOD_MMAP) {
+                buf.memory = V4L2_MEMORY_MMAP;
+        } else if (buffs.io_selection == IO_METHOD_USERPTR) {
+                buf.memory = V4L2_MEMORY_USERPTR;
+                buf.m.userptr = (unsigned long)buffs.buffers[frame->index].start;
+                buf.length = buffs.buffers[frame->index].length;
+        }
 
-                assert(buf.index < buffs.n_buffers);
+        STAGE_CLOCK(start);
+        requeue_buffer(device_handle, buffs, &buf);
+        STAGE_RECORD(STAGE_REQUEUE, start);
+        __atomic_store_n(&buffs.buffers[frame->index].borrowed, 0, __ATOMIC_RELEASE);
+        frame->start = NULL;
 
-                // process_image(buffs.buffers[buf.index].start, buf.bytesused, buffs.image_width, buffs.image_height,
-                //               output_filestring, frame_number, c_window);
-                memcpy(image_buffer, buffs.buffers[buf.index].start, buf.bytesused);
+        return 0;
+}
 
-                if (-1 == xioctl(device_handle, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
-                break;
+int read_frame(int device_handle, buffers buffs,
+                      char* output_filestring, int frame_number, crop_window c_window, capture_options opts)
+{
+        borrowed_frame frame;
 
-        case IO_METHOD_USERPTR:
-                CLEAR(buf);
+        if (borrow_frame(device_handle, buffs, &frame) != 1)
+                return 0;
 
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
+        process_image(frame.start, frame.bytesused, buffs.image_width, buffs.image_height,
+                      output_filestring, frame_number, c_window, opts);
 
-                if (-1 == xioctl(device_handle, VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+        release_frame(device_handle, buffs, &frame);
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+        return 1;
+}
 
-                                /* fall through */
+typedef struct frame_release_ {
+    int device_handle;
+    buffers buffs;
+    borrowed_frame* frame;
+} frame_release;
 
-                        default:
-                                errno_exit("VIDIOC_DQBUF");
-                        }
-                }
+static void stageRelease(void* context)
+{
+    frame_release* release = (frame_release*)context;
 
-                for (i = 0; i < buffs.n_buffers; ++i)
-                        if (buf.m.userptr == (unsigned long)buffs.buffers[i].start
-                            && buf.length == buffs.buffers[i].length)
-                                break;
+    release_frame(release->device_handle, release->buffs, release->frame);
+}
 
-                assert(i < buffs.n_buffers);
+/*
+*  Copies frame into size bytes at pCopy. A short frame is padded with
+*  zeros, so nothing of the frame copied there before is left over.
+*/
+static void copy_frame(unsigned char* pCopy, const borrowed_frame* frame, unsigned int size)
+{
+        unsigned int copied = (frame->bytesused < size) ? frame->bytesused : size;
 
-                // process_image((void *)buf.m.userptr, buf.bytesused, buffs.image_width, buffs.image_height,
-                //               output_filestring, frame_number, c_window);
-                memcpy(image_buffer, (void *)buf.m.userptr, buf.bytesused);
+        memcpy(pCopy, frame->start, copied);
+        memset(pCopy + copied, 0, size - copied);
+}
+
+/*
+*  read_frame into the output images of frame, handing the device buffer
+*  back as opts.requeue says: with REQUEUE_AFTER_COPY the frame is copied
+*  to frame->pCopy first, with REQUEUE_AFTER_CONVERSION the buffer goes
+*  back from within the task graph as soon as the conversion is done. Either
+*  way the driver has it again long before the detectors finish.
+*/
+static int read_frame_into(int device_handle, buffers buffs, frame_stages* frame, char* output_filestring, int frame_number,
+                           capture_options opts)
+{
+        borrowed_frame borrowed;
+        frame_release release;
+        unsigned int size = buffs.image_width*buffs.image_height*2;
+
+        if (borrow_frame(device_handle, buffs, &borrowed) != 1)
+                return 0;
+
+        frame->sequence = borrowed.sequence;
+        frame->timestamp = borrowed.timestamp;
+        switch (opts.requeue) {
+        case REQUEUE_AFTER_COPY:
+                copy_frame(frame->pCopy, &borrowed, size);
+                release_frame(device_handle, buffs, &borrowed);
+                process_frame(frame, frame->pCopy, output_filestring, frame_number, opts);
+                break;
+
+        case REQUEUE_AFTER_CONVERSION:
+                release.device_handle = device_handle;
+                release.buffs = buffs;
+                release.frame = &borrowed;
+                frame->converted = stageRelease;
+                frame->convertedContext = &release;
+                process_frame(frame, borrowed.start, output_filestring, frame_number, opts);
+                frame->converted = NULL;
+                break;
 
-                if (-1 == xioctl(device_handle, VIDIOC_QBUF, &buf))
-                        errno_exit("VIDIOC_QBUF");
+        case REQUEUE_AFTER_PROCESSING:
+                process_frame(frame, borrowed.start, output_filestring, frame_number, opts);
+                release_frame(device_handle, buffs, &borrowed);
                 break;
         }
 
         return 1;
 }
 
+// Copies the next frame into image_buffer; borrow_frame gets at it without the copy.
+int grab_frame(int device_handle, buffers buffs, unsigned char* image_buffer)
+{
+        borrowed_frame frame;
+
+        if (borrow_frame(device_handle, buffs, &frame) != 1)
+                return 0;
+
+        memcpy(image_buffer, frame.start, frame.bytesused);
+        release_frame(device_handle, buffs, &frame);
+
+        return 1;
+}
+
 int grab_frame_yuyv(char* dev_name, int width, int height, unsigned char* image_buffer)
 {
     int device_handle = 0;
@@ -305,7 +827,11 @@ int grab_frame_yuyv(char* dev_name, int width, int height, unsigned char* image_
     device_handle = open_device(dev_name);
     buffs = init_device(dev_name, device_handle, IO_METHOD_USERPTR, 0);
     start_capturing(device_handle, buffs);
-    grab_frame(device_handle, buffs, image_buffer);
+
+    for(;;) {
+        if(grab_frame(device_handle, buffs, image_buffer))
+            break;
+    }
     stop_capturing(device_handle, buffs);
     uninit_device(buffs);
     close_device(device_handle);
@@ -338,43 +864,277 @@ int grab_frame_rgb(char* dev_name, int width, int height, unsigned char* image_b
     return 1;
 }
 
-void mainloop(int device_handle, buffers buffs, int frame_count, char* output_filestring,
-                     crop_window c_window)
+// Waits until the device has a frame, or exits after five seconds without one.
+static void wait_for_frame(int device_handle)
 {
-    unsigned int count = 0;
+    for (;;) {
+        fd_set fds;
+        struct timeval tv;
+        int r;
 
-    while (count < frame_count) {
-        for (;;) {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+        FD_ZERO(&fds);
+        FD_SET(device_handle, &fds);
 
-            FD_ZERO(&fds);
-            FD_SET(device_handle, &fds);
+        /* Timeout. */
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
 
-            /* Timeout. */
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
+        r = select(device_handle + 1, &fds, NULL, NULL, &tv);
 
-            r = select(device_handle + 1, &fds, NULL, NULL, &tv);
+        if (-1 == r) {
+                if (EINTR == errno)
+                        continue;
+                errno_exit("select");
+        }
 
-            if (-1 == r) {
-                    if (EINTR == errno)
-                            continue;
-                    errno_exit("select");
-            }
+        if (0 == r) {
+                fprintf(stderr, "select timeout\\n");
+                exit(EXIT_FAILURE);
+        }
 
-            if (0 == r) {
-                    fprintf(stderr, "select timeout\\n");
-                    exit(EXIT_FAILURE);
-            }
+        return;
+    }
+}
 
-            if (read_frame(device_handle, buffs, output_filestring, count, c_window))
-                    break;
-            /* EAGAIN - continue select loop. */
+/*
+*  The pipelined capture: the state of the capture thread, and one frame of
+*  the pool, with its own copy of the YUYV data and its own output images.
+*/
+typedef struct capture_source_ {
+    int device_handle;
+    buffers buffs;
+    int frame_count;
+    int count;
+    char* output_filestring;
+    crop_window c_window;
+    capture_options opts;
+    borrowed_frame frame;
+    async_writer writer;        /* Used by the writer thread, with opts.async_writes. */
+    recording_writer recording; /* Used by the writer thread, with opts.recording_path. */
+} capture_source;
+
+typedef struct pipelined_frame_ {
+    frame_stages stages;
+    task_graph graph;
+} pipelined_frame;
+
+static void* alloc_pipelined_frame(void* context)
+{
+    capture_source* source = (capture_source*)context;
+    pipelined_frame* frame = (pipelined_frame*)malloc(sizeof(pipelined_frame));
+
+    frame->stages.pYUYV = (unsigned char*)malloc(source->buffs.image_width*source->buffs.image_height*2);
+    alloc_frame_outputs(&frame->stages, source->buffs.image_width, source->buffs.image_height, source->c_window, source->opts);
+
+    return frame;
+}
+
+static void free_pipelined_frame(void* context, void* data)
+{
+    pipelined_frame* frame = (pipelined_frame*)data;
+
+    free_frame_outputs(&frame->stages);
+    free(frame->stages.pYUYV);
+    free(frame);
+}
+
+static int next_captured_frame(void* context)
+{
+    capture_source* source = (capture_source*)context;
+
+    if (source->count >= source->frame_count)
+        return 0;
+
+    do {
+        wait_for_frame(source->device_handle);
+    } while (borrow_frame(source->device_handle, source->buffs, &source->frame) != 1);
+    source->count++;
+
+    return 1;
+}
+
+static void copy_captured_frame(void* context, void* data)
+{
+    capture_source* source = (capture_source*)context;
+    pipelined_frame* frame = (pipelined_frame*)data;
+    unsigned int size = source->buffs.image_width*source->buffs.image_height*2;
+
+    copy_frame(frame->stages.pYUYV, &source->frame, size);
+    frame->stages.sequence = source->frame.sequence;
+    frame->stages.timestamp = source->frame.timestamp;
+    release_frame(source->device_handle, source->buffs, &source->frame);
+}
+
+static void discard_captured_frame(void* context)
+{
+    capture_source* source = (capture_source*)context;
+
+    release_frame(source->device_handle, source->buffs, &source->frame);
+}
+
+static void process_pipelined_frame(void* context, void* data, long sequence)
+{
+    capture_source* source = (capture_source*)context;
+    pipelined_frame* frame = (pipelined_frame*)data;
+
+    name_frame_outputs(&frame->stages, source->output_filestring, (int)sequence);
+    run_frame_stages(&frame->stages, source->opts, 0, &frame->graph);
+}
+
+static void write_pipelined_frame(void* context, void* data, long sequence)
+{
+    capture_source* source = (capture_source*)context;
+    pipelined_frame* frame = (pipelined_frame*)data;
+    int i;
+
+    // The frame goes back to the pool on return, so its files are waited
+    // for; they are still written side by side, in one submission.
+    if (source->opts.recording_path != NULL) {
+        frame->stages.recording = &source->recording;
+        stageRecordYUYV(&frame->stages);
+        record_frame_outputs(&frame->stages);
+    } else if (source->opts.async_writes) {
+        frame->stages.writer = &source->writer;
+        submit_frame_outputs(&frame->stages);
+        while (frame->stages.pendingWrites > 0)
+            writer_wait(&source->writer);
+    } else {
+        for(i=0; i < FRAME_OUTPUTS; i++) {
+            if (frame->stages.outputs[i].image != NULL)
+                stageWrite(&frame->stages.outputs[i]);
         }
+    }
+
+    report_frame((int)sequence, frame->graph.wallTime, frame->graph.criticalPath, source->opts);
+}
+
+/*
+*  Function: mainloop_pipelined
+*  ----------------------------
+*
+*  Captures frame_count frames with capture, processing and writing running
+*  at the same time (see run_pipeline): the device buffer is copied and
+*  requeued straight away, opts.pipeline_workers threads process frames side
+*  by side, and one thread writes them out in order. Frames captured while
+*  opts.queue_depth frames are already waiting are dealt with according to
+*  opts.backpressure. Dropped frames are not written, and neither is their
+*  number, if they had one.
+*/
+void mainloop_pipelined(int device_handle, buffers buffs, int frame_count, char* output_filestring,
+                        crop_window c_window, capture_options opts)
+{
+    capture_source source;
+    pipeline_config config;
+    pipeline_stages stages;
+    pipeline_stats stats;
+
+    CLEAR(source);
+    source.device_handle = device_handle;
+    source.buffs = buffs;
+    source.frame_count = frame_count;
+    source.output_filestring = output_filestring;
+    source.c_window = c_window;
+    source.opts = opts;
+
+    config.workers = opts.pipeline_workers;
+    config.depth = (opts.queue_depth > 0) ? opts.queue_depth : 2*opts.pipeline_workers;
+    config.policy = opts.backpressure;
+
+    stages.context = &source;
+    stages.alloc_frame = alloc_pipelined_frame;
+    stages.free_frame = free_pipelined_frame;
+    stages.next = next_captured_frame;
+    stages.copy = copy_captured_frame;
+    stages.discard = discard_captured_frame;
+    stages.process = process_pipelined_frame;
+    stages.write = write_pipelined_frame;
+
+    if (opts.async_writes && writer_init(&source.writer, WRITER_AUTO, ASYNC_WRITE_BUDGET) == -1)
+        errno_exit("writer_init");
+    if (opts.recording_path != NULL && recording_create(&source.recording, opts.recording_path, 1) == -1)
+        errno_exit(opts.recording_path);
+
+    if (run_pipeline(&config, &stages, &stats) != 0) {
+        fprintf(stderr, "Cannot run a pipeline of %d workers and depth %d\n", config.workers, config.depth);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.async_writes)
+        writer_destroy(&source.writer);
+    if (opts.recording_path != NULL && recording_finish(&source.recording) == -1)
+        errno_exit(opts.recording_path);
+
+    fprintf(stderr, "\ncaptured %ld, dropped %ld, written %ld", stats.captured, stats.dropped, stats.written);
+}
+
+/*
+*  Function: mainloop
+*  ------------------
+*
+*  Captures and processes frame_count frames in turn, or pipelined if
+*  opts.pipeline_workers is set (see mainloop_pipelined). The output images
+*  are allocated once, and the stages take their scratch from workspaces
+*  kept from frame to frame, so after the first frame the loop allocates
+*  nothing. opts.requeue sets how long each device buffer is held (see
+*  read_frame_into); a pipelined capture always copies the frame out and
+*  requeues straight away. With opts.async_writes the files of a frame are
+*  written in the background while the next frames are captured, taking
+*  turns with ASYNC_FRAME_SETS sets of outputs. With opts.recording_path
+*  the YUYV frames and their outputs all go to that one recording instead
+*  (see recording_append), and no bitmaps are written.
+*/
+void mainloop(int device_handle, buffers buffs, int frame_count, char* output_filestring,
+                     crop_window c_window, capture_options opts)
+{
+    unsigned int count = 0;
+    frame_stages frames[ASYNC_FRAME_SETS];
+    frame_stages* frame;
+    async_writer writer;
+    recording_writer recording;
+    int i, sets;
+
+    if (opts.pipeline_workers > 0) {
+        mainloop_pipelined(device_handle, buffs, frame_count, output_filestring, c_window, opts);
+        return;
+    }
+
+    if (opts.async_writes && writer_init(&writer, WRITER_AUTO, ASYNC_WRITE_BUDGET) == -1)
+        errno_exit("writer_init");
+    if (opts.recording_path != NULL && recording_create(&recording, opts.recording_path, 1) == -1)
+        errno_exit(opts.recording_path);
+
+    sets = opts.async_writes ? ASYNC_FRAME_SETS : 1;
+    for(i=0; i < sets; i++) {
+        alloc_frame_outputs(&frames[i], buffs.image_width, buffs.image_height, c_window, opts);
+        if (opts.requeue == REQUEUE_AFTER_COPY)
+            frames[i].pCopy = (unsigned char*)malloc(buffs.image_width*buffs.image_height*2);
+        if (opts.async_writes)
+            frames[i].writer = &writer;
+        if (opts.recording_path != NULL)
+            frames[i].recording = &recording;
+    }
+
+    while (count < frame_count) {
+        frame = &frames[count % sets];
+        while (frame->pendingWrites > 0)
+            writer_wait(&writer);
+
+        do {
+            wait_for_frame(device_handle);
+            /* EAGAIN - continue select loop. */
+        } while (!read_frame_into(device_handle, buffs, frame, output_filestring, count, opts));
         count++;
     }
+
+    if (opts.async_writes)
+        writer_destroy(&writer);
+    if (opts.recording_path != NULL && recording_finish(&recording) == -1)
+        errno_exit(opts.recording_path);
+
+    for(i=0; i < sets; i++) {
+        free(frames[i].pCopy);
+        free_frame_outputs(&frames[i]);
+    }
 }
 
 void stop_capturing(int device_handle, buffers buffs)
@@ -383,6 +1143,7 @@ void stop_capturing(int device_handle, buffers buffs)
 
         switch (buffs.io_selection) {
         case IO_METHOD_READ:
+        case IO_METHOD_REPLAY:
                 /* Nothing to do. */
                 break;
 
@@ -441,6 +1202,11 @@ void start_capturing(int device_handle, buffers buffs)
         if (-1 == xioctl(device_handle, VIDIOC_STREAMON, &type))
             errno_exit("VIDIOC_STREAMON");
         break;
+
+    case IO_METHOD_REPLAY:
+        if (-1 == replay_start(buffs.replay))
+            errno_exit("replay_start");
+        break;
     }
 }
 
@@ -463,6 +1229,10 @@ void uninit_device(buffers buffs)
                 for (i = 0; i < buffs.n_buffers; ++i)
                         free(buffs.buffers[i].start);
                 break;
+
+        case IO_METHOD_REPLAY:
+                /* The frames belong to the replay_source. */
+                break;
         }
 
         free(buffs.buffers);
@@ -491,6 +1261,7 @@ buffers init_read(unsigned int buffer_size)
     bufs.io_selection = IO_METHOD_READ;
     bufs.n_buffers = 1;
     bufs.buffers = pBuffers;
+    bufs.replay = NULL;
 
     return bufs;
 }
@@ -558,6 +1329,7 @@ buffers init_mmap(char* dev_name, int device_handle)
     buffs.io_selection = IO_METHOD_MMAP;
     buffs.buffers = pBuffers;
     buffs.n_buffers = req.count;
+    buffs.replay = NULL;
 
     return buffs;
 }
@@ -605,6 +1377,42 @@ buffers init_userp(char* dev_name, int device_handle, unsigned int buffer_size)
     buffs.io_selection = IO_METHOD_USERPTR;
     buffs.buffers = pBuffers;
     buffs.n_buffers = 4;
+    buffs.replay = NULL;
+
+    return buffs;
+}
+
+/*
+*  Function: init_replay
+*  ---------------------
+*
+*  The buffers of a replay_source: REPLAY_BUFFERS of them, each pointed at
+*  a replayed frame by replay_next as it is dequeued, so borrow_frame and
+*  release_frame work on them as on a device's.
+*/
+buffers init_replay(replay_source* source)
+{
+    struct buffer* pBuffers;
+    buffers buffs;
+    unsigned int i;
+
+    pBuffers = calloc(REPLAY_BUFFERS, sizeof(*pBuffers));
+
+    if (!pBuffers) {
+            fprintf(stderr, "Out of memory\\n");
+            exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < REPLAY_BUFFERS; ++i) {
+            pBuffers[i].length = source->frameSize;
+    }
+
+    buffs.io_selection = IO_METHOD_REPLAY;
+    buffs.buffers = pBuffers;
+    buffs.n_buffers = REPLAY_BUFFERS;
+    buffs.replay = source;
+    buffs.image_width = source->width;
+    buffs.image_height = source->height;
 
     return buffs;
 }
@@ -617,6 +1425,11 @@ buffers init_device(char* dev_name, int device_handle, enum io_method io_selecti
     struct v4l2_format fmt;
     unsigned int min;
     buffers buffs;
+    replay_source* source = replay_lookup(device_handle);
+
+    /* A replay has its own buffers, whatever io_selection asks for. */
+    if (source != NULL)
+        return init_replay(source);
 
     if (-1 == xioctl(device_handle, VIDIOC_QUERYCAP, &cap)) {
         if (EINVAL == errno) {
@@ -651,6 +1464,11 @@ buffers init_device(char* dev_name, int device_handle, enum io_method io_selecti
             exit(EXIT_FAILURE);
         }
         break;
+
+    case IO_METHOD_REPLAY:
+        fprintf(stderr, "%s is not a replay\\n",
+                 dev_name);
+        exit(EXIT_FAILURE);
     }
 
 
@@ -718,6 +1536,7 @@ buffers init_device(char* dev_name, int device_handle, enum io_method io_selecti
         break;
 
     case IO_METHOD_USERPTR:
+    default:
         buffs = init_userp(dev_name, device_handle, fmt.fmt.pix.sizeimage);
         break;
     }
@@ -730,6 +1549,13 @@ buffers init_device(char* dev_name, int device_handle, enum io_method io_selecti
 
 void close_device(int device_handle)
 {
+    replay_source* source = replay_lookup(device_handle);
+
+    if (source != NULL) {
+        replay_close(source);
+        return;
+    }
+
     if (-1 == close(device_handle))
         errno_exit("close");
 
@@ -739,6 +1565,12 @@ void close_device(int device_handle)
 void print_formats(int device_handle)
 {
     struct v4l2_fmtdesc fmtdesc;
+
+    if (replay_lookup(device_handle) != NULL) {
+        fprintf(stdout, "YUYV 4:2:2 (replay)\n");
+        return;
+    }
+
     CLEAR(fmtdesc);
     fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmtdesc.index = 0;
@@ -754,6 +1586,13 @@ resolution get_resolution(int device_handle)
     unsigned int min;
     struct v4l2_format fmt;
     resolution res;
+    replay_source* source = replay_lookup(device_handle);
+
+    if (source != NULL) {
+        res.width = source->width;
+        res.height = source->height;
+        return res;
+    }
 
     CLEAR(fmt);
 
@@ -780,6 +1619,12 @@ int open_device(char *device_name)
 {
     struct stat st;
     int device_handle = -1;
+    replay_source* source;
+
+    if (strncmp(device_name, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0) {
+        source = replay_open(device_name + strlen(REPLAY_PREFIX));
+        return (source != NULL) ? source->fd : -1;
+    }
 
     if (-1 == stat(device_name, &st)) {
         fprintf(stderr, "Cannot identify '%s': %d, %s\\n",
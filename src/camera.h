@@ -1,27 +1,63 @@
 #ifndef CAMERA_H_   /* Include guard */
 #define CAMERA_H_
 
+#include <sys/time.h>
+
 #include "imageprocessing.h"
+#include "pipeline.h"
+#include "replay.h"
 
 enum io_method {
         IO_METHOD_READ,
         IO_METHOD_MMAP,
         IO_METHOD_USERPTR,
+        IO_METHOD_REPLAY,   /* Frames from a replay_source rather than a device. */
 };
 
 struct buffer {
         void   *start;
         size_t  length;
+        int     borrowed;   /* Held by a borrowed_frame rather than queued with the driver. */
+        unsigned int reads; /* With IO_METHOD_READ, the frames read into it so far. */
 };
 
+/* Buffers borrow_frame always leaves queued, so the driver never runs dry. */
+#define MIN_QUEUED_BUFFERS (1)
+
+typedef struct borrowed_frame_ {
+    void* start;                /* The frame, in the driver's buffer. */
+    unsigned int bytesused;
+    unsigned int index;         /* Which of buffs.buffers holds it. */
+    unsigned int sequence;      /* The driver's frame count, or with IO_METHOD_READ the frames read. */
+    struct timeval timestamp;   /* When the driver captured it. */
+} borrowed_frame;
+
 typedef struct buffers_ {
     struct buffer* buffers;
     unsigned int n_buffers;
     enum io_method io_selection;
     unsigned int image_width;
     unsigned int image_height;
+    replay_source* replay;      /* With IO_METHOD_REPLAY. */
 } buffers;
 
+enum requeue_policy {
+        REQUEUE_AFTER_PROCESSING,   /* Hold the device buffer until the frame is written. */
+        REQUEUE_AFTER_COPY,         /* Copy the frame out and requeue before processing it. */
+        REQUEUE_AFTER_CONVERSION,   /* Requeue as soon as the YUYV conversion has read it. */
+};
+
+typedef struct capture_opts_ {
+    int grayscale_only;     /* No RGB outputs: convert YUYV straight to grayscale. */
+    int report_timing;      /* Print the time and critical path of every frame. */
+    int pipeline_workers;   /* Processing threads of a pipelined capture, 0 to capture and process in turn. */
+    int queue_depth;        /* Frames waiting for a worker before backpressure applies, 0 for twice the workers. */
+    enum backpressure_policy backpressure;
+    enum requeue_policy requeue;    /* When a serial capture hands the device buffer back. */
+    int async_writes;               /* Write the outputs in the background (see async_writer). */
+    const char* recording_path;     /* Record every frame to this file instead of writing bitmaps, or NULL. */
+} capture_options;
+
 typedef struct res_ {
     unsigned int width;
     unsigned int height;
@@ -29,11 +65,16 @@ typedef struct res_ {
 
 void errno_exit(const char *s);
 int xioctl(int fh, int request, void *arg);
-void process_image(const void *p, int size, unsigned int width, unsigned int height, char* output_filestring, int frame_number, crop_window c_window);
+void process_image(const void *p, int size, unsigned int width, unsigned int height, char* output_filestring, int frame_number, crop_window c_window,
+                   capture_options opts);
 int read_frame(int device_handle, buffers buffs,
-                      char* output_filestring, int frame_number, crop_window c_window);
+                      char* output_filestring, int frame_number, crop_window c_window, capture_options opts);
 void mainloop(int device_handle, buffers buffs, int frame_count, char* output_filestring,
-                     crop_window c_window);
+                     crop_window c_window, capture_options opts);
+void mainloop_pipelined(int device_handle, buffers buffs, int frame_count, char* output_filestring,
+                        crop_window c_window, capture_options opts);
+int borrow_frame(int device_handle, buffers buffs, borrowed_frame* frame);
+int release_frame(int device_handle, buffers buffs, borrowed_frame* frame);
 int grab_frame(int device_handle, buffers buffs, unsigned char* image_buffer);
 int grab_frame_rgb(char* dev_name, int width, int height, unsigned char* image_buffer);
 int grab_frame_yuyv(char* device_name, int width, int height, unsigned char* image_buffer);
@@ -43,6 +84,7 @@ void uninit_device(buffers buffs);
 buffers init_read(unsigned int buffer_size);
 buffers init_mmap(char* dev_name, int device_handle);
 buffers init_userp(char* dev_name, int device_handle, unsigned int buffer_size);
+buffers init_replay(replay_source* source);
 buffers init_device(char* dev_name, int device_handle, enum io_method io_selection, int force_format);
 void close_device(int device_handle);
 void print_formats(int device_handle);
@@ -14,12 +14,21 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include <linux/videodev2.h>
 
 #include "imageprocessing.h"
 
 
+/*
+*  The tap row pointers of kernels up to this size are kept on the stack;
+*  longer kernels take them from the workspace, and only the functions called
+*  without one allocate them.
+*/
+#define STACK_TAPS (64)
+
 int BMPwriter(unsigned char *pRGB, int bitNum, int width, int height, char* output_filestring)
 {
     FILE *fd_output; 
@@ -151,6 +160,146 @@ int GrayScaleWriter(unsigned char *pGrayscale, int width, int height, char* outp
     return 0;
 }
 
+/*
+*  Function: BMPHeader
+*  -------------------
+*
+*  Fills in the header of a top-down (negative height) BMP, for
+*  BMPWritev: the rows follow in the order they are in memory, each
+*  ALIGN_TO_FOUR(width*bitNum/8) bytes apart. An 8 bit image gets the
+*  grayscale palette too, so header needs BMP_MAX_HEADER_SIZE bytes.
+*
+*  Returns the size of the header.
+*/
+int BMPHeader(unsigned char *header, int bitNum, int width, int height)
+{
+    int i;
+    int headerSize = BMP_HEADER_SIZE;
+    int widthStep = ALIGN_TO_FOUR(width*bitNum/8);
+    int imageSize = widthStep*height;
+    int topDownHeight = -height;
+    int infoSize = 40;
+    short planes = 1;
+    short bits = bitNum;
+    int fileSize;
+    unsigned char* palette = header + BMP_HEADER_SIZE;
+
+    if (bitNum == 8) {
+        headerSize += 256*sizeof(RGBQUAD);
+        for(i=0; i < 256; i++) {
+            palette[4*i] = i;
+            palette[4*i + 1] = i;
+            palette[4*i + 2] = i;
+            palette[4*i + 3] = 0;
+        }
+    }
+    fileSize = headerSize + imageSize;
+
+    memset(header, 0, BMP_HEADER_SIZE);
+    header[0] = 0x42;
+    header[1] = 0x4d;
+    memcpy(&header[2], &fileSize, sizeof(int));
+    memcpy(&header[10], &headerSize, sizeof(int));
+    memcpy(&header[14], &infoSize, sizeof(int));
+    memcpy(&header[18], &width, sizeof(int));
+    memcpy(&header[22], &topDownHeight, sizeof(int));
+    memcpy(&header[26], &planes, sizeof(short));
+    memcpy(&header[28], &bits, sizeof(short));
+    memcpy(&header[34], &imageSize, sizeof(int));
+
+    return headerSize;
+}
+
+/*
+*  Function: BMPWritev
+*  -------------------
+*
+*  Writes a bitmap with a header from BMPHeader: header and image in one
+*  writev, without stdio and without printing progress. The header only
+*  depends on the size and depth of the image, so it can be made once and
+*  used for every frame.
+*
+*  Returns 0, or -1 with errno set if the file cannot be written.
+*/
+int BMPWritev(unsigned char *header, int headerSize, unsigned char *pImage, int bitNum, int width, int height, char* output_filestring)
+{
+    struct iovec iov[2];
+    struct iovec* next = iov;
+    int iovcnt = 2;
+    ssize_t written;
+    int fd;
+
+    fd = open(output_filestring, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerSize;
+    iov[1].iov_base = pImage;
+    iov[1].iov_len = (size_t)ALIGN_TO_FOUR(width*bitNum/8)*height;
+
+    // A short write carries on from where it stopped.
+    while (iovcnt > 0) {
+        written = writev(fd, next, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (unsigned char*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return close(fd);
+}
+
+/*
+*  The whole image functions hand bands of rows to the thread pool; these are
+*  the bands, run through the Rows variant of each.
+*/
+typedef struct image_rows_ {
+    void* input;
+    int width;
+    int height;
+    void* output;
+} image_rows;
+
+static void YUYV2RGB24Band(void* context, int startRow, int endRow)
+{
+    image_rows* rows = (image_rows*)context;
+
+    YUYV2RGB24Rows(rows->input, rows->width, rows->height, startRow, endRow, rows->output);
+}
+
+static void YUYV2GrayscaleBand(void* context, int startRow, int endRow)
+{
+    image_rows* rows = (image_rows*)context;
+
+    YUYV2GrayscaleRows(rows->input, rows->width, rows->height, startRow, endRow, rows->output);
+}
+
+static void RGB24toGrayscaleBand(void* context, int startRow, int endRow)
+{
+    image_rows* rows = (image_rows*)context;
+
+    RGB24toGrayscaleRows(rows->input, rows->width, rows->height, startRow, endRow, rows->output);
+}
+
+static void convertDoubleToUcharGrayscaleBand(void* context, int startRow, int endRow)
+{
+    image_rows* rows = (image_rows*)context;
+
+    convertDoubleToUcharGrayscaleRows(rows->input, rows->width, rows->height, startRow, endRow, rows->output);
+}
+
 /*
 *  Function: YUYV2RGB24
 *  --------------------
@@ -186,12 +335,34 @@ int GrayScaleWriter(unsigned char *pGrayscale, int width, int height, char* outp
 *  RGB24 bitmaps are continuous runs of pixels stored as BGR, i.e. blue,
 *  green and red values. Each value takes up a byte of space, and so each
 *  pixel takes up three bytes of space, i.e. 24 bits.
+*
+*  Each row is converted by the widest SIMD kernel the CPU supports (see
+*  simd.c), chosen once at startup. setSIMDLevel(SIMD_NONE) forces the
+*  scalar path; the output is byte-identical either way.
+*
+*  Bands of rows are converted in parallel (see setThreadCount).
 */
 int YUYV2RGB24(unsigned char *pYUYV, int width, int height, unsigned char *pRGB24)
 {
-    unsigned int i, j;
+    image_rows rows = {pYUYV, width, height, pRGB24};
+
+    parallelRows(height, MIN_BAND_ROWS, YUYV2RGB24Band, &rows);
+
+    return 0;
+}
+
+/*
+*  Function: YUYV2RGB24Rows
+*  ------------------------
+*
+*  startRow, endRow  The band of rows [startRow, endRow) to convert. The other
+*                    arguments are those of YUYV2RGB24, for the whole image.
+*/
+int YUYV2RGB24Rows(unsigned char *pYUYV, int width, int height, int startRow, int endRow, unsigned char *pRGB24)
+{
+    int i, j;
 
-    unsigned char *pMovY, *pMovU, *pMovV;
+    unsigned char *pMovYUYV;
     unsigned char *pMovRGB;
 
     unsigned int pitch;
@@ -210,38 +381,98 @@ int YUYV2RGB24(unsigned char *pYUYV, int width, int height, unsigned char *pRGB2
     pitchRGB = ALIGN_TO_FOUR(3*width);
 
 
-    for(j = 0; j< height; j++){
-        pMovY = pYUYV + j*pitch;
-        pMovU = pMovY + 1; 
-        pMovV = pMovY + 3; 
-
+    for(j = startRow; j < endRow; j++){
+        pMovYUYV = pYUYV + j*pitch;
         pMovRGB = pRGB24 + pitchRGB*j;
 
-        for(i = 0; i< width; i++){
-            int R, G, B;  
-            int Y, U, V;
+        // The vector kernels convert as much of the row as they can,
+        // always a whole number of YUYV pairs, and return the number of
+        // pixels done. The scalar kernel does the rest of the row, and is
+        // the reference the vector kernels are tested against.
+        switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2:
+            i = YUYVRowToRGB24AVX2(pMovYUYV, width, pMovRGB);
+            break;
+        case SIMD_SSSE3:
+            i = YUYVRowToRGB24SSSE3(pMovYUYV, width, pMovRGB);
+            break;
+        case SIMD_SSE2:
+            i = YUYVRowToRGB24SSE2(pMovYUYV, width, pMovRGB);
+            break;
+#endif
+        default:
+            i = 0;
+            break;
+        }
+
+        YUYVRowToRGB24Scalar(pMovYUYV + 2*i, width - i, pMovRGB + 3*i);
+    }
+
+    return 0;
+}
 
-            // YUV --> RGB colorspace conversion.
-            Y = pMovY[0]; U = *pMovU; V = *pMovV;   
-            R = Y_PLUS_RDIFF(Y, V);
-            G = Y_PLUS_GDIFF(Y, U, V);
-            B = Y_PLUS_BDIFF(Y, U);
+/*
+*  Function: YUYV2Grayscale
+*  ------------------------
+*
+*  pYUYV:            A pointer to the pixels of a YUYV bitmap in memory.
+*  width:            The width of the image.
+*  height:           The height of the image.
+*  outputGrayscale:  A pointer to memory allocated to hold the pixels of the
+*                    8-bit grayscale bitmap, rows ALIGN_TO_FOUR(width) apart.
+*
+*  The Y channel of a YUYV bitmap already is the luminance of every pixel, so
+*  this simply pulls it out of the packed buffer, without going through an
+*  RGB24 bitmap and RGB24toGrayscale. Note that the two do not give identical
+*  images: RGB24toGrayscale rebuilds the luminance with its own weights.
+*/
+int YUYV2Grayscale(unsigned char *pYUYV, int width, int height, unsigned char *outputGrayscale)
+{
+    image_rows rows = {pYUYV, width, height, outputGrayscale};
 
-            // Clipping the value to the 0 - 255 range.
-            *pMovRGB = CLIP1(B);
-            *(pMovRGB + 1) = CLIP1(G);     
-            *(pMovRGB + 2) = CLIP1(R);   
+    parallelRows(height, MIN_BAND_ROWS, YUYV2GrayscaleBand, &rows);
 
-            // Move the pointer to the next Y value to use.
-            pMovY += 2;
+    return 0;
+}
 
-            // Move the U and V value pointers to the next U and V values to use.
-            pMovU += 4*EVEN_ZERO_ODD_ONE(i);
-            pMovV += 4*EVEN_ZERO_ODD_ONE(i);
+/*
+*  Function: YUYV2GrayscaleRows
+*  ----------------------------
+*
+*  startRow, endRow  The band of rows [startRow, endRow) to convert. The other
+*                    arguments are those of YUYV2Grayscale, for the whole image.
+*/
+int YUYV2GrayscaleRows(unsigned char *pYUYV, int width, int height, int startRow, int endRow, unsigned char *outputGrayscale)
+{
+    int i, j;
+    unsigned int pitch, pitchGrayscale;
+    unsigned char *pMovYUYV;
+    unsigned char *pMovGrayscale;
 
-            // Move the pointer to the start of the next BGR pixel in the RGB bitmap.
-            pMovRGB += 3;
+    pitch = 2*width;
+    pitchGrayscale = ALIGN_TO_FOUR(width);
+
+    for(j = startRow; j < endRow; j++) {
+        pMovYUYV = pYUYV + j*pitch;
+        pMovGrayscale = outputGrayscale + j*pitchGrayscale;
+
+        switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2:
+            i = YUYVRowToGrayscaleAVX2(pMovYUYV, width, pMovGrayscale);
+            break;
+        case SIMD_SSSE3:
+        case SIMD_SSE2:
+            i = YUYVRowToGrayscaleSSE2(pMovYUYV, width, pMovGrayscale);
+            break;
+#endif
+        default:
+            i = 0;
+            break;
         }
+
+        YUYVRowToGrayscaleScalar(pMovYUYV + 2*i, width - i, pMovGrayscale + i);
     }
 
     return 0;
@@ -260,42 +491,69 @@ int YUYV2RGB24(unsigned char *pYUYV, int width, int height, unsigned char *pRGB2
 *  This function calculates the luminance Y of each pixel of the input RGB24 bitmap, and
 *  clamps its value to the 0 - 255 range. It then assigns this value to the corresponding
 *  pixel of the output grayscale bitmap.
+*
+*  Bands of rows are converted in parallel (see setThreadCount).
 */
 int RGB24toGrayscale(unsigned char *inputRGB24, int width, int height, unsigned char *outputGrayscale)
 {
-    unsigned int i, j;
+    image_rows rows = {inputRGB24, width, height, outputGrayscale};
+
+    parallelRows(height, MIN_BAND_ROWS, RGB24toGrayscaleBand, &rows);
+
+    return 0;
+}
+
+/*
+*  Function: RGB24toGrayscaleRows
+*  ------------------------------
+*
+*  startRow, endRow  The band of rows [startRow, endRow) to convert. The other
+*                    arguments are those of RGB24toGrayscale, for the whole image,
+*                    so disjoint bands can be converted independently.
+*
+*  The luminance Y is calculated from the R, G, B values.
+*  These values were taken from this Stackoverflow here:
+*  https://stackoverflow.com/questions/687261/converting-rgb-to-grayscale-intensity
+*  When I applied the gamma crrection, the entire grayscale
+*  image came out white. And when I didn't apply the gamma
+*  correction, I got a grayscale looking image.
+*  Additionally, check out this reference here:
+*  http://cadik.posvete.cz/color_to_gray_evaluation/
+*
+*  The weights are applied in 16 bit fixed point (see GRAY_WEIGHT_* in simd.h),
+*  which stays within 1 of the original double precision sum, and lets the
+*  SSSE3 / AVX2 kernels deinterleave the BGR bytes with shuffles.
+*/
+int RGB24toGrayscaleRows(unsigned char *inputRGB24, int width, int height, int startRow, int endRow,
+                         unsigned char *outputGrayscale)
+{
+    int i, j;
     unsigned int pitchInputRGB, pitchOutputGrayscale;
     unsigned char* pMovInputRGB;
     unsigned char* pMovOutputGrayscale;
 
     pitchInputRGB = ALIGN_TO_FOUR(3*width);
     pitchOutputGrayscale = ALIGN_TO_FOUR(width);
-    pMovOutputGrayscale = outputGrayscale;
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            int R, G, B, Y;
-            pMovInputRGB = inputRGB24 + j*pitchInputRGB + i*3;
-            pMovOutputGrayscale = outputGrayscale + j*pitchOutputGrayscale + i;
-
-            B = *pMovInputRGB;
-            G = *(pMovInputRGB + 1);
-            R = *(pMovInputRGB + 2);
-
-            // The luminance Y is calculated from the R, G, B values.
-            // These values were taken from this Stackoverflow here:
-            // https://stackoverflow.com/questions/687261/converting-rgb-to-grayscale-intensity
-            // When I applied the gamma crrection, the entire grayscale
-            // image came out white. And when I didn't apply the gamma
-            // correction, I got a grayscale looking image.
-            // Additionally, check out this reference here:
-            // http://cadik.posvete.cz/color_to_gray_evaluation/
-            Y = 0.2126 * (double)R  + 0.7152 * (double)G + 0.722 * (double)B;
-            if (Y > 255) Y = 255;
-            else if (Y < 0) Y = 0;
-
-            *pMovOutputGrayscale = (unsigned char)Y;
+    for(j=startRow; j < endRow; j++) {
+        pMovInputRGB = inputRGB24 + j*pitchInputRGB;
+        pMovOutputGrayscale = outputGrayscale + j*pitchOutputGrayscale;
+
+        switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+        case SIMD_AVX2:
+            i = RGB24RowToGrayscaleAVX2(pMovInputRGB, width, pMovOutputGrayscale);
+            break;
+        case SIMD_SSSE3:
+            i = RGB24RowToGrayscaleSSSE3(pMovInputRGB, width, pMovOutputGrayscale);
+            break;
+#endif
+        default:
+            i = 0;
+            break;
         }
+
+        RGB24RowToGrayscaleScalar(pMovInputRGB + 3*i, width - i, pMovOutputGrayscale + i);
     }
 
     return 0;
@@ -456,6 +714,19 @@ int makeZeroPaddedImage(double *inputGrayscale, int inputWidth, int inputHeight,
 }
 
 int convolve2D(double* kernel, int kernelSize, unsigned char* inputGrayscale, int width, int height, double* outputGrayscale)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = convolve2D_ws(kernel, kernelSize, inputGrayscale, width, height, outputGrayscale, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int convolve2D_ws(double* kernel, int kernelSize, unsigned char* inputGrayscale, int width, int height, double* outputGrayscale,
+                  ip_workspace* ws)
 {
     unsigned int padWidth;
     unsigned int i, j, k, l;
@@ -467,11 +738,12 @@ int convolve2D(double* kernel, int kernelSize, unsigned char* inputGrayscale, in
     double* pMovPaddedGrayscale;
     double* pMovOutputGrayscale;
     double* pMovKernel;
+    workspace_mark mark = workspaceMark(ws);
 
     padWidth = (kernelSize - 1) / 2;
 
-    double_input_grayscale = (double*)malloc(width*height*sizeof(double));
-    paddedGrayscale = (double*)malloc(((width + 2*padWidth)*(height + 2*padWidth)) * sizeof(double));
+    double_input_grayscale = (double*)workspaceAlloc(ws, width*height*sizeof(double));
+    paddedGrayscale = (double*)workspaceAlloc(ws, ((width + 2*padWidth)*(height + 2*padWidth)) * sizeof(double));
 
     convertUcharToDoubleGrayscale(inputGrayscale, width, height, double_input_grayscale);
     makeZeroPaddedImage(double_input_grayscale, width, height, padWidth, paddedGrayscale, VERTICAL_AND_HORIZONTAL);
@@ -499,75 +771,385 @@ int convolve2D(double* kernel, int kernelSize, unsigned char* inputGrayscale, in
         }
     }
 
-    free(paddedGrayscale);
-    free(double_input_grayscale);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
+static enum gaussian_mode active_gaussian_mode = GAUSSIAN_FIR;
+static enum blur_precision active_blur_precision = BLUR_DOUBLE;
+
+/*
+*  Function: borderIndex
+*  ---------------------
+*
+*  Maps a sample position p that may fall outside [0, n) back onto the image,
+*  according to the border type. Returns -1 for a zero border, meaning the
+*  sample is 0 and contributes nothing.
+*
+*  BORDER_REFLECT mirrors about the edge sample without repeating it, i.e.
+*  ... 2 1 | 0 1 2 ... n-2 n-1 | n-2 n-3 ..., and keeps reflecting for kernels
+*  wider than the image.
+*/
+static int borderIndex(int p, int n, enum border_type border)
+{
+    if (p >= 0 && p < n)
+        return p;
+
+    switch (border) {
+    case BORDER_REPLICATE:
+        return (p < 0) ? 0 : n - 1;
+
+    case BORDER_REFLECT:
+        if (n == 1)
+            return 0;
+        while (p < 0 || p >= n) {
+            if (p < 0)
+                p = -p;
+            if (p >= n)
+                p = 2*(n - 1) - p;
+        }
+        return p;
+
+    case BORDER_ZERO:
+    default:
+        return -1;
+    }
+}
+
+/*
+*  Dispatch the interior spans of the separable convolution to the widest
+*  vector kernel available, finishing off with the scalar one.
+*/
+static void convolveRow1D(const double *kernel, int kernelSize, const double *input, int count, double *output)
+{
+    int i;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = convolveRow1DAVX2(kernel, kernelSize, input, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = convolveRow1DSSE2(kernel, kernelSize, input, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    convolveRow1DScalar(kernel, kernelSize, input + i, count - i, output + i);
+}
+
+/*
+*  taps  Room for kernelSize row pointers, for the rows the vector kernel
+*        leaves to the scalar one.
+*/
+static void convolveRows1D(const double *kernel, int kernelSize, const double **inputRows, int count, double *output,
+                           const double **taps)
+{
+    int i, k;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = convolveRows1DAVX2(kernel, kernelSize, inputRows, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = convolveRows1DSSE2(kernel, kernelSize, inputRows, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    if (i < count) {
+        for(k = 0; k < kernelSize; k++) {
+            taps[k] = inputRows[k] ? inputRows[k] + i : NULL;
+        }
+        convolveRows1DScalar(kernel, kernelSize, taps, count - i, output + i);
+    }
+}
+
+static void convolveColumns1D(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output)
+{
+    int i;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = convolveColumns1DAVX2(kernel, kernelSize, input, stride, rows, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = convolveColumns1DSSE2(kernel, kernelSize, input, stride, rows, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    convolveColumns1DScalar(kernel, kernelSize, input + i, stride, rows, count - i, output + i);
+}
+
+static void convolveRows1DU8(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output,
+                             const unsigned char **taps)
+{
+    int i, k;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = convolveRows1DU8AVX2(kernel, kernelSize, inputRows, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = convolveRows1DU8SSE2(kernel, kernelSize, inputRows, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    if (i < count) {
+        for(k = 0; k < kernelSize; k++) {
+            taps[k] = inputRows[k] ? inputRows[k] + i : NULL;
+        }
+        convolveRows1DU8Scalar(kernel, kernelSize, taps, count - i, output + i);
+    }
+}
+
+static void convolveRow1DS16(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output)
+{
+    int i;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = convolveRow1DS16AVX2(kernel, kernelSize, input, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = convolveRow1DS16SSE2(kernel, kernelSize, input, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    convolveRow1DS16Scalar(kernel, kernelSize, input + i, count - i, output + i);
+}
+
 int convolve2Dwith1Dkernel(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale, enum direction dir)
 {
-    unsigned int padWidth;
-    unsigned int i, j, k;
-    unsigned int pitchPaddedGrayscale, pitchOutputGrayscale;
+    return convolve2Dwith1DkernelBorder(kernel, kernelSize, inputGrayscale, width, height, outputGrayscale, dir, BORDER_ZERO);
+}
+
+typedef struct convolution_rows_ {
+    double* kernel;
+    int kernelSize;
+    double* input;
+    int width;
+    int height;
+    double* output;
+    enum direction dir;
+    enum border_type border;
+    const double** taps;        /* 2 * kernelSize row pointers for each band, or NULL. */
+} convolution_rows;
+
+static int convolveBorderRows(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, int startRow, int endRow,
+                              double* outputGrayscale, enum direction dir, enum border_type border, const double** taps);
+
+/*
+*  The bands parallelRows hands out start at least MIN_BAND_ROWS rows apart,
+*  so startRow / MIN_BAND_ROWS gives each its own tap row pointers.
+*/
+static void convolutionBand(void* context, int startRow, int endRow)
+{
+    convolution_rows* rows = (convolution_rows*)context;
+
+    if (rows->taps != NULL)
+        convolveBorderRows(rows->kernel, rows->kernelSize, rows->input, rows->width, rows->height, startRow, endRow, rows->output,
+                           rows->dir, rows->border, rows->taps + (startRow / MIN_BAND_ROWS) * 2 * rows->kernelSize);
+    else
+        convolve2Dwith1DkernelBorderRows(rows->kernel, rows->kernelSize, rows->input, rows->width, rows->height, startRow, endRow,
+                                         rows->output, rows->dir, rows->border);
+}
+
+/*
+*  Function: convolve2Dwith1DkernelBorder
+*  --------------------------------------
+*
+*  kernel           The 1D kernel, of odd size kernelSize.
+*  inputGrayscale   The width x height input image, unpitched doubles.
+*  outputGrayscale  The width x height output image. Must not alias the input.
+*  dir              VERTICAL or HORIZONTAL.
+*  border           How samples beyond the image edge are filled in.
+*
+*  Convolves the image along one direction without building a padded copy of
+*  it. Each row (or, vertically, each band of rows) is split into the border
+*  spans at either end, where some taps fall outside the image and are
+*  resolved through borderIndex, and the interior span in between, where all
+*  taps are in range and the vector kernels in simd.c do the work.
+*
+*  With BORDER_ZERO the result is identical to convolving a zero padded image
+*  (see makeZeroPaddedImage), which is what convolve2Dwith1Dkernel does.
+*
+*  Bands of rows are convolved in parallel (see setThreadCount).
+*/
+int convolve2Dwith1DkernelBorder(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale,
+                                 enum direction dir, enum border_type border)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = convolve2Dwith1DkernelBorder_ws(kernel, kernelSize, inputGrayscale, width, height, outputGrayscale, dir, border, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int convolve2Dwith1DkernelBorder_ws(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale,
+                                    enum direction dir, enum border_type border, ip_workspace* ws)
+{
+    convolution_rows rows = {kernel, kernelSize, inputGrayscale, width, height, outputGrayscale, dir, border, NULL};
+    workspace_mark mark;
+
+    if (dir != VERTICAL && dir != HORIZONTAL)
+        return -1;
+
+    mark = workspaceMark(ws);
+    if (dir == VERTICAL && kernelSize > STACK_TAPS)
+        rows.taps = (const double**)workspaceAlloc(ws, (height / MIN_BAND_ROWS + 1) * 2 * kernelSize * sizeof(double*));
+
+    parallelRows(height, MIN_BAND_ROWS, convolutionBand, &rows);
+
+    workspaceRelease(ws, mark);
+
+    return 0;
+}
+
+/*
+*  Function: convolve2Dwith1DkernelBorderRows
+*  ------------------------------------------
+*
+*  startRow, endRow  The band of output rows [startRow, endRow) to compute.
+*                    The other arguments are those of
+*                    convolve2Dwith1DkernelBorder, for the whole image.
+*
+*  A vertical pass reads the padWidth rows either side of the band as well,
+*  from the input image itself, and applies the border only at the top and
+*  bottom of the image, so every band is exactly that part of the whole
+*  image result.
+*/
+int convolve2Dwith1DkernelBorderRows(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, int startRow, int endRow,
+                                     double* outputGrayscale, enum direction dir, enum border_type border)
+{
+    const double* stackTaps[2 * STACK_TAPS];
+    const double** taps = stackTaps;
+    int result;
+
+    if (dir == VERTICAL && kernelSize > STACK_TAPS)
+        taps = (const double**)malloc(2 * kernelSize * sizeof(double*));
+
+    result = convolveBorderRows(kernel, kernelSize, inputGrayscale, width, height, startRow, endRow, outputGrayscale, dir, border, taps);
+
+    if (taps != stackTaps)
+        free(taps);
+
+    return result;
+}
+
+/*
+*  As convolve2Dwith1DkernelBorderRows, with room in taps for 2 * kernelSize
+*  row pointers.
+*/
+static int convolveBorderRows(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, int startRow, int endRow,
+                              double* outputGrayscale, enum direction dir, enum border_type border, const double** taps)
+{
+    int padWidth;
+    int i, j, k, p;
+    int interiorStart, interiorEnd;
     double result;
 
-    double* paddedGrayscale;
-    double* pMovPaddedGrayscale;
+    double* pMovInputGrayscale;
     double* pMovOutputGrayscale;
-    double* pMovKernel;
+    const double** inputRows = taps + kernelSize;
 
     padWidth = (kernelSize - 1) / 2;
 
     if (dir == VERTICAL) {
-        paddedGrayscale = (double*)malloc(width*(height + 2*padWidth)*sizeof(double));
-        makeZeroPaddedImage(inputGrayscale, width, height, padWidth, paddedGrayscale, VERTICAL);
 
-        pitchPaddedGrayscale = width;
-        pitchOutputGrayscale = width;
-
-        for(j=padWidth; j < (padWidth + height); j++) {
-            for(i=0; i < width; i++) {
-                pMovOutputGrayscale = outputGrayscale + (j - padWidth)*pitchOutputGrayscale + i;
-                pMovPaddedGrayscale = paddedGrayscale + j*pitchPaddedGrayscale + i;
-                result = 0.0;
-                for(k=0; k < kernelSize; k++) {
-                    pMovKernel = kernel + (kernelSize - k - 1);
-                    pMovPaddedGrayscale = paddedGrayscale + (j - padWidth + k)*pitchPaddedGrayscale + i;
-                    result = result + (*pMovKernel) * (*pMovPaddedGrayscale);
-                }
+        // The rows of the band whose taps all fall inside the image.
+        interiorStart = (padWidth < height) ? padWidth : height;
+        interiorEnd = (height - padWidth > interiorStart) ? height - padWidth : interiorStart;
+        interiorStart = (interiorStart < startRow) ? startRow : ((interiorStart > endRow) ? endRow : interiorStart);
+        interiorEnd = (interiorEnd > endRow) ? endRow : ((interiorEnd < interiorStart) ? interiorStart : interiorEnd);
+
+        // Near the top and bottom the tap rows are remapped, or dropped for a
+        // zero border, one output row at a time.
+        for(j=startRow; j < endRow; j++) {
+            if (j == interiorStart && interiorEnd > interiorStart) {
+                j = interiorEnd;
+                if (j >= endRow)
+                    break;
+            }
 
-                *pMovOutputGrayscale = result;
+            for(k=0; k < kernelSize; k++) {
+                p = borderIndex(j - padWidth + k, height, border);
+                inputRows[k] = (p < 0) ? NULL : inputGrayscale + p*width;
             }
+
+            convolveRows1D(kernel, kernelSize, inputRows, width, outputGrayscale + j*width, taps);
         }
 
-        free(paddedGrayscale);
+        // In the interior rows the tap rows are simply consecutive, and the
+        // whole band is done in strips of columns (see convolveColumns1DScalar).
+        if (interiorEnd > interiorStart)
+            convolveColumns1D(kernel, kernelSize, inputGrayscale + (interiorStart - padWidth)*width, width,
+                              interiorEnd - interiorStart, width, outputGrayscale + interiorStart*width);
 
         return 0;
 
     } else if (dir == HORIZONTAL) {
-        paddedGrayscale = (double*)malloc((width + 2*padWidth)*height*sizeof(double));
-        makeZeroPaddedImage(inputGrayscale, width, height, padWidth, paddedGrayscale, HORIZONTAL);
+        interiorStart = (padWidth < width) ? padWidth : width;
+        interiorEnd = (width - padWidth > interiorStart) ? width - padWidth : interiorStart;
 
-        pitchPaddedGrayscale = width + 2*padWidth;
-        pitchOutputGrayscale = width;
+        for(j=startRow; j < endRow; j++) {
+            pMovInputGrayscale = inputGrayscale + j*width;
+            pMovOutputGrayscale = outputGrayscale + j*width;
+
+            for(i=0; i < width; i++) {
+                // Left and right border spans, one tap at a time.
+                if (i == interiorStart) {
+                    i = interiorEnd;
+                    if (i >= width)
+                        break;
+                }
 
-        for(j=0; j < height; j++) {
-            for(i=padWidth; i < (padWidth + width); i++) {
-                pMovOutputGrayscale = outputGrayscale + j*pitchOutputGrayscale + (i - padWidth);
-                pMovPaddedGrayscale = paddedGrayscale + j*pitchPaddedGrayscale + i;
                 result = 0.0;
                 for(k=0; k < kernelSize; k++) {
-                    pMovKernel = kernel + (kernelSize - k - 1);
-                    pMovPaddedGrayscale = paddedGrayscale + j*pitchPaddedGrayscale + (i - padWidth + k);
-                    result = result + (*pMovKernel) * (*pMovPaddedGrayscale);
+                    p = borderIndex(i - padWidth + k, width, border);
+                    if (p >= 0)
+                        result = result + kernel[kernelSize - k - 1] * pMovInputGrayscale[p];
                 }
 
-                *pMovOutputGrayscale = result;
+                pMovOutputGrayscale[i] = result;
             }
-        }
 
-        free(paddedGrayscale);
+            // Interior span.
+            if (interiorEnd > interiorStart)
+                convolveRow1D(kernel, kernelSize, pMovInputGrayscale + interiorStart - padWidth, interiorEnd - interiorStart,
+                              pMovOutputGrayscale + interiorStart);
+        }
 
         return 0;
     }
@@ -575,26 +1157,100 @@ int convolve2Dwith1Dkernel(double* kernel, int kernelSize, double* inputGrayscal
     return -1;
 }
 
-int UniformBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale)
+/*
+*  Function: BoxBlur
+*  -----------------
+*
+*  inputGrayscale   The input image, rows ALIGN_TO_FOUR(width) apart.
+*  outputGrayscale  The output image, same layout. Must not alias the input.
+*  radius           The box spans 2*radius + 1 pixels each way.
+*
+*  The mean over a (2*radius + 1)^2 box, with zero outside the image and the
+*  result truncated, as a 2D convolution with a uniform kernel would give.
+*  The box is separable, so a running sum down each column and then one along
+*  each row gives every output from two adds and two subtracts, whatever the
+*  radius. The sums stay in 32 bit integers, which bounds the radius at
+*  BOX_BLUR_MAX_RADIUS.
+*/
+int BoxBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, int radius)
 {
-    double* intermediateGrayscale;
+    ip_workspace ws;
+    int result;
 
-    double kernel[9] =  {
-        1/9.0, 1/9.0, 1/9.0,
-        1/9.0, 1/9.0, 1/9.0,
-        1/9.0, 1/9.0, 1/9.0
-    };
+    initWorkspace(&ws, 0, 0);
+    result = BoxBlur_ws(inputGrayscale, width, height, outputGrayscale, radius, &ws);
+    freeWorkspace(&ws);
 
-    intermediateGrayscale = (double *)malloc(width*height*sizeof(double));
+    return result;
+}
 
-    convolve2D(kernel, 3, inputGrayscale, width, height, intermediateGrayscale);
-    convertDoubleToUcharGrayscale(intermediateGrayscale, width, height, outputGrayscale);
+int BoxBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, int radius, ip_workspace* ws)
+{
+    int i, j, pitch;
+    unsigned int area, sum;
+    unsigned int* columnSums;
+    unsigned char* pAddRow;
+    unsigned char* pSubRow;
+    unsigned char* pMovOutputGrayscale;
+    workspace_mark mark;
+
+    if (radius < 0 || radius > BOX_BLUR_MAX_RADIUS)
+        return -1;
+
+    pitch = ALIGN_TO_FOUR(width);
+    area = (2*radius + 1)*(2*radius + 1);
+    mark = workspaceMark(ws);
+    columnSums = (unsigned int*)workspaceCalloc(ws, width * sizeof(unsigned int));
+
+    // Prime the column sums with the rows below the first output row.
+    for(j=0; j < radius && j < height; j++) {
+        pAddRow = inputGrayscale + j*pitch;
+        for(i=0; i < width; i++)
+            columnSums[i] += pAddRow[i];
+    }
+
+    for(j=0; j < height; j++) {
+        // Slide the column window down: row j + radius enters, row j - radius - 1 leaves.
+        if (j + radius < height) {
+            pAddRow = inputGrayscale + (j + radius)*pitch;
+            for(i=0; i < width; i++)
+                columnSums[i] += pAddRow[i];
+        }
+        if (j - radius - 1 >= 0) {
+            pSubRow = inputGrayscale + (j - radius - 1)*pitch;
+            for(i=0; i < width; i++)
+                columnSums[i] -= pSubRow[i];
+        }
+
+        // Then slide the row window along the column sums.
+        pMovOutputGrayscale = outputGrayscale + j*pitch;
+        sum = 0;
+        for(i=0; i < radius && i < width; i++)
+            sum += columnSums[i];
+        for(i=0; i < width; i++) {
+            if (i + radius < width)
+                sum += columnSums[i + radius];
+            if (i - radius - 1 >= 0)
+                sum -= columnSums[i - radius - 1];
+            pMovOutputGrayscale[i] = (unsigned char)(sum / area);
+        }
+    }
 
-    free(intermediateGrayscale);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
+int UniformBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale)
+{
+    return BoxBlur(inputGrayscale, width, height, outputGrayscale, 1);
+}
+
+int UniformBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, ip_workspace* ws)
+{
+    return BoxBlur_ws(inputGrayscale, width, height, outputGrayscale, 1, ws);
+}
+
 void getGaussianKernel1D(double* kernel, double sigma, int kernelSize)
 {
     int i, max;
@@ -667,154 +1323,532 @@ void getGaussianKernel2D(double* kernel, double sigma, int kernelSize)
     }
 }
 
-int GaussianDerivativeX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
-{
-    double* kernel_x;
-    double* kernel_y;
-    int kernel_size;
-    double* temp_grayscale_v;
+/*
+*  Function: setGaussianMode
+*  -------------------------
+*
+*  mode:  GAUSSIAN_FIR (the default) or GAUSSIAN_IIR.
+*
+*  Selects how GaussianBlur, GaussianWindow and the GaussianDerivative* family
+*  filter. GAUSSIAN_FIR convolves with sampled kernels whose size, and so
+*  cost, grows linearly with sigma. GAUSSIAN_IIR runs the recursive filter of
+*  recursiveGaussian1D, whose cost per pixel does not depend on sigma. Use
+*  GaussianFilter to choose the mode for a single call instead.
+*/
+void setGaussianMode(enum gaussian_mode mode)
+{
+    active_gaussian_mode = mode;
+}
 
-    kernel_size = 2 * ((int) (5*sigma)) + 1;
+enum gaussian_mode getGaussianMode(void)
+{
+    return active_gaussian_mode;
+}
 
-    temp_grayscale_v = (double*)malloc(width * height * sizeof(double));
-    kernel_x = (double *)malloc(kernel_size * sizeof(double));
-    kernel_y = (double *)malloc(kernel_size * sizeof(double));
+/*
+*  Function: recursiveGaussian1D
+*  -----------------------------
+*
+*  input    The width x height input image, unpitched doubles.
+*  output   The width x height output image. May be the same as the input.
+*  sigma    The standard deviation; must be at least RECURSIVE_GAUSSIAN_MIN_SIGMA.
+*  order    0 to smooth, 1 or 2 for the first or second derivative.
+*  dir      VERTICAL or HORIZONTAL.
+*
+*  The third order recursive Gaussian of Young and van Vliet ("Recursive
+*  implementation of the Gaussian filter", Signal Processing 44, 1995): a
+*  causal pass followed by an anti-causal pass, 3 multiply-adds each per
+*  pixel for any sigma. Derivatives are taken with central differences of the
+*  smoothed signal, which is exact for polynomials up to the given order.
+*
+*  Both passes start from the edge sample extended outwards, i.e. a
+*  replicated border, where the FIR path uses a zero border. The vertical
+*  pass runs down all the columns at once, one row at a time, so it streams
+*  through memory like the horizontal one.
+*/
+int recursiveGaussian1D(double* input, int width, int height, double* output, double sigma, int order, enum direction dir)
+{
+    ip_workspace ws;
+    int result;
 
-    getDGausianKernel1D(kernel_x, sigma, kernel_size);
-    getGaussianKernel1D(kernel_y, sigma, kernel_size);
+    initWorkspace(&ws, 0, 0);
+    result = recursiveGaussian1D_ws(input, width, height, output, sigma, order, dir, &ws);
+    freeWorkspace(&ws);
 
-    convolve2Dwith1Dkernel(kernel_y, kernel_size, input_grayscale, width, height, temp_grayscale_v, VERTICAL);
-    convolve2Dwith1Dkernel(kernel_x, kernel_size, temp_grayscale_v, width, height, output_grayscale, HORIZONTAL);
+    return result;
+}
+
+int recursiveGaussian1D_ws(double* input, int width, int height, double* output, double sigma, int order, enum direction dir,
+                           ip_workspace* ws)
+{
+    int i, j, n, length;
+    double q, b0, b1, b2, b3, B, a1, a2, a3;
+    double w1, w2, w3, value, previous, current, next;
+    double* pMovInput;
+    double* pMovOutput;
+    double* edgeRow;
+    double* previousRow;
+    double* currentRow;
+    double* swapRow;
+    double* rows[3];
+    workspace_mark mark;
+
+    if (sigma < RECURSIVE_GAUSSIAN_MIN_SIGMA || order < 0 || order > 2)
+        return -1;
+
+    if (sigma >= 2.5)
+        q = 0.98711 * sigma - 0.96330;
+    else
+        q = 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+
+    b0 = 1.57825 + 2.44413*q + 1.4281*q*q + 0.422205*q*q*q;
+    b1 = 2.44413*q + 2.85619*q*q + 1.26661*q*q*q;
+    b2 = -(1.4281*q*q + 1.26661*q*q*q);
+    b3 = 0.422205*q*q*q;
+    B = 1.0 - (b1 + b2 + b3)/b0;
+    a1 = b1/b0;
+    a2 = b2/b0;
+    a3 = b3/b0;
+
+    if (dir == HORIZONTAL) {
+        for(j=0; j < height; j++) {
+            pMovInput = input + j*width;
+            pMovOutput = output + j*width;
+
+            w1 = w2 = w3 = pMovInput[0];
+            for(n=0; n < width; n++) {
+                value = B*pMovInput[n] + a1*w1 + a2*w2 + a3*w3;
+                pMovOutput[n] = value;
+                w3 = w2; w2 = w1; w1 = value;
+            }
 
-    free(temp_grayscale_v);
-    free(kernel_x);
-    free(kernel_y);
+            w1 = w2 = w3 = pMovOutput[width - 1];
+            for(n=width - 1; n >= 0; n--) {
+                value = B*pMovOutput[n] + a1*w1 + a2*w2 + a3*w3;
+                pMovOutput[n] = value;
+                w3 = w2; w2 = w1; w1 = value;
+            }
 
-    return 0;
+            if (order > 0) {
+                previous = pMovOutput[0];
+                for(n=0; n < width; n++) {
+                    current = pMovOutput[n];
+                    next = (n + 1 < width) ? pMovOutput[n + 1] : current;
+                    pMovOutput[n] = (order == 1) ? (next - previous)/2 : next - 2*current + previous;
+                    previous = current;
+                }
+            }
+        }
+
+        return 0;
+
+    } else if (dir == VERTICAL) {
+        length = height;
+        mark = workspaceMark(ws);
+        edgeRow = (double*)workspaceAlloc(ws, width * sizeof(double));
+
+        // Causal pass, down the image. The rows above the first are the first
+        // input row extended upwards.
+        memcpy(edgeRow, input, width * sizeof(double));
+        rows[0] = rows[1] = rows[2] = edgeRow;
+        for(j=0; j < length; j++) {
+            pMovInput = input + j*width;
+            pMovOutput = output + j*width;
+            for(i=0; i < width; i++) {
+                pMovOutput[i] = B*pMovInput[i] + a1*rows[0][i] + a2*rows[1][i] + a3*rows[2][i];
+            }
+            rows[2] = rows[1]; rows[1] = rows[0]; rows[0] = pMovOutput;
+        }
+
+        // Anti-causal pass, back up the image.
+        memcpy(edgeRow, output + (length - 1)*width, width * sizeof(double));
+        rows[0] = rows[1] = rows[2] = edgeRow;
+        for(j=length - 1; j >= 0; j--) {
+            pMovOutput = output + j*width;
+            for(i=0; i < width; i++) {
+                pMovOutput[i] = B*pMovOutput[i] + a1*rows[0][i] + a2*rows[1][i] + a3*rows[2][i];
+            }
+            rows[2] = rows[1]; rows[1] = rows[0]; rows[0] = pMovOutput;
+        }
+
+        if (order > 0) {
+            previousRow = (double*)workspaceAlloc(ws, width * sizeof(double));
+            currentRow = (double*)workspaceAlloc(ws, width * sizeof(double));
+
+            memcpy(previousRow, output, width * sizeof(double));
+            for(j=0; j < length; j++) {
+                pMovOutput = output + j*width;
+                memcpy(currentRow, pMovOutput, width * sizeof(double));
+                pMovInput = (j + 1 < length) ? pMovOutput + width : currentRow;
+                for(i=0; i < width; i++) {
+                    pMovOutput[i] = (order == 1) ? (pMovInput[i] - previousRow[i])/2 : pMovInput[i] - 2*currentRow[i] + previousRow[i];
+                }
+                swapRow = previousRow; previousRow = currentRow; currentRow = swapRow;
+            }
+        }
+
+        workspaceRelease(ws, mark);
+
+        return 0;
+    }
+
+    return -1;
 }
 
-int GaussianDerivativeY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+/*
+*  The sampled FIR kernel of the given derivative order.
+*/
+static double* makeGaussianKernel(double sigma, int order, int kernelSize, ip_workspace* ws)
 {
-    double* kernel_x;
-    double* kernel_y;
-    int kernel_size;
-    double* temp_grayscale_v;
+    double* kernel;
 
-    kernel_size = 2 * ((int) (5*sigma)) + 1;
+    kernel = (double *)workspaceAlloc(ws, kernelSize * sizeof(double));
+
+    if (order == 1)
+        getDGausianKernel1D(kernel, sigma, kernelSize);
+    else if (order == 2)
+        getD2GausianKernel1D(kernel, sigma, kernelSize);
+    else
+        getGaussianKernel1D(kernel, sigma, kernelSize);
+
+    return kernel;
+}
+
+/*
+*  Whether a pass at this sigma runs the recursive filter rather than a kernel.
+*/
+static int useRecursiveGaussian(double sigma, enum gaussian_mode mode)
+{
+    return (mode == GAUSSIAN_IIR && sigma >= RECURSIVE_GAUSSIAN_MIN_SIGMA);
+}
+
+/*
+*  One separable Gaussian pass of the given derivative order, either as a FIR
+*  convolution with the given kernel of that order, or as a recursive filter,
+*  in which case the kernel is not used and may be NULL.
+*/
+static int gaussianKernelPass(double* input, int width, int height, double* output, double sigma, int order, double* kernel,
+                              int kernelSize, enum direction dir, enum gaussian_mode mode, ip_workspace* ws)
+{
+    if (useRecursiveGaussian(sigma, mode))
+        return recursiveGaussian1D_ws(input, width, height, output, sigma, order, dir, ws);
 
-    temp_grayscale_v = (double*)malloc(width * height * sizeof(double));
-    kernel_x = (double *)malloc(kernel_size * sizeof(double));
-    kernel_y = (double *)malloc(kernel_size * sizeof(double));
+    return convolve2Dwith1DkernelBorder_ws(kernel, kernelSize, input, width, height, output, dir, BORDER_ZERO, ws);
+}
 
-    getDGausianKernel1D(kernel_y, sigma, kernel_size);
-    getGaussianKernel1D(kernel_x, sigma, kernel_size);
+/*
+*  As gaussianKernelPass, making the FIR kernel of kernelSize taps for the
+*  one pass.
+*/
+static int gaussianPass(double* input, int width, int height, double* output, double sigma, int order, int kernelSize,
+                        enum direction dir, enum gaussian_mode mode, ip_workspace* ws)
+{
+    double* kernel;
+    workspace_mark mark;
 
-    convolve2Dwith1Dkernel(kernel_y, kernel_size, input_grayscale, width, height, temp_grayscale_v, VERTICAL);
-    convolve2Dwith1Dkernel(kernel_x, kernel_size, temp_grayscale_v, width, height, output_grayscale, HORIZONTAL);
+    if (useRecursiveGaussian(sigma, mode))
+        return recursiveGaussian1D_ws(input, width, height, output, sigma, order, dir, ws);
 
-    free(temp_grayscale_v);
-    free(kernel_x);
-    free(kernel_y);
+    mark = workspaceMark(ws);
+    kernel = makeGaussianKernel(sigma, order, kernelSize, ws);
+    convolve2Dwith1DkernelBorder_ws(kernel, kernelSize, input, width, height, output, dir, BORDER_ZERO, ws);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
-int GaussianDerivativeXX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+/*
+*  Function: GaussianFilter
+*  ------------------------
+*
+*  input_grayscale   The width x height input image, unpitched doubles.
+*  output_grayscale  The width x height output image.
+*  sigma             The standard deviation of the Gaussian.
+*  orderX, orderY    The derivative order, 0 to 2, along each axis.
+*  mode              GAUSSIAN_FIR or GAUSSIAN_IIR, for this call only.
+*
+*  A general separable Gaussian derivative. The FIR kernels span 5 sigma
+*  either side for derivatives and 3 sigma for plain smoothing, as in
+*  GaussianDerivativeX and GaussianBlur respectively.
+*/
+int GaussianFilter(double* input_grayscale, int width, int height, double* output_grayscale, double sigma,
+                   int orderX, int orderY, enum gaussian_mode mode)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianFilter_ws(input_grayscale, width, height, output_grayscale, sigma, orderX, orderY, mode, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianFilter_ws(double* input_grayscale, int width, int height, double* output_grayscale, double sigma,
+                      int orderX, int orderY, enum gaussian_mode mode, ip_workspace* ws)
 {
-    double* kernel_x;
-    double* kernel_y;
     int kernel_size;
     double* temp_grayscale_v;
+    workspace_mark mark;
 
-    kernel_size = 2 * ((int) (5*sigma)) + 1;
+    if (orderX < 0 || orderX > 2 || orderY < 0 || orderY > 2)
+        return -1;
 
-    temp_grayscale_v = (double*)malloc(width * height * sizeof(double));
-    kernel_x = (double *)malloc(kernel_size * sizeof(double));
-    kernel_y = (double *)malloc(kernel_size * sizeof(double));
+    if (orderX || orderY)
+        kernel_size = 2 * ((int) (5*sigma)) + 1;
+    else
+        kernel_size = 2 * ((int) (3*sigma)) + 1;
 
-    getD2GausianKernel1D(kernel_x, sigma, kernel_size);
-    getGaussianKernel1D(kernel_y, sigma, kernel_size);
+    mark = workspaceMark(ws);
+    temp_grayscale_v = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
-    convolve2Dwith1Dkernel(kernel_y, kernel_size, input_grayscale, width, height, temp_grayscale_v, VERTICAL);
-    convolve2Dwith1Dkernel(kernel_x, kernel_size, temp_grayscale_v, width, height, output_grayscale, HORIZONTAL);
+    gaussianPass(input_grayscale, width, height, temp_grayscale_v, sigma, orderY, kernel_size, VERTICAL, mode, ws);
+    gaussianPass(temp_grayscale_v, width, height, output_grayscale, sigma, orderX, kernel_size, HORIZONTAL, mode, ws);
 
-    free(temp_grayscale_v);
-    free(kernel_x);
-    free(kernel_y);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
-int GaussianDerivativeYY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+/*
+*  Function: GaussianDerivativeBank
+*  --------------------------------
+*
+*  input_grayscale  The width x height input image, unpitched doubles.
+*  sigma            The standard deviation of the Gaussian.
+*  derivatives      The DERIVATIVE_* flags of the planes wanted.
+*  bank             The output planes, width x height doubles each. Only the
+*                   planes named in derivatives are written, and the others
+*                   may be NULL.
+*
+*  Computes any subset of the Gaussian derivatives DX, DY, DXX, DYY and DXY
+*  of an image, sharing the passes they have in common. DX, DXX and DXY all
+*  start from the image smoothed down the columns, and differ only in their
+*  horizontal pass; DY and DYY start from the image smoothed along the rows,
+*  and differ only in their vertical pass. All five take 7 passes instead of
+*  10, and each FIR kernel is made once. As in GaussianDerivativeXY, DXY is
+*  the smoothed image.
+*
+*  The kernels span 5 sigma either side, and the current Gaussian mode (see
+*  setGaussianMode) applies.
+*/
+int GaussianDerivativeBank(double* input_grayscale, int width, int height, double sigma, unsigned int derivatives, derivative_bank* bank)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianDerivativeBank_ws(input_grayscale, width, height, sigma, derivatives, bank, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianDerivativeBank_ws(double* input_grayscale, int width, int height, double sigma, unsigned int derivatives, derivative_bank* bank,
+                              ip_workspace* ws)
 {
-    double* kernel_x;
-    double* kernel_y;
     int kernel_size;
-    double* temp_grayscale_v;
+    double* kernel_G = NULL;
+    double* kernel_DG = NULL;
+    double* kernel_D2G = NULL;
+    double* temp_grayscale;
+    enum gaussian_mode mode = getGaussianMode();
+    workspace_mark mark;
+
+    if (bank == NULL ||
+        ((derivatives & DERIVATIVE_X) && bank->DX == NULL) ||
+        ((derivatives & DERIVATIVE_Y) && bank->DY == NULL) ||
+        ((derivatives & DERIVATIVE_XX) && bank->DXX == NULL) ||
+        ((derivatives & DERIVATIVE_YY) && bank->DYY == NULL) ||
+        ((derivatives & DERIVATIVE_XY) && bank->DXY == NULL))
+        return -1;
+
+    if (!(derivatives & DERIVATIVE_ALL))
+        return 0;
 
     kernel_size = 2 * ((int) (5*sigma)) + 1;
+    mark = workspaceMark(ws);
+
+    if (!useRecursiveGaussian(sigma, mode)) {
+        kernel_G = makeGaussianKernel(sigma, 0, kernel_size, ws);
+        if (derivatives & (DERIVATIVE_X | DERIVATIVE_Y))
+            kernel_DG = makeGaussianKernel(sigma, 1, kernel_size, ws);
+        if (derivatives & (DERIVATIVE_XX | DERIVATIVE_YY))
+            kernel_D2G = makeGaussianKernel(sigma, 2, kernel_size, ws);
+    }
 
-    temp_grayscale_v = (double*)malloc(width * height * sizeof(double));
-    kernel_x = (double *)malloc(kernel_size * sizeof(double));
-    kernel_y = (double *)malloc(kernel_size * sizeof(double));
+    temp_grayscale = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
-    getD2GausianKernel1D(kernel_y, sigma, kernel_size);
-    getGaussianKernel1D(kernel_x, sigma, kernel_size);
+    if (derivatives & (DERIVATIVE_X | DERIVATIVE_XX | DERIVATIVE_XY)) {
+        gaussianKernelPass(input_grayscale, width, height, temp_grayscale, sigma, 0, kernel_G, kernel_size, VERTICAL, mode, ws);
+        if (derivatives & DERIVATIVE_X)
+            gaussianKernelPass(temp_grayscale, width, height, bank->DX, sigma, 1, kernel_DG, kernel_size, HORIZONTAL, mode, ws);
+        if (derivatives & DERIVATIVE_XX)
+            gaussianKernelPass(temp_grayscale, width, height, bank->DXX, sigma, 2, kernel_D2G, kernel_size, HORIZONTAL, mode, ws);
+        if (derivatives & DERIVATIVE_XY)
+            gaussianKernelPass(temp_grayscale, width, height, bank->DXY, sigma, 0, kernel_G, kernel_size, HORIZONTAL, mode, ws);
+    }
 
-    convolve2Dwith1Dkernel(kernel_y, kernel_size, input_grayscale, width, height, temp_grayscale_v, VERTICAL);
-    convolve2Dwith1Dkernel(kernel_x, kernel_size, temp_grayscale_v, width, height, output_grayscale, HORIZONTAL);
+    if (derivatives & (DERIVATIVE_Y | DERIVATIVE_YY)) {
+        gaussianKernelPass(input_grayscale, width, height, temp_grayscale, sigma, 0, kernel_G, kernel_size, HORIZONTAL, mode, ws);
+        if (derivatives & DERIVATIVE_Y)
+            gaussianKernelPass(temp_grayscale, width, height, bank->DY, sigma, 1, kernel_DG, kernel_size, VERTICAL, mode, ws);
+        if (derivatives & DERIVATIVE_YY)
+            gaussianKernelPass(temp_grayscale, width, height, bank->DYY, sigma, 2, kernel_D2G, kernel_size, VERTICAL, mode, ws);
+    }
 
-    free(temp_grayscale_v);
-    free(kernel_x);
-    free(kernel_y);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
-int GaussianDerivativeXY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+/*
+*  Function: allocDerivativeBank
+*  -----------------------------
+*
+*  Allocates a width x height plane for each of the DERIVATIVE_* flags given,
+*  and sets the other planes of the bank to NULL, so that derivatives nobody
+*  reads are neither allocated nor computed. Release with freeDerivativeBank.
+*/
+int allocDerivativeBank(derivative_bank* bank, int width, int height, unsigned int derivatives)
 {
-    double* kernel_x;
-    double* kernel_y;
-    int kernel_size;
-    double* temp_grayscale_v;
+    size_t plane_size = (size_t)width * height * sizeof(double);
 
-    kernel_size = 2 * ((int) (5*sigma)) + 1;
+    CLEAR(*bank);
 
-    temp_grayscale_v = (double*)malloc(width * height * sizeof(double));
-    kernel_x = (double *)malloc(kernel_size * sizeof(double));
-    kernel_y = (double *)malloc(kernel_size * sizeof(double));
+    if (derivatives & DERIVATIVE_X)
+        bank->DX = (double*)malloc(plane_size);
+    if (derivatives & DERIVATIVE_Y)
+        bank->DY = (double*)malloc(plane_size);
+    if (derivatives & DERIVATIVE_XX)
+        bank->DXX = (double*)malloc(plane_size);
+    if (derivatives & DERIVATIVE_YY)
+        bank->DYY = (double*)malloc(plane_size);
+    if (derivatives & DERIVATIVE_XY)
+        bank->DXY = (double*)malloc(plane_size);
 
-    getGaussianKernel1D(kernel_x, sigma, kernel_size);
-    getGaussianKernel1D(kernel_y, sigma, kernel_size);
+    return 0;
+}
 
-    convolve2Dwith1Dkernel(kernel_x, kernel_size, input_grayscale, width, height, temp_grayscale_v, VERTICAL);
-    convolve2Dwith1Dkernel(kernel_y, kernel_size, temp_grayscale_v, width, height, output_grayscale, HORIZONTAL);
+/*
+*  Function: allocDerivativeBank_ws
+*  --------------------------------
+*
+*  As allocDerivativeBank, with the planes taken from ws: they are given
+*  back with the workspace, and must not be passed to freeDerivativeBank.
+*/
+int allocDerivativeBank_ws(derivative_bank* bank, int width, int height, unsigned int derivatives, ip_workspace* ws)
+{
+    size_t plane_size = (size_t)width * height * sizeof(double);
+
+    CLEAR(*bank);
 
-    free(temp_grayscale_v);
-    free(kernel_x);
-    free(kernel_y);
+    if (derivatives & DERIVATIVE_X)
+        bank->DX = (double*)workspaceAlloc(ws, plane_size);
+    if (derivatives & DERIVATIVE_Y)
+        bank->DY = (double*)workspaceAlloc(ws, plane_size);
+    if (derivatives & DERIVATIVE_XX)
+        bank->DXX = (double*)workspaceAlloc(ws, plane_size);
+    if (derivatives & DERIVATIVE_YY)
+        bank->DYY = (double*)workspaceAlloc(ws, plane_size);
+    if (derivatives & DERIVATIVE_XY)
+        bank->DXY = (double*)workspaceAlloc(ws, plane_size);
 
     return 0;
 }
 
+void freeDerivativeBank(derivative_bank* bank)
+{
+    free(bank->DX);
+    free(bank->DY);
+    free(bank->DXX);
+    free(bank->DYY);
+    free(bank->DXY);
+
+    CLEAR(*bank);
+}
+
+int GaussianDerivativeX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+{
+    derivative_bank bank;
+
+    CLEAR(bank);
+    bank.DX = output_grayscale;
+
+    return GaussianDerivativeBank(input_grayscale, width, height, sigma, DERIVATIVE_X, &bank);
+}
+
+int GaussianDerivativeY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+{
+    derivative_bank bank;
+
+    CLEAR(bank);
+    bank.DY = output_grayscale;
+
+    return GaussianDerivativeBank(input_grayscale, width, height, sigma, DERIVATIVE_Y, &bank);
+}
+
+int GaussianDerivativeXX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+{
+    derivative_bank bank;
+
+    CLEAR(bank);
+    bank.DXX = output_grayscale;
+
+    return GaussianDerivativeBank(input_grayscale, width, height, sigma, DERIVATIVE_XX, &bank);
+}
+
+int GaussianDerivativeYY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+{
+    derivative_bank bank;
+
+    CLEAR(bank);
+    bank.DYY = output_grayscale;
+
+    return GaussianDerivativeBank(input_grayscale, width, height, sigma, DERIVATIVE_YY, &bank);
+}
+
+int GaussianDerivativeXY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma)
+{
+    derivative_bank bank;
+
+    CLEAR(bank);
+    bank.DXY = output_grayscale;
+
+    return GaussianDerivativeBank(input_grayscale, width, height, sigma, DERIVATIVE_XY, &bank);
+}
+
 int GaussianBlur2DKernel(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianBlur2DKernel_ws(inputGrayscale, width, height, outputGrayscale, sigma, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianBlur2DKernel_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma,
+                            ip_workspace* ws)
 {
     double* kernel;
     double* intermediateGrayscale;
     int kernelSize;
+    workspace_mark mark = workspaceMark(ws);
 
     kernelSize = 2 * ((int) (3*sigma)) + 1;
 
-    kernel = (double *)malloc(kernelSize * kernelSize * sizeof(double));
-    intermediateGrayscale = (double *)malloc(width*height*sizeof(double));
+    kernel = (double *)workspaceAlloc(ws, kernelSize * kernelSize * sizeof(double));
+    intermediateGrayscale = (double *)workspaceAlloc(ws, width*height*sizeof(double));
 
     getGaussianKernel2D(kernel, sigma, kernelSize);
 
-    convolve2D(kernel, kernelSize, inputGrayscale, width, height, intermediateGrayscale);
+    convolve2D_ws(kernel, kernelSize, inputGrayscale, width, height, intermediateGrayscale, ws);
     convertDoubleToUcharGrayscale(intermediateGrayscale, width, height, outputGrayscale);
 
-    free(kernel);
-    free(intermediateGrayscale);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
@@ -839,50 +1873,352 @@ int zero_crossing_patch(double* pixel_values, int length)
 }
 
 
+static inline int testBit(const unsigned long long* bits, int index)
+{
+    return (bits[index >> 6] >> (index & 63)) & 1;
+}
+
+static inline void setBit(unsigned long long* bits, int index)
+{
+    bits[index >> 6] |= 1ULL << (index & 63);
+}
+
+/*
+*  Function: HysteresisThreshold
+*  -----------------------------
+*
+*  magnitude         The width x height edge strength plane.
+*  high, low         The thresholds: pixels at or above high are edges, and so
+*                    are pixels at or above low 8-connected to them through
+*                    other such pixels.
+*  output_grayscale  255 on edges, 0 elsewhere; rows ALIGN_TO_FOUR(width) apart.
+*
+*  A flood fill from every pixel at or above high. The visited marks are a
+*  bitset and the stack holds int32 pixel indices rather than a width x
+*  height array of pointers. Pixels are marked as they are pushed, so the
+*  stack never holds more than one entry per pixel. Neighbours outside the
+*  image are skipped, and do not wrap around to the next row.
+*/
+int HysteresisThreshold(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = HysteresisThreshold_ws(magnitude, width, height, high, low, output_grayscale, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int HysteresisThreshold_ws(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale,
+                           ip_workspace* ws)
+{
+    int i, j, k, p, q, x, y, pitch;
+    int stackSize;
+    int* stack;
+    unsigned long long* marks;
+    const int dx[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+    const int dy[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+    workspace_mark mark = workspaceMark(ws);
+
+    pitch = ALIGN_TO_FOUR(width);
+    marks = (unsigned long long*)workspaceCalloc(ws, ((size_t)width*height + 63)/64 * sizeof(unsigned long long));
+    stack = (int*)workspaceAlloc(ws, (size_t)width * height * sizeof(int));
+
+    for(p=0; p < width*height; p++) {
+        if (magnitude[p] < high || testBit(marks, p))
+            continue;
+
+        setBit(marks, p);
+        stack[0] = p;
+        stackSize = 1;
+
+        while (stackSize > 0) {
+            q = stack[--stackSize];
+            x = q % width;
+            y = q / width;
+            for(k=0; k < 8; k++) {
+                if (x + dx[k] < 0 || x + dx[k] >= width || y + dy[k] < 0 || y + dy[k] >= height)
+                    continue;
+                i = q + dy[k]*width + dx[k];
+                if (magnitude[i] >= low && !testBit(marks, i)) {
+                    setBit(marks, i);
+                    stack[stackSize++] = i;
+                }
+            }
+        }
+    }
+
+    for(j=0; j < height; j++) {
+        for(i=0; i < width; i++) {
+            output_grayscale[j*pitch + i] = testBit(marks, j*width + i) ? 255 : 0;
+        }
+    }
+
+    workspaceRelease(ws, mark);
+
+    return 0;
+}
+
+/*
+*  The parallel hysteresis labels the connected components of the pixels at
+*  or above low with a union-find over int32 pixel indices. Each band of rows
+*  is labelled by its own thread, the components are then joined across the
+*  band edges, and finally each band marks the pixels whose component holds a
+*  pixel at or above high. Roots are always the smallest index of their
+*  component, so the labelling does not depend on the banding.
+*/
+typedef struct hysteresis_band_ {
+    double* magnitude;
+    int width;
+    int height;
+    int startRow;
+    int endRow;
+    double high;
+    double low;
+    int* parent;
+    unsigned long long* strong;
+    unsigned char* output_grayscale;
+} hysteresis_band;
+
+static int findRoot(int* parent, int p)
+{
+    int root, next;
+
+    root = p;
+    while (parent[root] != root)
+        root = parent[root];
+
+    while (parent[p] != root) {
+        next = parent[p];
+        parent[p] = root;
+        p = next;
+    }
+
+    return root;
+}
+
+static int findRootReadOnly(const int* parent, int p)
+{
+    while (parent[p] != p)
+        p = parent[p];
+
+    return p;
+}
+
+static void unionRoots(int* parent, unsigned long long* strong, int p, int q, int atomic)
+{
+    int rootP, rootQ, root, child;
+
+    rootP = findRoot(parent, p);
+    rootQ = findRoot(parent, q);
+    if (rootP == rootQ)
+        return;
+
+    root = (rootP < rootQ) ? rootP : rootQ;
+    child = (rootP < rootQ) ? rootQ : rootP;
+    parent[child] = root;
+
+    if ((__atomic_load_n(&strong[child >> 6], __ATOMIC_RELAXED) >> (child & 63)) & 1) {
+        if (atomic)
+            __atomic_fetch_or(&strong[root >> 6], 1ULL << (root & 63), __ATOMIC_RELAXED);
+        else
+            setBit(strong, root);
+    }
+}
+
+static void labelHysteresisBand(void* context, int index)
+{
+    hysteresis_band* band = (hysteresis_band*)context + index;
+    int i, j, p, width = band->width;
+
+    for(j=band->startRow; j < band->endRow; j++) {
+        for(i=0; i < width; i++) {
+            p = j*width + i;
+            if (band->magnitude[p] < band->low) {
+                band->parent[p] = -1;
+                continue;
+            }
+
+            band->parent[p] = p;
+            if (band->magnitude[p] >= band->high)
+                __atomic_fetch_or(&band->strong[p >> 6], 1ULL << (p & 63), __ATOMIC_RELAXED);
+
+            // Join the neighbours already visited: left, and the three above
+            // as long as they are in this band.
+            if (i > 0 && band->parent[p - 1] >= 0)
+                unionRoots(band->parent, band->strong, p, p - 1, 1);
+            if (j > band->startRow) {
+                if (i > 0 && band->parent[p - width - 1] >= 0)
+                    unionRoots(band->parent, band->strong, p, p - width - 1, 1);
+                if (band->parent[p - width] >= 0)
+                    unionRoots(band->parent, band->strong, p, p - width, 1);
+                if (i < width - 1 && band->parent[p - width + 1] >= 0)
+                    unionRoots(band->parent, band->strong, p, p - width + 1, 1);
+            }
+        }
+    }
+}
+
+static void markHysteresisBand(void* context, int index)
+{
+    hysteresis_band* band = (hysteresis_band*)context + index;
+    int i, j, p, width = band->width;
+    int pitch = ALIGN_TO_FOUR(width);
+
+    for(j=band->startRow; j < band->endRow; j++) {
+        for(i=0; i < width; i++) {
+            p = j*width + i;
+            band->output_grayscale[j*pitch + i] =
+                (band->parent[p] >= 0 && testBit(band->strong, findRootReadOnly(band->parent, p))) ? 255 : 0;
+        }
+    }
+}
+
+/*
+*  Function: HysteresisThresholdParallel
+*  -------------------------------------
+*
+*  threads  The number of bands of rows, labelled in parallel on the thread
+*           pool (see setThreadCount).
+*
+*  HysteresisThreshold split over threads, with identical results. Fewer
+*  than two threads, or too few rows to share out, run HysteresisThreshold.
+*/
+int HysteresisThresholdParallel(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale,
+                                int threads)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = HysteresisThresholdParallel_ws(magnitude, width, height, high, low, output_grayscale, threads, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int HysteresisThresholdParallel_ws(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale,
+                                   int threads, ip_workspace* ws)
+{
+    int i, j, t, p;
+    int* parent;
+    unsigned long long* strong;
+    hysteresis_band* bands;
+    workspace_mark mark;
+
+    if (threads > height / HYSTERESIS_MIN_BAND_ROWS)
+        threads = height / HYSTERESIS_MIN_BAND_ROWS;
+    if (threads < 2)
+        return HysteresisThreshold_ws(magnitude, width, height, high, low, output_grayscale, ws);
+
+    mark = workspaceMark(ws);
+    parent = (int*)workspaceAlloc(ws, (size_t)width * height * sizeof(int));
+    strong = (unsigned long long*)workspaceCalloc(ws, ((size_t)width*height + 63)/64 * sizeof(unsigned long long));
+    bands = (hysteresis_band*)workspaceAlloc(ws, threads * sizeof(hysteresis_band));
+
+    for(t=0; t < threads; t++) {
+        bands[t].magnitude = magnitude;
+        bands[t].width = width;
+        bands[t].height = height;
+        bands[t].startRow = (int)((long)height * t / threads);
+        bands[t].endRow = (int)((long)height * (t + 1) / threads);
+        bands[t].high = high;
+        bands[t].low = low;
+        bands[t].parent = parent;
+        bands[t].strong = strong;
+        bands[t].output_grayscale = output_grayscale;
+    }
+
+    parallelFor(threads, labelHysteresisBand, bands);
+
+    // Join the components that meet across each band edge.
+    for(t=1; t < threads; t++) {
+        j = bands[t].startRow;
+        for(i=0; i < width; i++) {
+            p = j*width + i;
+            if (parent[p] < 0)
+                continue;
+            if (i > 0 && parent[p - width - 1] >= 0)
+                unionRoots(parent, strong, p, p - width - 1, 0);
+            if (parent[p - width] >= 0)
+                unionRoots(parent, strong, p, p - width, 0);
+            if (i < width - 1 && parent[p - width + 1] >= 0)
+                unionRoots(parent, strong, p, p - width + 1, 0);
+        }
+    }
+
+    parallelFor(threads, markHysteresisBand, bands);
+
+    workspaceRelease(ws, mark);
+
+    return 0;
+}
+
+/*
+*  Function: getHysteresisThreads
+*  ------------------------------
+*
+*  The number of threads the edge detectors link edges with: the thread
+*  count of the pool (see setThreadCount).
+*/
+int getHysteresisThreads(void)
+{
+    return getThreadCount();
+}
+
 int DifferentialEdgeDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold)
 {
-    unsigned int i, j, pitch, nedges;
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = DifferentialEdgeDetector_ws(input_grayscale, width, height, output_grayscale, sigma, threshold, cutoff_threshold, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int DifferentialEdgeDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma,
+                                double threshold, double cutoff_threshold, ip_workspace* ws)
+{
+    unsigned int i, j;
     double* double_input_grayscale;
     double* input_grayscale_DX;
     double* input_grayscale_DXX;
     double* input_grayscale_DY;
     double* input_grayscale_DYY;
     double* input_grayscale_DXY;
+    derivative_bank bank;
     double* p_DX;
     double* p_DXX;
     double* p_DY;
     double* p_DYY;
     double* p_DXY;
     double* gradient_norm;
-    double** hedges;
-    unsigned char* p_output;
     double* p_gradient_norm;
     double* p_second_order;
     double norm_squared_gradient, squared_threshold, squared_cutoff_threshold;
     double* second_order;
+    workspace_mark mark = workspaceMark(ws);
 
-    double_input_grayscale = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DX = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DXX = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DY = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DYY = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DXY = (double*)malloc(width * height * sizeof(double));
-    gradient_norm = (double*)malloc(width * height * sizeof(double));
-    second_order = (double*)malloc(width * height * sizeof(double));
-    hedges = (double**)malloc(width * height * sizeof(double**));
+    double_input_grayscale = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    allocDerivativeBank_ws(&bank, width, height, DIFFERENTIAL_DERIVATIVES, ws);
+    gradient_norm = (double*)workspaceCalloc(ws, width * height * sizeof(double));
+    second_order = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
     convertUcharToDoubleGrayscale(input_grayscale, width, height, double_input_grayscale);
-    GaussianDerivativeX(double_input_grayscale, width, height, input_grayscale_DX, sigma);
-    GaussianDerivativeXX(double_input_grayscale, width, height, input_grayscale_DXX, sigma);
-    GaussianDerivativeY(double_input_grayscale, width, height, input_grayscale_DY, sigma);
-    GaussianDerivativeYY(double_input_grayscale, width, height, input_grayscale_DYY, sigma);
-    GaussianDerivativeXY(double_input_grayscale, width, height, input_grayscale_DXY, sigma);
+    GaussianDerivativeBank_ws(double_input_grayscale, width, height, sigma, DIFFERENTIAL_DERIVATIVES, &bank, ws);
+    input_grayscale_DX = bank.DX;
+    input_grayscale_DY = bank.DY;
+    input_grayscale_DXX = bank.DXX;
+    input_grayscale_DYY = bank.DYY;
+    input_grayscale_DXY = bank.DXY;
 
     squared_threshold = threshold * threshold;
     squared_cutoff_threshold = cutoff_threshold * cutoff_threshold;
 
-    pitch = ALIGN_TO_FOUR(width);
-
     for(j=0; j < height; j++) {
         for (i=0; i < width; i++) {
             p_DX = input_grayscale_DX + width*j + i;
@@ -906,14 +2242,14 @@ int DifferentialEdgeDetector(unsigned char* input_grayscale, int width, int heig
             norm_squared_gradient = (*p_DX) * (*p_DX) + (*p_DY) * (*p_DY);
 
             double nbr_seo[8];
-            nbr_seo[0] = *(p_second_order + (j + 1)*width + i);
-            nbr_seo[1] = *(p_second_order + (j - 1)*width + i);
-            nbr_seo[2] = *(p_second_order + j*width + (i + 1));
-            nbr_seo[3] = *(p_second_order + j*width + (i - 1));
-            nbr_seo[4] = *(p_second_order + (j + 1)*width + (i + 1));
-            nbr_seo[5] = *(p_second_order + (j - 1)*width + (i - 1));
-            nbr_seo[6] = *(p_second_order + (j + 1)*width + (i - 1));
-            nbr_seo[7] = *(p_second_order + (j - 1)*width + (i + 1));
+            nbr_seo[0] = *(p_second_order + width);
+            nbr_seo[1] = *(p_second_order - width);
+            nbr_seo[2] = *(p_second_order + 1);
+            nbr_seo[3] = *(p_second_order - 1);
+            nbr_seo[4] = *(p_second_order + width + 1);
+            nbr_seo[5] = *(p_second_order - width - 1);
+            nbr_seo[6] = *(p_second_order + width - 1);
+            nbr_seo[7] = *(p_second_order - width + 1);
 
             if ((norm_squared_gradient >= squared_threshold) && (zero_crossing_patch(nbr_seo, 8))) {
                 *p_gradient_norm = norm_squared_gradient;
@@ -925,352 +2261,787 @@ int DifferentialEdgeDetector(unsigned char* input_grayscale, int width, int heig
         }
     }
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            p_gradient_norm = gradient_norm + width * j + i;
+    HysteresisThresholdParallel_ws(gradient_norm, width, height, squared_threshold, squared_cutoff_threshold, output_grayscale,
+                                   getHysteresisThreads(), ws);
 
-            if (*p_gradient_norm >= squared_threshold) {
-                hedges[0] = p_gradient_norm;
-                nedges = 1;
-
-                do {
-                    nedges--;
-                    double* nbrs[8];
-                    nbrs[0] = hedges[nedges] + width;
-                    nbrs[1] = hedges[nedges] - width;
-                    nbrs[2] = hedges[nedges] - 1;
-                    nbrs[3] = hedges[nedges] + 1;
-                    nbrs[4] = hedges[nedges] + width + 1;
-                    nbrs[5] = hedges[nedges] + width - 1;
-                    nbrs[6] = hedges[nedges] - width + 1;
-                    nbrs[7] = hedges[nedges] - width - 1;
-                    for (int k=0; k < 8; k++) {
-                        if ((*(nbrs[k]) >= squared_cutoff_threshold) && (*(nbrs[k]) < squared_threshold)) {
-                            *(nbrs[k]) = squared_threshold;
-                            nedges++;
-                            hedges[nedges] = nbrs[k];
-                        }
-                    }
-
-                } while(nedges > 0);
-            }
-        }
-    }
+    workspaceRelease(ws, mark);
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            p_gradient_norm = gradient_norm + width * j + i;
-            p_output = output_grayscale + pitch * j + i;
+    return 0;
+}
 
-            *p_output = 0;
-            if(*p_gradient_norm >= squared_threshold) {
-                *p_output = 255;
-            }
-        }
+
+static void nonMaximumSuppressionRow(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output)
+{
+    int i;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = nonMaximumSuppressionRowAVX2(DX, DY, magnitude, stride, count, output);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = nonMaximumSuppressionRowSSE2(DX, DY, magnitude, stride, count, output);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
     }
 
+    nonMaximumSuppressionRowScalar(DX + i, DY + i, magnitude + i, stride, count - i, output + i);
+}
+
+typedef struct suppression_rows_ {
+    double* DX;
+    double* DY;
+    double* magnitude;
+    int width;
+    int height;
+    double* output;
+} suppression_rows;
+
+static void nonMaximumSuppressionBand(void* context, int startRow, int endRow)
+{
+    suppression_rows* rows = (suppression_rows*)context;
+
+    NonMaximumSuppressionRows(rows->DX, rows->DY, rows->magnitude, rows->width, rows->height, startRow, endRow, rows->output);
+}
+
+/*
+*  Function: NonMaximumSuppression
+*  -------------------------------
+*
+*  DX, DY     The width x height gradient planes.
+*  magnitude  The width x height gradient magnitude plane (any monotonic
+*             measure, e.g. the squared norm).
+*  output     The magnitude where it is a strict maximum along the gradient
+*             direction, quantized to horizontal, vertical or one of the
+*             diagonals, and 0 elsewhere.
+*
+*  The one pixel frame around the image, which lacks neighbours on one side,
+*  is always suppressed. That also keeps the hysteresis, which only starts
+*  from and walks through nonzero pixels, away from the edges of the planes.
+*
+*  Bands of rows are suppressed in parallel (see setThreadCount).
+*/
+int NonMaximumSuppression(double* DX, double* DY, double* magnitude, int width, int height, double* output)
+{
+    suppression_rows rows = {DX, DY, magnitude, width, height, output};
 
-    free(input_grayscale_DX);
-    free(input_grayscale_DXX);
-    free(input_grayscale_DY);
-    free(input_grayscale_DYY);
-    free(input_grayscale_DXY);
-    free(double_input_grayscale);
-    free(gradient_norm);
-    free(second_order);
-    free(hedges);
+    parallelRows(height, MIN_BAND_ROWS, nonMaximumSuppressionBand, &rows);
 
     return 0;
 }
 
+/*
+*  Function: NonMaximumSuppressionRows
+*  -----------------------------------
+*
+*  startRow, endRow  The band of output rows [startRow, endRow) to compute.
+*                    The other arguments are those of NonMaximumSuppression,
+*                    for the whole image; the rows either side of the band
+*                    are read as neighbours.
+*/
+int NonMaximumSuppressionRows(double* DX, double* DY, double* magnitude, int width, int height, int startRow, int endRow, double* output)
+{
+    int j;
+
+    for(j=startRow; j < endRow; j++) {
+        if (width < 3 || j == 0 || j >= height - 1) {
+            memset(output + j*width, 0, width * sizeof(double));
+            continue;
+        }
+
+        output[j*width] = 0.0;
+        nonMaximumSuppressionRow(DX + j*width + 1, DY + j*width + 1, magnitude + j*width + 1, width, width - 2,
+                                 output + j*width + 1);
+        output[j*width + width - 1] = 0.0;
+    }
+
+    return 0;
+}
 
 int CannyEdgeDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold)
 {
-    unsigned int i, j, pitch, nedges;
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = CannyEdgeDetector_ws(input_grayscale, width, height, output_grayscale, sigma, threshold, cutoff_threshold, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int CannyEdgeDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma,
+                         double threshold, double cutoff_threshold, ip_workspace* ws)
+{
+    unsigned int i, j;
     double* double_input_grayscale;
     double* input_grayscale_DX;
-    double* input_grayscale_DXX;
     double* input_grayscale_DY;
-    double* input_grayscale_DYY;
-    double* input_grayscale_DXY;
+    derivative_bank bank;
     double* p_DX;
     double* p_DY;
     double* gradient_norm;
-    double** hedges;
-    unsigned char* p_output;
-    double* p_gradient_norm;
-    double norm_squared_gradient, squared_threshold, squared_cutoff_threshold;
-    double n_norm_squared_gradient, s_norm_squared_gradient, e_norm_squared_gradient, w_norm_squared_gradient, ne_norm_squared_gradient,
-           nw_norm_squared_gradient, se_norm_squared_gradient, sw_norm_squared_gradient, dir;
-
-    double_input_grayscale = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DX = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DXX = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DY = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DYY = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DXY = (double*)malloc(width * height * sizeof(double));
-    gradient_norm = (double*)malloc(width * height * sizeof(double));
-    hedges = (double**)malloc(width * height * sizeof(double**));
+    double* magnitude;
+    double squared_threshold, squared_cutoff_threshold;
+    workspace_mark mark = workspaceMark(ws);
+
+    double_input_grayscale = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    allocDerivativeBank_ws(&bank, width, height, CANNY_DERIVATIVES, ws);
+    gradient_norm = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    magnitude = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
     convertUcharToDoubleGrayscale(input_grayscale, width, height, double_input_grayscale);
-    GaussianDerivativeX(double_input_grayscale, width, height, input_grayscale_DX, sigma);
-    GaussianDerivativeXX(double_input_grayscale, width, height, input_grayscale_DXX, sigma);
-    GaussianDerivativeY(double_input_grayscale, width, height, input_grayscale_DY, sigma);
-    GaussianDerivativeYY(double_input_grayscale, width, height, input_grayscale_DYY, sigma);
-    GaussianDerivativeXY(double_input_grayscale, width, height, input_grayscale_DXY, sigma);
+    GaussianDerivativeBank_ws(double_input_grayscale, width, height, sigma, CANNY_DERIVATIVES, &bank, ws);
+    input_grayscale_DX = bank.DX;
+    input_grayscale_DY = bank.DY;
 
     squared_threshold = threshold * threshold;
     squared_cutoff_threshold = cutoff_threshold * cutoff_threshold;
 
-    pitch = ALIGN_TO_FOUR(width);
-
     for(j=0; j < height; j++) {
         for(i=0; i < width; i++) {
             p_DX = input_grayscale_DX + width*j + i;
             p_DY = input_grayscale_DY + width*j + i;
-            p_gradient_norm = gradient_norm + width * j + i;
+            *(magnitude + width*j + i) = (*p_DX) * (*p_DX) + (*p_DY) * (*p_DY);
+        }
+    }
 
-            norm_squared_gradient = (*p_DX) * (*p_DX) + (*p_DY) * (*p_DY);
-            n_norm_squared_gradient = ((*(p_DX + width)) * (*(p_DX + width))) + ((*(p_DY + width)) * (*(p_DY + width)));
-            s_norm_squared_gradient = ((*(p_DX - width)) * (*(p_DX - width))) + ((*(p_DY - width)) * (*(p_DY - width)));
-            e_norm_squared_gradient = ((*(p_DX - 1)) * (*(p_DX - 1))) + ((*(p_DY - 1)) * (*(p_DY - 1)));
-            w_norm_squared_gradient = ((*(p_DX + 1)) * (*(p_DX + 1))) + ((*(p_DY + 1)) * (*(p_DY + 1)));
-            ne_norm_squared_gradient = ((*(p_DX + width + 1)) * (*(p_DX + width + 1))) + ((*(p_DY + width + 1)) * (*(p_DY + width + 1)));
-            nw_norm_squared_gradient = ((*(p_DX + width - 1)) * (*(p_DX + width - 1))) + ((*(p_DY + width - 1)) * (*(p_DY + width - 1)));
-            se_norm_squared_gradient = ((*(p_DX - width + 1)) * (*(p_DX - width + 1))) + ((*(p_DY - width + 1)) * (*(p_DY - width + 1)));
-            sw_norm_squared_gradient = ((*(p_DX - width - 1)) * (*(p_DX - width - 1))) + ((*(p_DY - width - 1)) * (*(p_DY - width - 1)));
-
-            dir = (fmod(atan2(*p_DY, *p_DX) + M_PI, M_PI) / M_PI) * 8;
-            if (((dir <= 1 || dir > 7) && ((norm_squared_gradient > e_norm_squared_gradient) && (norm_squared_gradient > w_norm_squared_gradient))) ||
-                ((dir > 1 && dir <= 3) && ((norm_squared_gradient > nw_norm_squared_gradient) && (norm_squared_gradient > se_norm_squared_gradient))) ||
-                ((dir > 3 && dir <= 5) && ((norm_squared_gradient > n_norm_squared_gradient) && (norm_squared_gradient > s_norm_squared_gradient))) ||
-                ((dir > 5 && dir <= 7) && ((norm_squared_gradient > ne_norm_squared_gradient) && (norm_squared_gradient > sw_norm_squared_gradient)))) {
-                *p_gradient_norm = norm_squared_gradient;
-            }
-            else {
-                *p_gradient_norm = 0.0;
-            }
+    NonMaximumSuppression(input_grayscale_DX, input_grayscale_DY, magnitude, width, height, gradient_norm);
+
+    HysteresisThresholdParallel_ws(gradient_norm, width, height, squared_threshold, squared_cutoff_threshold, output_grayscale,
+                                   getHysteresisThreads(), ws);
 
+    workspaceRelease(ws, mark);
+
+    return 0;
+}
+
+/*
+*  taps  Room for 2 * kernelSize row pointers, for the rows the vector kernel
+*        leaves to the scalar one.
+*/
+static void structureTensorRows(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                                double *outputXX, double *outputYY, double *outputXY, const double **taps)
+{
+    int i, k;
+    const double **pMovRowsDX = taps;
+    const double **pMovRowsDY = taps + kernelSize;
+
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = structureTensorRowsAVX2(kernel, kernelSize, rowsDX, rowsDY, count, outputXX, outputYY, outputXY);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = structureTensorRowsSSE2(kernel, kernelSize, rowsDX, rowsDY, count, outputXX, outputYY, outputXY);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+
+    if (i < count) {
+        for(k = 0; k < kernelSize; k++) {
+            pMovRowsDX[k] = rowsDX[k] ? rowsDX[k] + i : NULL;
+            pMovRowsDY[k] = rowsDY[k] ? rowsDY[k] + i : NULL;
         }
+        structureTensorRowsScalar(kernel, kernelSize, pMovRowsDX, pMovRowsDY, count - i, outputXX + i, outputYY + i, outputXY + i);
     }
+}
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            p_gradient_norm = gradient_norm + width * j + i;
+static void structureTensorResponse(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                    int count, double k, int shiTomasi, double threshold, double *response)
+{
+    int i;
 
-            if (*p_gradient_norm >= squared_threshold) {
-                hedges[0] = p_gradient_norm;
-                nedges = 1;
-
-                do {
-                    nedges--;
-                    double* nbrs[8];
-                    nbrs[0] = hedges[nedges] + width;
-                    nbrs[1] = hedges[nedges] - width;
-                    nbrs[2] = hedges[nedges] - 1;
-                    nbrs[3] = hedges[nedges] + 1;
-                    nbrs[4] = hedges[nedges] + width + 1;
-                    nbrs[5] = hedges[nedges] + width - 1;
-                    nbrs[6] = hedges[nedges] - width + 1;
-                    nbrs[7] = hedges[nedges] - width - 1;
-                    for (int k=0; k < 8; k++) {
-                        if ((*(nbrs[k]) >= squared_cutoff_threshold) && (*(nbrs[k]) < squared_threshold)) {
-                            *(nbrs[k]) = squared_threshold;
-                            nedges++;
-                            hedges[nedges] = nbrs[k];
-                        }
-                    }
-
-                } while(nedges > 0);
-            }
-        }
+    switch (getSIMDLevel()) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX2:
+        i = structureTensorResponseAVX2(kernel, kernelSize, inputXX, inputYY, inputXY, count, k, shiTomasi, threshold, response);
+        break;
+    case SIMD_SSSE3:
+    case SIMD_SSE2:
+        i = structureTensorResponseSSE2(kernel, kernelSize, inputXX, inputYY, inputXY, count, k, shiTomasi, threshold, response);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
     }
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            p_gradient_norm = gradient_norm + width * j + i;
-            p_output = output_grayscale + pitch * j + i;
+    structureTensorResponseScalar(kernel, kernelSize, inputXX + i, inputYY + i, inputXY + i, count - i, k, shiTomasi, threshold, response + i);
+}
 
-            *p_output = 0;
-            if(*p_gradient_norm >= squared_threshold) {
-                *p_output = 255;
-            }
+/*
+*  Function: CornerResponse
+*  ------------------------
+*
+*  DX, DY     The width x height gradient planes.
+*  sigma_w    The standard deviation of the Gaussian window.
+*  k          The Harris sensitivity; unused by CORNER_SHI_TOMASI.
+*  threshold  Responses at or below this are written as 0.
+*  measure    CORNER_HARRIS for det - k trace^2 of the windowed structure
+*             tensor, or CORNER_SHI_TOMASI for its smaller eigenvalue.
+*  response   The width x height response plane.
+*
+*  The structure tensor products, their Gaussian windowing and the response
+*  in one sweep down the image. For each output row the vertical window is
+*  applied to DX*DX, DY*DY and DX*DY together, formed on the fly from the DX
+*  and DY rows under the window, into one scratch row per channel; the
+*  horizontal window then runs along the three rows at once, and each
+*  pixel's response and threshold follow as soon as its tensor is complete.
+*  No product or windowed plane is ever stored.
+*
+*  The window is the FIR kernel of GaussianWindow, and the results are the
+*  same as windowing the three product planes with it.
+*/
+int CornerResponse(double* DX, double* DY, int width, int height, double sigma_w, double k, double threshold,
+                   enum corner_measure measure, double* response)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = CornerResponse_ws(DX, DY, width, height, sigma_w, k, threshold, measure, response, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int CornerResponse_ws(double* DX, double* DY, int width, int height, double sigma_w, double k, double threshold,
+                      enum corner_measure measure, double* response, ip_workspace* ws)
+{
+    int j, l, p, padWidth, kernelSize, rowLength;
+    double* kernel;
+    double* tensorRows;
+    double* rowXX;
+    double* rowYY;
+    double* rowXY;
+    const double** rowsDX;
+    const double** rowsDY;
+    const double** taps;
+    workspace_mark mark = workspaceMark(ws);
+
+    kernelSize = 2 * ((int) (3*sigma_w)) + 1;
+    padWidth = (kernelSize - 1) / 2;
+
+    // The scratch rows carry padWidth zeros either side, for the zero border
+    // of the horizontal window.
+    rowLength = width + 2*padWidth;
+    tensorRows = (double*)workspaceCalloc(ws, 3 * rowLength * sizeof(double));
+    rowXX = tensorRows;
+    rowYY = tensorRows + rowLength;
+    rowXY = tensorRows + 2*rowLength;
+
+    kernel = (double*)workspaceAlloc(ws, kernelSize * sizeof(double));
+    rowsDX = (const double**)workspaceAlloc(ws, 4 * kernelSize * sizeof(double*));
+    rowsDY = rowsDX + kernelSize;
+    taps = rowsDX + 2*kernelSize;
+    getGaussianKernel1D(kernel, sigma_w, kernelSize);
+
+    for(j=0; j < height; j++) {
+        for(l=0; l < kernelSize; l++) {
+            p = j - padWidth + l;
+            rowsDX[l] = (p < 0 || p >= height) ? NULL : DX + p*width;
+            rowsDY[l] = (p < 0 || p >= height) ? NULL : DY + p*width;
         }
-    }
 
+        structureTensorRows(kernel, kernelSize, rowsDX, rowsDY, width, rowXX + padWidth, rowYY + padWidth, rowXY + padWidth, taps);
+        structureTensorResponse(kernel, kernelSize, rowXX, rowYY, rowXY, width, k, measure == CORNER_SHI_TOMASI, threshold,
+                                response + j*width);
+    }
 
-    free(input_grayscale_DX);
-    free(input_grayscale_DXX);
-    free(input_grayscale_DY);
-    free(input_grayscale_DYY);
-    free(input_grayscale_DXY);
-    free(double_input_grayscale);
-    free(gradient_norm);
-    free(hedges);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
-int CornerDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold)
+static void cornerResponsePlane(unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold,
+                                enum corner_measure measure, double* response, ip_workspace* ws)
 {
-    unsigned int i, j, pitch;
     double* double_input_grayscale;
-    double* input_grayscale_DX_squared;
-    double* input_grayscale_DY_squared;
-    double* input_grayscale_DXDY;
-    double* s_x2;
-    double* s_y2;
-    double* s_xy;
-    double* p_DX_squared;
-    double* p_DY_squared;
-    double* p_DXDY;
-    double* p_sx2;
-    double* p_sy2;
-    double* p_sxy;
-    unsigned char* p_output;
-    double harris_corner_response;
-    double* harris_corner_response_image;
-    double* p_harris_corner_response_image;
-
-    harris_corner_response_image = (double*)malloc(width*height*sizeof(double));
-    double_input_grayscale = (double*)malloc(width*height*sizeof(double));
-    input_grayscale_DX_squared = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DY_squared = (double*)malloc(width * height * sizeof(double));
-    input_grayscale_DXDY = (double*)malloc(width * height * sizeof(double));
-    s_x2 = (double*)malloc(width * height * sizeof(double));
-    s_y2 = (double*)malloc(width * height * sizeof(double));
-    s_xy = (double*)malloc(width * height * sizeof(double));
+    derivative_bank bank;
+    workspace_mark mark = workspaceMark(ws);
+
+    double_input_grayscale = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    allocDerivativeBank_ws(&bank, width, height, CORNER_DERIVATIVES, ws);
 
     convertUcharToDoubleGrayscale(input_grayscale, width, height, double_input_grayscale);
-    GaussianDerivativeX(double_input_grayscale, width, height, input_grayscale_DX_squared, sigma);
-    GaussianDerivativeY(double_input_grayscale, width, height, input_grayscale_DY_squared, sigma);
+    GaussianDerivativeBank_ws(double_input_grayscale, width, height, sigma, CORNER_DERIVATIVES, &bank, ws);
+    CornerResponse_ws(bank.DX, bank.DY, width, height, sigma_w, k, threshold, measure, response, ws);
+
+    workspaceRelease(ws, mark);
+}
+
+// Whether the interior pixel at p_response is above the threshold and
+// strictly greater than all 8 neighbours.
+static inline int isCorner(const double* p_response, int width)
+{
+    return (*p_response != 0.0) &&
+           (*p_response > *(p_response + width)) && (*p_response > *(p_response - width)) && (*p_response > *(p_response - 1)) &&
+           (*p_response > *(p_response + 1)) && (*p_response > *(p_response + width + 1)) && (*p_response > *(p_response + width - 1)) &&
+           (*p_response > *(p_response - width + 1)) && (*p_response > *(p_response - width - 1));
+}
+
+/*
+*  Function: CornerDetectorMeasure
+*  -------------------------------
+*
+*  As CornerDetector, with the choice of corner measure (see CornerResponse).
+*  Corners are the pixels whose response is above the threshold and strictly
+*  greater than all 8 neighbours; the one pixel frame is never a corner.
+*/
+int CornerDetectorMeasure(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w,
+                          double k, double threshold, enum corner_measure measure)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = CornerDetectorMeasure_ws(input_grayscale, width, height, output_grayscale, sigma, sigma_w, k, threshold, measure, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int CornerDetectorMeasure_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma,
+                             double sigma_w, double k, double threshold, enum corner_measure measure, ip_workspace* ws)
+{
+    int i, j, pitch;
+    double* response;
+    workspace_mark mark = workspaceMark(ws);
 
     pitch = ALIGN_TO_FOUR(width);
 
+    response = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    cornerResponsePlane(input_grayscale, width, height, sigma, sigma_w, k, threshold, measure, response, ws);
+
     for(j=0; j < height; j++) {
         for(i=0; i < width; i++) {
-            p_DX_squared = input_grayscale_DX_squared + width * j + i;
-            p_DY_squared = input_grayscale_DY_squared + width * j + i;
-            p_DXDY = input_grayscale_DXDY + width * j + i;
+            output_grayscale[pitch * j + i] = 0;
+
+            if (i == 0 || j == 0 || i == width - 1 || j == height - 1)
+                continue;
 
-            *p_DXDY = (*p_DX_squared) * (*p_DX_squared);
-            *p_DX_squared = (*p_DX_squared) * (*p_DX_squared);
-            *p_DY_squared = (*p_DY_squared) * (*p_DY_squared);
+            if (isCorner(response + width * j + i, width))
+                output_grayscale[pitch * j + i] = 255;
         }
     }
 
-    GaussianWindow(input_grayscale_DX_squared, width, height, s_x2, sigma_w);
-    GaussianWindow(input_grayscale_DY_squared, width, height, s_y2, sigma_w);
-    GaussianWindow(input_grayscale_DXDY, width, height, s_xy, sigma_w);
+    workspaceRelease(ws, mark);
 
-    for(j=0; j < height; j++) {
-        for(i=0; i < width; i++) {
-            p_sx2 = s_x2 + width * j + i;
-            p_sy2 = s_y2 + width * j + i;
-            p_sxy = s_xy + width * j + i;
-            p_harris_corner_response_image = harris_corner_response_image + width * j + i;
+    return 0;
+}
+
+int CornerDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold)
+{
+    return CornerDetectorMeasure(input_grayscale, width, height, output_grayscale, sigma, sigma_w, k, threshold, CORNER_HARRIS);
+}
+
+int CornerDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w,
+                      double k, double threshold, ip_workspace* ws)
+{
+    return CornerDetectorMeasure_ws(input_grayscale, width, height, output_grayscale, sigma, sigma_w, k, threshold, CORNER_HARRIS, ws);
+}
+
+// Keypoints rank by response, ties by position in raster order, so the
+// selection never depends on the order of the heap.
+static inline int keypointAbove(const keypoint* a, const keypoint* b)
+{
+    if (a->response != b->response)
+        return a->response > b->response;
+
+    return (a->y < b->y) || (a->y == b->y && a->x < b->x);
+}
+
+// The heap keeps its lowest ranked keypoint at the root.
+static void siftDownKeypoint(keypoint* heap, int count, int n)
+{
+    int child;
+    keypoint item = heap[n];
+
+    while ((child = 2*n + 1) < count) {
+        if (child + 1 < count && keypointAbove(&heap[child], &heap[child + 1]))
+            child++;
+        if (!keypointAbove(&item, &heap[child]))
+            break;
+        heap[n] = heap[child];
+        n = child;
+    }
+    heap[n] = item;
+}
+
+static void siftUpKeypoint(keypoint* heap, int n)
+{
+    keypoint item = heap[n];
+
+    while (n > 0 && keypointAbove(&heap[(n - 1) / 2], &item)) {
+        heap[n] = heap[(n - 1) / 2];
+        n = (n - 1) / 2;
+    }
+    heap[n] = item;
+}
+
+/*
+*  Function: CornerKeypoints
+*  -------------------------
+*
+*  input_grayscale  The input image, rows ALIGN_TO_FOUR(width) apart.
+*  sigma, sigma_w, k, threshold, measure
+*                   As CornerDetectorMeasure.
+*  max_keypoints    The most keypoints to return, and the capacity of
+*                   keypoints; MAX_CORNER_KEYPOINTS(width, height) returns
+*                   every corner.
+*  min_distance     Corners closer than this to a stronger kept corner are
+*                   dropped; 0 keeps them all.
+*  keypoints        The corners, strongest first.
+*
+*  The corners of CornerDetectorMeasure as a list of (x, y, response) rather
+*  than a full frame mask. Candidates go straight from the response plane
+*  into a heap bounded at max_keypoints, so only the strongest are ever
+*  kept and sorted. With a minimum distance the suppression is greedy from
+*  the strongest corner down, and the heap holds every candidate until it
+*  is done; a grid of cells min_distance / sqrt(2) wide, each of which can
+*  hold at most one kept corner, makes each test a look at 5 x 5 cells.
+*
+*  Returns the number of keypoints written, or -1 if max_keypoints < 1.
+*/
+int CornerKeypoints(unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold,
+                    enum corner_measure measure, int max_keypoints, double min_distance, keypoint* keypoints)
+{
+    ip_workspace ws;
+    int result;
 
-            harris_corner_response = (((*p_sx2) * (*p_sy2)) - ((*p_sxy) * (*p_sxy))) - k * ((*p_sx2)  + (*p_sy2)) * ((*p_sx2)  + (*p_sy2));
+    initWorkspace(&ws, 0, 0);
+    result = CornerKeypoints_ws(input_grayscale, width, height, sigma, sigma_w, k, threshold, measure, max_keypoints, min_distance,
+                                keypoints, &ws);
+    freeWorkspace(&ws);
 
-            *p_harris_corner_response_image = 0;
+    return result;
+}
 
-            if (harris_corner_response > threshold) {
-                *p_harris_corner_response_image = harris_corner_response;
+int CornerKeypoints_ws(unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold,
+                       enum corner_measure measure, int max_keypoints, double min_distance, keypoint* keypoints, ip_workspace* ws)
+{
+    int i, j, n, count, capacity, limit, found, suppress, isolated;
+    int gridWidth, gridHeight, cellX, cellY, cx, cy;
+    int* grid;
+    double* response;
+    double cellSize, dx, dy;
+    keypoint* heap;
+    keypoint candidate;
+    keypoint item;
+    workspace_mark mark;
+
+    if (max_keypoints < 1)
+        return -1;
+
+    // Corners are never adjacent, so none are closer than 2 and shorter
+    // distances suppress nothing.
+    suppress = (min_distance > 2.0);
+
+    // There are never more candidates than MAX_CORNER_KEYPOINTS, so the heap
+    // is sized for them once instead of growing.
+    mark = workspaceMark(ws);
+    limit = suppress ? MAX_CORNER_KEYPOINTS(width, height) : max_keypoints;
+    capacity = (limit < MAX_CORNER_KEYPOINTS(width, height)) ? limit : MAX_CORNER_KEYPOINTS(width, height);
+    if (capacity < 1)
+        capacity = 1;
+    heap = (keypoint*)workspaceAlloc(ws, capacity * sizeof(keypoint));
+    response = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    cornerResponsePlane(input_grayscale, width, height, sigma, sigma_w, k, threshold, measure, response, ws);
+    count = 0;
+
+    for(j=1; j < height - 1; j++) {
+        for(i=1; i < width - 1; i++) {
+            if (!isCorner(response + width * j + i, width))
+                continue;
+
+            candidate.x = i;
+            candidate.y = j;
+            candidate.response = response[width * j + i];
+
+            if (count < limit) {
+                heap[count] = candidate;
+                siftUpKeypoint(heap, count);
+                count++;
+            } else if (keypointAbove(&candidate, &heap[0])) {
+                heap[0] = candidate;
+                siftDownKeypoint(heap, count, 0);
             }
         }
     }
 
+    // Taking the lowest ranked off the heap into the slot it frees leaves
+    // the array strongest first.
+    for(n=count - 1; n > 0; n--) {
+        item = heap[0];
+        heap[0] = heap[n];
+        heap[n] = item;
+        siftDownKeypoint(heap, n, 0);
+    }
+
+    if (!suppress) {
+        memcpy(keypoints, heap, count * sizeof(keypoint));
+        workspaceRelease(ws, mark);
+        return count;
+    }
+
+    cellSize = min_distance / sqrt(2.0);
+    gridWidth = (int)(width / cellSize) + 1;
+    gridHeight = (int)(height / cellSize) + 1;
+    grid = (int*)workspaceAlloc(ws, gridWidth * gridHeight * sizeof(int));
+    for(n=0; n < gridWidth * gridHeight; n++)
+        grid[n] = -1;
+
+    found = 0;
+    for(n=0; n < count && found < max_keypoints; n++) {
+        cellX = (int)(heap[n].x / cellSize);
+        cellY = (int)(heap[n].y / cellSize);
+        candidate = heap[n];
+        isolated = 1;
+
+        for(cy=cellY - 2; cy <= cellY + 2 && isolated; cy++) {
+            for(cx=cellX - 2; cx <= cellX + 2 && isolated; cx++) {
+                if (cx < 0 || cy < 0 || cx >= gridWidth || cy >= gridHeight || grid[cy * gridWidth + cx] < 0)
+                    continue;
+                dx = keypoints[grid[cy * gridWidth + cx]].x - candidate.x;
+                dy = keypoints[grid[cy * gridWidth + cx]].y - candidate.y;
+                isolated = (dx*dx + dy*dy >= min_distance * min_distance);
+            }
+        }
+
+        if (isolated) {
+            grid[cellY * gridWidth + cellX] = found;
+            keypoints[found++] = candidate;
+        }
+    }
+
+    workspaceRelease(ws, mark);
+
+    return found;
+}
+
+/*
+*  Function: setBlurPrecision
+*  --------------------------
+*
+*  precision:  BLUR_DOUBLE (the default) or BLUR_INTEGER.
+*
+*  With BLUR_INTEGER, GaussianBlur runs GaussianBlurInteger whenever the FIR
+*  mode is selected and the kernel can be quantized; otherwise it keeps to
+*  the double passes.
+*/
+void setBlurPrecision(enum blur_precision precision)
+{
+    active_blur_precision = precision;
+}
+
+enum blur_precision getBlurPrecision(void)
+{
+    return active_blur_precision;
+}
+
+/*
+*  Function: GaussianBlurInteger
+*  -----------------------------
+*
+*  inputGrayscale   The input image, rows ALIGN_TO_FOUR(width) apart.
+*  outputGrayscale  The output image, same layout.
+*  sigma            The standard deviation of the Gaussian.
+*
+*  GaussianBlur without the doubles: the same 3 sigma kernel, quantized to
+*  INTEGER_BLUR_WEIGHT_SHIFT bits, a vertical pass from the 8 bit image to a
+*  16 bit fixed point one, and a horizontal pass back to 8 bits, all with
+*  32 bit sums. That is 2 bytes of intermediate per pixel instead of 8 for
+*  each of three double images, and 16 pixels per AVX2 instruction. The
+*  border is zero and the result truncated, as in GaussianBlur, and every
+*  pixel is within 1 of it.
+*
+*  Returns -1, without touching the output, for sigmas so small that the
+*  kernel gain does not fit the fixed point format.
+*/
+int GaussianBlurInteger(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma)
+{
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianBlurInteger_ws(inputGrayscale, width, height, outputGrayscale, sigma, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianBlurInteger_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma,
+                           ip_workspace* ws)
+{
+    int i, j, k, p, pitch, padWidth, kernelSize, weightSum, result;
+    int interiorStart, interiorEnd;
+    long weight;
+    double* kernel;
+    short* quantizedKernel;
+    short* tempGrayscaleV;
+    short* pMovTempGrayscale;
+    unsigned char* pMovOutputGrayscale;
+    const unsigned char** inputRows;
+    workspace_mark mark = workspaceMark(ws);
+
+    kernelSize = 2 * ((int) (3*sigma)) + 1;
+    padWidth = (kernelSize - 1) / 2;
+    pitch = ALIGN_TO_FOUR(width);
+
+    kernel = (double*)workspaceAlloc(ws, kernelSize * sizeof(double));
+    quantizedKernel = (short*)workspaceAlloc(ws, kernelSize * sizeof(short));
+
+    getGaussianKernel1D(kernel, sigma, kernelSize);
+    weightSum = 0;
+    for(k=0; k < kernelSize; k++) {
+        weight = lround(kernel[k] * (1 << INTEGER_BLUR_WEIGHT_SHIFT));
+        weightSum += (weight < INTEGER_BLUR_MAX_WEIGHT_SUM) ? weight : INTEGER_BLUR_MAX_WEIGHT_SUM + 1;
+        quantizedKernel[k] = (short)weight;
+    }
+
+    // The weights are all positive, so a bounded sum also keeps each one within 16 bits.
+    if (weightSum > INTEGER_BLUR_MAX_WEIGHT_SUM) {
+        workspaceRelease(ws, mark);
+        return -1;
+    }
+
+    tempGrayscaleV = (short*)workspaceAlloc(ws, width * height * sizeof(short));
+    inputRows = (const unsigned char**)workspaceAlloc(ws, 2 * kernelSize * sizeof(unsigned char*));
+
     for(j=0; j < height; j++) {
+        for(k=0; k < kernelSize; k++) {
+            p = j - padWidth + k;
+            inputRows[k] = (p < 0 || p >= height) ? NULL : inputGrayscale + p*pitch;
+        }
+        convolveRows1DU8(quantizedKernel, kernelSize, inputRows, width, tempGrayscaleV + j*width, inputRows + kernelSize);
+    }
+
+    interiorStart = (padWidth < width) ? padWidth : width;
+    interiorEnd = (width - padWidth > interiorStart) ? width - padWidth : interiorStart;
+
+    for(j=0; j < height; j++) {
+        pMovTempGrayscale = tempGrayscaleV + j*width;
+        pMovOutputGrayscale = outputGrayscale + j*pitch;
+
         for(i=0; i < width; i++) {
-            double* nbrs[8];
-            p_harris_corner_response_image = harris_corner_response_image + width * j + i;
-            p_output = output_grayscale + pitch * j + i;
-            nbrs[0] = p_harris_corner_response_image + width;
-            nbrs[1] = p_harris_corner_response_image - width;
-            nbrs[2] = p_harris_corner_response_image - 1;
-            nbrs[3] = p_harris_corner_response_image + 1;
-            nbrs[4] = p_harris_corner_response_image + width + 1;
-            nbrs[5] = p_harris_corner_response_image + width - 1;
-            nbrs[6] = p_harris_corner_response_image - width + 1;
-            nbrs[7] = p_harris_corner_response_image - width - 1;
-            if((*p_harris_corner_response_image > *nbrs[0]) && (*p_harris_corner_response_image > *nbrs[1]) && (*p_harris_corner_response_image > *nbrs[2]) &&
-                (*p_harris_corner_response_image > *nbrs[3]) && (*p_harris_corner_response_image > *nbrs[4]) && (*p_harris_corner_response_image > *nbrs[5]) &&
-                (*p_harris_corner_response_image > *nbrs[6]) && (*p_harris_corner_response_image > *nbrs[7])) {
-                *p_output = 255;
+            if (i == interiorStart) {
+                i = interiorEnd;
+                if (i >= width)
+                    break;
             }
-            else {
-                *p_output = 0;
+
+            result = 0;
+            for(k=0; k < kernelSize; k++) {
+                p = i - padWidth + k;
+                if (p >= 0 && p < width)
+                    result += quantizedKernel[kernelSize - k - 1] * pMovTempGrayscale[p];
             }
+            result >>= INTEGER_BLUR_ROW_SHIFT;
+            pMovOutputGrayscale[i] = (result > 255) ? 255 : result;
         }
+
+        if (interiorEnd > interiorStart)
+            convolveRow1DS16(quantizedKernel, kernelSize, pMovTempGrayscale + interiorStart - padWidth, interiorEnd - interiorStart,
+                             pMovOutputGrayscale + interiorStart);
     }
 
-    free(input_grayscale_DX_squared);
-    free(input_grayscale_DY_squared);
-    free(input_grayscale_DXDY);
-    free(s_x2);
-    free(s_y2);
-    free(s_xy);
-    free(double_input_grayscale);
-    free(harris_corner_response_image);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
 int GaussianBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma)
 {
-    double* kernel;
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianBlur_ws(inputGrayscale, width, height, outputGrayscale, sigma, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma, ip_workspace* ws)
+{
     int max, kernelSize;
     double* doubleInputGrayscale;
     double* tempGrayscaleV;
     double* tempGrayscaleH;
+    enum gaussian_mode mode = getGaussianMode();
+    workspace_mark mark;
+
+    if (getBlurPrecision() == BLUR_INTEGER && mode == GAUSSIAN_FIR &&
+        GaussianBlurInteger_ws(inputGrayscale, width, height, outputGrayscale, sigma, ws) == 0)
+        return 0;
 
-    doubleInputGrayscale = (double*)malloc(width * height * sizeof(double));
-    tempGrayscaleV = (double*)malloc(width * height * sizeof(double));
-    tempGrayscaleH = (double*)malloc(width * height * sizeof(double));
+    mark = workspaceMark(ws);
+    doubleInputGrayscale = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    tempGrayscaleV = (double*)workspaceAlloc(ws, width * height * sizeof(double));
+    tempGrayscaleH = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
     max = (int) (3*sigma);
     kernelSize = 2 * max + 1;
 
-    kernel = (double*)malloc(kernelSize * sizeof(double));
-    getGaussianKernel1D(kernel, sigma, kernelSize);
-
     convertUcharToDoubleGrayscale(inputGrayscale, width, height, doubleInputGrayscale);
-    convolve2Dwith1Dkernel(kernel, kernelSize, doubleInputGrayscale, width, height, tempGrayscaleV, VERTICAL);
-    convolve2Dwith1Dkernel(kernel, kernelSize, tempGrayscaleV, width, height, tempGrayscaleH, HORIZONTAL);
+    gaussianPass(doubleInputGrayscale, width, height, tempGrayscaleV, sigma, 0, kernelSize, VERTICAL, mode, ws);
+    gaussianPass(tempGrayscaleV, width, height, tempGrayscaleH, sigma, 0, kernelSize, HORIZONTAL, mode, ws);
     convertDoubleToUcharGrayscale(tempGrayscaleH, width, height, outputGrayscale);
 
-    free(kernel);
-    free(tempGrayscaleV);
-    free(tempGrayscaleH);
-    free(doubleInputGrayscale);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
 int GaussianWindow(double* inputGrayscale, int width, int height, double* outputGrayscale, double sigma)
 {
-    double* kernel;
+    ip_workspace ws;
+    int result;
+
+    initWorkspace(&ws, 0, 0);
+    result = GaussianWindow_ws(inputGrayscale, width, height, outputGrayscale, sigma, &ws);
+    freeWorkspace(&ws);
+
+    return result;
+}
+
+int GaussianWindow_ws(double* inputGrayscale, int width, int height, double* outputGrayscale, double sigma, ip_workspace* ws)
+{
     int max, kernelSize;
     double* tempGrayscaleV;
+    enum gaussian_mode mode = getGaussianMode();
+    workspace_mark mark = workspaceMark(ws);
 
-    tempGrayscaleV = (double*)malloc(width * height * sizeof(double));
+    tempGrayscaleV = (double*)workspaceAlloc(ws, width * height * sizeof(double));
 
     max = (int) (3*sigma);
     kernelSize = 2 * max + 1;
 
-    kernel = (double*)malloc(kernelSize * sizeof(double));
-    getGaussianKernel1D(kernel, sigma, kernelSize);
-
-    convolve2Dwith1Dkernel(kernel, kernelSize, inputGrayscale, width, height, tempGrayscaleV, VERTICAL);
-    convolve2Dwith1Dkernel(kernel, kernelSize, tempGrayscaleV, width, height, outputGrayscale, HORIZONTAL);
+    gaussianPass(inputGrayscale, width, height, tempGrayscaleV, sigma, 0, kernelSize, VERTICAL, mode, ws);
+    gaussianPass(tempGrayscaleV, width, height, outputGrayscale, sigma, 0, kernelSize, HORIZONTAL, mode, ws);
 
-    free(kernel);
-    free(tempGrayscaleV);
+    workspaceRelease(ws, mark);
 
     return 0;
 }
 
 void convertDoubleToUcharGrayscale(double* inputGrayscale, int width, int height, unsigned char* outputGrayscale)
+{
+    image_rows rows = {inputGrayscale, width, height, outputGrayscale};
+
+    parallelRows(height, MIN_BAND_ROWS, convertDoubleToUcharGrayscaleBand, &rows);
+}
+
+void convertDoubleToUcharGrayscaleRows(double* inputGrayscale, int width, int height, int startRow, int endRow, unsigned char* outputGrayscale)
 {
     int i, j, pitch;
     double* pInput;
@@ -1278,7 +3049,7 @@ void convertDoubleToUcharGrayscale(double* inputGrayscale, int width, int height
 
     pitch = ALIGN_TO_FOUR(width);
 
-    for(j=0; j < height; j++) {
+    for(j=startRow; j < endRow; j++) {
         for(i=0; i < width; i++) {
             pInput = inputGrayscale + j*width + i;
             pOutput = outputGrayscale + j*pitch + i;
@@ -3,6 +3,10 @@
 
 #include <stdlib.h>
 
+#include "simd.h"
+#include "threadpool.h"
+#include "workspace.h"
+
 
 #define FOUR                      (4) 
 #define ALIGN_TO_FOUR(VAL)        (((VAL) + FOUR - 1) & ~(FOUR - 1))
@@ -29,6 +33,72 @@ enum direction {
         VERTICAL_AND_HORIZONTAL,
 };
 
+enum border_type {
+        BORDER_ZERO,
+        BORDER_REPLICATE,
+        BORDER_REFLECT,
+};
+
+enum gaussian_mode {
+        GAUSSIAN_FIR,
+        GAUSSIAN_IIR,
+};
+
+enum blur_precision {
+        BLUR_DOUBLE,
+        BLUR_INTEGER,
+};
+
+/* Below this sigma the recursive Gaussian is inaccurate, and the FIR kernels are used instead. */
+#define RECURSIVE_GAUSSIAN_MIN_SIGMA (0.5)
+
+/* Largest radius for which a BoxBlur sum of 8 bit pixels fits in 32 bits. */
+#define BOX_BLUR_MAX_RADIUS (2047)
+
+/* The planes of GaussianDerivativeBank. */
+enum derivative_flags {
+        DERIVATIVE_X = 1 << 0,
+        DERIVATIVE_Y = 1 << 1,
+        DERIVATIVE_XX = 1 << 2,
+        DERIVATIVE_YY = 1 << 3,
+        DERIVATIVE_XY = 1 << 4,
+        DERIVATIVE_ALL = (1 << 5) - 1,
+};
+
+/* The derivative planes each detector reads, and so the only ones it computes. */
+#define DIFFERENTIAL_DERIVATIVES  (DERIVATIVE_ALL)
+#define CANNY_DERIVATIVES         (DERIVATIVE_X | DERIVATIVE_Y)
+#define CORNER_DERIVATIVES        (DERIVATIVE_X | DERIVATIVE_Y)
+
+typedef struct derivative_bank_ {
+    double* DX;
+    double* DY;
+    double* DXX;
+    double* DYY;
+    double* DXY;
+} derivative_bank;
+
+enum corner_measure {
+        CORNER_HARRIS,
+        CORNER_SHI_TOMASI,
+};
+
+/* A corner found by CornerKeypoints: its pixel and its corner response. */
+typedef struct keypoint_ {
+    int x;
+    int y;
+    double response;
+} keypoint;
+
+/*
+*  The most corners a width x height image can have: corners are strict 8
+*  neighbour maxima inside the one pixel frame, so no two are adjacent.
+*/
+#define MAX_CORNER_KEYPOINTS(width, height) ((((width) - 1) / 2) * (((height) - 1) / 2))
+
+/* The fewest rows a thread of HysteresisThresholdParallel is given. */
+#define HYSTERESIS_MIN_BAND_ROWS (16)
+
 typedef struct crop_w {
     int start_x;
     int start_y;
@@ -43,31 +113,83 @@ typedef struct tagRGBQUAD {
   unsigned char rgbReserved;
 } RGBQUAD;
 
+/* A BMP header, with the grayscale palette of an 8 bit image. */
+#define BMP_HEADER_SIZE           (54)
+#define BMP_MAX_HEADER_SIZE       (BMP_HEADER_SIZE + 256*sizeof(RGBQUAD))
+
 int BMPwriter(unsigned char *pRGB, int bitNum, int width, int height, char* output_filestring);
 int GrayScaleWriter(unsigned char *pGrayscale, int width, int height, char* output_filestring);
+int BMPHeader(unsigned char *header, int bitNum, int width, int height);
+int BMPWritev(unsigned char *header, int headerSize, unsigned char *pImage, int bitNum, int width, int height, char* output_filestring);
 int YUYV2RGB24(unsigned char *pYUYV, int width, int height, unsigned char *pRGB24);
+int YUYV2RGB24Rows(unsigned char *pYUYV, int width, int height, int startRow, int endRow, unsigned char *pRGB24);
+int YUYV2Grayscale(unsigned char *pYUYV, int width, int height, unsigned char *outputGrayscale);
+int YUYV2GrayscaleRows(unsigned char *pYUYV, int width, int height, int startRow, int endRow, unsigned char *outputGrayscale);
 int RGB24toGrayscale(unsigned char *inputRGB24, int width, int height, unsigned char *outputGrayscale);
+int RGB24toGrayscaleRows(unsigned char *inputRGB24, int width, int height, int startRow, int endRow, unsigned char *outputGrayscale);
 int cropRGB24(unsigned char *inputRGB24, int width, int height, int startX, int startY, int endX, int endY, unsigned char* outputRGB24);
 int makeZeroPaddedImage(double *inputGrayscale, int inputWidth, int inputHeight, int padWidth, double *outputGrayscale, enum direction ptype);
 int convolve2D(double* kernel, int kernelSize, unsigned char* inputGrayscale, int width, int height, double* outputGrayscale);
+int convolve2D_ws(double* kernel, int kernelSize, unsigned char* inputGrayscale, int width, int height, double* outputGrayscale, ip_workspace* ws);
 int convolve2Dwith1Dkernel(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale, enum direction dir);
+int convolve2Dwith1DkernelBorder(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale, enum direction dir, enum border_type border);
+int convolve2Dwith1DkernelBorder_ws(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, double* outputGrayscale, enum direction dir, enum border_type border, ip_workspace* ws);
+int convolve2Dwith1DkernelBorderRows(double* kernel, int kernelSize, double* inputGrayscale, int width, int height, int startRow, int endRow, double* outputGrayscale, enum direction dir, enum border_type border);
+int BoxBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, int radius);
+int BoxBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, int radius, ip_workspace* ws);
 int UniformBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale);
+int UniformBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, ip_workspace* ws);
 void getGaussianKernel1D(double* kernel, double sigma, int kernelSize);
 void getGaussianKernel2D(double* kernel, double sigma, int kernelSize);
 void getDGausianKernel1D(double* kernel, double sigma, int kernelSize);
 void getD2GausianKernel1D(double* kernel, double sigma, int kernelSize);
 int GaussianBlur2DKernel(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma);
+int GaussianBlur2DKernel_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma, ip_workspace* ws);
+void setGaussianMode(enum gaussian_mode mode);
+enum gaussian_mode getGaussianMode(void);
+int recursiveGaussian1D(double* input, int width, int height, double* output, double sigma, int order, enum direction dir);
+int recursiveGaussian1D_ws(double* input, int width, int height, double* output, double sigma, int order, enum direction dir, ip_workspace* ws);
+int GaussianFilter(double* input_grayscale, int width, int height, double* output_grayscale, double sigma, int orderX, int orderY, enum gaussian_mode mode);
+int GaussianFilter_ws(double* input_grayscale, int width, int height, double* output_grayscale, double sigma, int orderX, int orderY, enum gaussian_mode mode, ip_workspace* ws);
+int GaussianDerivativeBank(double* input_grayscale, int width, int height, double sigma, unsigned int derivatives, derivative_bank* bank);
+int GaussianDerivativeBank_ws(double* input_grayscale, int width, int height, double sigma, unsigned int derivatives, derivative_bank* bank, ip_workspace* ws);
+int allocDerivativeBank(derivative_bank* bank, int width, int height, unsigned int derivatives);
+int allocDerivativeBank_ws(derivative_bank* bank, int width, int height, unsigned int derivatives, ip_workspace* ws);
+void freeDerivativeBank(derivative_bank* bank);
 int GaussianDerivativeX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
 int GaussianDerivativeY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
 int GaussianDerivativeXX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
 int GaussianDerivativeYY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
 int GaussianDerivativeXY(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
+void setBlurPrecision(enum blur_precision precision);
+enum blur_precision getBlurPrecision(void);
+int GaussianBlurInteger(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma);
+int GaussianBlurInteger_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma, ip_workspace* ws);
 int GaussianBlur(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma);
+int GaussianBlur_ws(unsigned char* inputGrayscale, int width, int height, unsigned char* outputGrayscale, double sigma, ip_workspace* ws);
 int GaussianWindow(double* inputGrayscale, int width, int height, double* outputGrayscale, double sigma);
+int GaussianWindow_ws(double* inputGrayscale, int width, int height, double* outputGrayscale, double sigma, ip_workspace* ws);
+int HysteresisThreshold(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale);
+int HysteresisThreshold_ws(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale, ip_workspace* ws);
+int HysteresisThresholdParallel(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale, int threads);
+int HysteresisThresholdParallel_ws(double* magnitude, int width, int height, double high, double low, unsigned char* output_grayscale, int threads, ip_workspace* ws);
+int getHysteresisThreads(void);
 int DifferentialEdgeDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold);
+int DifferentialEdgeDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold, ip_workspace* ws);
+int NonMaximumSuppression(double* DX, double* DY, double* magnitude, int width, int height, double* output);
+int NonMaximumSuppressionRows(double* DX, double* DY, double* magnitude, int width, int height, int startRow, int endRow, double* output);
 int CannyEdgeDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold);
+int CannyEdgeDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double threshold, double cutoff_threshold, ip_workspace* ws);
+int CornerResponse(double* DX, double* DY, int width, int height, double sigma_w, double k, double threshold, enum corner_measure measure, double* response);
+int CornerResponse_ws(double* DX, double* DY, int width, int height, double sigma_w, double k, double threshold, enum corner_measure measure, double* response, ip_workspace* ws);
+int CornerDetectorMeasure(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold, enum corner_measure measure);
+int CornerDetectorMeasure_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold, enum corner_measure measure, ip_workspace* ws);
 int CornerDetector(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold);
+int CornerDetector_ws(unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale, double sigma, double sigma_w, double k, double threshold, ip_workspace* ws);
+int CornerKeypoints(unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold, enum corner_measure measure, int max_keypoints, double min_distance, keypoint* keypoints);
+int CornerKeypoints_ws(unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold, enum corner_measure measure, int max_keypoints, double min_distance, keypoint* keypoints, ip_workspace* ws);
 void convertDoubleToUcharGrayscale(double* inputGrayscale, int width, int height, unsigned char* outputGrayscale);
+void convertDoubleToUcharGrayscaleRows(double* inputGrayscale, int width, int height, int startRow, int endRow, unsigned char* outputGrayscale);
 void convertUcharToDoubleGrayscale(unsigned char* inputGrayscale, int width, int height, double* outputGrayscale);
 
 #endif
@@ -13,10 +13,12 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <signal.h>
 
 #include <linux/videodev2.h>
 
 #include "camera.h"
+#include "stagestats.h"
 
 
 
@@ -27,6 +29,8 @@ void usage(FILE *fp, int argc, char **argv, char* dev_name, int frame_count)
                  "Version 1.3\n"
                  "Options:\n"
                  "-d  | --device name   Video device name [%s]n\n"
+                 "                      or file:<recording>[,max-speed] or\n"
+                 "                      file:<directory>,size=<w>x<h>[,fps=<n>][,max-speed] to replay frames\n"
                  "-h  | --help          Print this messagen\n"
                  "-m  | --mmap          Use memory mapped buffers [default]n\n"
                  "-r  | --read          Use read() callsn\n"
@@ -35,11 +39,19 @@ void usage(FILE *fp, int argc, char **argv, char* dev_name, int frame_count)
                  "-f  | --format        Force format to 640x480 YUYVn\n"
                  "-c  | --count         Number of frames to grab [%i]n\n"
                  "-w  | --window        Crop window\n"
+                 "-g  | --gray          Grayscale outputs only, skip the RGB conversion\n"
+                 "-t  | --timing        Print the processing time of every frame\n"
+                 "-p  | --pipeline      Capture, process and write at once, with this many processing threads\n"
+                 "-q  | --queue         Frames that may wait for a processing thread [twice the threads]\n"
+                 "-b  | --backpressure  When the queue is full: block, drop-oldest or drop-newest [block]\n"
+                 "-e  | --requeue       Hand the device buffer back after: copy, convert or process [process]\n"
+                 "-a  | --async         Write the outputs in the background, with io_uring where available\n"
+                 "-R  | --record file   Record the frames and their outputs to one file instead of bitmaps\n"
                  "",
                  argv[0], dev_name, frame_count);
 }
 
-static const char short_options[] = "d:hmruo:fc:w:";
+static const char short_options[] = "d:hmruo:fc:w:gtp:q:b:e:aR:";
 
 static const struct option
 long_options[] = {
@@ -52,6 +64,14 @@ long_options[] = {
         { "format", no_argument,       NULL, 'f' },
         { "count",  required_argument, NULL, 'c' },
         { "window",  required_argument, NULL, 'w' },
+        { "gray",   no_argument,       NULL, 'g' },
+        { "timing", no_argument,       NULL, 't' },
+        { "pipeline", required_argument, NULL, 'p' },
+        { "queue",  required_argument, NULL, 'q' },
+        { "backpressure", required_argument, NULL, 'b' },
+        { "requeue", required_argument, NULL, 'e' },
+        { "async",  no_argument,       NULL, 'a' },
+        { "record", required_argument, NULL, 'R' },
         { 0, 0, 0, 0 }
 };
 
@@ -68,6 +88,9 @@ int main(int argc, char **argv)
     char* window_args;
     int force_format = 0;
     crop_window c_window;
+    capture_options opts;
+
+    CLEAR(opts);
 
     for (;;) {
         int idx;
@@ -125,6 +148,62 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'g':
+                opts.grayscale_only = 1;
+                break;
+
+        case 't':
+                opts.report_timing = 1;
+                break;
+
+        case 'a':
+                opts.async_writes = 1;
+                break;
+
+        case 'R':
+                opts.recording_path = optarg;
+                break;
+
+        case 'p':
+                errno = 0;
+                opts.pipeline_workers = strtol(optarg, NULL, 0);
+                if (errno)
+                        errno_exit(optarg);
+                break;
+
+        case 'q':
+                errno = 0;
+                opts.queue_depth = strtol(optarg, NULL, 0);
+                if (errno)
+                        errno_exit(optarg);
+                break;
+
+        case 'b':
+                if (strcmp(optarg, "block") == 0) {
+                        opts.backpressure = BACKPRESSURE_BLOCK;
+                } else if (strcmp(optarg, "drop-oldest") == 0) {
+                        opts.backpressure = BACKPRESSURE_DROP_OLDEST;
+                } else if (strcmp(optarg, "drop-newest") == 0) {
+                        opts.backpressure = BACKPRESSURE_DROP_NEWEST;
+                } else {
+                        usage(stderr, argc, argv, dev_name, frame_count);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
+        case 'e':
+                if (strcmp(optarg, "copy") == 0) {
+                        opts.requeue = REQUEUE_AFTER_COPY;
+                } else if (strcmp(optarg, "convert") == 0) {
+                        opts.requeue = REQUEUE_AFTER_CONVERSION;
+                } else if (strcmp(optarg, "process") == 0) {
+                        opts.requeue = REQUEUE_AFTER_PROCESSING;
+                } else {
+                        usage(stderr, argc, argv, dev_name, frame_count);
+                        exit(EXIT_FAILURE);
+                }
+                break;
+
         default:
                 usage(stderr, argc, argv, dev_name, frame_count);
                 exit(EXIT_FAILURE);
@@ -136,11 +215,15 @@ int main(int argc, char **argv)
     c_window.end_x = window_coords[2];
     c_window.end_y = window_coords[3];
 
+    /* kill -USR1 prints the stage latencies so far; they are printed at exit too. */
+    if (stage_stats_dump_on(SIGUSR1) == -1)
+        perror("SIGUSR1");
+
     device_handle = open_device(dev_name);
     print_formats(device_handle);
     buffs = init_device(dev_name, device_handle, io_selection, force_format);
     start_capturing(device_handle, buffs);
-    mainloop(device_handle, buffs, frame_count, output_filestring, c_window);
+    mainloop(device_handle, buffs, frame_count, output_filestring, c_window, opts);
     stop_capturing(device_handle, buffs);
     uninit_device(buffs);
     close_device(device_handle);
@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+
+/*
+*  Waiting on the queues: a few yields first, for a frame that is about to
+*  turn up, then short sleeps, so an idle pipeline does not spin.
+*/
+static void backoff(int* spins)
+{
+    struct timespec pause = {0, 50000};
+
+    if ((*spins)++ < 16)
+        sched_yield();
+    else
+        nanosleep(&pause, NULL);
+}
+
+/*
+*  Function: queue_init
+*  --------------------
+*
+*  capacity  The most pointers the queue holds, rounded up to a power of two.
+*
+*  Returns 0, or -1 if the cells cannot be allocated.
+*/
+int queue_init(frame_queue* queue, unsigned int capacity)
+{
+    unsigned long i, size;
+
+    size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    queue->cells = (queue_cell*)malloc(size * sizeof(queue_cell));
+    if (queue->cells == NULL)
+        return -1;
+
+    for(i=0; i < size; i++)
+        queue->cells[i].sequence = i;
+    queue->mask = size - 1;
+    queue->enqueuePosition = 0;
+    queue->dequeuePosition = 0;
+
+    return 0;
+}
+
+void queue_destroy(frame_queue* queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+/*
+*  Function: queue_push
+*  --------------------
+*
+*  A cell is free for the producer at position p when its sequence is p, and
+*  holds data for the consumer at position p when it is p + 1.
+*
+*  Returns 0, or -1 if the queue is full.
+*/
+int queue_push(frame_queue* queue, void* data)
+{
+    queue_cell* cell;
+    unsigned long position, sequence;
+    long difference;
+
+    position = __atomic_load_n(&queue->enqueuePosition, __ATOMIC_RELAXED);
+    for(;;) {
+        cell = &queue->cells[position & queue->mask];
+        sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        difference = (long)sequence - (long)position;
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueuePosition, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return -1;
+        } else {
+            position = __atomic_load_n(&queue->enqueuePosition, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+*  Function: queue_pop
+*  -------------------
+*
+*  Returns the oldest pointer in the queue, or NULL if it is empty.
+*/
+void* queue_pop(frame_queue* queue)
+{
+    queue_cell* cell;
+    unsigned long position, sequence;
+    long difference;
+    void* data;
+
+    position = __atomic_load_n(&queue->dequeuePosition, __ATOMIC_RELAXED);
+    for(;;) {
+        cell = &queue->cells[position & queue->mask];
+        sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        difference = (long)sequence - (long)(position + 1);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeuePosition, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = __atomic_load_n(&queue->dequeuePosition, __ATOMIC_RELAXED);
+        }
+    }
+
+    data = cell->data;
+    __atomic_store_n(&cell->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+
+    return data;
+}
+
+void queue_push_wait(frame_queue* queue, void* data)
+{
+    int spins = 0;
+
+    while (queue_push(queue, data) != 0)
+        backoff(&spins);
+}
+
+void* queue_pop_wait(frame_queue* queue)
+{
+    int spins = 0;
+    void* data;
+
+    while ((data = queue_pop(queue)) == NULL)
+        backoff(&spins);
+
+    return data;
+}
+
+typedef struct pipeline_frame_ {
+    long sequence;
+    void* data;
+} pipeline_frame;
+
+typedef struct pipeline_ {
+    const pipeline_stages* stages;
+    int workers;
+    frame_queue freeFrames;
+    frame_queue processQueue;
+    frame_queue writeQueue;
+    long queued;                                /* Frames in processQueue. */
+    long writerNext;                            /* The next sequence to write. */
+    long dropped[PIPELINE_REORDER_WINDOW];      /* sequence + 1 of each frame dropped. */
+    long written;
+} pipeline;
+
+/* Sent down the queues once capture ends, one per worker. */
+static pipeline_frame pipeline_stop;
+
+static void* pipeline_worker(void* arg)
+{
+    pipeline* p = (pipeline*)arg;
+    pipeline_frame* frame;
+
+    for(;;) {
+        frame = (pipeline_frame*)queue_pop_wait(&p->processQueue);
+        if (frame == &pipeline_stop)
+            break;
+
+        __atomic_sub_fetch(&p->queued, 1, __ATOMIC_RELEASE);
+        p->stages->process(p->stages->context, frame->data, frame->sequence);
+        queue_push_wait(&p->writeQueue, frame);
+    }
+
+    queue_push_wait(&p->writeQueue, &pipeline_stop);
+
+    return NULL;
+}
+
+/*
+*  The writer takes the frames in whatever order the workers finish them,
+*  and writes them in capture order: it holds on to any that are early, and
+*  steps over the sequence numbers capture dropped.
+*/
+static void* pipeline_writer(void* arg)
+{
+    pipeline* p = (pipeline*)arg;
+    pipeline_frame* pending[PIPELINE_MAX_FRAMES];
+    pipeline_frame* frame;
+    int i, stops, pendingCount, progress, spins;
+    long next;
+
+    stops = pendingCount = spins = 0;
+    next = 0;
+    while (stops < p->workers || pendingCount > 0) {
+        progress = 0;
+
+        frame = (pipeline_frame*)queue_pop(&p->writeQueue);
+        if (frame == &pipeline_stop) {
+            stops++;
+            progress = 1;
+        } else if (frame != NULL) {
+            pending[pendingCount++] = frame;
+            progress = 1;
+        }
+
+        for(;;) {
+            if (__atomic_load_n(&p->dropped[next % PIPELINE_REORDER_WINDOW], __ATOMIC_ACQUIRE) == next + 1) {
+                __atomic_store_n(&p->writerNext, ++next, __ATOMIC_RELEASE);
+                progress = 1;
+                continue;
+            }
+
+            for(i=0; i < pendingCount && pending[i]->sequence != next; i++);
+            if (i == pendingCount)
+                break;
+
+            frame = pending[i];
+            pending[i] = pending[--pendingCount];
+            p->stages->write(p->stages->context, frame->data, frame->sequence);
+            p->written++;
+            queue_push_wait(&p->freeFrames, frame);
+            __atomic_store_n(&p->writerNext, ++next, __ATOMIC_RELEASE);
+            progress = 1;
+        }
+
+        // Every worker has finished, and what is left can never be written.
+        if (!progress && stops == p->workers)
+            break;
+
+        if (progress)
+            spins = 0;
+        else
+            backoff(&spins);
+    }
+
+    return NULL;
+}
+
+/*
+*  Function: run_pipeline
+*  ----------------------
+*
+*  config  The number of workers, how many captured frames may wait for one,
+*          and what to do when that many are waiting.
+*  stages  The source, processing and writing of the frames.
+*  stats   Filled in with the frames captured, dropped and written.
+*
+*  Capture runs on the calling thread, which only ever copies a frame into
+*  the pool and queues it, so it keeps up with the source as long as the
+*  workers keep up on average. Each frame goes from capture to a free worker
+*  through a lock free queue, then on to the writer through another, and
+*  back to the pool once written. The pool holds depth + workers + 2 frames,
+*  allocated once.
+*
+*  When depth frames are waiting, or the pool is empty, the policy decides:
+*  BACKPRESSURE_BLOCK holds capture until there is room, and so pushes back
+*  on the source; BACKPRESSURE_DROP_OLDEST drops the frame that has waited
+*  longest for a worker and queues the new one, and drops the new one only
+*  when nothing is waiting, or when the reordering window is full behind a
+*  frame still being processed; BACKPRESSURE_DROP_NEWEST releases the new frame
+*  without copying it. The frames that are written are always in capture
+*  order.
+*
+*  Returns 0 once every frame has been written, or -1 if the configuration
+*  is out of range or the pipeline cannot be set up.
+*/
+int run_pipeline(const pipeline_config* config, const pipeline_stages* stages, pipeline_stats* stats)
+{
+    int i, frameCount, spins, inWindow, room;
+    long sequence;
+    pipeline* p;
+    pipeline_frame* frames;
+    pipeline_frame* frame;
+    pipeline_frame* oldest;
+    pthread_t* workers;
+    pthread_t writer;
+
+    frameCount = config->depth + config->workers + 2;
+    if (config->workers < 1 || config->depth < 1 || frameCount > PIPELINE_MAX_FRAMES)
+        return -1;
+
+    p = (pipeline*)calloc(1, sizeof(pipeline));
+    frames = (pipeline_frame*)calloc(frameCount, sizeof(pipeline_frame));
+    workers = (pthread_t*)malloc(config->workers * sizeof(pthread_t));
+    if (p == NULL || frames == NULL || workers == NULL) {
+        free(workers);
+        free(frames);
+        free(p);
+        return -1;
+    }
+
+    p->stages = stages;
+    p->workers = config->workers;
+    if (queue_init(&p->freeFrames, frameCount) != 0 ||
+        queue_init(&p->processQueue, config->depth + config->workers) != 0 ||
+        queue_init(&p->writeQueue, frameCount + config->workers) != 0) {
+        queue_destroy(&p->freeFrames);
+        queue_destroy(&p->processQueue);
+        free(workers);
+        free(frames);
+        free(p);
+        return -1;
+    }
+
+    for(i=0; i < frameCount; i++) {
+        frames[i].data = stages->alloc_frame(stages->context);
+        queue_push(&p->freeFrames, &frames[i]);
+    }
+
+    for(i=0; i < config->workers; i++)
+        pthread_create(&workers[i], NULL, pipeline_worker, p);
+    pthread_create(&writer, NULL, pipeline_writer, p);
+
+    stats->captured = stats->dropped = stats->written = 0;
+    sequence = 0;
+    while (stages->next(stages->context)) {
+        stats->captured++;
+        frame = NULL;
+        spins = 0;
+
+        for(;;) {
+            inWindow = (sequence - __atomic_load_n(&p->writerNext, __ATOMIC_ACQUIRE) < PIPELINE_REORDER_WINDOW);
+            room = inWindow && (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) < config->depth);
+            if (room && frame == NULL)
+                frame = (pipeline_frame*)queue_pop(&p->freeFrames);
+            if (room && frame != NULL)
+                break;
+
+            // Dropping a waiting frame makes room in the queue and the pool,
+            // but not in the window, which a frame still being processed holds.
+            if (config->policy == BACKPRESSURE_DROP_OLDEST && inWindow &&
+                (oldest = (pipeline_frame*)queue_pop(&p->processQueue)) != NULL) {
+                __atomic_sub_fetch(&p->queued, 1, __ATOMIC_RELEASE);
+                __atomic_store_n(&p->dropped[oldest->sequence % PIPELINE_REORDER_WINDOW], oldest->sequence + 1, __ATOMIC_RELEASE);
+                stats->dropped++;
+                if (frame == NULL)
+                    frame = oldest;
+                else
+                    queue_push(&p->freeFrames, oldest);
+                continue;
+            }
+
+            if (config->policy != BACKPRESSURE_BLOCK)
+                break;
+
+            backoff(&spins);
+        }
+
+        if (!room || frame == NULL) {
+            stages->discard(stages->context);
+            stats->dropped++;
+            if (frame != NULL)
+                queue_push(&p->freeFrames, frame);
+            continue;
+        }
+
+        stages->copy(stages->context, frame->data);
+        frame->sequence = sequence++;
+        __atomic_add_fetch(&p->queued, 1, __ATOMIC_RELEASE);
+        queue_push_wait(&p->processQueue, frame);
+    }
+
+    for(i=0; i < config->workers; i++)
+        queue_push_wait(&p->processQueue, &pipeline_stop);
+    for(i=0; i < config->workers; i++)
+        pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+
+    stats->written = p->written;
+
+    for(i=0; i < frameCount; i++)
+        stages->free_frame(stages->context, frames[i].data);
+
+    queue_destroy(&p->freeFrames);
+    queue_destroy(&p->processQueue);
+    queue_destroy(&p->writeQueue);
+    free(workers);
+    free(frames);
+    free(p);
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef PIPELINE_H_   /* Include guard */
+#define PIPELINE_H_
+
+
+/* The most frames a pipeline keeps in flight, and its reordering window. */
+#define PIPELINE_MAX_FRAMES       (128)
+#define PIPELINE_REORDER_WINDOW   (256)
+
+enum backpressure_policy {
+        BACKPRESSURE_BLOCK,         /* Wait for a free frame: nothing is dropped. */
+        BACKPRESSURE_DROP_OLDEST,   /* Drop the oldest frame waiting to be processed. */
+        BACKPRESSURE_DROP_NEWEST,   /* Drop the frame just captured. */
+};
+
+/*
+*  A bounded multi-producer, multi-consumer queue of pointers, lock free: each
+*  cell carries a sequence number saying whether it is ready to be written or
+*  read at the current position, and producers and consumers claim positions
+*  with a compare and swap.
+*/
+typedef struct queue_cell_ {
+    unsigned long sequence;
+    void* data;
+} queue_cell;
+
+typedef struct frame_queue_ {
+    queue_cell* cells;
+    unsigned long mask;
+    char pad0[64];
+    unsigned long enqueuePosition;
+    char pad1[64];
+    unsigned long dequeuePosition;
+    char pad2[64];
+} frame_queue;
+
+int queue_init(frame_queue* queue, unsigned int capacity);
+void queue_destroy(frame_queue* queue);
+int queue_push(frame_queue* queue, void* data);
+void* queue_pop(frame_queue* queue);
+void queue_push_wait(frame_queue* queue, void* data);
+void* queue_pop_wait(frame_queue* queue);
+
+typedef struct pipeline_config_ {
+    int workers;                        /* Processing threads. */
+    int depth;                          /* Frames waiting to be processed. */
+    enum backpressure_policy policy;
+} pipeline_config;
+
+/*
+*  What the pipeline runs. frame is the caller's own per frame state, made
+*  by alloc_frame for each frame of the pool.
+*
+*  next     Waits for the next frame from the source; returns 0 when there
+*           are no more. Called on the capture thread, as are copy and discard.
+*  copy     Takes the frame next got into a frame of the pool, and releases
+*           it back to the source.
+*  discard  Releases the frame next got without taking it.
+*  process  Called on a worker thread, for any number of frames at once.
+*  write    Called on the writer thread, once per frame in capture order.
+*/
+typedef struct pipeline_stages_ {
+    void* context;
+    void* (*alloc_frame)(void* context);
+    void (*free_frame)(void* context, void* frame);
+    int (*next)(void* context);
+    void (*copy)(void* context, void* frame);
+    void (*discard)(void* context);
+    void (*process)(void* context, void* frame, long sequence);
+    void (*write)(void* context, void* frame, long sequence);
+} pipeline_stages;
+
+typedef struct pipeline_stats_ {
+    long captured;
+    long dropped;
+    long written;
+} pipeline_stats;
+
+int run_pipeline(const pipeline_config* config, const pipeline_stages* stages, pipeline_stats* stats);
+
+#endif
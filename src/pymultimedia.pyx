@@ -14,7 +14,39 @@ cdef extern from "camera.h":
     cdef resolution get_resolution(int device_handle);
 
 
+cdef extern from "threadpool.h":
+    cdef int setThreadCount(int threads)
+    cdef int getThreadCount()
+
+
+cdef extern from "stdint.h":
+    ctypedef unsigned long long uint64_t
+
+
+cdef extern from "stagestats.h":
+    cdef enum capture_stage:
+        CAPTURE_STAGES
+    ctypedef struct stage_summary:
+        const char* name
+        uint64_t count
+        uint64_t p50
+        uint64_t p90
+        uint64_t p99
+        uint64_t max
+        double mean
+    cdef int stage_summarize(capture_stage stage, stage_summary* summary)
+    cdef void stage_stats_reset()
+
+
 cdef extern from "imageprocessing.h":
+    ctypedef struct keypoint:
+        int x
+        int y
+        double response
+    cdef enum corner_measure:
+        CORNER_HARRIS
+        CORNER_SHI_TOMASI
+    cdef int MAX_CORNER_KEYPOINTS(int width, int height)
     cdef int BMPwriter(unsigned char *pRGB, int bitNum, int width, int height, char* output_filestring);
     cdef int RGB24toGrayscale(unsigned char *inputRGB24, int width, int height, unsigned char *outputGrayscale);
     cdef int GaussianDerivativeX(double* input_grayscale, int width, int height, double* output_grayscale, double sigma);
@@ -33,6 +65,36 @@ cdef extern from "imageprocessing.h":
     cdef int CornerDetector(
         unsigned char* input_grayscale, int width, int height, unsigned char* output_grayscale,
         double sigma, double sigma_w, double k, double threshold);
+    cdef int CornerKeypoints(
+        unsigned char* input_grayscale, int width, int height, double sigma, double sigma_w, double k, double threshold,
+        corner_measure measure, int max_keypoints, double min_distance, keypoint* keypoints);
+
+
+cpdef int set_thread_count(int threads=0):
+    return setThreadCount(threads)
+
+
+cpdef int get_thread_count():
+    return getThreadCount()
+
+
+cpdef dict get_stage_stats():
+    """The latency of each capture stage that has run, in nanoseconds; empty if compiled out."""
+    cdef stage_summary summary
+    cdef int stage
+    stats = {}
+
+    for stage in range(CAPTURE_STAGES):
+        if stage_summarize(<capture_stage>stage, &summary) == 0 and summary.count > 0:
+            stats[summary.name.decode()] = {
+                "count": summary.count, "mean": summary.mean, "p50": summary.p50, "p90": summary.p90,
+                "p99": summary.p99, "max": summary.max}
+
+    return stats
+
+
+cpdef reset_stage_stats():
+    stage_stats_reset()
 
 
 cpdef int py_open_device(dev_name):
@@ -95,7 +157,7 @@ cpdef np.ndarray py_grab_frame_rgb(dev_name, int width, int height):
     cdef unsigned char* image_buffer_rgb
     cdef dev_name_bytes = dev_name.encode()
     cdef char* d_name = dev_name_bytes
-    cpdef int result
+    cdef int result
 
     image_buffer_rgb = <unsigned char*> malloc(int(math.ceil(width*3/4.0)*4.0)*height);
     result = grab_frame_rgb(d_name, width, height, image_buffer_rgb)
@@ -116,7 +178,7 @@ cpdef py_grab_frame_grayscale(dev_name, int width, int height, sigma=2.0):
     cdef double* input_grayscale_DXY
     cdef dev_name_bytes = dev_name.encode()
     cdef char* d_name = dev_name_bytes
-    cpdef int result
+    cdef int result
 
     image_buffer_rgb = <unsigned char*> malloc(int(math.ceil(width*3/4.0)*4.0)*height);
     image_buffer_grayscale = <unsigned char*> malloc(int(math.ceil(width/4.0)*4.0)*height);
@@ -264,6 +326,50 @@ cpdef get_image_corners(imagearray, sigma=2.0, sigma_w=2.0, k=0.06, threshold=10
     return edges
 
 
+cpdef get_image_keypoints(imagearray, sigma=2.0, sigma_w=2.0, k=0.06, threshold=1000.0, max_keypoints=0, min_distance=0.0, measure="harris"):
+    cdef unsigned char* input_grayscale
+    cdef keypoint* keypoints
+    cdef int width
+    cdef int height
+    cdef int count
+    cdef corner_measure c_measure
+
+    if measure == "harris":
+        c_measure = CORNER_HARRIS
+    elif measure == "shi-tomasi":
+        c_measure = CORNER_SHI_TOMASI
+    else:
+        raise ValueError("Unknown corner measure '%s', expected 'harris' or 'shi-tomasi'" % measure)
+
+    height, width = imagearray.shape
+    cdef int pitch = int(math.ceil(width/4.0)*4.0)
+    cdef int capacity = max_keypoints if max_keypoints > 0 else MAX_CORNER_KEYPOINTS(width, height)
+    if capacity < 1:
+        return np.zeros((0, 3), dtype=np.float64)
+
+    input_grayscale = <unsigned char*> malloc(pitch*height*sizeof(unsigned char))
+    keypoints = <keypoint*> malloc(capacity*sizeof(keypoint))
+
+    for j in range(height):
+        for i in range(width):
+            input_grayscale[pitch * j + i] = imagearray[j, i]
+
+    count = CornerKeypoints(
+        input_grayscale, width, height, np.float64(sigma), np.float64(sigma_w), np.float64(k), np.float64(threshold),
+        c_measure, capacity, np.float64(min_distance), keypoints)
+
+    points = np.zeros((count, 3), dtype=np.float64)
+    for n in range(count):
+        points[n, 0] = keypoints[n].x
+        points[n, 1] = keypoints[n].y
+        points[n, 2] = keypoints[n].response
+
+    free(input_grayscale)
+    free(keypoints)
+
+    return points
+
+
 cpdef get_gaussian_kernel1d(sigma, kernelsize):
     cdef double* kernel
 
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE             /* O_DIRECT */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "recording.h"
+
+
+static const unsigned char zeros[RECORDING_ALIGNMENT];
+
+static uint64_t round_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Writes all of iov at offset, carrying on after short writes.
+static int write_all(int fd, struct iovec* iov, int iovcnt, uint64_t offset)
+{
+    ssize_t written;
+
+    while (iovcnt > 0) {
+        written = pwritev(fd, iov, iovcnt, (off_t)offset);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+static int write_header(recording_writer* writer, uint64_t indexOffset)
+{
+    recording_header header;
+    struct iovec iov[2];
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    header.version = RECORDING_VERSION;
+    header.alignment = RECORDING_ALIGNMENT;
+    header.indexOffset = indexOffset;
+    header.frames = writer->frames;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)zeros;
+    iov[1].iov_len = RECORDING_ALIGNMENT - sizeof(header);
+
+    return write_all(writer->fd, iov, 2, 0);
+}
+
+/*
+*  Function: recording_create
+*  --------------------------
+*
+*  direct  Write the large frames with O_DIRECT, past the page cache, where
+*          the file system allows it. A frame only goes that way if its data
+*          is RECORDING_ALIGNMENT aligned in memory and a multiple of it in
+*          size; every other frame is written through the page cache.
+*
+*  Returns 0, or -1 with errno set if the file cannot be created.
+*/
+int recording_create(recording_writer* writer, const char* path, int direct)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->directFd = -1;
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (writer->fd == -1)
+        return -1;
+
+    if (direct) {
+        writer->directFd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (posix_memalign((void**)&writer->headerBlock, RECORDING_ALIGNMENT, RECORDING_ALIGNMENT) != 0) {
+            writer->headerBlock = NULL;
+            if (writer->directFd != -1)
+                close(writer->directFd);
+            writer->directFd = -1;
+        }
+    }
+
+    writer->offset = RECORDING_ALIGNMENT;
+    if (write_header(writer, 0) == -1) {
+        recording_finish(writer);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+*  Function: recording_append
+*  --------------------------
+*
+*  Appends a frame: frame says what data is, its magic and dataOffset are
+*  filled in here. Frames are appended in the order of the calls, which are
+*  not to be made from more than one thread at once.
+*
+*  Returns 0, or -1 with errno set if the frame cannot be written.
+*/
+int recording_append(recording_writer* writer, const recording_frame* frame, const void* data)
+{
+    recording_frame header;
+    unsigned char block[RECORDING_HEADER_SIZE];
+    recording_index_entry* index;
+    struct iovec iov[4];
+    int iovcnt = 0;
+    uint64_t start, end;
+    int fd = writer->fd;
+    int large = (frame->size >= RECORDING_DIRECT_MIN);
+
+    if (writer->frames == writer->capacity) {
+        index = (recording_index_entry*)realloc(writer->index, (writer->capacity ? 2*writer->capacity : 1024)*sizeof(*index));
+        if (index == NULL)
+            return -1;
+        writer->index = index;
+        writer->capacity = writer->capacity ? 2*writer->capacity : 1024;
+    }
+
+    header = *frame;
+    header.magic = RECORDING_FRAME_MAGIC;
+    header.dataOffset = large ? RECORDING_ALIGNMENT : RECORDING_HEADER_SIZE;
+
+    start = round_up(writer->offset, large ? RECORDING_ALIGNMENT : RECORDING_HEADER_SIZE);
+    end = round_up(start + header.dataOffset + header.size, RECORDING_HEADER_SIZE);
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, &header, sizeof(header));
+    if (large && writer->directFd != -1 && ((uintptr_t)data % RECORDING_ALIGNMENT) == 0
+        && (header.size % RECORDING_ALIGNMENT) == 0) {
+        memset(writer->headerBlock, 0, RECORDING_ALIGNMENT);
+        memcpy(writer->headerBlock, block, sizeof(block));
+        fd = writer->directFd;
+        iov[iovcnt].iov_base = writer->headerBlock;
+        iov[iovcnt++].iov_len = RECORDING_ALIGNMENT;
+    } else {
+        iov[iovcnt].iov_base = block;
+        iov[iovcnt++].iov_len = sizeof(block);
+        if (header.dataOffset > sizeof(block)) {
+            iov[iovcnt].iov_base = (void*)zeros;
+            iov[iovcnt++].iov_len = header.dataOffset - sizeof(block);
+        }
+    }
+    iov[iovcnt].iov_base = (void*)data;
+    iov[iovcnt++].iov_len = header.size;
+    if (end > start + header.dataOffset + header.size) {
+        iov[iovcnt].iov_base = (void*)zeros;
+        iov[iovcnt++].iov_len = end - (start + header.dataOffset + header.size);
+    }
+
+    if (write_all(fd, iov, iovcnt, start) == -1)
+        return -1;
+    if (fd == writer->directFd)
+        writer->directFrames++;
+
+    writer->index[writer->frames].offset = start;
+    writer->index[writer->frames].stream = header.stream;
+    writer->index[writer->frames].sequence = header.sequence;
+    writer->frames++;
+    writer->offset = end;
+
+    return 0;
+}
+
+/*
+*  Function: recording_finish
+*  --------------------------
+*
+*  Writes the index and the trailer after the last frame, points the file
+*  header at them and closes the file.
+*
+*  Returns 0, or -1 with errno set if any of it cannot be written.
+*/
+int recording_finish(recording_writer* writer)
+{
+    recording_trailer trailer;
+    struct iovec iov[2];
+    int result = 0;
+
+    if (writer->fd != -1) {
+        memcpy(trailer.magic, RECORDING_INDEX_MAGIC, sizeof(trailer.magic));
+        trailer.frames = writer->frames;
+        trailer.indexOffset = writer->offset;
+
+        iov[0].iov_base = writer->index;
+        iov[0].iov_len = writer->frames*sizeof(recording_index_entry);
+        iov[1].iov_base = &trailer;
+        iov[1].iov_len = sizeof(trailer);
+        if (write_all(writer->fd, iov, 2, writer->offset) == -1 || write_header(writer, writer->offset) == -1)
+            result = -1;
+        if (close(writer->fd) == -1)
+            result = -1;
+    }
+    if (writer->directFd != -1)
+        close(writer->directFd);
+
+    free(writer->headerBlock);
+    free(writer->index);
+    writer->fd = -1;
+    writer->directFd = -1;
+    writer->headerBlock = NULL;
+    writer->index = NULL;
+
+    return result;
+}
+
+static const recording_frame* frame_at(const recording_reader* reader, uint64_t offset)
+{
+    const recording_frame* frame;
+
+    if (offset + sizeof(recording_frame) > reader->size)
+        return NULL;
+    frame = (const recording_frame*)(reader->map + offset);
+    if (frame->magic != RECORDING_FRAME_MAGIC || offset + frame->dataOffset + frame->size > reader->size)
+        return NULL;
+
+    return frame;
+}
+
+// Finds the frames of a recording without an index, from their headers.
+static int scan_frames(recording_reader* reader)
+{
+    const recording_frame* frame;
+    recording_index_entry* index;
+    uint64_t offset = RECORDING_ALIGNMENT;
+    long capacity = 0;
+
+    for (;;) {
+        frame = frame_at(reader, offset);
+        if (frame == NULL) {
+            // The next frame may be a large one, on the next alignment.
+            offset = round_up(offset, RECORDING_ALIGNMENT);
+            frame = frame_at(reader, offset);
+            if (frame == NULL)
+                break;
+        }
+
+        if (reader->frames == capacity) {
+            capacity = capacity ? 2*capacity : 1024;
+            index = (recording_index_entry*)realloc(reader->scanned, capacity*sizeof(*index));
+            if (index == NULL)
+                return -1;
+            reader->scanned = index;
+        }
+        reader->scanned[reader->frames].offset = offset;
+        reader->scanned[reader->frames].stream = frame->stream;
+        reader->scanned[reader->frames].sequence = frame->sequence;
+        reader->frames++;
+
+        offset = round_up(offset + frame->dataOffset + frame->size, RECORDING_HEADER_SIZE);
+    }
+    reader->index = reader->scanned;
+
+    return 0;
+}
+
+/*
+*  Function: recording_open
+*  ------------------------
+*
+*  Maps a recording for reading. recording_read then finds any frame
+*  straight from the index, without reading the ones before it.
+*
+*  Returns 0, or -1 with errno set if path is not a recording.
+*/
+int recording_open(recording_reader* reader, const char* path)
+{
+    const recording_header* header;
+    struct stat st;
+    void* map;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || st.st_size < RECORDING_ALIGNMENT) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    reader->map = (const unsigned char*)map;
+    reader->size = st.st_size;
+    header = (const recording_header*)reader->map;
+    if (memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 || header->version != RECORDING_VERSION) {
+        recording_close(reader);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (header->indexOffset != 0
+        && header->indexOffset + header->frames*sizeof(recording_index_entry) + sizeof(recording_trailer) <= reader->size) {
+        reader->index = (const recording_index_entry*)(reader->map + header->indexOffset);
+        reader->frames = header->frames;
+        return 0;
+    }
+
+    if (scan_frames(reader) == -1) {
+        recording_close(reader);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+*  Function: recording_read
+*  ------------------------
+*
+*  Points frame and data at frame number index of the recording, in the
+*  mapping: they stay valid until recording_close.
+*
+*  Returns 0, or -1 if there is no such frame.
+*/
+int recording_read(const recording_reader* reader, long index, const recording_frame** frame, const unsigned char** data)
+{
+    const recording_frame* found;
+
+    if (index < 0 || index >= reader->frames)
+        return -1;
+
+    found = frame_at(reader, reader->index[index].offset);
+    if (found == NULL)
+        return -1;
+
+    *frame = found;
+    *data = (const unsigned char*)found + found->dataOffset;
+
+    return 0;
+}
+
+void recording_close(recording_reader* reader)
+{
+    if (reader->map != NULL)
+        munmap((void*)reader->map, reader->size);
+    free(reader->scanned);
+    reader->map = NULL;
+    reader->scanned = NULL;
+    reader->index = NULL;
+    reader->frames = 0;
+}
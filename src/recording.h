@@ -0,0 +1,98 @@
+#ifndef RECORDING_H_   /* Include guard */
+#define RECORDING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*
+*  A recording is one file of raw frames, appended one after the other:
+*
+*  - a file header, padded to RECORDING_ALIGNMENT;
+*  - the frames, each a recording_frame header followed by its data. Small
+*    frames follow each other on RECORDING_HEADER_SIZE boundaries; frames of
+*    RECORDING_DIRECT_MIN bytes or more start on a RECORDING_ALIGNMENT
+*    boundary, with their data a RECORDING_ALIGNMENT further on, so they
+*    can be written with O_DIRECT;
+*  - an index of where every frame starts, and a trailer saying where the
+*    index is. The file header says so too, once the recording is finished.
+*
+*  A recording that was never finished has no index; the reader then finds
+*  the frames by walking their headers.
+*/
+#define RECORDING_MAGIC           "MMRECORD"
+#define RECORDING_INDEX_MAGIC     "MMRINDEX"
+#define RECORDING_FRAME_MAGIC     (0x4d524652)
+#define RECORDING_VERSION         (1)
+#define RECORDING_ALIGNMENT       (4096)
+#define RECORDING_HEADER_SIZE     (64)
+#define RECORDING_DIRECT_MIN      (64*1024)
+
+enum recording_format {
+        RECORDING_YUYV,
+        RECORDING_GRAY,
+        RECORDING_RGB24,
+};
+
+typedef struct recording_header_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t alignment;
+    uint64_t indexOffset;       /* 0 until the recording is finished. */
+    uint64_t frames;
+} recording_header;
+
+/* The header of each frame, RECORDING_HEADER_SIZE bytes on disk. */
+typedef struct recording_frame_ {
+    uint32_t magic;
+    uint32_t stream;            /* The caller's: which plane of the frame this is. */
+    uint32_t format;            /* enum recording_format */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* Bytes from one row to the next. */
+    uint32_t sequence;          /* The driver's frame count. */
+    uint32_t dataOffset;        /* From the start of this header to the data. */
+    uint64_t size;              /* Bytes of data. */
+    int64_t timestampSec;       /* When the driver captured the frame. */
+    int64_t timestampUsec;
+} recording_frame;
+
+typedef struct recording_index_entry_ {
+    uint64_t offset;
+    uint32_t stream;
+    uint32_t sequence;
+} recording_index_entry;
+
+typedef struct recording_trailer_ {
+    char magic[8];
+    uint64_t frames;
+    uint64_t indexOffset;
+} recording_trailer;
+
+typedef struct recording_writer_ {
+    int fd;
+    int directFd;               /* The file again with O_DIRECT, or -1. */
+    uint64_t offset;            /* Where the next frame goes. */
+    unsigned char* headerBlock; /* RECORDING_ALIGNMENT bytes, aligned, for O_DIRECT frame headers. */
+    recording_index_entry* index;
+    long frames;
+    long capacity;
+    long directFrames;          /* Frames written with O_DIRECT. */
+} recording_writer;
+
+typedef struct recording_reader_ {
+    const unsigned char* map;
+    size_t size;
+    const recording_index_entry* index;
+    recording_index_entry* scanned;     /* The index found by walking, for an unfinished file. */
+    long frames;
+} recording_reader;
+
+int recording_create(recording_writer* writer, const char* path, int direct);
+int recording_append(recording_writer* writer, const recording_frame* frame, const void* data);
+int recording_finish(recording_writer* writer);
+int recording_open(recording_reader* reader, const char* path);
+int recording_read(const recording_reader* reader, long index, const recording_frame** frame, const unsigned char** data);
+void recording_close(recording_reader* reader);
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "replay.h"
+
+
+/* The open sources, for replay_lookup: a device is only known by its fd. */
+static replay_source* sources[REPLAY_MAX_SOURCES];
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Lists the frames of a directory: every file in it but the hidden ones, in name order.
+static int list_directory(const char* path, size_t frameSize, unsigned int width, unsigned int height, char*** names,
+                          long* count)
+{
+    DIR* dir;
+    struct dirent* entry;
+    struct stat st;
+    char** grown;
+    char* file;
+    long capacity = 0;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        file = (char*)malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (file == NULL) {
+            closedir(dir);
+            return -1;
+        }
+        sprintf(file, "%s/%s", path, entry->d_name);
+        if (stat(file, &st) == -1 || !S_ISREG(st.st_mode)) {
+            free(file);
+            continue;
+        }
+        if ((size_t)st.st_size < frameSize) {
+            fprintf(stderr, "%s is smaller than a %ux%u frame\n", file, width, height);
+            free(file);
+            closedir(dir);
+            return -1;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            grown = (char**)realloc(*names, capacity*sizeof(char*));
+            if (grown == NULL) {
+                free(file);
+                closedir(dir);
+                return -1;
+            }
+            *names = grown;
+        }
+        (*names)[(*count)++] = file;
+    }
+    closedir(dir);
+
+    qsort(*names, *count, sizeof(char*), compare_names);
+
+    return 0;
+}
+
+/*
+*  Maps the frames of a directory, each file once and up front, so that
+*  replay_next serves them from memory as it does those of a recording.
+*/
+static int open_directory(replay_source* source, const char* path)
+{
+    char** names = NULL;
+    void* map;
+    long count = 0, i;
+    int fd, result;
+
+    result = list_directory(path, source->frameSize, source->width, source->height, &names, &count);
+    if (result == 0 && count > 0) {
+        source->maps = (unsigned char**)malloc(count*sizeof(unsigned char*));
+        if (source->maps == NULL)
+            result = -1;
+    }
+
+    for(i=0; i < count && result == 0; i++) {
+        fd = open(names[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            result = -1;
+            break;
+        }
+        map = mmap(NULL, source->frameSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            result = -1;
+            break;
+        }
+        source->maps[source->frames++] = (unsigned char*)map;
+    }
+
+    for(i=0; i < count; i++)
+        free(names[i]);
+    free(names);
+
+    return result;
+}
+
+// Finds the YUYV planes of a recording, all of one size.
+static int open_recording(replay_source* source, const char* path)
+{
+    const recording_frame* frame;
+    const unsigned char* data;
+    long i;
+
+    if (recording_open(&source->reader, path) == -1)
+        return -1;
+
+    source->planes = (long*)malloc((source->reader.frames + 1)*sizeof(long));
+    source->times = (int64_t*)malloc((source->reader.frames + 1)*sizeof(int64_t));
+    if (source->planes == NULL || source->times == NULL)
+        return -1;
+
+    for(i=0; i < source->reader.frames; i++) {
+        if (recording_read(&source->reader, i, &frame, &data) == -1 || frame->stream != 0 || frame->format != RECORDING_YUYV)
+            continue;
+
+        if (source->frames == 0) {
+            source->width = frame->width;
+            source->height = frame->height;
+            source->frameSize = (size_t)frame->width*frame->height*2;
+            source->firstTimestamp = frame->timestampSec*1000000 + frame->timestampUsec;
+        }
+        if (frame->width != source->width || frame->height != source->height || frame->stride != 2*frame->width) {
+            fprintf(stderr, "%s: frame %ld is not a %ux%u YUYV frame\n", path, i, source->width, source->height);
+            return -1;
+        }
+        // A frame stamped before the one it follows is due with it.
+        source->times[source->frames] = frame->timestampSec*1000000 + frame->timestampUsec - source->firstTimestamp;
+        if (source->frames > 0 && source->times[source->frames] < source->times[source->frames - 1])
+            source->times[source->frames] = source->times[source->frames - 1];
+        source->planes[source->frames++] = i;
+    }
+
+    return 0;
+}
+
+static int parse_options(replay_source* source, char* options, int* fps)
+{
+    char* option;
+
+    for(option=strtok(options, ","); option != NULL; option=strtok(NULL, ",")) {
+        if (strcmp(option, "max-speed") == 0) {
+            source->paced = 0;
+        } else if (sscanf(option, "size=%ux%u", &source->width, &source->height) == 2) {
+            source->frameSize = (size_t)source->width*source->height*2;
+        } else if (sscanf(option, "fps=%d", fps) != 1 || *fps <= 0) {
+            fprintf(stderr, "Unknown replay option '%s'\n", option);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+*  Function: replay_open
+*  ---------------------
+*
+*  spec  What follows REPLAY_PREFIX in the device name.
+*
+*  Returns the source, known from then on by source->fd, or NULL if spec
+*  cannot be replayed.
+*/
+replay_source* replay_open(const char* spec)
+{
+    replay_source* source;
+    struct stat st;
+    char* path;
+    char* options;
+    int fps = REPLAY_DEFAULT_FPS;
+    int i, result = -1;
+
+    source = (replay_source*)calloc(1, sizeof(replay_source));
+    if (source == NULL)
+        return NULL;
+    source->fd = -1;
+    source->paced = 1;
+
+    path = strdup(spec);
+    if (path == NULL) {
+        free(source);
+        return NULL;
+    }
+    options = strchr(path, ',');
+    if (options != NULL)
+        *options++ = '\0';
+
+    if (options == NULL || parse_options(source, options, &fps) == 0) {
+        if (stat(path, &st) == -1) {
+            fprintf(stderr, "Cannot identify '%s': %d, %s\n", path, errno, strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            if (source->frameSize == 0)
+                fprintf(stderr, "Replaying the directory %s needs size=<width>x<height>\n", path);
+            else
+                result = open_directory(source, path);
+        } else {
+            result = open_recording(source, path);
+        }
+    }
+
+    if (result == 0 && source->frames == 0) {
+        fprintf(stderr, "%s has no frames to replay\n", path);
+        result = -1;
+    }
+    free(path);
+
+    if (result == 0 && source->maps != NULL) {
+        source->times = (int64_t*)malloc(source->frames*sizeof(int64_t));
+        if (source->times == NULL)
+            result = -1;
+        for(i=0; i < source->frames && result == 0; i++)
+            source->times[i] = (int64_t)i*1000000/fps;
+    }
+
+    // One pass lasts until the frame after the last, at the average interval.
+    if (result == 0) {
+        source->duration = (source->frames > 1) ? source->times[source->frames - 1]*source->frames/(source->frames - 1) : 1000000/fps;
+        if (source->duration <= 0)
+            source->duration = 1;
+
+        if (source->paced)
+            source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        else
+            source->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (source->fd == -1)
+            result = -1;
+    }
+
+    if (result == 0) {
+        result = -1;
+        pthread_mutex_lock(&sources_lock);
+        for(i=0; i < REPLAY_MAX_SOURCES && result == -1; i++) {
+            if (sources[i] == NULL) {
+                sources[i] = source;
+                result = 0;
+            }
+        }
+        pthread_mutex_unlock(&sources_lock);
+    }
+
+    if (result == -1) {
+        replay_close(source);
+        return NULL;
+    }
+
+    return source;
+}
+
+void replay_close(replay_source* source)
+{
+    long i;
+
+    pthread_mutex_lock(&sources_lock);
+    for(i=0; i < REPLAY_MAX_SOURCES; i++) {
+        if (sources[i] == source)
+            sources[i] = NULL;
+    }
+    pthread_mutex_unlock(&sources_lock);
+
+    if (source->fd != -1)
+        close(source->fd);
+    recording_close(&source->reader);
+    for(i=0; i < source->frames && source->maps != NULL; i++)
+        munmap(source->maps[i], source->frameSize);
+    free(source->maps);
+    free(source->planes);
+    free(source->times);
+    free(source);
+}
+
+// Returns the source whose fd is fd, or NULL if fd is not a replay.
+replay_source* replay_lookup(int fd)
+{
+    replay_source* source = NULL;
+    int i;
+
+    if (fd < 0)
+        return NULL;
+
+    pthread_mutex_lock(&sources_lock);
+    for(i=0; i < REPLAY_MAX_SOURCES; i++) {
+        if (sources[i] != NULL && sources[i]->fd == fd)
+            source = sources[i];
+    }
+    pthread_mutex_unlock(&sources_lock);
+
+    return source;
+}
+
+static int64_t frame_time(replay_source* source, long n)
+{
+    return (n / source->frames)*source->duration + source->times[n % source->frames];
+}
+
+// Sets the timer to go off when frame n is due.
+static int arm_timer(replay_source* source, long n)
+{
+    struct itimerspec due;
+    int64_t usec = frame_time(source, n);
+
+    memset(&due, 0, sizeof(due));
+    due.it_value.tv_sec = source->start.tv_sec + usec/1000000;
+    due.it_value.tv_nsec = source->start.tv_nsec + (usec % 1000000)*1000;
+    if (due.it_value.tv_nsec >= 1000000000) {
+        due.it_value.tv_sec++;
+        due.it_value.tv_nsec -= 1000000000;
+    }
+
+    return timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &due, NULL);
+}
+
+/*
+*  Function: replay_start
+*  ----------------------
+*
+*  Starts the clock: the first frame is due straight away, and each one
+*  after it when it was captured, relative to the first.
+*/
+int replay_start(replay_source* source)
+{
+    source->next = 0;
+    clock_gettime(CLOCK_MONOTONIC, &source->start);
+
+    return source->paced ? arm_timer(source, 0) : 0;
+}
+
+/*
+*  Function: replay_next
+*  ---------------------
+*
+*  Serves the next frame if it is due, straight from the mapping of the
+*  recording or of the directory's file: nothing is read. sequence
+*  counts the frames served, and timestamp carries on from the recorded
+*  ones, pass after pass.
+*
+*  Returns 1 with the frame, 0 if it is not due yet, or -1 if it cannot be
+*  read or the timer cannot be set for the next one.
+*/
+int replay_next(replay_source* source, void** start, unsigned int* bytesused, unsigned int* sequence,
+                struct timeval* timestamp)
+{
+    const recording_frame* frame;
+    const unsigned char* data;
+    uint64_t expirations;
+    int64_t usec;
+    long n = source->next % source->frames;
+
+    if (source->paced && read(source->fd, &expirations, sizeof(expirations)) == -1)
+        return (errno == EAGAIN) ? 0 : -1;
+
+    if (source->maps != NULL) {
+        *start = source->maps[n];
+    } else {
+        if (recording_read(&source->reader, source->planes[n], &frame, &data) == -1)
+            return -1;
+        *start = (void*)data;
+    }
+
+    usec = source->firstTimestamp + frame_time(source, source->next);
+    timestamp->tv_sec = usec/1000000;
+    timestamp->tv_usec = usec % 1000000;
+    *sequence = (unsigned int)source->next;
+    *bytesused = (unsigned int)source->frameSize;
+
+    source->next++;
+    if (source->paced && arm_timer(source, source->next) == -1)
+        return -1;
+
+    return 1;
+}
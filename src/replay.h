@@ -0,0 +1,52 @@
+#ifndef REPLAY_H_   /* Include guard */
+#define REPLAY_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "recording.h"
+
+
+/*
+*  A device name starting with REPLAY_PREFIX replays frames instead of
+*  capturing them:
+*
+*    file:<recording>[,max-speed]
+*    file:<directory>,size=<width>x<height>[,fps=<n>][,max-speed]
+*
+*  A recording replays its stream 0 YUYV planes, at the pace they were
+*  captured at; a directory replays each file in it as one raw YUYV frame,
+*  in name order, at fps frames a second. With max-speed every frame is
+*  ready as soon as it is asked for. Either way the frames loop forever.
+*/
+#define REPLAY_PREFIX             "file:"
+#define REPLAY_BUFFERS            (4)
+#define REPLAY_DEFAULT_FPS        (30)
+#define REPLAY_MAX_SOURCES        (8)
+
+typedef struct replay_source_ {
+    int fd;                     /* For select: a timer when paced, always readable at max speed. */
+    int paced;
+    unsigned int width;
+    unsigned int height;
+    size_t frameSize;
+    recording_reader reader;    /* A recording, and */
+    long* planes;               /* its YUYV planes; or */
+    unsigned char** maps;       /* the frames of a directory, mapped in name order. */
+    long frames;
+    long next;                  /* Frames served so far. */
+    int64_t* times;             /* Of each frame, in microseconds from the first. */
+    int64_t firstTimestamp;     /* Of the first frame, in microseconds. */
+    int64_t duration;           /* Of one pass through the frames. */
+    struct timespec start;      /* When the replay started. */
+} replay_source;
+
+replay_source* replay_open(const char* spec);
+void replay_close(replay_source* source);
+replay_source* replay_lookup(int fd);
+int replay_start(replay_source* source);
+int replay_next(replay_source* source, void** start, unsigned int* bytesused, unsigned int* sequence,
+                struct timeval* timestamp);
+
+#endif
@@ -0,0 +1,1208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "imageprocessing.h"
+#include "simd.h"
+
+
+/*
+*  Width in doubles of the column strips of the vertical convolution (2 KB of
+*  each row). Within a strip the outputs are computed in blocks of
+*  CONVOLUTION_BLOCK_COLUMNS, one 64 byte cache line, accumulated in registers.
+*
+*  Strips a single cache line wide were tried first, and lost to plain
+*  row-at-a-time order above 720p: every step down a strip then lands on a new
+*  page, which defeats the hardware prefetcher and thrashes the TLB.
+*/
+#define CONVOLUTION_STRIP_COLUMNS (256)
+#define CONVOLUTION_BLOCK_COLUMNS (8)
+
+static enum simd_level active_simd_level = SIMD_NONE;
+
+/*
+*  Function: detectSIMDLevel
+*  -------------------------
+*
+*  Queries CPUID (through the compiler builtins, which also check that the OS
+*  saves the wide registers) and returns the widest instruction set that the
+*  kernels in this file have an implementation for.
+*/
+enum simd_level detectSIMDLevel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return SIMD_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+
+    return SIMD_NONE;
+}
+
+/*
+*  The dispatch level is chosen once at startup, before main() runs, so the
+*  hot loops only ever read a plain global.
+*/
+__attribute__((constructor))
+static void initSIMDLevel(void)
+{
+    active_simd_level = detectSIMDLevel();
+}
+
+enum simd_level getSIMDLevel(void)
+{
+    return active_simd_level;
+}
+
+/*
+*  Function: setSIMDLevel
+*  ----------------------
+*
+*  level:  The instruction set the kernels should use from now on.
+*
+*  Requests above what the CPU supports are clamped to the detected level,
+*  so this can only ever lower the dispatch level (e.g. SIMD_NONE to force
+*  the scalar reference path). Returns the level actually selected.
+*/
+enum simd_level setSIMDLevel(enum simd_level level)
+{
+    enum simd_level detected = detectSIMDLevel();
+
+    active_simd_level = (level > detected) ? detected : level;
+
+    return active_simd_level;
+}
+
+/*
+*  Function: YUYVRowToRGB24Scalar
+*  ------------------------------
+*
+*  The reference conversion for a single row, one pixel at a time through the
+*  Y_PLUS_*DIFF / CLIP1 macros. The SIMD variants below must produce output
+*  that is byte-identical to this.
+*/
+void YUYVRowToRGB24Scalar(const unsigned char *pYUYV, int width, unsigned char *pRGB24)
+{
+    int i;
+    const unsigned char *pMovY, *pMovU, *pMovV;
+    unsigned char *pMovRGB;
+
+    pMovY = pYUYV;
+    pMovU = pMovY + 1;
+    pMovV = pMovY + 3;
+    pMovRGB = pRGB24;
+
+    for(i = 0; i < width; i++){
+        int R, G, B;
+        int Y, U, V;
+
+        Y = pMovY[0]; U = *pMovU; V = *pMovV;
+        R = Y_PLUS_RDIFF(Y, V);
+        G = Y_PLUS_GDIFF(Y, U, V);
+        B = Y_PLUS_BDIFF(Y, U);
+
+        *pMovRGB = CLIP1(B);
+        *(pMovRGB + 1) = CLIP1(G);
+        *(pMovRGB + 2) = CLIP1(R);
+
+        pMovY += 2;
+        pMovU += 4*EVEN_ZERO_ODD_ONE(i);
+        pMovV += 4*EVEN_ZERO_ODD_ONE(i);
+        pMovRGB += 3;
+    }
+}
+
+/*
+*  Function: YUYVRowToGrayscaleScalar
+*  ----------------------------------
+*
+*  Copies the Y sample of every pixel of a YUYV row, i.e. every even byte.
+*/
+void YUYVRowToGrayscaleScalar(const unsigned char *pYUYV, int width, unsigned char *pGrayscale)
+{
+    int i;
+
+    for(i = 0; i < width; i++) {
+        pGrayscale[i] = pYUYV[2*i];
+    }
+}
+
+/*
+*  Function: RGB24RowToGrayscaleScalar
+*  -----------------------------------
+*
+*  Fixed point luminance of a row of BGR pixels, clamped to 255. This is the
+*  reference for the vector variants, which compute exactly the same sums.
+*/
+void RGB24RowToGrayscaleScalar(const unsigned char *pRGB24, int width, unsigned char *pGrayscale)
+{
+    int i;
+    int Y;
+
+    for(i = 0; i < width; i++) {
+        Y = (GRAY_WEIGHT_B * pRGB24[0] + GRAY_WEIGHT_G * pRGB24[1] + GRAY_WEIGHT_R * pRGB24[2]) >> GRAY_WEIGHT_SHIFT;
+        pGrayscale[i] = (Y > 255) ? 255 : Y;
+        pRGB24 += 3;
+    }
+}
+
+/*
+*  Function: convolveRow1DScalar
+*  -----------------------------
+*
+*  kernel, kernelSize:  The 1D kernel.
+*  input:               The input sample under the first kernel tap of the first
+*                       output, i.e. output[i] covers input[i] to input[i + kernelSize - 1].
+*  count:               The number of outputs to compute.
+*  output:              Where to write them.
+*
+*  The interior span of a horizontal convolution, where no tap falls outside
+*  the row. The kernel is flipped, and the taps are summed in the same order
+*  as every other convolution in imageprocessing.c, so that all the variants
+*  give bit-identical results.
+*/
+void convolveRow1DScalar(const double *kernel, int kernelSize, const double *input, int count, double *output)
+{
+    int i, k;
+    double result;
+
+    for(i = 0; i < count; i++) {
+        result = 0.0;
+        for(k = 0; k < kernelSize; k++) {
+            result = result + kernel[kernelSize - k - 1] * input[i + k];
+        }
+        output[i] = result;
+    }
+}
+
+/*
+*  Function: convolveRows1DScalar
+*  ------------------------------
+*
+*  inputRows:  One row pointer per kernel tap; a NULL row contributes nothing
+*              (a zero border).
+*
+*  One output row of a vertical convolution: output[i] is the kernel applied
+*  down column i of the given rows.
+*/
+void convolveRows1DScalar(const double *kernel, int kernelSize, const double **inputRows, int count, double *output)
+{
+    int i, k;
+    double result;
+
+    for(i = 0; i < count; i++) {
+        result = 0.0;
+        for(k = 0; k < kernelSize; k++) {
+            if (inputRows[k])
+                result = result + kernel[kernelSize - k - 1] * inputRows[k][i];
+        }
+        output[i] = result;
+    }
+}
+
+/*
+*  Function: convolveColumns1DScalar
+*  ---------------------------------
+*
+*  input:   The top tap of the first output, i.e. output row r covers input
+*           rows r to r + kernelSize - 1.
+*  stride:  The distance between rows, for both input and output.
+*  rows:    The number of output rows.
+*  count:   The number of columns.
+*
+*  The interior rows of a vertical convolution, where no tap falls outside
+*  the image. The columns are walked in strips, top to bottom within a strip,
+*  so the kernelSize row segments a strip needs at any one time stay in cache
+*  while it slides down, rather than streaming kernelSize whole rows through
+*  the cache for every output row.
+*/
+void convolveColumns1DScalar(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output)
+{
+    int c, i, r, k, stripEnd;
+    double result;
+
+    for(c = 0; c < count; c += CONVOLUTION_STRIP_COLUMNS) {
+        stripEnd = (c + CONVOLUTION_STRIP_COLUMNS < count) ? c + CONVOLUTION_STRIP_COLUMNS : count;
+        for(r = 0; r < rows; r++) {
+            for(i = c; i < stripEnd; i++) {
+                result = 0.0;
+                for(k = 0; k < kernelSize; k++) {
+                    result = result + kernel[kernelSize - k - 1] * input[(r + k)*stride + i];
+                }
+                output[r*stride + i] = result;
+            }
+        }
+    }
+}
+
+/*
+*  Function: convolveRows1DU8Scalar
+*  --------------------------------
+*
+*  kernel:     INTEGER_BLUR_WEIGHT_SHIFT fixed point weights.
+*  inputRows:  One 8 bit row per kernel tap; a NULL row is a zero border.
+*
+*  The vertical pass of the integer Gaussian blur. The outputs keep
+*  INTEGER_BLUR_FRACTION_BITS bits of fraction, rounded, in 16 bits.
+*/
+void convolveRows1DU8Scalar(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output)
+{
+    int i, k;
+    int result;
+
+    for(i = 0; i < count; i++) {
+        result = 1 << (INTEGER_BLUR_ROWS_SHIFT - 1);
+        for(k = 0; k < kernelSize; k++) {
+            if (inputRows[k])
+                result += kernel[kernelSize - k - 1] * inputRows[k][i];
+        }
+        output[i] = (short)(result >> INTEGER_BLUR_ROWS_SHIFT);
+    }
+}
+
+/*
+*  Function: convolveRow1DS16Scalar
+*  --------------------------------
+*
+*  The horizontal pass of the integer Gaussian blur, over the interior of a
+*  row of convolveRows1DU8Scalar outputs (input as for convolveRow1DScalar).
+*  The result is truncated to 8 bits and clamped, like
+*  convertDoubleToUcharGrayscale.
+*/
+void convolveRow1DS16Scalar(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output)
+{
+    int i, k;
+    int result;
+
+    for(i = 0; i < count; i++) {
+        result = 0;
+        for(k = 0; k < kernelSize; k++) {
+            result += kernel[kernelSize - k - 1] * input[i + k];
+        }
+        result >>= INTEGER_BLUR_ROW_SHIFT;
+        output[i] = (result > 255) ? 255 : result;
+    }
+}
+
+/*
+*  Function: nonMaximumSuppressionRowScalar
+*  ----------------------------------------
+*
+*  DX, DY, magnitude:  The first pixel to do in each plane; the pixels above,
+*                      below and either side must exist.
+*  stride:             The distance between rows of the planes.
+*  count:              The number of pixels.
+*  output:             The magnitude where it is a strict maximum along the
+*                      gradient direction, else 0.
+*
+*  The direction is quantized to 4 sectors without any trigonometry:
+*  |DY| <= tan(22.5)|DX| is horizontal, tan(22.5)|DY| > |DX| is vertical,
+*  and in between the sign of DX*DY picks the diagonal.
+*/
+void nonMaximumSuppressionRowScalar(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output)
+{
+    int i, offset;
+    double absDX, absDY;
+
+    for(i = 0; i < count; i++) {
+        absDX = fabs(DX[i]);
+        absDY = fabs(DY[i]);
+
+        if (absDY <= NMS_TAN_22_5 * absDX)
+            offset = 1;
+        else if (absDY * NMS_TAN_22_5 > absDX)
+            offset = stride;
+        else if (DX[i] * DY[i] > 0)
+            offset = stride + 1;
+        else
+            offset = stride - 1;
+
+        if (magnitude[i] > magnitude[i - offset] && magnitude[i] > magnitude[i + offset])
+            output[i] = magnitude[i];
+        else
+            output[i] = 0.0;
+    }
+}
+
+/*
+*  Function: structureTensorRowsScalar
+*  -----------------------------------
+*
+*  rowsDX, rowsDY:  One row pointer per kernel tap into each gradient plane;
+*                   a NULL row is a zero border.
+*  outputXX, outputXY, outputYY:  One row each of the windowed products.
+*
+*  The vertical window of the structure tensor: the three products DX*DX,
+*  DY*DY and DX*DY are formed from the rows under the window as they are
+*  weighted, in the same order as a vertical convolution of product planes.
+*/
+void structureTensorRowsScalar(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                               double *outputXX, double *outputYY, double *outputXY)
+{
+    int i, k;
+    double weight, dx, dy, sxx, syy, sxy;
+
+    for(i = 0; i < count; i++) {
+        sxx = syy = sxy = 0.0;
+        for(k = 0; k < kernelSize; k++) {
+            if (rowsDX[k] == NULL)
+                continue;
+            weight = kernel[kernelSize - k - 1];
+            dx = rowsDX[k][i];
+            dy = rowsDY[k][i];
+            sxx = sxx + weight * (dx * dx);
+            syy = syy + weight * (dy * dy);
+            sxy = sxy + weight * (dx * dy);
+        }
+        outputXX[i] = sxx;
+        outputYY[i] = syy;
+        outputXY[i] = sxy;
+    }
+}
+
+/*
+*  Function: structureTensorResponseScalar
+*  ---------------------------------------
+*
+*  inputXX, inputYY, inputXY:  The vertically windowed products, from the first
+*                              tap of the first output (as convolveRow1DScalar).
+*  k:                          The Harris sensitivity.
+*  shiTomasi:                  Nonzero for the smaller eigenvalue instead of
+*                              the Harris measure.
+*  threshold:                  Responses at or below it are written as 0.
+*
+*  The horizontal window of the structure tensor, and the corner response of
+*  each pixel as soon as its tensor is complete.
+*/
+void structureTensorResponseScalar(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                   int count, double k, int shiTomasi, double threshold, double *response)
+{
+    int i, l;
+    double weight, sxx, syy, sxy, value, trace, halfDifference;
+
+    for(i = 0; i < count; i++) {
+        sxx = syy = sxy = 0.0;
+        for(l = 0; l < kernelSize; l++) {
+            weight = kernel[kernelSize - l - 1];
+            sxx = sxx + weight * inputXX[i + l];
+            syy = syy + weight * inputYY[i + l];
+            sxy = sxy + weight * inputXY[i + l];
+        }
+
+        trace = sxx + syy;
+        if (shiTomasi) {
+            halfDifference = (sxx - syy) * 0.5;
+            value = trace * 0.5 - sqrt(halfDifference * halfDifference + sxy * sxy);
+        } else {
+            value = ((sxx * syy) - (sxy * sxy)) - (k * trace) * trace;
+        }
+
+        response[i] = (value > threshold) ? value : 0.0;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+*  All the vector paths share the same arithmetic: every intermediate of the
+*  R_DIFF / G_DIFF / B_DIFF macros fits in a signed 16 bit lane, and a
+*  16 bit arithmetic shift rounds the same way as the int shift in C, so the
+*  results are exact. The sums are clamped to 0 - 255, matching CLIP1.
+*
+*  Each 16 bytes of YUYV hold 8 pixels (4 pairs sharing one U and one V).
+*  The returned vectors hold one 16 bit value per pixel.
+*/
+__attribute__((target("sse2")))
+static inline void YUYVToBGR16SSE2(__m128i yuyv, __m128i *b, __m128i *g, __m128i *r)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    __m128i y, c, u, v, rdiff, gdiff, bdiff;
+
+    y = _mm_sub_epi16(_mm_and_si128(yuyv, _mm_set1_epi16(0x00FF)), _mm_set1_epi16(16));
+
+    // [U0 V0 U1 V1 U2 V2 U3 V3], then duplicate each chroma value to both pixels of its pair.
+    c = _mm_sub_epi16(_mm_srli_epi16(yuyv, 8), _mm_set1_epi16(128));
+    u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+
+    rdiff = _mm_add_epi16(v, _mm_srai_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(103)), 8));
+    gdiff = _mm_sub_epi16(_mm_sub_epi16(zero, _mm_srai_epi16(_mm_mullo_epi16(u, _mm_set1_epi16(88)), 8)),
+                          _mm_srai_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(183)), 8));
+    bdiff = _mm_add_epi16(u, _mm_srai_epi16(_mm_mullo_epi16(u, _mm_set1_epi16(198)), 8));
+
+    *r = _mm_max_epi16(_mm_min_epi16(_mm_add_epi16(y, rdiff), max), zero);
+    *g = _mm_max_epi16(_mm_min_epi16(_mm_add_epi16(y, gdiff), max), zero);
+    *b = _mm_max_epi16(_mm_min_epi16(_mm_add_epi16(y, bdiff), max), zero);
+}
+
+/*
+*  Packs 4 pixels held as B G R 0 dwords into 12 contiguous BGR bytes, using
+*  only 64 bit shifts and masks. The top 4 bytes of the result are zero.
+*/
+__attribute__((target("sse2")))
+static inline __m128i packBGR0toBGRSSE2(__m128i bgr0)
+{
+    __m128i t;
+
+    // Within each 64 bit lane: p0 | p1 << 24.
+    t = _mm_or_si128(_mm_and_si128(bgr0, _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF)),
+                     _mm_and_si128(_mm_srli_epi64(bgr0, 8), _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000)));
+
+    // Slide the upper lane's 6 bytes down next to the lower lane's.
+    return _mm_or_si128(_mm_and_si128(t, _mm_set_epi32(0, 0, 0x0000FFFF, (int)0xFFFFFFFF)),
+                        _mm_and_si128(_mm_srli_si128(t, 2), _mm_set_epi32(0, (int)0xFFFFFFFF, (int)0xFFFF0000, 0)));
+}
+
+/*
+*  Function: YUYVRowToRGB24SSE2
+*  ----------------------------
+*
+*  Converts the leading pixels of a row, 8 at a time, and returns how many
+*  pixels were done. The caller finishes the row with YUYVRowToRGB24Scalar.
+*
+*  Each 4 pixel group is written with a 16 byte store, i.e. 4 bytes past its
+*  12 bytes of BGR. Those bytes are rewritten by the next group, so the loop
+*  stops while there are still at least 2 more pixels left in the row.
+*/
+__attribute__((target("sse2")))
+int YUYVRowToRGB24SSE2(const unsigned char *pYUYV, int width, unsigned char *pRGB24)
+{
+    int i;
+
+    for(i = 0; i + 8 + 2 <= width; i += 8) {
+        __m128i b, g, r, bg;
+
+        YUYVToBGR16SSE2(_mm_loadu_si128((const __m128i*)(pYUYV + 2*i)), &b, &g, &r);
+        bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i*)(pRGB24 + 3*i), packBGR0toBGRSSE2(_mm_unpacklo_epi16(bg, r)));
+        _mm_storeu_si128((__m128i*)(pRGB24 + 3*i + 12), packBGR0toBGRSSE2(_mm_unpackhi_epi16(bg, r)));
+    }
+
+    return i;
+}
+
+/*
+*  Function: YUYVRowToRGB24SSSE3
+*  -----------------------------
+*
+*  As YUYVRowToRGB24SSE2, with a single byte shuffle to drop the padding byte
+*  of every pixel.
+*/
+__attribute__((target("ssse3")))
+int YUYVRowToRGB24SSSE3(const unsigned char *pYUYV, int width, unsigned char *pRGB24)
+{
+    int i;
+    const __m128i packBGR = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    for(i = 0; i + 8 + 2 <= width; i += 8) {
+        __m128i b, g, r, bg;
+
+        YUYVToBGR16SSE2(_mm_loadu_si128((const __m128i*)(pYUYV + 2*i)), &b, &g, &r);
+        bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i*)(pRGB24 + 3*i), _mm_shuffle_epi8(_mm_unpacklo_epi16(bg, r), packBGR));
+        _mm_storeu_si128((__m128i*)(pRGB24 + 3*i + 12), _mm_shuffle_epi8(_mm_unpackhi_epi16(bg, r), packBGR));
+    }
+
+    return i;
+}
+
+/*
+*  Function: YUYVRowToRGB24AVX2
+*  ----------------------------
+*
+*  16 pixels per iteration. The 256 bit unpack and shuffle instructions work
+*  within each 128 bit half, so the low half holds pixels 0 - 3 / 4 - 7 and
+*  the high half pixels 8 - 11 / 12 - 15; the four 12 byte groups are stored
+*  in ascending order so each overlapping tail is rewritten by the next one.
+*/
+__attribute__((target("avx2")))
+int YUYVRowToRGB24AVX2(const unsigned char *pYUYV, int width, unsigned char *pRGB24)
+{
+    int i;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i packBGR = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    for(i = 0; i + 16 + 2 <= width; i += 16) {
+        __m256i yuyv, y, c, u, v, r, g, b, bg, lo, hi;
+        unsigned char *pMovRGB = pRGB24 + 3*i;
+
+        yuyv = _mm256_loadu_si256((const __m256i*)(pYUYV + 2*i));
+
+        y = _mm256_sub_epi16(_mm256_and_si256(yuyv, _mm256_set1_epi16(0x00FF)), _mm256_set1_epi16(16));
+        c = _mm256_sub_epi16(_mm256_srli_epi16(yuyv, 8), _mm256_set1_epi16(128));
+        u = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+        v = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+
+        r = _mm256_add_epi16(v, _mm256_srai_epi16(_mm256_mullo_epi16(v, _mm256_set1_epi16(103)), 8));
+        g = _mm256_sub_epi16(_mm256_sub_epi16(zero, _mm256_srai_epi16(_mm256_mullo_epi16(u, _mm256_set1_epi16(88)), 8)),
+                             _mm256_srai_epi16(_mm256_mullo_epi16(v, _mm256_set1_epi16(183)), 8));
+        b = _mm256_add_epi16(u, _mm256_srai_epi16(_mm256_mullo_epi16(u, _mm256_set1_epi16(198)), 8));
+
+        r = _mm256_max_epi16(_mm256_min_epi16(_mm256_add_epi16(y, r), max), zero);
+        g = _mm256_max_epi16(_mm256_min_epi16(_mm256_add_epi16(y, g), max), zero);
+        b = _mm256_max_epi16(_mm256_min_epi16(_mm256_add_epi16(y, b), max), zero);
+
+        bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+        lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(bg, r), packBGR);
+        hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(bg, r), packBGR);
+
+        _mm_storeu_si128((__m128i*)(pMovRGB), _mm256_castsi256_si128(lo));
+        _mm_storeu_si128((__m128i*)(pMovRGB + 12), _mm256_castsi256_si128(hi));
+        _mm_storeu_si128((__m128i*)(pMovRGB + 24), _mm256_extracti128_si256(lo, 1));
+        _mm_storeu_si128((__m128i*)(pMovRGB + 36), _mm256_extracti128_si256(hi, 1));
+    }
+
+    return i;
+}
+
+/*
+*  Function: YUYVRowToGrayscaleSSE2
+*  --------------------------------
+*
+*  16 pixels per iteration: mask the Y bytes out of two 16 byte loads and
+*  pack them back down to bytes. Returns the number of pixels done.
+*/
+__attribute__((target("sse2")))
+int YUYVRowToGrayscaleSSE2(const unsigned char *pYUYV, int width, unsigned char *pGrayscale)
+{
+    int i;
+    const __m128i lumaMask = _mm_set1_epi16(0x00FF);
+
+    for(i = 0; i + 16 <= width; i += 16) {
+        __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pYUYV + 2*i)), lumaMask);
+        __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i*)(pYUYV + 2*i + 16)), lumaMask);
+
+        _mm_storeu_si128((__m128i*)(pGrayscale + i), _mm_packus_epi16(lo, hi));
+    }
+
+    return i;
+}
+
+/*
+*  Function: YUYVRowToGrayscaleAVX2
+*  --------------------------------
+*
+*  32 pixels per iteration. The 256 bit pack interleaves the 128 bit halves
+*  of its two inputs, so the 64 bit quarters are put back in order after it.
+*/
+__attribute__((target("avx2")))
+int YUYVRowToGrayscaleAVX2(const unsigned char *pYUYV, int width, unsigned char *pGrayscale)
+{
+    int i;
+    const __m256i lumaMask = _mm256_set1_epi16(0x00FF);
+
+    for(i = 0; i + 32 <= width; i += 32) {
+        __m256i lo = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(pYUYV + 2*i)), lumaMask);
+        __m256i hi = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(pYUYV + 2*i + 32)), lumaMask);
+
+        _mm256_storeu_si256((__m256i*)(pGrayscale + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+
+    return i;
+}
+
+/*
+*  Luminance of 4 BGR pixels starting `offset` bytes into a 16 byte vector:
+*  one shuffle spreads B and G into 16 bit pairs for a multiply-add, another
+*  spreads R into the low half of 32 bit lanes. Returns 4 int32 sums, already
+*  shifted down.
+*/
+#define RGB24_LUMA_SHUFFLES(OFF) \
+    _mm_setr_epi8((OFF) + 0, -1, (OFF) + 1, -1, (OFF) + 3, -1, (OFF) + 4, -1, \
+                  (OFF) + 6, -1, (OFF) + 7, -1, (OFF) + 9, -1, (OFF) + 10, -1), \
+    _mm_setr_epi8((OFF) + 2, -1, -1, -1, (OFF) + 5, -1, -1, -1, \
+                  (OFF) + 8, -1, -1, -1, (OFF) + 11, -1, -1, -1)
+
+__attribute__((target("ssse3")))
+static inline __m128i RGB24LumaSSSE3(__m128i bgr, __m128i shuffleBG, __m128i shuffleR)
+{
+    const __m128i weightsBG = _mm_setr_epi16(GRAY_WEIGHT_B, GRAY_WEIGHT_G, GRAY_WEIGHT_B, GRAY_WEIGHT_G,
+                                             GRAY_WEIGHT_B, GRAY_WEIGHT_G, GRAY_WEIGHT_B, GRAY_WEIGHT_G);
+    const __m128i weightsR = _mm_setr_epi16(GRAY_WEIGHT_R, 0, GRAY_WEIGHT_R, 0, GRAY_WEIGHT_R, 0, GRAY_WEIGHT_R, 0);
+
+    return _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_shuffle_epi8(bgr, shuffleBG), weightsBG),
+                                        _mm_madd_epi16(_mm_shuffle_epi8(bgr, shuffleR), weightsR)),
+                          GRAY_WEIGHT_SHIFT);
+}
+
+/*
+*  Function: RGB24RowToGrayscaleSSSE3
+*  ----------------------------------
+*
+*  16 pixels (48 bytes) per iteration, as four groups of 4 pixels. The last
+*  group is loaded 4 bytes early so no load reaches past the 48 bytes.
+*/
+__attribute__((target("ssse3")))
+int RGB24RowToGrayscaleSSSE3(const unsigned char *pRGB24, int width, unsigned char *pGrayscale)
+{
+    int i;
+    const __m128i shuffles[4] = { RGB24_LUMA_SHUFFLES(0), RGB24_LUMA_SHUFFLES(4) };
+
+    for(i = 0; i + 16 <= width; i += 16) {
+        const unsigned char *pMovRGB = pRGB24 + 3*i;
+        __m128i y0, y1, y2, y3;
+
+        y0 = RGB24LumaSSSE3(_mm_loadu_si128((const __m128i*)(pMovRGB)), shuffles[0], shuffles[1]);
+        y1 = RGB24LumaSSSE3(_mm_loadu_si128((const __m128i*)(pMovRGB + 12)), shuffles[0], shuffles[1]);
+        y2 = RGB24LumaSSSE3(_mm_loadu_si128((const __m128i*)(pMovRGB + 24)), shuffles[0], shuffles[1]);
+        y3 = RGB24LumaSSSE3(_mm_loadu_si128((const __m128i*)(pMovRGB + 32)), shuffles[2], shuffles[3]);
+
+        _mm_storeu_si128((__m128i*)(pGrayscale + i),
+                         _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3)));
+    }
+
+    return i;
+}
+
+/*
+*  Function: RGB24RowToGrayscaleAVX2
+*  ---------------------------------
+*
+*  As RGB24RowToGrayscaleSSSE3, with two 4 pixel groups per 256 bit vector.
+*  The in-lane packs leave the pixels in 64 bit blocks out of order, which
+*  the 64 bit permutes put back.
+*/
+__attribute__((target("avx2")))
+int RGB24RowToGrayscaleAVX2(const unsigned char *pRGB24, int width, unsigned char *pGrayscale)
+{
+    int i;
+    const __m128i shuffles[4] = { RGB24_LUMA_SHUFFLES(0), RGB24_LUMA_SHUFFLES(4) };
+    const __m256i shuffleBG = _mm256_setr_m128i(shuffles[0], shuffles[0]);
+    const __m256i shuffleR = _mm256_setr_m128i(shuffles[1], shuffles[1]);
+    const __m256i shuffleBGLast = _mm256_setr_m128i(shuffles[0], shuffles[2]);
+    const __m256i shuffleRLast = _mm256_setr_m128i(shuffles[1], shuffles[3]);
+    const __m256i weightsBG = _mm256_set1_epi32((GRAY_WEIGHT_G << 16) | GRAY_WEIGHT_B);
+    const __m256i weightsR = _mm256_set1_epi32(GRAY_WEIGHT_R);
+
+    for(i = 0; i + 16 <= width; i += 16) {
+        const unsigned char *pMovRGB = pRGB24 + 3*i;
+        __m256i bgr, y0, y1, y;
+
+        bgr = _mm256_loadu2_m128i((const __m128i*)(pMovRGB + 12), (const __m128i*)(pMovRGB));
+        y0 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(bgr, shuffleBG), weightsBG),
+                              _mm256_madd_epi16(_mm256_shuffle_epi8(bgr, shuffleR), weightsR));
+
+        bgr = _mm256_loadu2_m128i((const __m128i*)(pMovRGB + 32), (const __m128i*)(pMovRGB + 24));
+        y1 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_shuffle_epi8(bgr, shuffleBGLast), weightsBG),
+                              _mm256_madd_epi16(_mm256_shuffle_epi8(bgr, shuffleRLast), weightsR));
+
+        y = _mm256_packs_epi32(_mm256_srli_epi32(y0, GRAY_WEIGHT_SHIFT), _mm256_srli_epi32(y1, GRAY_WEIGHT_SHIFT));
+        y = _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3, 1, 2, 0));
+        y = _mm256_permute4x64_epi64(_mm256_packus_epi16(y, y), _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm_storeu_si128((__m128i*)(pGrayscale + i), _mm256_castsi256_si128(y));
+    }
+
+    return i;
+}
+
+/*
+*  The convolution kernels below compute several neighbouring outputs per
+*  vector with a separate multiply and add per tap (never a fused one), in
+*  the same tap order as the scalar loops, so every lane is bit-identical to
+*  its scalar counterpart. They return the number of outputs done.
+*/
+__attribute__((target("sse2")))
+int convolveRow1DSSE2(const double *kernel, int kernelSize, const double *input, int count, double *output)
+{
+    int i, k;
+
+    for(i = 0; i + 2 <= count; i += 2) {
+        __m128d result = _mm_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            result = _mm_add_pd(result, _mm_mul_pd(_mm_set1_pd(kernel[kernelSize - k - 1]), _mm_loadu_pd(input + i + k)));
+        }
+        _mm_storeu_pd(output + i, result);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int convolveRow1DAVX2(const double *kernel, int kernelSize, const double *input, int count, double *output)
+{
+    int i, k;
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m256d result0 = _mm256_setzero_pd();
+        __m256d result1 = _mm256_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            __m256d weight = _mm256_set1_pd(kernel[kernelSize - k - 1]);
+            result0 = _mm256_add_pd(result0, _mm256_mul_pd(weight, _mm256_loadu_pd(input + i + k)));
+            result1 = _mm256_add_pd(result1, _mm256_mul_pd(weight, _mm256_loadu_pd(input + i + k + 4)));
+        }
+        _mm256_storeu_pd(output + i, result0);
+        _mm256_storeu_pd(output + i + 4, result1);
+    }
+
+    return i;
+}
+
+__attribute__((target("sse2")))
+int convolveRows1DSSE2(const double *kernel, int kernelSize, const double **inputRows, int count, double *output)
+{
+    int i, k;
+
+    for(i = 0; i + 2 <= count; i += 2) {
+        __m128d result = _mm_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            if (inputRows[k])
+                result = _mm_add_pd(result, _mm_mul_pd(_mm_set1_pd(kernel[kernelSize - k - 1]), _mm_loadu_pd(inputRows[k] + i)));
+        }
+        _mm_storeu_pd(output + i, result);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int convolveRows1DAVX2(const double *kernel, int kernelSize, const double **inputRows, int count, double *output)
+{
+    int i, k;
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m256d result0 = _mm256_setzero_pd();
+        __m256d result1 = _mm256_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            if (inputRows[k]) {
+                __m256d weight = _mm256_set1_pd(kernel[kernelSize - k - 1]);
+                result0 = _mm256_add_pd(result0, _mm256_mul_pd(weight, _mm256_loadu_pd(inputRows[k] + i)));
+                result1 = _mm256_add_pd(result1, _mm256_mul_pd(weight, _mm256_loadu_pd(inputRows[k] + i + 4)));
+            }
+        }
+        _mm256_storeu_pd(output + i, result0);
+        _mm256_storeu_pd(output + i + 4, result1);
+    }
+
+    return i;
+}
+
+/*
+*  The strip-major vertical kernels: strips of CONVOLUTION_STRIP_COLUMNS, and
+*  within each output row of a strip, blocks of CONVOLUTION_BLOCK_COLUMNS
+*  whose outputs are accumulated across the taps in registers. They only do
+*  whole blocks and return the number of columns done.
+*/
+__attribute__((target("sse2")))
+int convolveColumns1DSSE2(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output)
+{
+    int c, i, r, k, stripEnd;
+    int blocked = count - (count % CONVOLUTION_BLOCK_COLUMNS);
+
+    for(c = 0; c < blocked; c += CONVOLUTION_STRIP_COLUMNS) {
+        stripEnd = (c + CONVOLUTION_STRIP_COLUMNS < blocked) ? c + CONVOLUTION_STRIP_COLUMNS : blocked;
+        for(r = 0; r < rows; r++) {
+            for(i = c; i < stripEnd; i += CONVOLUTION_BLOCK_COLUMNS) {
+                const double *pMovInput = input + r*stride + i;
+                __m128d result0 = _mm_setzero_pd();
+                __m128d result1 = _mm_setzero_pd();
+                __m128d result2 = _mm_setzero_pd();
+                __m128d result3 = _mm_setzero_pd();
+
+                for(k = 0; k < kernelSize; k++) {
+                    __m128d weight = _mm_set1_pd(kernel[kernelSize - k - 1]);
+                    result0 = _mm_add_pd(result0, _mm_mul_pd(weight, _mm_loadu_pd(pMovInput)));
+                    result1 = _mm_add_pd(result1, _mm_mul_pd(weight, _mm_loadu_pd(pMovInput + 2)));
+                    result2 = _mm_add_pd(result2, _mm_mul_pd(weight, _mm_loadu_pd(pMovInput + 4)));
+                    result3 = _mm_add_pd(result3, _mm_mul_pd(weight, _mm_loadu_pd(pMovInput + 6)));
+                    pMovInput += stride;
+                }
+
+                _mm_storeu_pd(output + r*stride + i, result0);
+                _mm_storeu_pd(output + r*stride + i + 2, result1);
+                _mm_storeu_pd(output + r*stride + i + 4, result2);
+                _mm_storeu_pd(output + r*stride + i + 6, result3);
+            }
+        }
+    }
+
+    return blocked;
+}
+
+__attribute__((target("avx2")))
+int convolveColumns1DAVX2(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output)
+{
+    int c, i, r, k, stripEnd;
+    int blocked = count - (count % CONVOLUTION_BLOCK_COLUMNS);
+
+    for(c = 0; c < blocked; c += CONVOLUTION_STRIP_COLUMNS) {
+        stripEnd = (c + CONVOLUTION_STRIP_COLUMNS < blocked) ? c + CONVOLUTION_STRIP_COLUMNS : blocked;
+        for(r = 0; r < rows; r++) {
+            for(i = c; i < stripEnd; i += CONVOLUTION_BLOCK_COLUMNS) {
+                const double *pMovInput = input + r*stride + i;
+                __m256d result0 = _mm256_setzero_pd();
+                __m256d result1 = _mm256_setzero_pd();
+
+                for(k = 0; k < kernelSize; k++) {
+                    __m256d weight = _mm256_set1_pd(kernel[kernelSize - k - 1]);
+                    result0 = _mm256_add_pd(result0, _mm256_mul_pd(weight, _mm256_loadu_pd(pMovInput)));
+                    result1 = _mm256_add_pd(result1, _mm256_mul_pd(weight, _mm256_loadu_pd(pMovInput + 4)));
+                    pMovInput += stride;
+                }
+
+                _mm256_storeu_pd(output + r*stride + i, result0);
+                _mm256_storeu_pd(output + r*stride + i + 4, result1);
+            }
+        }
+    }
+
+    return blocked;
+}
+
+/*
+*  The integer blur kernels take the taps two at a time: the samples under
+*  taps k and k + 1 are interleaved into 16 bit pairs, and pmaddwd multiplies
+*  them by the pair of weights and adds the products into 32 bit sums. The
+*  interleave works within 128 bit halves, and packing the two halves of the
+*  sums back together undoes it. Integer sums do not depend on the order of
+*  the taps, so the results are identical to the scalar ones.
+*/
+__attribute__((target("sse2")))
+static inline __m128i weightPairSSE2(const short *kernel, int kernelSize, int k)
+{
+    unsigned short w0 = (unsigned short)kernel[kernelSize - k - 1];
+    unsigned short w1 = (k + 1 < kernelSize) ? (unsigned short)kernel[kernelSize - k - 2] : 0;
+
+    return _mm_set1_epi32((int)(((unsigned int)w1 << 16) | w0));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i weightPairAVX2(const short *kernel, int kernelSize, int k)
+{
+    unsigned short w0 = (unsigned short)kernel[kernelSize - k - 1];
+    unsigned short w1 = (k + 1 < kernelSize) ? (unsigned short)kernel[kernelSize - k - 2] : 0;
+
+    return _mm256_set1_epi32((int)(((unsigned int)w1 << 16) | w0));
+}
+
+__attribute__((target("sse2")))
+int convolveRows1DU8SSE2(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output)
+{
+    int i, k;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (INTEGER_BLUR_ROWS_SHIFT - 1));
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m128i resultLo = round;
+        __m128i resultHi = round;
+        for(k = 0; k < kernelSize; k += 2) {
+            __m128i weights = weightPairSSE2(kernel, kernelSize, k);
+            __m128i a = inputRows[k] ? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(inputRows[k] + i)), zero) : zero;
+            __m128i b = (k + 1 < kernelSize && inputRows[k + 1]) ?
+                        _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(inputRows[k + 1] + i)), zero) : zero;
+            resultLo = _mm_add_epi32(resultLo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+            resultHi = _mm_add_epi32(resultHi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+        }
+        resultLo = _mm_srai_epi32(resultLo, INTEGER_BLUR_ROWS_SHIFT);
+        resultHi = _mm_srai_epi32(resultHi, INTEGER_BLUR_ROWS_SHIFT);
+        _mm_storeu_si128((__m128i*)(output + i), _mm_packs_epi32(resultLo, resultHi));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int convolveRows1DU8AVX2(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output)
+{
+    int i, k;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (INTEGER_BLUR_ROWS_SHIFT - 1));
+
+    for(i = 0; i + 16 <= count; i += 16) {
+        __m256i resultLo = round;
+        __m256i resultHi = round;
+        for(k = 0; k < kernelSize; k += 2) {
+            __m256i weights = weightPairAVX2(kernel, kernelSize, k);
+            __m256i a = inputRows[k] ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(inputRows[k] + i))) : zero;
+            __m256i b = (k + 1 < kernelSize && inputRows[k + 1]) ?
+                        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(inputRows[k + 1] + i))) : zero;
+            resultLo = _mm256_add_epi32(resultLo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weights));
+            resultHi = _mm256_add_epi32(resultHi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weights));
+        }
+        resultLo = _mm256_srai_epi32(resultLo, INTEGER_BLUR_ROWS_SHIFT);
+        resultHi = _mm256_srai_epi32(resultHi, INTEGER_BLUR_ROWS_SHIFT);
+        _mm256_storeu_si256((__m256i*)(output + i), _mm256_packs_epi32(resultLo, resultHi));
+    }
+
+    return i;
+}
+
+__attribute__((target("sse2")))
+int convolveRow1DS16SSE2(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output)
+{
+    int i, k;
+    const __m128i zero = _mm_setzero_si128();
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m128i resultLo = zero;
+        __m128i resultHi = zero;
+        for(k = 0; k < kernelSize; k += 2) {
+            __m128i weights = weightPairSSE2(kernel, kernelSize, k);
+            __m128i a = _mm_loadu_si128((const __m128i*)(input + i + k));
+            __m128i b = (k + 1 < kernelSize) ? _mm_loadu_si128((const __m128i*)(input + i + k + 1)) : zero;
+            resultLo = _mm_add_epi32(resultLo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+            resultHi = _mm_add_epi32(resultHi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+        }
+        resultLo = _mm_srai_epi32(resultLo, INTEGER_BLUR_ROW_SHIFT);
+        resultHi = _mm_srai_epi32(resultHi, INTEGER_BLUR_ROW_SHIFT);
+        resultLo = _mm_packs_epi32(resultLo, resultHi);
+        _mm_storel_epi64((__m128i*)(output + i), _mm_packus_epi16(resultLo, resultLo));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int convolveRow1DS16AVX2(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output)
+{
+    int i, k;
+    const __m256i zero = _mm256_setzero_si256();
+
+    for(i = 0; i + 16 <= count; i += 16) {
+        __m256i resultLo = zero;
+        __m256i resultHi = zero;
+        for(k = 0; k < kernelSize; k += 2) {
+            __m256i weights = weightPairAVX2(kernel, kernelSize, k);
+            __m256i a = _mm256_loadu_si256((const __m256i*)(input + i + k));
+            __m256i b = (k + 1 < kernelSize) ? _mm256_loadu_si256((const __m256i*)(input + i + k + 1)) : zero;
+            resultLo = _mm256_add_epi32(resultLo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weights));
+            resultHi = _mm256_add_epi32(resultHi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weights));
+        }
+        resultLo = _mm256_srai_epi32(resultLo, INTEGER_BLUR_ROW_SHIFT);
+        resultHi = _mm256_srai_epi32(resultHi, INTEGER_BLUR_ROW_SHIFT);
+        resultLo = _mm256_packs_epi32(resultLo, resultHi);
+        _mm_storeu_si128((__m128i*)(output + i),
+                         _mm_packus_epi16(_mm256_castsi256_si128(resultLo), _mm256_extracti128_si256(resultLo, 1)));
+    }
+
+    return i;
+}
+
+/*
+*  The vector non-maximum suppression computes the neighbours of all four
+*  sectors and selects between them with the sector masks, which are the
+*  same comparisons as the scalar code, so the results are identical.
+*/
+__attribute__((target("sse2")))
+static inline __m128d selectSSE2(__m128d mask, __m128d a, __m128d b)
+{
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+__attribute__((target("sse2")))
+int nonMaximumSuppressionRowSSE2(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output)
+{
+    int i;
+    const __m128d signMask = _mm_set1_pd(-0.0);
+    const __m128d tan22 = _mm_set1_pd(NMS_TAN_22_5);
+    const __m128d zero = _mm_setzero_pd();
+
+    for(i = 0; i + 2 <= count; i += 2) {
+        const double *pMovMagnitude = magnitude + i;
+        __m128d dx = _mm_loadu_pd(DX + i);
+        __m128d dy = _mm_loadu_pd(DY + i);
+        __m128d absDX = _mm_andnot_pd(signMask, dx);
+        __m128d absDY = _mm_andnot_pd(signMask, dy);
+        __m128d horizontal = _mm_cmple_pd(absDY, _mm_mul_pd(tan22, absDX));
+        __m128d vertical = _mm_cmpgt_pd(_mm_mul_pd(absDY, tan22), absDX);
+        __m128d diagonal = _mm_cmpgt_pd(_mm_mul_pd(dx, dy), zero);
+        __m128d m = _mm_loadu_pd(pMovMagnitude);
+        __m128d before, after;
+
+        before = selectSSE2(diagonal, _mm_loadu_pd(pMovMagnitude - stride - 1), _mm_loadu_pd(pMovMagnitude - stride + 1));
+        after = selectSSE2(diagonal, _mm_loadu_pd(pMovMagnitude + stride + 1), _mm_loadu_pd(pMovMagnitude + stride - 1));
+        before = selectSSE2(vertical, _mm_loadu_pd(pMovMagnitude - stride), before);
+        after = selectSSE2(vertical, _mm_loadu_pd(pMovMagnitude + stride), after);
+        before = selectSSE2(horizontal, _mm_loadu_pd(pMovMagnitude - 1), before);
+        after = selectSSE2(horizontal, _mm_loadu_pd(pMovMagnitude + 1), after);
+
+        _mm_storeu_pd(output + i, _mm_and_pd(_mm_and_pd(_mm_cmpgt_pd(m, before), _mm_cmpgt_pd(m, after)), m));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int nonMaximumSuppressionRowAVX2(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output)
+{
+    int i;
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    const __m256d tan22 = _mm256_set1_pd(NMS_TAN_22_5);
+    const __m256d zero = _mm256_setzero_pd();
+
+    for(i = 0; i + 4 <= count; i += 4) {
+        const double *pMovMagnitude = magnitude + i;
+        __m256d dx = _mm256_loadu_pd(DX + i);
+        __m256d dy = _mm256_loadu_pd(DY + i);
+        __m256d absDX = _mm256_andnot_pd(signMask, dx);
+        __m256d absDY = _mm256_andnot_pd(signMask, dy);
+        __m256d horizontal = _mm256_cmp_pd(absDY, _mm256_mul_pd(tan22, absDX), _CMP_LE_OQ);
+        __m256d vertical = _mm256_cmp_pd(_mm256_mul_pd(absDY, tan22), absDX, _CMP_GT_OQ);
+        __m256d diagonal = _mm256_cmp_pd(_mm256_mul_pd(dx, dy), zero, _CMP_GT_OQ);
+        __m256d m = _mm256_loadu_pd(pMovMagnitude);
+        __m256d before, after;
+
+        before = _mm256_blendv_pd(_mm256_loadu_pd(pMovMagnitude - stride + 1), _mm256_loadu_pd(pMovMagnitude - stride - 1), diagonal);
+        after = _mm256_blendv_pd(_mm256_loadu_pd(pMovMagnitude + stride - 1), _mm256_loadu_pd(pMovMagnitude + stride + 1), diagonal);
+        before = _mm256_blendv_pd(before, _mm256_loadu_pd(pMovMagnitude - stride), vertical);
+        after = _mm256_blendv_pd(after, _mm256_loadu_pd(pMovMagnitude + stride), vertical);
+        before = _mm256_blendv_pd(before, _mm256_loadu_pd(pMovMagnitude - 1), horizontal);
+        after = _mm256_blendv_pd(after, _mm256_loadu_pd(pMovMagnitude + 1), horizontal);
+
+        _mm256_storeu_pd(output + i, _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(m, before, _CMP_GT_OQ),
+                                                                 _mm256_cmp_pd(m, after, _CMP_GT_OQ)), m));
+    }
+
+    return i;
+}
+
+/*
+*  The structure tensor kernels keep the scalar order of operations, with
+*  separate multiplies and adds, so their results are identical to it.
+*/
+__attribute__((target("sse2")))
+int structureTensorRowsSSE2(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                            double *outputXX, double *outputYY, double *outputXY)
+{
+    int i, k;
+
+    for(i = 0; i + 2 <= count; i += 2) {
+        __m128d sxx = _mm_setzero_pd();
+        __m128d syy = _mm_setzero_pd();
+        __m128d sxy = _mm_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            if (rowsDX[k] == NULL)
+                continue;
+            __m128d weight = _mm_set1_pd(kernel[kernelSize - k - 1]);
+            __m128d dx = _mm_loadu_pd(rowsDX[k] + i);
+            __m128d dy = _mm_loadu_pd(rowsDY[k] + i);
+            sxx = _mm_add_pd(sxx, _mm_mul_pd(weight, _mm_mul_pd(dx, dx)));
+            syy = _mm_add_pd(syy, _mm_mul_pd(weight, _mm_mul_pd(dy, dy)));
+            sxy = _mm_add_pd(sxy, _mm_mul_pd(weight, _mm_mul_pd(dx, dy)));
+        }
+        _mm_storeu_pd(outputXX + i, sxx);
+        _mm_storeu_pd(outputYY + i, syy);
+        _mm_storeu_pd(outputXY + i, sxy);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int structureTensorRowsAVX2(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                            double *outputXX, double *outputYY, double *outputXY)
+{
+    int i, k;
+
+    for(i = 0; i + 4 <= count; i += 4) {
+        __m256d sxx = _mm256_setzero_pd();
+        __m256d syy = _mm256_setzero_pd();
+        __m256d sxy = _mm256_setzero_pd();
+        for(k = 0; k < kernelSize; k++) {
+            if (rowsDX[k] == NULL)
+                continue;
+            __m256d weight = _mm256_set1_pd(kernel[kernelSize - k - 1]);
+            __m256d dx = _mm256_loadu_pd(rowsDX[k] + i);
+            __m256d dy = _mm256_loadu_pd(rowsDY[k] + i);
+            sxx = _mm256_add_pd(sxx, _mm256_mul_pd(weight, _mm256_mul_pd(dx, dx)));
+            syy = _mm256_add_pd(syy, _mm256_mul_pd(weight, _mm256_mul_pd(dy, dy)));
+            sxy = _mm256_add_pd(sxy, _mm256_mul_pd(weight, _mm256_mul_pd(dx, dy)));
+        }
+        _mm256_storeu_pd(outputXX + i, sxx);
+        _mm256_storeu_pd(outputYY + i, syy);
+        _mm256_storeu_pd(outputXY + i, sxy);
+    }
+
+    return i;
+}
+
+__attribute__((target("sse2")))
+int structureTensorResponseSSE2(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                int count, double k, int shiTomasi, double threshold, double *response)
+{
+    int i, l;
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d sensitivity = _mm_set1_pd(k);
+    const __m128d limit = _mm_set1_pd(threshold);
+
+    for(i = 0; i + 2 <= count; i += 2) {
+        __m128d sxx = _mm_setzero_pd();
+        __m128d syy = _mm_setzero_pd();
+        __m128d sxy = _mm_setzero_pd();
+        __m128d trace, value;
+        for(l = 0; l < kernelSize; l++) {
+            __m128d weight = _mm_set1_pd(kernel[kernelSize - l - 1]);
+            sxx = _mm_add_pd(sxx, _mm_mul_pd(weight, _mm_loadu_pd(inputXX + i + l)));
+            syy = _mm_add_pd(syy, _mm_mul_pd(weight, _mm_loadu_pd(inputYY + i + l)));
+            sxy = _mm_add_pd(sxy, _mm_mul_pd(weight, _mm_loadu_pd(inputXY + i + l)));
+        }
+
+        trace = _mm_add_pd(sxx, syy);
+        if (shiTomasi) {
+            __m128d halfDifference = _mm_mul_pd(_mm_sub_pd(sxx, syy), half);
+            value = _mm_sub_pd(_mm_mul_pd(trace, half),
+                               _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(halfDifference, halfDifference), _mm_mul_pd(sxy, sxy))));
+        } else {
+            value = _mm_sub_pd(_mm_sub_pd(_mm_mul_pd(sxx, syy), _mm_mul_pd(sxy, sxy)), _mm_mul_pd(_mm_mul_pd(sensitivity, trace), trace));
+        }
+
+        _mm_storeu_pd(response + i, _mm_and_pd(_mm_cmpgt_pd(value, limit), value));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+int structureTensorResponseAVX2(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                int count, double k, int shiTomasi, double threshold, double *response)
+{
+    int i, l;
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d sensitivity = _mm256_set1_pd(k);
+    const __m256d limit = _mm256_set1_pd(threshold);
+
+    for(i = 0; i + 4 <= count; i += 4) {
+        __m256d sxx = _mm256_setzero_pd();
+        __m256d syy = _mm256_setzero_pd();
+        __m256d sxy = _mm256_setzero_pd();
+        __m256d trace, value;
+        for(l = 0; l < kernelSize; l++) {
+            __m256d weight = _mm256_set1_pd(kernel[kernelSize - l - 1]);
+            sxx = _mm256_add_pd(sxx, _mm256_mul_pd(weight, _mm256_loadu_pd(inputXX + i + l)));
+            syy = _mm256_add_pd(syy, _mm256_mul_pd(weight, _mm256_loadu_pd(inputYY + i + l)));
+            sxy = _mm256_add_pd(sxy, _mm256_mul_pd(weight, _mm256_loadu_pd(inputXY + i + l)));
+        }
+
+        trace = _mm256_add_pd(sxx, syy);
+        if (shiTomasi) {
+            __m256d halfDifference = _mm256_mul_pd(_mm256_sub_pd(sxx, syy), half);
+            value = _mm256_sub_pd(_mm256_mul_pd(trace, half),
+                                  _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(halfDifference, halfDifference), _mm256_mul_pd(sxy, sxy))));
+        } else {
+            value = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(sxx, syy), _mm256_mul_pd(sxy, sxy)),
+                                  _mm256_mul_pd(_mm256_mul_pd(sensitivity, trace), trace));
+        }
+
+        _mm256_storeu_pd(response + i, _mm256_and_pd(_mm256_cmp_pd(value, limit, _CMP_GT_OQ), value));
+    }
+
+    return i;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SIMD_H_   /* Include guard */
+#define SIMD_H_
+
+
+enum simd_level {
+        SIMD_NONE,
+        SIMD_SSE2,
+        SIMD_SSSE3,
+        SIMD_AVX2,
+};
+
+/*
+*  Fixed point luminance weights for RGB24toGrayscale: the original
+*  0.2126 / 0.7152 / 0.722 coefficients scaled by 2^GRAY_WEIGHT_SHIFT, small
+*  enough to be multiplied as signed 16 bit values.
+*/
+#define GRAY_WEIGHT_SHIFT         (15)
+#define GRAY_WEIGHT_R             (6966)
+#define GRAY_WEIGHT_G             (23436)
+#define GRAY_WEIGHT_B             (23658)
+
+/*
+*  Fixed point format of the integer Gaussian blur (see GaussianBlurInteger):
+*  the weights carry INTEGER_BLUR_WEIGHT_SHIFT bits of fraction and the 16 bit
+*  intermediate image INTEGER_BLUR_FRACTION_BITS. The weights must sum to at
+*  most INTEGER_BLUR_MAX_WEIGHT_SUM for the intermediate to fit in 16 bits.
+*/
+#define INTEGER_BLUR_WEIGHT_SHIFT     (14)
+#define INTEGER_BLUR_FRACTION_BITS    (6)
+#define INTEGER_BLUR_MAX_WEIGHT_SUM   (30000)
+#define INTEGER_BLUR_ROWS_SHIFT       (INTEGER_BLUR_WEIGHT_SHIFT - INTEGER_BLUR_FRACTION_BITS)
+#define INTEGER_BLUR_ROW_SHIFT        (INTEGER_BLUR_WEIGHT_SHIFT + INTEGER_BLUR_FRACTION_BITS)
+
+/* tan(22.5 degrees), the boundary between the sectors of the Canny non-maximum suppression. */
+#define NMS_TAN_22_5                  (0.41421356237309503)
+
+enum simd_level detectSIMDLevel(void);
+enum simd_level getSIMDLevel(void);
+enum simd_level setSIMDLevel(enum simd_level level);
+
+void YUYVRowToRGB24Scalar(const unsigned char *pYUYV, int width, unsigned char *pRGB24);
+void YUYVRowToGrayscaleScalar(const unsigned char *pYUYV, int width, unsigned char *pGrayscale);
+void RGB24RowToGrayscaleScalar(const unsigned char *pRGB24, int width, unsigned char *pGrayscale);
+void convolveRow1DScalar(const double *kernel, int kernelSize, const double *input, int count, double *output);
+void convolveRows1DScalar(const double *kernel, int kernelSize, const double **inputRows, int count, double *output);
+void convolveColumns1DScalar(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output);
+void convolveRows1DU8Scalar(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output);
+void convolveRow1DS16Scalar(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output);
+void nonMaximumSuppressionRowScalar(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output);
+void structureTensorRowsScalar(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                               double *outputXX, double *outputYY, double *outputXY);
+void structureTensorResponseScalar(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                   int count, double k, int shiTomasi, double threshold, double *response);
+
+#if defined(__x86_64__) || defined(__i386__)
+int YUYVRowToRGB24SSE2(const unsigned char *pYUYV, int width, unsigned char *pRGB24);
+int YUYVRowToRGB24SSSE3(const unsigned char *pYUYV, int width, unsigned char *pRGB24);
+int YUYVRowToRGB24AVX2(const unsigned char *pYUYV, int width, unsigned char *pRGB24);
+int YUYVRowToGrayscaleSSE2(const unsigned char *pYUYV, int width, unsigned char *pGrayscale);
+int YUYVRowToGrayscaleAVX2(const unsigned char *pYUYV, int width, unsigned char *pGrayscale);
+int RGB24RowToGrayscaleSSSE3(const unsigned char *pRGB24, int width, unsigned char *pGrayscale);
+int RGB24RowToGrayscaleAVX2(const unsigned char *pRGB24, int width, unsigned char *pGrayscale);
+int convolveRow1DSSE2(const double *kernel, int kernelSize, const double *input, int count, double *output);
+int convolveRow1DAVX2(const double *kernel, int kernelSize, const double *input, int count, double *output);
+int convolveRows1DSSE2(const double *kernel, int kernelSize, const double **inputRows, int count, double *output);
+int convolveRows1DAVX2(const double *kernel, int kernelSize, const double **inputRows, int count, double *output);
+int convolveColumns1DSSE2(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output);
+int convolveColumns1DAVX2(const double *kernel, int kernelSize, const double *input, int stride, int rows, int count, double *output);
+int convolveRows1DU8SSE2(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output);
+int convolveRows1DU8AVX2(const short *kernel, int kernelSize, const unsigned char **inputRows, int count, short *output);
+int convolveRow1DS16SSE2(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output);
+int convolveRow1DS16AVX2(const short *kernel, int kernelSize, const short *input, int count, unsigned char *output);
+int nonMaximumSuppressionRowSSE2(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output);
+int nonMaximumSuppressionRowAVX2(const double *DX, const double *DY, const double *magnitude, int stride, int count, double *output);
+int structureTensorRowsSSE2(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                            double *outputXX, double *outputYY, double *outputXY);
+int structureTensorRowsAVX2(const double *kernel, int kernelSize, const double **rowsDX, const double **rowsDY, int count,
+                            double *outputXX, double *outputYY, double *outputXY);
+int structureTensorResponseSSE2(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                int count, double k, int shiTomasi, double threshold, double *response);
+int structureTensorResponseAVX2(const double *kernel, int kernelSize, const double *inputXX, const double *inputYY, const double *inputXY,
+                                int count, double k, int shiTomasi, double threshold, double *response);
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "stagestats.h"
+
+
+static const char* stage_names[CAPTURE_STAGES] = {
+    "dequeue", "yuyv2rgb24", "grayscale", "crop", "uniform", "gaussian", "gaussian2d", "differential", "canny", "corners",
+    "write", "record", "requeue", "frame"
+};
+
+#ifndef NO_STAGE_STATS
+
+typedef struct stage_histogram_ {
+    uint64_t buckets[STAGE_BUCKETS];
+    uint64_t sum;
+    uint64_t max;
+} stage_histogram;
+
+static stage_histogram histograms[CAPTURE_STAGES];
+
+#endif
+
+#ifndef NO_STAGE_STATS
+static volatile sig_atomic_t dump_requested = 0;
+#endif
+
+uint64_t stage_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+#ifndef NO_STAGE_STATS
+
+/*
+*  The first STAGE_SUB_BUCKETS buckets are exact; after that each power of
+*  two is split into STAGE_SUB_BUCKETS, by the bits below the leading one.
+*/
+static int bucket_of(uint64_t nanoseconds)
+{
+    int exponent;
+
+    if (nanoseconds < STAGE_SUB_BUCKETS)
+        return (int)nanoseconds;
+
+    exponent = 63 - __builtin_clzll(nanoseconds);
+
+    return (exponent - STAGE_SUB_BUCKET_BITS + 1)*STAGE_SUB_BUCKETS
+           + (int)((nanoseconds >> (exponent - STAGE_SUB_BUCKET_BITS)) & (STAGE_SUB_BUCKETS - 1));
+}
+
+// The largest duration that falls in bucket.
+static uint64_t bucket_limit(int bucket)
+{
+    int shift;
+
+    if (bucket < STAGE_SUB_BUCKETS)
+        return bucket;
+
+    shift = bucket/STAGE_SUB_BUCKETS - 1;
+
+    return (((uint64_t)STAGE_SUB_BUCKETS + bucket % STAGE_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+#endif
+
+/*
+*  Function: stage_record
+*  ----------------------
+*
+*  Adds one run of stage, of nanoseconds, to its histogram. Safe from any
+*  thread; STAGE_CLOCK and STAGE_RECORD time a stage with it.
+*/
+void stage_record(enum capture_stage stage, uint64_t nanoseconds)
+{
+#ifndef NO_STAGE_STATS
+    stage_histogram* histogram = &histograms[stage];
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[bucket_of(nanoseconds)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, nanoseconds, __ATOMIC_RELAXED);
+    while (nanoseconds > max
+           && !__atomic_compare_exchange_n(&histogram->max, &max, nanoseconds, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#else
+    (void)stage;
+    (void)nanoseconds;
+#endif
+}
+
+const char* stage_name(enum capture_stage stage)
+{
+    return (stage >= 0 && stage < CAPTURE_STAGES) ? stage_names[stage] : NULL;
+}
+
+/*
+*  Function: stage_summarize
+*  -------------------------
+*
+*  Fills summary with the runs of stage so far. The percentiles are the
+*  upper bounds of the buckets they fall in, and never above the maximum.
+*  Runs recorded while it reads the histogram may or may not be counted.
+*
+*  Returns 0, or -1 with errno set to EINVAL for no such stage, or ENOSYS
+*  if the statistics are compiled out.
+*/
+int stage_summarize(enum capture_stage stage, stage_summary* summary)
+{
+#ifndef NO_STAGE_STATS
+    uint64_t counts[STAGE_BUCKETS];
+    uint64_t* percentiles[3];
+    double quantiles[3] = {0.5, 0.9, 0.99};
+    uint64_t seen = 0;
+    int i, q = 0;
+
+    if (stage < 0 || stage >= CAPTURE_STAGES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(summary, 0, sizeof(*summary));
+    summary->name = stage_names[stage];
+    for(i=0; i < STAGE_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&histograms[stage].buckets[i], __ATOMIC_RELAXED);
+        summary->count += counts[i];
+    }
+    summary->max = __atomic_load_n(&histograms[stage].max, __ATOMIC_RELAXED);
+    if (summary->count == 0)
+        return 0;
+    summary->mean = (double)__atomic_load_n(&histograms[stage].sum, __ATOMIC_RELAXED)/summary->count;
+
+    percentiles[0] = &summary->p50;
+    percentiles[1] = &summary->p90;
+    percentiles[2] = &summary->p99;
+    for(i=0; i < STAGE_BUCKETS && q < 3; i++) {
+        seen += counts[i];
+        while (q < 3 && seen >= quantiles[q]*summary->count) {
+            *percentiles[q] = (bucket_limit(i) < summary->max) ? bucket_limit(i) : summary->max;
+            q++;
+        }
+    }
+
+    return 0;
+#else
+    (void)stage;
+    (void)summary;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void stage_stats_reset(void)
+{
+#ifndef NO_STAGE_STATS
+    int i, j;
+
+    for(i=0; i < CAPTURE_STAGES; i++) {
+        for(j=0; j < STAGE_BUCKETS; j++)
+            __atomic_store_n(&histograms[i].buckets[j], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histograms[i].sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&histograms[i].max, 0, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+// Prints the stages that have run, in microseconds.
+void stage_stats_print(FILE* fp)
+{
+#ifndef NO_STAGE_STATS
+    stage_summary summary;
+    int i;
+
+    fprintf(fp, "%-14s %8s %10s %10s %10s %10s %10s\n", "stage (us)", "count", "mean", "p50", "p90", "p99", "max");
+    for(i=0; i < CAPTURE_STAGES; i++) {
+        if (stage_summarize(i, &summary) == -1 || summary.count == 0)
+            continue;
+        fprintf(fp, "%-14s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", summary.name, (unsigned long long)summary.count,
+                summary.mean/1e3, summary.p50/1e3, summary.p90/1e3, summary.p99/1e3, summary.max/1e3);
+    }
+#else
+    fprintf(fp, "Stage statistics are compiled out\n");
+#endif
+}
+
+#ifndef NO_STAGE_STATS
+
+static void request_dump(int signum)
+{
+    (void)signum;
+    dump_requested = 1;
+}
+
+static void dump_at_exit(void)
+{
+    fprintf(stderr, "\n");
+    stage_stats_print(stderr);
+}
+
+#endif
+
+/*
+*  Function: stage_stats_dump_on
+*  -----------------------------
+*
+*  Prints the statistics to stderr whenever signum arrives, from the next
+*  stage_stats_poll (a signal handler cannot print), and once more at exit.
+*  With the statistics compiled out it installs nothing.
+*
+*  Returns 0, or -1 with errno set if the handler cannot be installed.
+*/
+int stage_stats_dump_on(int signum)
+{
+#ifndef NO_STAGE_STATS
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_dump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signum, &action, NULL) == -1)
+        return -1;
+
+    return (atexit(dump_at_exit) == 0) ? 0 : -1;
+#else
+    (void)signum;
+    return 0;
+#endif
+}
+
+// Prints the statistics if a dump has been asked for since the last poll.
+void stage_stats_poll(void)
+{
+#ifndef NO_STAGE_STATS
+    if (dump_requested) {
+        dump_requested = 0;
+        stage_stats_print(stderr);
+    }
+#endif
+}
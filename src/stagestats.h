@@ -0,0 +1,73 @@
+#ifndef STAGESTATS_H_   /* Include guard */
+#define STAGESTATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/*
+*  Latency histograms of the stages of the capture loop: every time a stage
+*  runs, its duration on the monotonic clock goes into the histogram of the
+*  stage. The histograms are log-linear: STAGE_SUB_BUCKETS buckets for each
+*  power of two nanoseconds, so a percentile read from them is within
+*  1/STAGE_SUB_BUCKETS of the true one. Recording a duration is a few
+*  relaxed atomic adds, from any thread.
+*
+*  Built with NO_STAGE_STATS (make STAGE_STATS=0) the instrumentation
+*  compiles out: the STAGE_ macros expand to nothing, no histograms are
+*  kept, stage_summarize fails with ENOSYS, and stage_stats_dump_on installs
+*  no handler.
+*/
+#define STAGE_SUB_BUCKET_BITS     (3)
+#define STAGE_SUB_BUCKETS         (1 << STAGE_SUB_BUCKET_BITS)
+#define STAGE_BUCKETS             ((64 - STAGE_SUB_BUCKET_BITS + 1)*STAGE_SUB_BUCKETS)
+
+enum capture_stage {
+        STAGE_DEQUEUE,              /* Taking a filled buffer from the device. */
+        STAGE_CONVERT_RGB,          /* YUYV to RGB24. */
+        STAGE_CONVERT_GRAY,         /* YUYV or RGB24 to grayscale. */
+        STAGE_CROP,
+        STAGE_UNIFORM_BLUR,
+        STAGE_GAUSSIAN_BLUR,
+        STAGE_GAUSSIAN_BLUR_2D,
+        STAGE_DIFFERENTIAL_EDGES,
+        STAGE_CANNY_EDGES,
+        STAGE_CORNERS,
+        STAGE_WRITE,                /* Each bitmap, from submission to completion when written in the background. */
+        STAGE_RECORDING,            /* Each plane appended to a recording. */
+        STAGE_REQUEUE,              /* Handing a buffer back to the device. */
+        STAGE_FRAME,                /* The processing of a whole frame. */
+        CAPTURE_STAGES,
+};
+
+typedef struct stage_summary_ {
+    const char* name;
+    uint64_t count;
+    uint64_t p50;               /* Nanoseconds. */
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+    double mean;
+} stage_summary;
+
+/* STAGE_CLOCK declares start as now, STAGE_MARK sets it to now. */
+#ifndef NO_STAGE_STATS
+#define STAGE_CLOCK(start)            uint64_t start = stage_clock()
+#define STAGE_MARK(start)             ((start) = stage_clock())
+#define STAGE_RECORD(stage, start)    stage_record((stage), stage_clock() - (start))
+#else
+#define STAGE_CLOCK(start)
+#define STAGE_MARK(start)
+#define STAGE_RECORD(stage, start)
+#endif
+
+uint64_t stage_clock(void);
+void stage_record(enum capture_stage stage, uint64_t nanoseconds);
+const char* stage_name(enum capture_stage stage);
+int stage_summarize(enum capture_stage stage, stage_summary* summary);
+void stage_stats_reset(void);
+void stage_stats_print(FILE* fp);
+int stage_stats_dump_on(int signum);
+void stage_stats_poll(void);
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+#include "taskgraph.h"
+
+
+static double monotonicMilliseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+void initTaskGraph(task_graph* graph)
+{
+    memset(graph, 0, sizeof(task_graph));
+}
+
+/*
+*  Function: addTask
+*  -----------------
+*
+*  name             A label for the stage, kept for reporting.
+*  function         Called with context once every dependency has finished.
+*  dependencyCount  The number of task ids that follow, each returned by an
+*                   earlier addTask on the same graph.
+*
+*  Tasks can only depend on tasks added before them, so the graph never has
+*  a cycle. Among the tasks ready to run at any moment, the one added first
+*  goes first: add the long stages before the short ones.
+*
+*  Returns the id of the new task, or -1 if the graph is full, there are too
+*  many dependencies, or one of them is not an earlier task.
+*/
+int addTask(task_graph* graph, const char* name, graph_function function, void* context, int dependencyCount, ...)
+{
+    int i, dependency;
+    graph_task* task;
+    va_list dependencies;
+
+    if (graph->count >= TASK_GRAPH_MAX_TASKS || dependencyCount < 0 || dependencyCount > TASK_GRAPH_MAX_DEPENDENCIES)
+        return -1;
+
+    task = &graph->tasks[graph->count];
+    memset(task, 0, sizeof(graph_task));
+    task->name = name;
+    task->function = function;
+    task->context = context;
+
+    va_start(dependencies, dependencyCount);
+    for(i=0; i < dependencyCount; i++) {
+        dependency = va_arg(dependencies, int);
+        if (dependency < 0 || dependency >= graph->count) {
+            va_end(dependencies);
+            return -1;
+        }
+        task->dependencies[task->dependencyCount++] = dependency;
+    }
+    va_end(dependencies);
+
+    return graph->count++;
+}
+
+// Runs ready tasks until the whole graph has finished. One of these runs on
+// each thread taking part.
+static void taskGraphWorker(void* context, int index)
+{
+    task_graph* graph = (task_graph*)context;
+    graph_task* task;
+    int i, k, slot, id;
+    double start;
+
+    pthread_mutex_lock(&graph->lock);
+    while (graph->finished < graph->count) {
+        if (graph->readyCount == 0) {
+            pthread_cond_wait(&graph->changed, &graph->lock);
+            continue;
+        }
+
+        slot = 0;
+        for(i=1; i < graph->readyCount; i++)
+            if (graph->ready[i] < graph->ready[slot])
+                slot = i;
+        id = graph->ready[slot];
+        graph->ready[slot] = graph->ready[--graph->readyCount];
+        task = &graph->tasks[id];
+        pthread_mutex_unlock(&graph->lock);
+
+        start = monotonicMilliseconds();
+        task->function(task->context);
+        task->end = monotonicMilliseconds();
+        task->start = start;
+
+        pthread_mutex_lock(&graph->lock);
+        graph->finished++;
+        for(i=id + 1; i < graph->count; i++) {
+            for(k=0; k < graph->tasks[i].dependencyCount; k++) {
+                if (graph->tasks[i].dependencies[k] == id && --graph->tasks[i].waiting == 0)
+                    graph->ready[graph->readyCount++] = i;
+            }
+        }
+        pthread_cond_broadcast(&graph->changed);
+    }
+    pthread_mutex_unlock(&graph->lock);
+}
+
+/*
+*  Function: runTaskGraph
+*  ----------------------
+*
+*  Runs every task of the graph, each as soon as its dependencies have
+*  finished, on up to one thread of the pool per task (see setThreadCount).
+*  The image functions the tasks call then run their rows on the calling
+*  thread: the parallelism comes from the independent tasks instead.
+*
+*  On return wallTime holds the elapsed time of the run, and criticalPath
+*  the longest chain of dependent tasks, each taking the time it took this
+*  run: the least wallTime could be with enough threads. Task times are
+*  relative to the start of the run.
+*/
+int runTaskGraph(task_graph* graph)
+{
+    int i, k, threads;
+    double start, longest;
+    graph_task* task;
+
+    pthread_mutex_init(&graph->lock, NULL);
+    pthread_cond_init(&graph->changed, NULL);
+
+    graph->readyCount = 0;
+    graph->finished = 0;
+    for(i=0; i < graph->count; i++) {
+        graph->tasks[i].waiting = graph->tasks[i].dependencyCount;
+        if (graph->tasks[i].waiting == 0)
+            graph->ready[graph->readyCount++] = i;
+    }
+
+    threads = getThreadCount();
+    if (threads > graph->count)
+        threads = graph->count;
+
+    start = monotonicMilliseconds();
+    parallelFor(threads, taskGraphWorker, graph);
+    graph->wallTime = monotonicMilliseconds() - start;
+
+    // Tasks only depend on earlier ones, so one pass in order finds every
+    // longest path.
+    graph->criticalPath = 0.0;
+    for(i=0; i < graph->count; i++) {
+        task = &graph->tasks[i];
+        longest = 0.0;
+        for(k=0; k < task->dependencyCount; k++)
+            if (graph->tasks[task->dependencies[k]].pathTime > longest)
+                longest = graph->tasks[task->dependencies[k]].pathTime;
+        task->start -= start;
+        task->end -= start;
+        task->pathTime = longest + (task->end - task->start);
+        if (task->pathTime > graph->criticalPath)
+            graph->criticalPath = task->pathTime;
+    }
+
+    pthread_cond_destroy(&graph->changed);
+    pthread_mutex_destroy(&graph->lock);
+
+    return 0;
+}
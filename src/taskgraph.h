@@ -0,0 +1,40 @@
+#ifndef TASKGRAPH_H_   /* Include guard */
+#define TASKGRAPH_H_
+
+#include <pthread.h>
+
+
+#define TASK_GRAPH_MAX_TASKS          (32)
+#define TASK_GRAPH_MAX_DEPENDENCIES   (4)
+
+typedef void (*graph_function)(void* context);
+
+typedef struct graph_task_ {
+    const char* name;
+    graph_function function;
+    void* context;
+    int dependencies[TASK_GRAPH_MAX_DEPENDENCIES];
+    int dependencyCount;
+    int waiting;            /* Dependencies not yet finished, while running. */
+    double start;           /* Milliseconds from the start of the run. */
+    double end;
+    double pathTime;        /* The longest chain of stages ending here. */
+} graph_task;
+
+typedef struct task_graph_ {
+    graph_task tasks[TASK_GRAPH_MAX_TASKS];
+    int count;
+    int ready[TASK_GRAPH_MAX_TASKS];
+    int readyCount;
+    int finished;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    double wallTime;        /* Milliseconds, from the last runTaskGraph. */
+    double criticalPath;
+} task_graph;
+
+void initTaskGraph(task_graph* graph);
+int addTask(task_graph* graph, const char* name, graph_function function, void* context, int dependencyCount, ...);
+int runTaskGraph(task_graph* graph);
+
+#endif
@@ -1,11 +1,103 @@
 #include "minunit.h"
 
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+
 #include "imageprocessing.h"
+#include "recording.h"
 #include "camera.h"
+#include "stagestats.h"
+
+#define REPLAY_WIDTH    (64)
+#define REPLAY_HEIGHT   (48)
+#define REPLAY_FRAMES   (3)
+#define REPLAY_INTERVAL (20000)     /* Microseconds between the recorded frames. */
+
+/* Kept after the run: the Python tests replay it too. */
+#ifndef TEST_RECORDING
+#define TEST_RECORDING  "test_replay.rec"
+#endif
+
+static char recording_device[64];
+
+
+// Fills a YUYV frame with a pattern of its own.
+static void fill_frame(unsigned char* pFrame, int n)
+{
+    int i;
+
+    for(i=0; i < REPLAY_WIDTH*REPLAY_HEIGHT*2; i++)
+        pFrame[i] = (unsigned char)(i*7 + n*31);
+}
+
+static int frame_matches(const unsigned char* pFrame, int n)
+{
+    unsigned char expected[REPLAY_WIDTH*REPLAY_HEIGHT*2];
+
+    fill_frame(expected, n);
+
+    return memcmp(pFrame, expected, sizeof(expected)) == 0;
+}
+
+// Borrows the next frame, waiting for it as mainloop does.
+static int wait_and_borrow(int dev_handle, buffers buffs, borrowed_frame* frame)
+{
+    fd_set fds;
+    struct timeval tv;
+
+    for(;;) {
+        FD_ZERO(&fds);
+        FD_SET(dev_handle, &fds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(dev_handle + 1, &fds, NULL, NULL, &tv) <= 0)
+            return 0;
+        if (borrow_frame(dev_handle, buffs, frame) == 1)
+            return 1;
+    }
+}
+
+static double elapsed_ms(struct timespec* start)
+{
+    struct timespec now;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec)*1e3 + (now.tv_nsec - start->tv_nsec)/1e6;
+}
 
 void test_setup(void) {
-    /* Nothing */
+    recording_writer writer;
+    recording_frame frame;
+    unsigned char pFrame[REPLAY_WIDTH*REPLAY_HEIGHT*2];
+    int n;
+
+    // A recording of a few frames, with a plane the replay has to skip.
+    sprintf(recording_device, "%s%s", REPLAY_PREFIX, TEST_RECORDING);
+    recording_create(&writer, TEST_RECORDING, 0);
+    for(n=0; n < REPLAY_FRAMES; n++) {
+        memset(&frame, 0, sizeof(frame));
+        frame.stream = 0;
+        frame.format = RECORDING_YUYV;
+        frame.width = REPLAY_WIDTH;
+        frame.height = REPLAY_HEIGHT;
+        frame.stride = REPLAY_WIDTH*2;
+        frame.sequence = 100 + n;
+        frame.size = sizeof(pFrame);
+        frame.timestampSec = 1000;
+        frame.timestampUsec = n*REPLAY_INTERVAL;
+        fill_frame(pFrame, n);
+        recording_append(&writer, &frame, pFrame);
+
+        frame.stream = 1;
+        frame.format = RECORDING_GRAY;
+        frame.stride = REPLAY_WIDTH;
+        frame.size = REPLAY_WIDTH*REPLAY_HEIGHT;
+        recording_append(&writer, &frame, pFrame);
+    }
+    recording_finish(&writer);
 }
 
 void test_teardown(void) {
@@ -19,13 +111,19 @@ MU_TEST(test_grab_frame_rgb) {
     resolution res;
     long size = 0;
     int dev_handle = 0;
+    char* dev_name = getenv("MULTIMEDIA_TEST_DEVICE");
+
+    // A real camera if one is named, else the replay of a recording.
+    if (dev_name == NULL)
+        dev_name = recording_device;
 
-    dev_handle = open_device("/dev/video0");
+    dev_handle = open_device(dev_name);
+    mu_check(dev_handle != -1);
     res = get_resolution(dev_handle);
     close_device(dev_handle);
 
     pRGB = (unsigned char*)malloc(ALIGN_TO_FOUR(res.width*3)*res.height);
-    grab_frame_rgb("/dev/video0", res.width, res.height, pRGB);
+    grab_frame_rgb(dev_name, res.width, res.height, pRGB);
     BMPwriter(pRGB, 24, res.width, res.height, "test.bmp");
 
     fp = fopen("test.bmp", "rb");
@@ -38,11 +136,253 @@ MU_TEST(test_grab_frame_rgb) {
     mu_check(size == (54 + ALIGN_TO_FOUR(res.width*3)*res.height));
 }
 
+MU_TEST(test_replay_recording) {
+    borrowed_frame frames[REPLAY_FRAMES + 1];
+    struct timespec start;
+    buffers buffs;
+    int dev_handle, n;
+
+    dev_handle = open_device(recording_device);
+    mu_check(dev_handle != -1);
+    buffs = init_device(recording_device, dev_handle, IO_METHOD_MMAP, 0);
+    mu_check(buffs.io_selection == IO_METHOD_REPLAY);
+    mu_check(buffs.image_width == REPLAY_WIDTH && buffs.image_height == REPLAY_HEIGHT);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_capturing(dev_handle, buffs);
+
+    // One pass, at the recorded pace, straight from the recording.
+    for(n=0; n < REPLAY_FRAMES; n++) {
+        mu_check(wait_and_borrow(dev_handle, buffs, &frames[n]));
+        mu_check(frames[n].bytesused == REPLAY_WIDTH*REPLAY_HEIGHT*2);
+        mu_check(frame_matches(frames[n].start, n));
+        mu_check(frames[n].sequence == (unsigned int)n);
+        mu_check(frames[n].timestamp.tv_sec == 1000 && frames[n].timestamp.tv_usec == n*REPLAY_INTERVAL);
+    }
+    mu_check(elapsed_ms(&start) >= (REPLAY_FRAMES - 1)*REPLAY_INTERVAL/1000.0);
+
+    // As with a device, only so many frames can be held at once.
+    mu_check(borrow_frame(dev_handle, buffs, &frames[REPLAY_FRAMES]) == -1 && errno == EBUSY);
+    for(n=0; n < REPLAY_FRAMES; n++)
+        mu_check(release_frame(dev_handle, buffs, &frames[n]) == 0);
+
+    // Then it loops, carrying the sequence and the timestamps on.
+    mu_check(wait_and_borrow(dev_handle, buffs, &frames[0]));
+    mu_check(frame_matches(frames[0].start, 0));
+    mu_check(frames[0].sequence == REPLAY_FRAMES);
+    mu_check(frames[0].timestamp.tv_usec == REPLAY_FRAMES*REPLAY_INTERVAL);
+    mu_check(elapsed_ms(&start) >= REPLAY_FRAMES*REPLAY_INTERVAL/1000.0);
+    release_frame(dev_handle, buffs, &frames[0]);
+
+    stop_capturing(dev_handle, buffs);
+    uninit_device(buffs);
+    close_device(dev_handle);
+}
+
+MU_TEST(test_replay_out_of_order) {
+    unsigned char pFrame[REPLAY_WIDTH*REPLAY_HEIGHT*2];
+    long stamps[REPLAY_FRAMES] = {1000*1000000L, 998*1000000L + 1, 1000*1000000L + REPLAY_INTERVAL};
+    recording_writer writer;
+    recording_frame recorded;
+    borrowed_frame frame;
+    buffers buffs;
+    int dev_handle, n;
+
+    // The second frame is stamped almost two seconds before the first.
+    recording_create(&writer, "test_out_of_order.rec", 0);
+    for(n=0; n < REPLAY_FRAMES; n++) {
+        memset(&recorded, 0, sizeof(recorded));
+        recorded.format = RECORDING_YUYV;
+        recorded.width = REPLAY_WIDTH;
+        recorded.height = REPLAY_HEIGHT;
+        recorded.stride = REPLAY_WIDTH*2;
+        recorded.size = sizeof(pFrame);
+        recorded.timestampSec = stamps[n] / 1000000;
+        recorded.timestampUsec = stamps[n] % 1000000;
+        fill_frame(pFrame, n);
+        recording_append(&writer, &recorded, pFrame);
+    }
+    recording_finish(&writer);
+
+    dev_handle = open_device(REPLAY_PREFIX "test_out_of_order.rec");
+    mu_check(dev_handle != -1);
+    buffs = init_device(REPLAY_PREFIX "test_out_of_order.rec", dev_handle, IO_METHOD_MMAP, 0);
+    start_capturing(dev_handle, buffs);
+
+    // It is due with the first, and the timer keeps going after it.
+    for(n=0; n < REPLAY_FRAMES + 1; n++) {
+        mu_check(wait_and_borrow(dev_handle, buffs, &frame));
+        mu_check(frame_matches(frame.start, n % REPLAY_FRAMES));
+        release_frame(dev_handle, buffs, &frame);
+    }
+
+    stop_capturing(dev_handle, buffs);
+    uninit_device(buffs);
+    close_device(dev_handle);
+    remove("test_out_of_order.rec");
+}
+
+MU_TEST(test_replay_directory) {
+    unsigned char pFrame[REPLAY_WIDTH*REPLAY_HEIGHT*2];
+    char dev_name[128];
+    char path[64];
+    borrowed_frame frame;
+    buffers buffs;
+    FILE* fp;
+    int dev_handle, n;
+
+    mkdir("test_replay", 0777);
+    for(n=0; n < 2; n++) {
+        sprintf(path, "test_replay/frame%02d.yuv", 1 - n);
+        fill_frame(pFrame, 1 - n);
+        fp = fopen(path, "wb");
+        fwrite(pFrame, 1, sizeof(pFrame), fp);
+        fclose(fp);
+    }
+
+    // Without a size the frames cannot be told apart.
+    mu_check(open_device(REPLAY_PREFIX "test_replay") == -1);
+
+    sprintf(dev_name, "%stest_replay,size=%dx%d,max-speed", REPLAY_PREFIX, REPLAY_WIDTH, REPLAY_HEIGHT);
+    dev_handle = open_device(dev_name);
+    mu_check(dev_handle != -1);
+    buffs = init_device(dev_name, dev_handle, IO_METHOD_USERPTR, 0);
+    start_capturing(dev_handle, buffs);
+
+    // The frames are mapped when the replay opens, so the files can go.
+    remove("test_replay/frame00.yuv");
+    remove("test_replay/frame01.yuv");
+    rmdir("test_replay");
+
+    // At max speed every frame is ready at once, in name order.
+    for(n=0; n < 5; n++) {
+        mu_check(borrow_frame(dev_handle, buffs, &frame) == 1);
+        mu_check(frame_matches(frame.start, n % 2));
+        mu_check(frame.sequence == (unsigned int)n);
+        release_frame(dev_handle, buffs, &frame);
+    }
+
+    stop_capturing(dev_handle, buffs);
+    uninit_device(buffs);
+    close_device(dev_handle);
+}
+
+MU_TEST(test_borrow_frame) {
+    int fds[2];
+    int i;
+    unsigned char data[16];
+    unsigned char copy[16];
+    buffers buffs;
+    borrowed_frame frame;
+    borrowed_frame second;
+
+    for(i=0; i < 16; i++)
+        data[i] = (unsigned char)(3*i + 1);
+
+    // A pipe stands in for a device read with IO_METHOD_READ.
+    mu_check(pipe(fds) == 0);
+    buffs = init_read(16);
+    buffs.image_width = 4;
+    buffs.image_height = 2;
+
+    mu_check(write(fds[1], data, 16) == 16);
+    mu_check(borrow_frame(fds[0], buffs, &frame) == 1);
+    mu_check(frame.start == buffs.buffers[0].start);
+    mu_check(frame.index == 0);
+    mu_check(frame.bytesused == 16);
+    mu_check(frame.sequence == 0);
+    mu_check(memcmp(frame.start, data, 16) == 0);
+
+    // The one buffer is held, so another borrow is refused before reading.
+    mu_check(write(fds[1], data, 16) == 16);
+    errno = 0;
+    mu_check(borrow_frame(fds[0], buffs, &second) == -1);
+    mu_check(errno == EBUSY);
+
+    mu_check(release_frame(fds[0], buffs, &frame) == 0);
+    mu_check(frame.start == NULL);
+    errno = 0;
+    mu_check(release_frame(fds[0], buffs, &frame) == -1);
+    mu_check(errno == EINVAL);
+
+    // grab_frame copies the frame the borrow above left waiting.
+    memset(copy, 0, 16);
+    mu_check(grab_frame(fds[0], buffs, copy) == 1);
+    mu_check(memcmp(copy, data, 16) == 0);
+    mu_check(buffs.buffers[0].borrowed == 0);
+
+    // Each frame read is numbered, as the driver numbers streamed ones.
+    mu_check(write(fds[1], data, 16) == 16);
+    mu_check(borrow_frame(fds[0], buffs, &frame) == 1);
+    mu_check(frame.sequence == 2);
+    mu_check(release_frame(fds[0], buffs, &frame) == 0);
+
+    uninit_device(buffs);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+MU_TEST(test_stage_stats) {
+    stage_summary summary;
+#ifndef NO_STAGE_STATS
+    unsigned char data[16];
+    buffers buffs;
+    borrowed_frame frame;
+    int fds[2];
+    int i;
+#endif
+
+    stage_stats_reset();
+#ifdef NO_STAGE_STATS
+    errno = 0;
+    mu_check(stage_summarize(STAGE_CANNY_EDGES, &summary) == -1 && errno == ENOSYS);
+#else
+    // 1 to 1000 us: each percentile within a sub-bucket above the true one.
+    for(i=1; i <= 1000; i++)
+        stage_record(STAGE_CANNY_EDGES, i*1000);
+    mu_check(stage_summarize(STAGE_CANNY_EDGES, &summary) == 0);
+    mu_check(strcmp(summary.name, "canny") == 0);
+    mu_check(summary.count == 1000);
+    mu_check(summary.max == 1000000);
+    mu_check(summary.mean == 500500.0);
+    mu_check(summary.p50 >= 500000 && summary.p50 <= 500000 + 500000/STAGE_SUB_BUCKETS);
+    mu_check(summary.p90 >= 900000 && summary.p90 <= 900000 + 900000/STAGE_SUB_BUCKETS);
+    mu_check(summary.p99 >= 990000 && summary.p99 <= summary.max);
+
+    // Below STAGE_SUB_BUCKETS ns the buckets are exact.
+    stage_record(STAGE_CROP, 3);
+    mu_check(stage_summarize(STAGE_CROP, &summary) == 0);
+    mu_check(summary.count == 1 && summary.p50 == 3 && summary.p99 == 3 && summary.max == 3);
+
+    // The capture functions time themselves.
+    mu_check(pipe(fds) == 0);
+    buffs = init_read(16);
+    memset(data, 1, 16);
+    mu_check(write(fds[1], data, 16) == 16);
+    mu_check(borrow_frame(fds[0], buffs, &frame) == 1);
+    mu_check(release_frame(fds[0], buffs, &frame) == 0);
+    mu_check(stage_summarize(STAGE_DEQUEUE, &summary) == 0 && summary.count == 1);
+    mu_check(stage_summarize(STAGE_REQUEUE, &summary) == 0 && summary.count == 1);
+    uninit_device(buffs);
+    close(fds[0]);
+    close(fds[1]);
+
+    stage_stats_reset();
+    mu_check(stage_summarize(STAGE_CANNY_EDGES, &summary) == 0 && summary.count == 0 && summary.max == 0);
+#endif
+    errno = 0;
+    mu_check(stage_summarize(CAPTURE_STAGES, &summary) == -1);
+}
 
 MU_TEST_SUITE(test_suite) {
     MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
     MU_RUN_TEST(test_grab_frame_rgb);
+    MU_RUN_TEST(test_replay_recording);
+    MU_RUN_TEST(test_replay_out_of_order);
+    MU_RUN_TEST(test_replay_directory);
+    MU_RUN_TEST(test_borrow_frame);
+    MU_RUN_TEST(test_stage_stats);
 }
 
 int main(int argc, char *argv[]) {
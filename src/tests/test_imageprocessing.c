@@ -3,6 +3,21 @@
 #include "imageprocessing.h"
 
 
+/*
+*  The test is linked with -Wl,--wrap=malloc, so every malloc the library
+*  makes is counted here.
+*/
+void* __real_malloc(size_t size);
+
+static long mallocCalls;
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&mallocCalls, 1, __ATOMIC_RELAXED);
+
+    return __real_malloc(size);
+}
+
 void test_setup(void) {
     /* Nothing */
 }
@@ -31,6 +46,61 @@ MU_TEST(test_grayscale_writer) {
 }
 
 
+MU_TEST(test_bmp_writev) {
+    unsigned char header[BMP_MAX_HEADER_SIZE];
+    unsigned char gray[8*3];
+    unsigned char rgb[16*3];
+    unsigned char top_down[1078 + 16*3];
+    unsigned char bottom_up[54 + 16*3];
+    int header_size, height, i, y;
+    FILE *fp;
+    long size;
+
+    for(i=0; i < 8*3; i++)
+        gray[i] = (unsigned char)(7*i);
+    for(i=0; i < 16*3; i++)
+        rgb[i] = (unsigned char)(5*i + 1);
+
+    // 8 bit: palette, then the rows top-down, as they are in memory.
+    header_size = BMPHeader(header, 8, 5, 3);
+    mu_check(header_size == 54 + 256 * sizeof(RGBQUAD));
+    mu_check(BMPWritev(header, header_size, gray, 8, 5, 3, "test-writev-gray.bmp") == 0);
+
+    fp = fopen("test-writev-gray.bmp", "rb");
+    size = fread(top_down, 1, sizeof(top_down), fp);
+    fclose(fp);
+    remove("test-writev-gray.bmp");
+
+    mu_check(size == header_size + 8*3);
+    memcpy(&height, &top_down[22], sizeof(int));
+    mu_check(height == -3);
+    mu_check(top_down[54 + 4*7] == 7 && top_down[54 + 4*7 + 3] == 0);
+    mu_check(memcmp(&top_down[header_size], gray, 8*3) == 0);
+
+    // 24 bit: the same rows as BMPwriter, in the opposite order.
+    header_size = BMPHeader(header, 24, 5, 3);
+    mu_check(header_size == 54);
+    mu_check(BMPWritev(header, header_size, rgb, 24, 5, 3, "test-writev-rgb.bmp") == 0);
+    BMPwriter(rgb, 24, 5, 3, "test-writer-rgb.bmp");
+
+    fp = fopen("test-writev-rgb.bmp", "rb");
+    size = fread(top_down, 1, sizeof(top_down), fp);
+    fclose(fp);
+    mu_check(size == 54 + 16*3);
+    fp = fopen("test-writer-rgb.bmp", "rb");
+    size = fread(bottom_up, 1, sizeof(bottom_up), fp);
+    fclose(fp);
+    mu_check(size == 54 + 16*3);
+    remove("test-writev-rgb.bmp");
+    remove("test-writer-rgb.bmp");
+
+    mu_check(memcmp(top_down, bottom_up, 22) == 0);
+    for(y=0; y < 3; y++)
+        mu_check(memcmp(&top_down[54 + 16*y], &bottom_up[54 + 16*(2 - y)], 16) == 0);
+
+    mu_check(BMPWritev(header, header_size, rgb, 24, 5, 3, "no-such-directory/test.bmp") == -1);
+}
+
 MU_TEST(test_padded_grayscale) {
         int i, j;
         int imagePitch, paddedImagePitch;
@@ -262,15 +332,1068 @@ MU_TEST(test_GaussianBlur) {
     free(outputGrayscaleSeparable);
 }
 
+MU_TEST(test_yuyv2rgb24_simd) {
+    int i, width, level, maxLevel;
+    int height = 3;
+    unsigned char* pYUYV;
+    unsigned char* pRGBScalar;
+    unsigned char* pRGBSimd;
+
+    maxLevel = detectSIMDLevel();
+
+    // Widths around the 8 and 16 pixel vector blocks, so the scalar tail is exercised too.
+    for(width = 2; width <= 70; width += 2) {
+        pYUYV = (unsigned char*)malloc(2*width*height);
+        pRGBScalar = (unsigned char*)calloc(ALIGN_TO_FOUR(3*width)*height, 1);
+        pRGBSimd = (unsigned char*)calloc(ALIGN_TO_FOUR(3*width)*height, 1);
+
+        srand(width);
+        for(i=0; i < 2*width*height; i++) {
+            pYUYV[i] = rand() & 0xFF;
+        }
+
+        setSIMDLevel(SIMD_NONE);
+        YUYV2RGB24(pYUYV, width, height, pRGBScalar);
+
+        for(level = SIMD_SSE2; level <= maxLevel; level++) {
+            setSIMDLevel(level);
+            memset(pRGBSimd, 0, ALIGN_TO_FOUR(3*width)*height);
+            YUYV2RGB24(pYUYV, width, height, pRGBSimd);
+            mu_check(memcmp(pRGBScalar, pRGBSimd, ALIGN_TO_FOUR(3*width)*height) == 0);
+        }
+
+        free(pYUYV);
+        free(pRGBScalar);
+        free(pRGBSimd);
+    }
+
+    setSIMDLevel(maxLevel);
+}
+
+MU_TEST(test_yuyv2grayscale) {
+    int i, j, width, level, maxLevel;
+    int height = 3;
+    unsigned char* pYUYV;
+    unsigned char* pGrayscale;
+
+    maxLevel = detectSIMDLevel();
+
+    for(width = 2; width <= 70; width += 2) {
+        pYUYV = (unsigned char*)malloc(2*width*height);
+        pGrayscale = (unsigned char*)malloc(ALIGN_TO_FOUR(width)*height);
+
+        srand(width);
+        for(i=0; i < 2*width*height; i++) {
+            pYUYV[i] = rand() & 0xFF;
+        }
+
+        for(level = SIMD_NONE; level <= maxLevel; level++) {
+            setSIMDLevel(level);
+            memset(pGrayscale, 0, ALIGN_TO_FOUR(width)*height);
+            YUYV2Grayscale(pYUYV, width, height, pGrayscale);
+
+            for(j=0; j < height; j++) {
+                for(i=0; i < width; i++) {
+                    mu_check(pGrayscale[ALIGN_TO_FOUR(width)*j + i] == pYUYV[2*width*j + 2*i]);
+                }
+            }
+        }
+
+        free(pYUYV);
+        free(pGrayscale);
+    }
+
+    setSIMDLevel(maxLevel);
+}
+
+MU_TEST(test_rgb24_to_grayscale) {
+    int i, j, width, level, maxLevel, Y;
+    int height = 4;
+    unsigned char* pRGB;
+    unsigned char* pGrayscaleScalar;
+    unsigned char* pGrayscale;
+    unsigned char* pPixel;
+
+    maxLevel = detectSIMDLevel();
+
+    for(width = 1; width <= 70; width++) {
+        pRGB = (unsigned char*)malloc(ALIGN_TO_FOUR(3*width)*height);
+        pGrayscaleScalar = (unsigned char*)calloc(ALIGN_TO_FOUR(width)*height, 1);
+        pGrayscale = (unsigned char*)calloc(ALIGN_TO_FOUR(width)*height, 1);
+
+        srand(width);
+        for(i=0; i < ALIGN_TO_FOUR(3*width)*height; i++) {
+            pRGB[i] = rand() & 0xFF;
+        }
+
+        setSIMDLevel(SIMD_NONE);
+        RGB24toGrayscale(pRGB, width, height, pGrayscaleScalar);
+
+        // Within 1 of the double precision luminance it replaces.
+        for(j=0; j < height; j++) {
+            for(i=0; i < width; i++) {
+                pPixel = pRGB + ALIGN_TO_FOUR(3*width)*j + 3*i;
+                Y = 0.2126 * (double)pPixel[2]  + 0.7152 * (double)pPixel[1] + 0.722 * (double)pPixel[0];
+                if (Y > 255) Y = 255;
+                mu_check(abs(Y - pGrayscaleScalar[ALIGN_TO_FOUR(width)*j + i]) <= 1);
+            }
+        }
+
+        // The vector kernels and the row band variant match the scalar path exactly.
+        for(level = SIMD_SSE2; level <= maxLevel; level++) {
+            setSIMDLevel(level);
+            memset(pGrayscale, 0, ALIGN_TO_FOUR(width)*height);
+            RGB24toGrayscaleRows(pRGB, width, height, 0, 1, pGrayscale);
+            RGB24toGrayscaleRows(pRGB, width, height, 1, height, pGrayscale);
+            mu_check(memcmp(pGrayscaleScalar, pGrayscale, ALIGN_TO_FOUR(width)*height) == 0);
+        }
+
+        free(pRGB);
+        free(pGrayscaleScalar);
+        free(pGrayscale);
+    }
+
+    setSIMDLevel(maxLevel);
+}
+
+MU_TEST(test_convolve2dwith1dkernel_border) {
+    int i, j, k, p, width, height, kernelSize, level, maxLevel, border, dir;
+    double* pImage;
+    double* pPadded;
+    double* pExpected;
+    double* pResult;
+    double* kernel;
+    double result;
+
+    int sizes[5][3] = {
+        {4, 4, 3},      // Small image, small kernel
+        {37, 21, 11},   // Odd sizes, vector loops plus scalar tails
+        {5, 40, 13},    // Kernel wider than the image
+        {64, 3, 9},     // Kernel taller than the image
+        {301, 12, 5}    // More than one strip of columns in the vertical pass
+    };
+
+    maxLevel = detectSIMDLevel();
+
+    for(int s=0; s < 5; s++) {
+        width = sizes[s][0];
+        height = sizes[s][1];
+        kernelSize = sizes[s][2];
+
+        pImage = (double*)malloc(width*height*sizeof(double));
+        pExpected = (double*)malloc(width*height*sizeof(double));
+        pResult = (double*)malloc(width*height*sizeof(double));
+        pPadded = (double*)malloc((width + kernelSize)*(height + kernelSize)*sizeof(double));
+        kernel = (double*)malloc(kernelSize*sizeof(double));
+
+        srand(s);
+        for(i=0; i < width*height; i++) {
+            pImage[i] = (rand() & 0xFF) - 64.0;
+        }
+        for(k=0; k < kernelSize; k++) {
+            kernel[k] = ((rand() & 0xFF) - 128.0) / 128.0;
+        }
+
+        // A zero border gives exactly what convolving the zero padded image did.
+        for(dir=VERTICAL; dir <= HORIZONTAL; dir++) {
+            makeZeroPaddedImage(pImage, width, height, (kernelSize - 1)/2, pPadded, dir);
+            for(j=0; j < height; j++) {
+                for(i=0; i < width; i++) {
+                    result = 0.0;
+                    for(k=0; k < kernelSize; k++) {
+                        if (dir == VERTICAL)
+                            result = result + kernel[kernelSize - k - 1] * pPadded[(j + k)*width + i];
+                        else
+                            result = result + kernel[kernelSize - k - 1] * pPadded[j*(width + kernelSize - 1) + i + k];
+                    }
+                    pExpected[j*width + i] = result;
+                }
+            }
+
+            for(level = SIMD_NONE; level <= maxLevel; level++) {
+                setSIMDLevel(level);
+                convolve2Dwith1Dkernel(kernel, kernelSize, pImage, width, height, pResult, dir);
+                mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+            }
+        }
+
+        // Replicated and reflected borders against an explicit index remapping.
+        for(border=BORDER_REPLICATE; border <= BORDER_REFLECT; border++) {
+            for(dir=VERTICAL; dir <= HORIZONTAL; dir++) {
+                int n = (dir == VERTICAL) ? height : width;
+                for(j=0; j < height; j++) {
+                    for(i=0; i < width; i++) {
+                        result = 0.0;
+                        for(k=0; k < kernelSize; k++) {
+                            p = ((dir == VERTICAL) ? j : i) - (kernelSize - 1)/2 + k;
+                            if (border == BORDER_REPLICATE) {
+                                p = (p < 0) ? 0 : ((p >= n) ? n - 1 : p);
+                            } else {
+                                while (n > 1 && (p < 0 || p >= n))
+                                    p = (p < 0) ? -p : 2*(n - 1) - p;
+                                if (n == 1)
+                                    p = 0;
+                            }
+                            result = result + kernel[kernelSize - k - 1] * ((dir == VERTICAL) ? pImage[p*width + i] : pImage[j*width + p]);
+                        }
+                        pExpected[j*width + i] = result;
+                    }
+                }
+
+                for(level = SIMD_NONE; level <= maxLevel; level++) {
+                    setSIMDLevel(level);
+                    convolve2Dwith1DkernelBorder(kernel, kernelSize, pImage, width, height, pResult, dir, border);
+                    mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+                }
+            }
+        }
+
+        free(pImage);
+        free(pExpected);
+        free(pResult);
+        free(pPadded);
+        free(kernel);
+    }
+
+    setSIMDLevel(maxLevel);
+}
+
+MU_TEST(test_recursive_gaussian) {
+    int i, j, width = 96, height = 80;
+    double sigma, sum, expected, maxError;
+    double* pImage;
+    double* pResult;
+    double* pFIR;
+
+    pImage = (double*)malloc(width*height*sizeof(double));
+    pResult = (double*)malloc(width*height*sizeof(double));
+    pFIR = (double*)malloc(width*height*sizeof(double));
+
+    // A constant image stays constant: the replicated border has no fall-off.
+    for(i=0; i < width*height; i++)
+        pImage[i] = 100.0;
+    GaussianFilter(pImage, width, height, pResult, 3.0, 0, 0, GAUSSIAN_IIR);
+    for(i=0; i < width*height; i++)
+        mu_check(fabs(pResult[i] - 100.0) < 1e-9);
+
+    // The impulse response sums to one and follows the sampled Gaussian.
+    for(sigma=2.0; sigma <= 8.0; sigma *= 2) {
+        memset(pImage, 0, width*height*sizeof(double));
+        pImage[(height/2)*width + width/2] = 1.0;
+        recursiveGaussian1D(pImage, width, height, pResult, sigma, 0, HORIZONTAL);
+        sum = 0.0;
+        maxError = 0.0;
+        for(i=0; i < width; i++) {
+            sum += pResult[(height/2)*width + i];
+            expected = exp(-(i - width/2)*(i - width/2)/(2*sigma*sigma))/(sqrt(2*3.14159265358979323846)*sigma);
+            maxError = fmax(maxError, fabs(pResult[(height/2)*width + i] - expected));
+        }
+        mu_check(fabs(sum - 1.0) < 1e-3);
+        mu_check(maxError < 0.025/sigma);
+    }
+
+    // Derivatives of a ramp and a parabola, away from the borders.
+    for(j=0; j < height; j++)
+        for(i=0; i < width; i++)
+            pImage[j*width + i] = 2.0*i + 0.05*j*j;
+    GaussianFilter(pImage, width, height, pResult, 2.0, 1, 0, GAUSSIAN_IIR);
+    for(j=20; j < height - 20; j++)
+        for(i=20; i < width - 20; i++)
+            mu_check(fabs(pResult[j*width + i] - 2.0) < 1e-3);
+    GaussianFilter(pImage, width, height, pResult, 2.0, 0, 2, GAUSSIAN_IIR);
+    for(j=20; j < height - 20; j++)
+        for(i=20; i < width - 20; i++)
+            mu_check(fabs(pResult[j*width + i] - 0.1) < 1e-3);
+
+    // The global mode switches the Gaussian family; FIR stays the default.
+    mu_check(getGaussianMode() == GAUSSIAN_FIR);
+    GaussianDerivativeX(pImage, width, height, pFIR, 2.0);
+    GaussianFilter(pImage, width, height, pResult, 2.0, 1, 0, GAUSSIAN_FIR);
+    mu_check(memcmp(pFIR, pResult, width*height*sizeof(double)) == 0);
+    setGaussianMode(GAUSSIAN_IIR);
+    GaussianDerivativeX(pImage, width, height, pFIR, 2.0);
+    GaussianFilter(pImage, width, height, pResult, 2.0, 1, 0, GAUSSIAN_IIR);
+    mu_check(memcmp(pFIR, pResult, width*height*sizeof(double)) == 0);
+    setGaussianMode(GAUSSIAN_FIR);
+
+    free(pImage);
+    free(pResult);
+    free(pFIR);
+}
+
+MU_TEST(test_box_blur) {
+    int i, j, k, l, r, pitch, size, sum, mismatches;
+    int sizes[4][2] = {{4, 4}, {37, 21}, {5, 40}, {64, 3}};
+    int radii[5] = {0, 1, 2, 7, 50};
+    unsigned char* pImage;
+    unsigned char* pBlurredImage;
+
+    for(size=0; size < 4; size++) {
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+        pitch = ALIGN_TO_FOUR(width);
+
+        pImage = (unsigned char*)malloc(pitch*height);
+        pBlurredImage = (unsigned char*)malloc(pitch*height);
+        for(i=0; i < pitch*height; i++)
+            pImage[i] = (unsigned char)((i*97 + 13) % 256);
+
+        // Against the direct sum over the box, zero outside the image.
+        for(r=0; r < 5; r++) {
+            mu_check(BoxBlur(pImage, width, height, pBlurredImage, radii[r]) == 0);
+            mismatches = 0;
+            for(j=0; j < height; j++) {
+                for(i=0; i < width; i++) {
+                    sum = 0;
+                    for(k=j - radii[r]; k <= j + radii[r]; k++)
+                        for(l=i - radii[r]; l <= i + radii[r]; l++)
+                            if (k >= 0 && k < height && l >= 0 && l < width)
+                                sum += pImage[k*pitch + l];
+                    if (pBlurredImage[j*pitch + i] != sum / ((2*radii[r] + 1)*(2*radii[r] + 1)))
+                        mismatches++;
+                }
+            }
+            mu_check(mismatches == 0);
+        }
+
+        free(pImage);
+        free(pBlurredImage);
+    }
+
+    mu_check(BoxBlur(NULL, 4, 4, NULL, -1) == -1);
+}
+
+MU_TEST(test_gaussian_blur_integer) {
+    int i, size, s, mismatches, maxDifference;
+    int sizes[4][2] = {{4, 4}, {37, 21}, {5, 40}, {301, 12}};
+    double sigmas[5] = {0.5, 1.0, 2.0, 3.3, 6.0};
+    enum simd_level level, maxLevel = getSIMDLevel();
+    unsigned char* pImage;
+    unsigned char* pExpected;
+    unsigned char* pResult;
+    unsigned char* pReference;
+
+    for(size=0; size < 4; size++) {
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+        int pitch = ALIGN_TO_FOUR(width);
+
+        pImage = (unsigned char*)calloc(pitch*height, 1);
+        pExpected = (unsigned char*)calloc(pitch*height, 1);
+        pResult = (unsigned char*)calloc(pitch*height, 1);
+        pReference = (unsigned char*)calloc(pitch*height, 1);
+        for(i=0; i < pitch*height; i++)
+            pImage[i] = (unsigned char)((i*i*7 + i*31) % 256);
+
+        for(s=0; s < 5; s++) {
+            // Within one of the double pipeline, and the same at every SIMD level.
+            GaussianBlur(pImage, width, height, pExpected, sigmas[s]);
+            setSIMDLevel(SIMD_NONE);
+            mu_check(GaussianBlurInteger(pImage, width, height, pReference, sigmas[s]) == 0);
+            maxDifference = 0;
+            for(i=0; i < pitch*height; i++)
+                if (i % pitch < width && abs(pReference[i] - pExpected[i]) > maxDifference)
+                    maxDifference = abs(pReference[i] - pExpected[i]);
+            mu_check(maxDifference <= 1);
+
+            for(level = SIMD_SSE2; level <= maxLevel; level++) {
+                setSIMDLevel(level);
+                GaussianBlurInteger(pImage, width, height, pResult, sigmas[s]);
+                mismatches = 0;
+                for(i=0; i < pitch*height; i++)
+                    if (i % pitch < width && pResult[i] != pReference[i])
+                        mismatches++;
+                mu_check(mismatches == 0);
+            }
+            setSIMDLevel(maxLevel);
+        }
+
+        // The precision flag routes GaussianBlur through the integer path.
+        setBlurPrecision(BLUR_INTEGER);
+        GaussianBlur(pImage, width, height, pResult, 2.0);
+        GaussianBlurInteger(pImage, width, height, pReference, 2.0);
+        mu_check(memcmp(pResult, pReference, pitch*height) == 0);
+        setBlurPrecision(BLUR_DOUBLE);
+
+        free(pImage);
+        free(pExpected);
+        free(pResult);
+        free(pReference);
+    }
+
+    // Too small a sigma for the fixed point gain.
+    pImage = (unsigned char*)calloc(16, 1);
+    mu_check(GaussianBlurInteger(pImage, 4, 4, pImage, 0.1) == -1);
+    free(pImage);
+}
+
+MU_TEST(test_gaussian_derivative_bank) {
+    int i, d, mode, width = 53, height = 41;
+    int orders[4][2] = {{1, 0}, {0, 1}, {2, 0}, {0, 2}};
+    double maxError;
+    double* pImage;
+    double* pExpected;
+    double* planes[5];
+    derivative_bank bank;
+
+    pImage = (double*)malloc(width*height*sizeof(double));
+    pExpected = (double*)malloc(width*height*sizeof(double));
+    for(i=0; i < width*height; i++)
+        pImage[i] = (double)((i*i*7 + i*31) % 256);
+
+    for(mode=GAUSSIAN_FIR; mode <= GAUSSIAN_IIR; mode++) {
+        setGaussianMode(mode);
+
+        // Every plane of the full bank matches the single derivative filter.
+        for(d=0; d < 5; d++)
+            planes[d] = (double*)malloc(width*height*sizeof(double));
+        bank.DX = planes[0];
+        bank.DY = planes[1];
+        bank.DXX = planes[2];
+        bank.DYY = planes[3];
+        bank.DXY = planes[4];
+        mu_check(GaussianDerivativeBank(pImage, width, height, 1.5, DERIVATIVE_ALL, &bank) == 0);
+
+        for(d=0; d < 4; d++) {
+            GaussianFilter(pImage, width, height, pExpected, 1.5, orders[d][0], orders[d][1], mode);
+            maxError = 0.0;
+            for(i=0; i < width*height; i++)
+                maxError = fmax(maxError, fabs(planes[d][i] - pExpected[i]));
+            mu_check(maxError < 1e-9);
+        }
+
+        // DXY, which only smooths, matches GaussianDerivativeXY.
+        GaussianDerivativeXY(pImage, width, height, pExpected, 1.5);
+        mu_check(memcmp(planes[4], pExpected, width*height*sizeof(double)) == 0);
+
+        // A subset only needs, and only writes, its own planes.
+        memset(planes[1], 0, width*height*sizeof(double));
+        CLEAR(bank);
+        bank.DY = planes[1];
+        mu_check(GaussianDerivativeBank(pImage, width, height, 1.5, DERIVATIVE_Y, &bank) == 0);
+        GaussianFilter(pImage, width, height, pExpected, 1.5, 0, 1, mode);
+        maxError = 0.0;
+        for(i=0; i < width*height; i++)
+            maxError = fmax(maxError, fabs(planes[1][i] - pExpected[i]));
+        mu_check(maxError < 1e-9);
+        mu_check(GaussianDerivativeBank(pImage, width, height, 1.5, DERIVATIVE_X, &bank) == -1);
+
+        for(d=0; d < 5; d++)
+            free(planes[d]);
+    }
+
+    setGaussianMode(GAUSSIAN_FIR);
+    free(pImage);
+    free(pExpected);
+}
+
+MU_TEST(test_alloc_derivative_bank) {
+    int i, width = 40, height = 30;
+    double* pImage;
+    double* pExpected;
+    derivative_bank bank;
+
+    pImage = (double*)malloc(width*height*sizeof(double));
+    pExpected = (double*)malloc(width*height*sizeof(double));
+    for(i=0; i < width*height; i++)
+        pImage[i] = (double)((i*13) % 256);
+
+    // Only the planes a detector declares are allocated, and they are enough to compute it.
+    allocDerivativeBank(&bank, width, height, CANNY_DERIVATIVES);
+    mu_check(bank.DX != NULL && bank.DY != NULL);
+    mu_check(bank.DXX == NULL && bank.DYY == NULL && bank.DXY == NULL);
+    mu_check(GaussianDerivativeBank(pImage, width, height, 2.0, CANNY_DERIVATIVES, &bank) == 0);
+    GaussianDerivativeY(pImage, width, height, pExpected, 2.0);
+    mu_check(memcmp(bank.DY, pExpected, width*height*sizeof(double)) == 0);
+    freeDerivativeBank(&bank);
+    mu_check(bank.DX == NULL && bank.DY == NULL);
+
+    allocDerivativeBank(&bank, width, height, DIFFERENTIAL_DERIVATIVES);
+    mu_check(bank.DX && bank.DY && bank.DXX && bank.DYY && bank.DXY);
+    freeDerivativeBank(&bank);
+
+    free(pImage);
+    free(pExpected);
+}
+
+MU_TEST(test_non_maximum_suppression) {
+    int i, j, size, offset, mismatches;
+    int sizes[4][2] = {{3, 3}, {37, 21}, {5, 40}, {64, 17}};
+    double dir;
+    enum simd_level level, maxLevel = getSIMDLevel();
+    double* pDX;
+    double* pDY;
+    double* pMagnitude;
+    double* pExpected;
+    double* pResult;
+    unsigned char* pImage;
+    unsigned char* pEdges;
+
+    for(size=0; size < 4; size++) {
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+
+        pDX = (double*)malloc(width*height*sizeof(double));
+        pDY = (double*)malloc(width*height*sizeof(double));
+        pMagnitude = (double*)malloc(width*height*sizeof(double));
+        pExpected = (double*)malloc(width*height*sizeof(double));
+        pResult = (double*)malloc(width*height*sizeof(double));
+        for(i=0; i < width*height; i++) {
+            pDX[i] = (double)((i*37 + 11) % 23) - 11.0;
+            pDY[i] = (double)((i*53 + 5) % 19) - 9.0;
+            pMagnitude[i] = pDX[i]*pDX[i] + pDY[i]*pDY[i];
+        }
+
+        // Against sectors of the gradient angle, with the frame suppressed.
+        for(j=0; j < height; j++) {
+            for(i=0; i < width; i++) {
+                pExpected[j*width + i] = 0.0;
+                if (i == 0 || j == 0 || i == width - 1 || j == height - 1)
+                    continue;
+                dir = fmod(atan2(pDY[j*width + i], pDX[j*width + i]) + 3.14159265358979323846, 3.14159265358979323846) / 3.14159265358979323846 * 8;
+                if (dir <= 1 || dir > 7)
+                    offset = 1;
+                else if (dir > 3 && dir <= 5)
+                    offset = width;
+                else if (dir <= 3)
+                    offset = width + 1;
+                else
+                    offset = width - 1;
+                if (pMagnitude[j*width + i] > pMagnitude[j*width + i - offset] && pMagnitude[j*width + i] > pMagnitude[j*width + i + offset])
+                    pExpected[j*width + i] = pMagnitude[j*width + i];
+            }
+        }
+
+        for(level = SIMD_NONE; level <= maxLevel; level++) {
+            setSIMDLevel(level);
+            NonMaximumSuppression(pDX, pDY, pMagnitude, width, height, pResult);
+            mismatches = 0;
+            for(i=0; i < width*height; i++)
+                if (pResult[i] != pExpected[i])
+                    mismatches++;
+            mu_check(mismatches == 0);
+        }
+        setSIMDLevel(maxLevel);
+
+        free(pDX);
+        free(pDY);
+        free(pMagnitude);
+        free(pExpected);
+        free(pResult);
+    }
+
+    // A 45 degree step edge is found along its whole length.
+    pImage = (unsigned char*)malloc(64*64);
+    pEdges = (unsigned char*)malloc(64*64);
+    for(j=0; j < 64; j++)
+        for(i=0; i < 64; i++)
+            pImage[j*64 + i] = (i + j > 64) ? 200 : 50;
+    CannyEdgeDetector(pImage, 64, 64, pEdges, 2.0, 10.0, 5.0);
+    mismatches = 0;
+    for(j=16; j < 48; j++) {
+        int found = 0;
+        for(i=0; i < 64; i++)
+            if (pEdges[j*64 + i] && abs(i + j - 64) <= 1)
+                found = 1;
+        if (!found)
+            mismatches++;
+    }
+    mu_check(mismatches == 0);
+    free(pImage);
+    free(pEdges);
+}
+
+MU_TEST(test_hysteresis_threshold) {
+    int i, j, k, size, threads, pitch, nedges, mismatches;
+    int sizes[4][2] = {{3, 3}, {61, 47}, {7, 130}, {200, 64}};
+    double* pMagnitude;
+    double* pFilled;
+    double** hedges;
+    unsigned char* pExpected;
+    unsigned char* pResult;
+
+    for(size=0; size < 4; size++) {
+        int width = sizes[size][0];
+        int height = sizes[size][1];
+        pitch = ALIGN_TO_FOUR(width);
+
+        // Snaking weak ridges with a few strong pixels, inside a zero frame.
+        pMagnitude = (double*)calloc(width*height, sizeof(double));
+        pFilled = (double*)malloc(width*height*sizeof(double));
+        hedges = (double**)malloc(width*height*sizeof(double*));
+        pExpected = (unsigned char*)calloc(pitch*height, 1);
+        pResult = (unsigned char*)calloc(pitch*height, 1);
+        for(j=1; j < height - 1; j++)
+            for(i=1; i < width - 1; i++)
+                pMagnitude[j*width + i] = (double)(((i*7 + j*j*3 + (i*j) % 5) % 17));
+
+        // A reference flood fill through pointers, which the zero frame keeps in bounds.
+        memcpy(pFilled, pMagnitude, width*height*sizeof(double));
+        for(i=0; i < width*height; i++) {
+            if (pFilled[i] >= 15.0) {
+                hedges[0] = pFilled + i;
+                nedges = 1;
+                do {
+                    double* nbrs[8];
+                    nedges--;
+                    nbrs[0] = hedges[nedges] + width;
+                    nbrs[1] = hedges[nedges] - width;
+                    nbrs[2] = hedges[nedges] - 1;
+                    nbrs[3] = hedges[nedges] + 1;
+                    nbrs[4] = hedges[nedges] + width + 1;
+                    nbrs[5] = hedges[nedges] + width - 1;
+                    nbrs[6] = hedges[nedges] - width + 1;
+                    nbrs[7] = hedges[nedges] - width - 1;
+                    for(k=0; k < 8; k++) {
+                        if (nbrs[k] >= pFilled && nbrs[k] < pFilled + width*height && *(nbrs[k]) >= 9.0 && *(nbrs[k]) < 15.0) {
+                            *(nbrs[k]) = 15.0;
+                            hedges[nedges++] = nbrs[k];
+                        }
+                    }
+                } while(nedges > 0);
+            }
+        }
+        for(j=0; j < height; j++)
+            for(i=0; i < width; i++)
+                pExpected[j*pitch + i] = (pFilled[j*width + i] >= 15.0) ? 255 : 0;
+
+        HysteresisThreshold(pMagnitude, width, height, 15.0, 9.0, pResult);
+        mu_check(memcmp(pExpected, pResult, pitch*height) == 0);
+
+        for(threads=2; threads <= 8; threads++) {
+            memset(pResult, 0, pitch*height);
+            HysteresisThresholdParallel(pMagnitude, width, height, 15.0, 9.0, pResult, threads);
+            mismatches = 0;
+            for(i=0; i < pitch*height; i++)
+                if (pResult[i] != pExpected[i])
+                    mismatches++;
+            mu_check(mismatches == 0);
+        }
+
+        free(pMagnitude);
+        free(pFilled);
+        free(hedges);
+        free(pExpected);
+        free(pResult);
+    }
+}
+
+MU_TEST(test_corner_response) {
+    int i, j, measure, corners, width = 67, height = 45;
+    enum simd_level level, maxLevel = getSIMDLevel();
+    double sxx, syy, sxy, value;
+    double* pDX;
+    double* pDY;
+    double* pProducts[3];
+    double* pWindowed[3];
+    double* pExpected;
+    double* pResult;
+    unsigned char* pImage;
+    unsigned char* pCorners;
+
+    pDX = (double*)malloc(width*height*sizeof(double));
+    pDY = (double*)malloc(width*height*sizeof(double));
+    pExpected = (double*)malloc(width*height*sizeof(double));
+    pResult = (double*)malloc(width*height*sizeof(double));
+    for(i=0; i < 3; i++) {
+        pProducts[i] = (double*)malloc(width*height*sizeof(double));
+        pWindowed[i] = (double*)malloc(width*height*sizeof(double));
+    }
+    for(i=0; i < width*height; i++) {
+        pDX[i] = (double)((i*37 + 11) % 23) - 11.0;
+        pDY[i] = (double)((i*53 + 5) % 19) - 9.0;
+        pProducts[0][i] = pDX[i] * pDX[i];
+        pProducts[1][i] = pDY[i] * pDY[i];
+        pProducts[2][i] = pDX[i] * pDY[i];
+    }
+
+    // The fused sweep matches windowing each product plane separately.
+    for(i=0; i < 3; i++)
+        GaussianWindow(pProducts[i], width, height, pWindowed[i], 1.5);
+
+    for(measure=CORNER_HARRIS; measure <= CORNER_SHI_TOMASI; measure++) {
+        for(i=0; i < width*height; i++) {
+            sxx = pWindowed[0][i];
+            syy = pWindowed[1][i];
+            sxy = pWindowed[2][i];
+            if (measure == CORNER_SHI_TOMASI)
+                value = (sxx + syy) / 2 - sqrt(((sxx - syy) / 2) * ((sxx - syy) / 2) + sxy * sxy);
+            else
+                value = ((sxx * syy) - (sxy * sxy)) - 0.06 * (sxx + syy) * (sxx + syy);
+            pExpected[i] = (value > 5.0) ? value : 0.0;
+        }
+        for(level = SIMD_NONE; level <= maxLevel; level++) {
+            setSIMDLevel(level);
+            CornerResponse(pDX, pDY, width, height, 1.5, 0.06, 5.0, measure, pResult);
+            mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+        }
+    }
+    setSIMDLevel(maxLevel);
+
+    // Both measures find the four corners of a square, and nothing else.
+    pImage = (unsigned char*)calloc(64*64, 1);
+    pCorners = (unsigned char*)malloc(64*64);
+    for(j=20; j < 44; j++)
+        for(i=20; i < 44; i++)
+            pImage[j*64 + i] = 200;
+    for(measure=CORNER_HARRIS; measure <= CORNER_SHI_TOMASI; measure++) {
+        // The smaller eigenvalue scales as the gradient squared, not to the fourth.
+        CornerDetectorMeasure(pImage, 64, 64, pCorners, 1.0, 2.0, 0.06, (measure == CORNER_HARRIS) ? 1000.0 : 50.0, measure);
+        corners = 0;
+        for(j=0; j < 64; j++) {
+            for(i=0; i < 64; i++) {
+                if (pCorners[j*64 + i]) {
+                    corners++;
+                    mu_check(abs(i - ((i < 32) ? 20 : 43)) <= 2 && abs(j - ((j < 32) ? 20 : 43)) <= 2);
+                }
+            }
+        }
+        mu_check(corners == 4);
+    }
+
+    for(i=0; i < 3; i++) {
+        free(pProducts[i]);
+        free(pWindowed[i]);
+    }
+    free(pDX);
+    free(pDY);
+    free(pExpected);
+    free(pResult);
+    free(pImage);
+    free(pCorners);
+}
+
+MU_TEST(test_corner_keypoints) {
+    int i, j, n, m, count, all, kept, width = 150, height = 110;
+    int pitch = ALIGN_TO_FOUR(width);
+    double dx, dy;
+    unsigned char* pImage;
+    unsigned char* pCorners;
+    keypoint* pAll;
+    keypoint* pKeypoints;
+
+    // Squares of different contrast, so the corners have different responses.
+    pImage = (unsigned char*)calloc(pitch*height, 1);
+    pCorners = (unsigned char*)malloc(pitch*height);
+    for(n=0; n < 12; n++)
+        for(j=10 + (n / 4)*32; j < 30 + (n / 4)*32 + (n % 3); j++)
+            for(i=8 + (n % 4)*35; i < 24 + (n % 4)*35 + (n % 2)*4; i++)
+                pImage[j*pitch + i] = 60 + 15*n;
+
+    all = MAX_CORNER_KEYPOINTS(width, height);
+    pAll = (keypoint*)malloc(all * sizeof(keypoint));
+    pKeypoints = (keypoint*)malloc(all * sizeof(keypoint));
+
+    // Without a limit the keypoints are exactly the detector's corners, strongest first.
+    CornerDetector(pImage, width, height, pCorners, 1.0, 2.0, 0.06, 1000.0);
+    count = CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, all, 0.0, pAll);
+    mu_check(count >= 48);
+    for(j=0, n=0; j < height; j++)
+        for(i=0; i < width; i++)
+            n += (pCorners[j*pitch + i] == 255);
+    mu_check(n == count);
+    for(n=0; n < count; n++) {
+        mu_check(pCorners[pAll[n].y*pitch + pAll[n].x] == 255);
+        mu_check(pAll[n].response > 1000.0);
+        if (n > 0)
+            mu_check(pAll[n].response <= pAll[n - 1].response);
+    }
+
+    // The bounded heap keeps the strongest.
+    mu_check(CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, 10, 0.0, pKeypoints) == 10);
+    mu_check(memcmp(pKeypoints, pAll, 10 * sizeof(keypoint)) == 0);
+
+    // Minimum distance is a greedy pass down the full list.
+    for(n=0, kept=0; n < count; n++) {
+        for(m=0; m < kept; m++) {
+            dx = pAll[m].x - pAll[n].x;
+            dy = pAll[m].y - pAll[n].y;
+            if (dx*dx + dy*dy < 20.0*20.0)
+                break;
+        }
+        if (m == kept)
+            pAll[kept++] = pAll[n];
+    }
+    mu_check(kept < count);
+    mu_check(CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, all, 20.0, pKeypoints) == kept);
+    mu_check(memcmp(pKeypoints, pAll, kept * sizeof(keypoint)) == 0);
+    mu_check(CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, 5, 20.0, pKeypoints) == 5);
+    mu_check(memcmp(pKeypoints, pAll, 5 * sizeof(keypoint)) == 0);
+
+    mu_check(CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, 0, 0.0, pKeypoints) == -1);
+
+    free(pImage);
+    free(pCorners);
+    free(pAll);
+    free(pKeypoints);
+}
+
+MU_TEST(test_parallel_rows) {
+    int i, j, t, k, dir, border, width = 86, height = 205;
+    int pitch = ALIGN_TO_FOUR(width), pitchRGB = ALIGN_TO_FOUR(3*width);
+    int threads[4] = {2, 3, 5, 16};
+    int kernelSizes[3] = {3, 21, 141};
+    int defaultThreads = getThreadCount();
+    double* kernel;
+    double* pPlane;
+    double* pDX;
+    double* pExpected;
+    double* pResult;
+    unsigned char* pYUYV;
+    unsigned char* pRGB;
+    unsigned char* pExpectedBytes;
+    unsigned char* pResultBytes;
+
+    pYUYV = (unsigned char*)malloc(2*width*height);
+    pPlane = (double*)malloc(width*height*sizeof(double));
+    pDX = (double*)malloc(width*height*sizeof(double));
+    pExpected = (double*)malloc(width*height*sizeof(double));
+    pResult = (double*)malloc(width*height*sizeof(double));
+    pRGB = (unsigned char*)malloc(pitchRGB*height);
+    pExpectedBytes = (unsigned char*)malloc(4*pitch*height);
+    pResultBytes = (unsigned char*)malloc(4*pitch*height);
+    kernel = (double*)malloc(141*sizeof(double));
+    for(i=0; i < 2*width*height; i++)
+        pYUYV[i] = (unsigned char)((i*131 + 7) % 251);
+    for(i=0; i < width*height; i++) {
+        pPlane[i] = (double)((i*37 + 11) % 301) - 20.0;
+        pDX[i] = (double)((i*53 + 5) % 19) - 9.0;
+    }
+
+    // Every band, down to a single row, is exactly that part of the whole
+    // image result, halo rows and borders included.
+    setThreadCount(1);
+    for(k=0; k < 3; k++) {
+        getGaussianKernel1D(kernel, kernelSizes[k] / 6.0, kernelSizes[k]);
+        for(dir=VERTICAL; dir <= HORIZONTAL; dir++) {
+            for(border=BORDER_ZERO; border <= BORDER_REFLECT; border++) {
+                convolve2Dwith1DkernelBorder(kernel, kernelSizes[k], pPlane, width, height, pExpected, dir, border);
+                for(j=0; j < height; j++)
+                    convolve2Dwith1DkernelBorderRows(kernel, kernelSizes[k], pPlane, width, height, j, j + 1, pResult, dir, border);
+                mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+
+                for(t=0; t < 4; t++) {
+                    setThreadCount(threads[t]);
+                    convolve2Dwith1DkernelBorder(kernel, kernelSizes[k], pPlane, width, height, pResult, dir, border);
+                    mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+                }
+                setThreadCount(1);
+            }
+        }
+    }
+
+    NonMaximumSuppression(pDX, pPlane, pPlane, width, height, pExpected);
+    for(j=0; j < height; j++)
+        NonMaximumSuppressionRows(pDX, pPlane, pPlane, width, height, j, j + 1, pResult);
+    mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+    for(t=0; t < 4; t++) {
+        setThreadCount(threads[t]);
+        NonMaximumSuppression(pDX, pPlane, pPlane, width, height, pResult);
+        mu_check(memcmp(pExpected, pResult, width*height*sizeof(double)) == 0);
+    }
+
+    // The whole image conversions match at any thread count.
+    setThreadCount(1);
+    YUYV2RGB24(pYUYV, width, height, pExpectedBytes);
+    for(t=0; t < 4; t++) {
+        setThreadCount(threads[t]);
+        YUYV2RGB24(pYUYV, width, height, pResultBytes);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpectedBytes + j*pitchRGB, pResultBytes + j*pitchRGB, 3*width) == 0);
+    }
+
+    // The grayscale conversions, from the RGB24 image just made.
+    memcpy(pRGB, pExpectedBytes, pitchRGB*height);
+    setThreadCount(1);
+    RGB24toGrayscale(pRGB, width, height, pExpectedBytes);
+    YUYV2Grayscale(pYUYV, width, height, pExpectedBytes + pitch*height);
+    convertDoubleToUcharGrayscale(pPlane, width, height, pExpectedBytes + 2*pitch*height);
+    for(t=0; t < 4; t++) {
+        setThreadCount(threads[t]);
+        RGB24toGrayscale(pRGB, width, height, pResultBytes);
+        YUYV2Grayscale(pYUYV, width, height, pResultBytes + pitch*height);
+        convertDoubleToUcharGrayscale(pPlane, width, height, pResultBytes + 2*pitch*height);
+        for(j=0; j < 3*height; j++)
+            mu_check(memcmp(pExpectedBytes + j*pitch, pResultBytes + j*pitch, width) == 0);
+    }
+
+    // The environment variable sets the default thread count.
+    setenv(THREAD_COUNT_ENV, "3", 1);
+    mu_check(setThreadCount(0) == 3);
+    mu_check(getThreadCount() == 3);
+    unsetenv(THREAD_COUNT_ENV);
+    setThreadCount(defaultThreads);
+
+    free(pYUYV);
+    free(pRGB);
+    free(pPlane);
+    free(pDX);
+    free(pExpected);
+    free(pResult);
+    free(pExpectedBytes);
+    free(pResultBytes);
+    free(kernel);
+}
+
+MU_TEST(test_workspace) {
+    int i, j, n, width = 90, height = 70;
+    int defaultThreads = getThreadCount();
+    long calls, allocations, growths;
+    int pitch = ALIGN_TO_FOUR(width);
+    unsigned char* pImage;
+    unsigned char* pExpected;
+    unsigned char* pOutput;
+    keypoint* pExpectedKeypoints;
+    keypoint* pKeypoints;
+    void* first;
+    void* second;
+    workspace_mark mark;
+    ip_workspace ws;
+
+    // Allocations are aligned, and a release hands the same memory back.
+    initWorkspace(&ws, 0, 0);
+    mark = workspaceMark(&ws);
+    first = workspaceAlloc(&ws, 10);
+    second = workspaceAlloc(&ws, 3 * WORKSPACE_MIN_BLOCK);
+    mu_check(((size_t)first % WORKSPACE_ALIGNMENT) == 0 && ((size_t)second % WORKSPACE_ALIGNMENT) == 0);
+    mu_check(ws.growths == 2);
+    workspaceRelease(&ws, mark);
+    mu_check(workspaceAlloc(&ws, 10) == first);
+    mu_check(workspaceAlloc(&ws, 3 * WORKSPACE_MIN_BLOCK) == second);
+    mu_check(ws.growths == 2);
+    freeWorkspace(&ws);
+
+    pImage = (unsigned char*)calloc(pitch*height, 1);
+    pExpected = (unsigned char*)malloc(pitch*height);
+    pOutput = (unsigned char*)malloc(pitch*height);
+    pExpectedKeypoints = (keypoint*)malloc(MAX_CORNER_KEYPOINTS(width, height) * sizeof(keypoint));
+    pKeypoints = (keypoint*)malloc(MAX_CORNER_KEYPOINTS(width, height) * sizeof(keypoint));
+    for(j=15; j < 50; j++)
+        for(i=20; i < 65; i++)
+            pImage[j*pitch + i] = 40 + (i*7 + j*3) % 160;
+
+    // The workspace holds what the kernels that run need: the uniform blur
+    // takes a single plane, which the first block already is.
+    initWorkspace(&ws, width, height);
+    for(n=0; n < 2; n++)
+        UniformBlur_ws(pImage, width, height, pOutput, &ws);
+    mu_check(ws.growths == 0);
+    mu_check(ws.first->next == NULL && ws.first->size < 2 * width * height * sizeof(double) + WORKSPACE_MIN_BLOCK);
+    freeWorkspace(&ws);
+
+    // A workspace for the resolution grows while the kernels first run and
+    // then no more, and the results are those of the allocating versions.
+    initWorkspace(&ws, width, height);
+    for(n=0; n < 2; n++) {
+        growths = ws.growths;
+        GaussianBlur(pImage, width, height, pExpected, 1.5);
+        GaussianBlur_ws(pImage, width, height, pOutput, 1.5, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        GaussianBlur2DKernel(pImage, width, height, pExpected, 1.0);
+        GaussianBlur2DKernel_ws(pImage, width, height, pOutput, 1.0, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        UniformBlur(pImage, width, height, pExpected);
+        UniformBlur_ws(pImage, width, height, pOutput, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        DifferentialEdgeDetector(pImage, width, height, pExpected, 2.0, 10.0, 5.0);
+        DifferentialEdgeDetector_ws(pImage, width, height, pOutput, 2.0, 10.0, 5.0, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        CannyEdgeDetector(pImage, width, height, pExpected, 2.0, 10.0, 5.0);
+        CannyEdgeDetector_ws(pImage, width, height, pOutput, 2.0, 10.0, 5.0, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        CornerDetector(pImage, width, height, pExpected, 2.0, 2.0, 0.06, 1000.0);
+        CornerDetector_ws(pImage, width, height, pOutput, 2.0, 2.0, 0.06, 1000.0, &ws);
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        i = CornerKeypoints(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, 20, 6.0, pExpectedKeypoints);
+        mu_check(i > 0);
+        mu_check(CornerKeypoints_ws(pImage, width, height, 1.0, 2.0, 0.06, 1000.0, CORNER_HARRIS, 20, 6.0, pKeypoints, &ws) == i);
+        mu_check(memcmp(pExpectedKeypoints, pKeypoints, i * sizeof(keypoint)) == 0);
+
+        mu_check(n == 0 || ws.growths == growths);
+    }
+
+    // Kernels longer than STACK_TAPS take their tap rows from the workspace
+    // too, in every band: once warm, the workspace kernels allocate nothing.
+    setThreadCount(4);
+    for(n=0; n < 2; n++) {
+        growths = ws.growths;
+        GaussianBlur(pImage, width, height, pExpected, 11.0);
+        calls = mallocCalls;
+        GaussianBlur_ws(pImage, width, height, pOutput, 11.0, &ws);
+        allocations = mallocCalls - calls;
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        GaussianBlurInteger(pImage, width, height, pExpected, 11.0);
+        calls = mallocCalls;
+        mu_check(GaussianBlurInteger_ws(pImage, width, height, pOutput, 11.0, &ws) == 0);
+        allocations += mallocCalls - calls;
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        CannyEdgeDetector(pImage, width, height, pExpected, 7.0, 10.0, 5.0);
+        calls = mallocCalls;
+        CannyEdgeDetector_ws(pImage, width, height, pOutput, 7.0, 10.0, 5.0, &ws);
+        allocations += mallocCalls - calls;
+        for(j=0; j < height; j++)
+            mu_check(memcmp(pExpected + j*pitch, pOutput + j*pitch, width) == 0);
+
+        i = CornerKeypoints(pImage, width, height, 7.0, 11.0, 0.06, 1000.0, CORNER_HARRIS, 20, 6.0, pExpectedKeypoints);
+        calls = mallocCalls;
+        mu_check(CornerKeypoints_ws(pImage, width, height, 7.0, 11.0, 0.06, 1000.0, CORNER_HARRIS, 20, 6.0, pKeypoints, &ws) == i);
+        allocations += mallocCalls - calls;
+        mu_check(memcmp(pExpectedKeypoints, pKeypoints, i * sizeof(keypoint)) == 0);
+
+        mu_check(n == 0 || ws.growths == growths);
+        mu_check(n == 0 || allocations == 0);
+    }
+    setThreadCount(defaultThreads);
+    freeWorkspace(&ws);
+
+    free(pImage);
+    free(pExpected);
+    free(pOutput);
+    free(pExpectedKeypoints);
+    free(pKeypoints);
+}
+
 MU_TEST_SUITE(test_suite) {
     MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
     MU_RUN_TEST(test_grayscale_writer);
+    MU_RUN_TEST(test_bmp_writev);
     MU_RUN_TEST(test_padded_grayscale);
     MU_RUN_TEST(test_uniform_blur);
+    MU_RUN_TEST(test_box_blur);
     MU_RUN_TEST(test_convolve2dwith1dkernel);
     MU_RUN_TEST(test_getGaussianKernel1d);
     MU_RUN_TEST(test_GaussianBlur);
+    MU_RUN_TEST(test_gaussian_blur_integer);
+    MU_RUN_TEST(test_yuyv2rgb24_simd);
+    MU_RUN_TEST(test_yuyv2grayscale);
+    MU_RUN_TEST(test_rgb24_to_grayscale);
+    MU_RUN_TEST(test_convolve2dwith1dkernel_border);
+    MU_RUN_TEST(test_recursive_gaussian);
+    MU_RUN_TEST(test_gaussian_derivative_bank);
+    MU_RUN_TEST(test_alloc_derivative_bank);
+    MU_RUN_TEST(test_non_maximum_suppression);
+    MU_RUN_TEST(test_hysteresis_threshold);
+    MU_RUN_TEST(test_corner_response);
+    MU_RUN_TEST(test_corner_keypoints);
+    MU_RUN_TEST(test_parallel_rows);
+    MU_RUN_TEST(test_workspace);
 }
 
 int main(int argc, char *argv[]) {
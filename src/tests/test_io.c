@@ -0,0 +1,195 @@
+#include "minunit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "asyncwriter.h"
+#include "recording.h"
+
+
+void test_setup(void) {
+    /* Nothing */
+}
+
+void test_teardown(void) {
+    /* Nothing */
+}
+
+
+#define WRITER_FILES (24)
+
+typedef struct written_files_ {
+    int done;
+    int failed;
+    int last_result;
+} written_files;
+
+static void count_written(void* context, int result)
+{
+    written_files* files = (written_files*)context;
+
+    files->done++;
+    if (result < 0) {
+        files->failed++;
+        files->last_result = result;
+    }
+}
+
+// Writes WRITER_FILES files through a writer with the given budget and checks them.
+static void check_writer(enum writer_backend backend, size_t budget)
+{
+    async_writer writer;
+    written_files files;
+    unsigned char header[8];
+    unsigned char data[WRITER_FILES][100];
+    unsigned char read_back[200];
+    char path[64];
+    FILE *fp;
+    long size;
+    int i, j;
+
+    memset(&files, 0, sizeof(files));
+    mu_check(writer_init(&writer, backend, budget) == 0);
+    mu_check(writer.backend != WRITER_AUTO);
+
+    for(i=0; i < 8; i++)
+        header[i] = (unsigned char)(0xa0 + i);
+    for(i=0; i < WRITER_FILES; i++) {
+        for(j=0; j < 100; j++)
+            data[i][j] = (unsigned char)(i*7 + j);
+        sprintf(path, "test-writer-%d.bin", i);
+        mu_check(writer_submit(&writer, path, header, 8, data[i], 100 - i, count_written, &files) == 0);
+        if (i % 8 == 7)
+            mu_check(writer_poll(&writer) >= 0);
+    }
+    mu_check(writer.inFlight <= ((budget > 108) ? budget : 108));
+    mu_check(writer_submit(&writer, "no-such-directory/test.bin", header, 8, data[0], 100, count_written, &files) == 0);
+    writer_flush(&writer);
+
+    mu_check(files.done == WRITER_FILES + 1);
+    mu_check(files.failed == 1);
+    mu_check(files.last_result == -ENOENT);
+    mu_check(writer.written == WRITER_FILES);
+    mu_check(writer.inFlight == 0);
+
+    for(i=0; i < WRITER_FILES; i++) {
+        sprintf(path, "test-writer-%d.bin", i);
+        fp = fopen(path, "rb");
+        mu_check(fp != NULL);
+        size = fread(read_back, 1, sizeof(read_back), fp);
+        fclose(fp);
+        remove(path);
+        mu_check(size == 8 + 100 - i);
+        mu_check(memcmp(read_back, header, 8) == 0);
+        mu_check(memcmp(read_back + 8, data[i], 100 - i) == 0);
+    }
+
+    writer_destroy(&writer);
+}
+
+MU_TEST(test_async_writer) {
+    async_writer writer;
+    int uring, fd;
+
+    // io_uring where the kernel has it, and the thread fallback always.
+    fd = open("/dev/null", O_RDONLY);
+    close(fd);
+    uring = (writer_init(&writer, WRITER_IO_URING, 1024) == 0);
+    if (uring) {
+        writer_destroy(&writer);
+        // Probing the ring leaves no descriptor behind.
+        mu_check(open("/dev/null", O_RDONLY) == fd);
+        close(fd);
+        check_writer(WRITER_IO_URING, 1 << 20);
+        check_writer(WRITER_IO_URING, 150);
+    }
+    check_writer(WRITER_THREADS_ONLY, 1 << 20);
+    check_writer(WRITER_THREADS_ONLY, 150);
+    check_writer(WRITER_AUTO, 1 << 20);
+}
+
+MU_TEST(test_recording) {
+    recording_writer writer;
+    recording_reader reader;
+    recording_frame frame;
+    const recording_frame* read_frame;
+    const unsigned char* data;
+    unsigned char* planes[6];
+    size_t sizes[6] = {100, 2*64*64, 96*1024, 5000, 160*120*2, 64*1024 + 3};
+    long order[6] = {3, 0, 5, 1, 4, 2};
+    int i, k;
+
+    // Small and large planes, the large ones aligned or not for O_DIRECT.
+    for(i=0; i < 6; i++) {
+        mu_check(posix_memalign((void**)&planes[i], RECORDING_ALIGNMENT, sizes[i]) == 0);
+        for(k=0; k < (int)sizes[i]; k++)
+            planes[i][k] = (unsigned char)(i*31 + k*7);
+    }
+
+    for(k=0; k < 2; k++) {
+        mu_check(recording_create(&writer, "test-recording.rec", 1) == 0);
+        for(i=0; i < 6; i++) {
+            memset(&frame, 0, sizeof(frame));
+            frame.stream = i % 3;
+            frame.format = (i % 2) ? RECORDING_GRAY : RECORDING_YUYV;
+            frame.width = (unsigned int)sizes[i];
+            frame.height = 1;
+            frame.stride = (unsigned int)sizes[i];
+            frame.sequence = 100 + i;
+            frame.timestampSec = 1000 + i;
+            frame.timestampUsec = 10*i;
+            frame.size = sizes[i];
+            mu_check(recording_append(&writer, &frame, planes[i]) == 0);
+        }
+        // Only the 96k plane is aligned in both address and size.
+        mu_check(writer.directFd == -1 || writer.directFrames == 1);
+
+        // The second time round the index is never written, as after a crash.
+        if (k == 0) {
+            mu_check(recording_finish(&writer) == 0);
+        } else {
+            close(writer.fd);
+            if (writer.directFd != -1)
+                close(writer.directFd);
+            free(writer.headerBlock);
+            free(writer.index);
+        }
+
+        mu_check(recording_open(&reader, "test-recording.rec") == 0);
+        mu_check(reader.frames == 6);
+        mu_check((k == 0) == (reader.scanned == NULL));
+        for(i=0; i < 6; i++) {
+            mu_check(recording_read(&reader, order[i], &read_frame, &data) == 0);
+            mu_check(read_frame->sequence == 100 + order[i]);
+            mu_check(read_frame->stream == order[i] % 3);
+            mu_check(read_frame->timestampSec == 1000 + order[i]);
+            mu_check(read_frame->size == sizes[order[i]]);
+            mu_check(memcmp(data, planes[order[i]], sizes[order[i]]) == 0);
+            if (sizes[order[i]] >= RECORDING_DIRECT_MIN)
+                mu_check(((data - reader.map) % RECORDING_ALIGNMENT) == 0);
+        }
+        mu_check(recording_read(&reader, 6, &read_frame, &data) == -1);
+        recording_close(&reader);
+    }
+    remove("test-recording.rec");
+
+    for(i=0; i < 6; i++)
+        free(planes[i]);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+    MU_RUN_TEST(test_async_writer);
+    MU_RUN_TEST(test_recording);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return 0;
+}
@@ -0,0 +1,332 @@
+#include "minunit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+#include "taskgraph.h"
+#include "pipeline.h"
+
+
+void test_setup(void) {
+    /* Nothing */
+}
+
+void test_teardown(void) {
+    /* Nothing */
+}
+
+
+typedef struct graph_log_ {
+    pthread_mutex_t lock;
+    int order[8];
+    int count;
+} graph_log;
+
+static graph_log taskLog;
+
+static void logTask(void* context)
+{
+    struct timespec pause = {0, 2000000};
+
+    nanosleep(&pause, NULL);
+    pthread_mutex_lock(&taskLog.lock);
+    taskLog.order[taskLog.count++] = (int)(long)context;
+    pthread_mutex_unlock(&taskLog.lock);
+}
+
+MU_TEST(test_task_graph) {
+    int i, t, a, b, c, d, position[5];
+    int threads[2] = {1, 4};
+    int defaultThreads = getThreadCount();
+    task_graph graph;
+
+    pthread_mutex_init(&taskLog.lock, NULL);
+
+    for(t=0; t < 2; t++) {
+        setThreadCount(threads[t]);
+        taskLog.count = 0;
+
+        // A diamond, a -> (b, c) -> d, and a task on its own.
+        initTaskGraph(&graph);
+        a = addTask(&graph, "a", logTask, (void*)0, 0);
+        b = addTask(&graph, "b", logTask, (void*)1, 1, a);
+        c = addTask(&graph, "c", logTask, (void*)2, 1, a);
+        d = addTask(&graph, "d", logTask, (void*)3, 2, b, c);
+        mu_check(addTask(&graph, "e", logTask, (void*)4, 0) == 4);
+        mu_check(d == 3);
+
+        // Only earlier tasks can be dependencies.
+        mu_check(addTask(&graph, "f", logTask, (void*)5, 1, 5) == -1);
+        mu_check(addTask(&graph, "f", logTask, (void*)5, 1, -1) == -1);
+        mu_check(graph.count == 5);
+
+        runTaskGraph(&graph);
+
+        mu_check(taskLog.count == 5);
+        for(i=0; i < 5; i++)
+            position[taskLog.order[i]] = i;
+        mu_check(position[a] < position[b] && position[a] < position[c]);
+        mu_check(position[d] > position[b] && position[d] > position[c]);
+        for(i=0; i < 5; i++)
+            mu_check(graph.tasks[i].end >= graph.tasks[i].start);
+        mu_check(graph.tasks[d].start >= graph.tasks[b].end && graph.tasks[d].start >= graph.tasks[c].end);
+
+        // The critical path is a -> b or c -> d: three of the five tasks.
+        mu_check(graph.criticalPath >= 6.0);
+        mu_check(graph.criticalPath <= graph.wallTime);
+        mu_check(graph.criticalPath == graph.tasks[d].pathTime);
+    }
+
+    initTaskGraph(&graph);
+    for(i=0; i < TASK_GRAPH_MAX_TASKS; i++)
+        addTask(&graph, "t", logTask, NULL, 0);
+    mu_check(addTask(&graph, "full", logTask, NULL, 0) == -1);
+
+    pthread_mutex_destroy(&taskLog.lock);
+    setThreadCount(defaultThreads);
+}
+
+#define QUEUE_THREADS      (4)
+#define QUEUE_ITEMS        (20000)
+
+typedef struct queue_traffic_ {
+    frame_queue queue;
+    long popped;
+    long sum;
+} queue_traffic;
+
+static void* queueProducer(void* arg)
+{
+    queue_traffic* traffic = (queue_traffic*)arg;
+    long i;
+
+    for(i=1; i <= QUEUE_ITEMS; i++)
+        queue_push_wait(&traffic->queue, (void*)i);
+
+    return NULL;
+}
+
+static void* queueConsumer(void* arg)
+{
+    queue_traffic* traffic = (queue_traffic*)arg;
+    long i, sum = 0;
+
+    // As many pops as one producer pushes, so together they take everything.
+    for(i=0; i < QUEUE_ITEMS; i++)
+        sum += (long)queue_pop_wait(&traffic->queue);
+    __atomic_add_fetch(&traffic->popped, QUEUE_ITEMS, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&traffic->sum, sum, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+MU_TEST(test_frame_queue) {
+    long i;
+    pthread_t producers[QUEUE_THREADS], consumers[QUEUE_THREADS];
+    queue_traffic traffic;
+
+    // The capacity rounds up to a power of two, and the queue is first in, first out.
+    mu_check(queue_init(&traffic.queue, 5) == 0);
+    mu_check(queue_pop(&traffic.queue) == NULL);
+    for(i=1; i <= 8; i++)
+        mu_check(queue_push(&traffic.queue, (void*)i) == 0);
+    mu_check(queue_push(&traffic.queue, (void*)9) == -1);
+    for(i=1; i <= 4; i++)
+        mu_check((long)queue_pop(&traffic.queue) == i);
+    for(i=9; i <= 12; i++)
+        mu_check(queue_push(&traffic.queue, (void*)i) == 0);
+    for(i=5; i <= 12; i++)
+        mu_check((long)queue_pop(&traffic.queue) == i);
+    mu_check(queue_pop(&traffic.queue) == NULL);
+    queue_destroy(&traffic.queue);
+
+    // Every item pushed by several threads at once is popped exactly once.
+    queue_init(&traffic.queue, 16);
+    traffic.popped = 0;
+    traffic.sum = 0;
+    for(i=0; i < QUEUE_THREADS; i++) {
+        pthread_create(&consumers[i], NULL, queueConsumer, &traffic);
+        pthread_create(&producers[i], NULL, queueProducer, &traffic);
+    }
+    for(i=0; i < QUEUE_THREADS; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    mu_check(traffic.popped == (long)QUEUE_THREADS*QUEUE_ITEMS);
+    mu_check(traffic.sum == (long)QUEUE_THREADS*QUEUE_ITEMS*(QUEUE_ITEMS + 1)/2);
+    mu_check(queue_pop(&traffic.queue) == NULL);
+    queue_destroy(&traffic.queue);
+}
+
+/*
+*  A source of numbered frames for the pipeline, as fast as it can make them,
+*  with a worker that takes a while over each one.
+*/
+typedef struct numbered_source_ {
+    long frames;
+    long captured;
+    long copied;
+    long discarded;
+    long allocated;
+    long written;
+    long lastSequence;
+    long lastValue;
+    int inOrder;
+    long processNanoseconds;
+    int holdFirst;              /* Process frame 0 only once every frame is captured, */
+    int firstHeld;              /* and capture the rest only once it is being processed. */
+} numbered_source;
+
+static void* allocNumberedFrame(void* context)
+{
+    ((numbered_source*)context)->allocated++;
+
+    return calloc(1, sizeof(long));
+}
+
+static void freeNumberedFrame(void* context, void* frame)
+{
+    ((numbered_source*)context)->allocated--;
+    free(frame);
+}
+
+static int nextNumberedFrame(void* context)
+{
+    numbered_source* source = (numbered_source*)context;
+
+    if (source->captured == source->frames)
+        return 0;
+    while (source->captured == 1 && source->holdFirst && !__atomic_load_n(&source->firstHeld, __ATOMIC_ACQUIRE))
+        sched_yield();
+    __atomic_store_n(&source->captured, source->captured + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void copyNumberedFrame(void* context, void* frame)
+{
+    numbered_source* source = (numbered_source*)context;
+
+    *(long*)frame = source->captured - 1;
+    source->copied++;
+}
+
+static void discardNumberedFrame(void* context)
+{
+    ((numbered_source*)context)->discarded++;
+}
+
+static void processNumberedFrame(void* context, void* frame, long sequence)
+{
+    numbered_source* source = (numbered_source*)context;
+    struct timespec pause = {0, source->processNanoseconds};
+
+    if (sequence == 0)
+        __atomic_store_n(&source->firstHeld, 1, __ATOMIC_RELEASE);
+    while (sequence == 0 && source->holdFirst && __atomic_load_n(&source->captured, __ATOMIC_ACQUIRE) < source->frames)
+        nanosleep(&pause, NULL);
+    nanosleep(&pause, NULL);
+    *(long*)frame *= 2;
+}
+
+static void writeNumberedFrame(void* context, void* frame, long sequence)
+{
+    numbered_source* source = (numbered_source*)context;
+
+    if (sequence <= source->lastSequence || *(long*)frame <= source->lastValue || *(long*)frame % 2 != 0)
+        source->inOrder = 0;
+    source->lastSequence = sequence;
+    source->lastValue = *(long*)frame;
+    source->written++;
+}
+
+MU_TEST(test_pipeline) {
+    int p;
+    enum backpressure_policy policies[3] = {BACKPRESSURE_BLOCK, BACKPRESSURE_DROP_OLDEST, BACKPRESSURE_DROP_NEWEST};
+    numbered_source source;
+    pipeline_config config;
+    pipeline_stages stages;
+    pipeline_stats stats;
+
+    stages.context = &source;
+    stages.alloc_frame = allocNumberedFrame;
+    stages.free_frame = freeNumberedFrame;
+    stages.next = nextNumberedFrame;
+    stages.copy = copyNumberedFrame;
+    stages.discard = discardNumberedFrame;
+    stages.process = processNumberedFrame;
+    stages.write = writeNumberedFrame;
+
+    config.workers = 3;
+    config.depth = 2;
+    for(p=0; p < 3; p++) {
+        memset(&source, 0, sizeof(numbered_source));
+        source.frames = 300;
+        source.lastSequence = -1;
+        source.lastValue = -1;
+        source.inOrder = 1;
+        source.processNanoseconds = 200000;
+        config.policy = policies[p];
+
+        mu_check(run_pipeline(&config, &stages, &stats) == 0);
+
+        // Whatever is dropped, everything else is written, once and in order.
+        mu_check(stats.captured == 300);
+        mu_check(stats.captured == stats.written + stats.dropped);
+        mu_check(source.written == stats.written);
+        mu_check(source.copied + source.discarded == stats.captured);
+        mu_check(source.inOrder);
+        mu_check(source.allocated == 0);
+
+        if (policies[p] == BACKPRESSURE_BLOCK) {
+            mu_check(stats.dropped == 0);
+            mu_check(source.lastValue == 2*299);
+        } else {
+            mu_check(stats.dropped > 0);
+        }
+        if (policies[p] == BACKPRESSURE_DROP_NEWEST)
+            mu_check(source.discarded == stats.dropped);
+    }
+
+    // Frame 0 holds the reordering window while capture runs far ahead. Once
+    // the window is full, the frames already waiting stay queued and are
+    // written, and only the new ones are dropped.
+    memset(&source, 0, sizeof(numbered_source));
+    source.frames = 2000;
+    source.lastSequence = -1;
+    source.lastValue = -1;
+    source.inOrder = 1;
+    source.processNanoseconds = 20000000;
+    source.holdFirst = 1;
+    config.workers = 2;
+    config.depth = 4;
+    config.policy = BACKPRESSURE_DROP_OLDEST;
+    mu_check(run_pipeline(&config, &stages, &stats) == 0);
+    mu_check(stats.captured == stats.written + stats.dropped);
+    mu_check(source.inOrder);
+    mu_check(source.written >= config.depth + 1);
+
+    config.workers = 0;
+    mu_check(run_pipeline(&config, &stages, &stats) == -1);
+    config.workers = 1;
+    config.depth = PIPELINE_MAX_FRAMES;
+    mu_check(run_pipeline(&config, &stages, &stats) == -1);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+
+    MU_RUN_TEST(test_task_graph);
+    MU_RUN_TEST(test_frame_queue);
+    MU_RUN_TEST(test_pipeline);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return 0;
+}
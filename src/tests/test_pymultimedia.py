@@ -1,14 +1,29 @@
 import os
+import numpy as np
+import pytest
 from PIL import Image
 
 import pymultimedia
 
+# The recording build/test_camera leaves behind.
+TEST_RECORDING = os.path.join(os.path.dirname(__file__), "..", "..", "build", "test_replay.rec")
+
+
+def camera_device():
+    """A real camera if MULTIMEDIA_TEST_DEVICE names one, else a replay of the C tests' recording."""
+    device = os.environ.get("MULTIMEDIA_TEST_DEVICE")
+    if device:
+        return device
+    assert os.path.exists(TEST_RECORDING), "%s is missing: run build/test_camera first" % TEST_RECORDING
+    return "file:" + os.path.abspath(TEST_RECORDING)
+
 
 def test_grab_frame_rgb():
-    dev_handle = pymultimedia.py_open_device("/dev/video0")
+    device = camera_device()
+    dev_handle = pymultimedia.py_open_device(device)
     width, height = pymultimedia.py_get_resolution(dev_handle)
     pymultimedia.py_close_device(dev_handle)
-    image_ndarray = pymultimedia.py_grab_frame_rgb("/dev/video0", width, height)
+    image_ndarray = pymultimedia.py_grab_frame_rgb(device, width, height)
     assert image_ndarray.shape == (height, width, 3)
     img = Image.fromarray(image_ndarray, "RGB")
     img.save("test.bmp")
@@ -20,10 +35,11 @@ def test_grab_frame_rgb():
 
 
 def test_grab_frame_grayscale():
-    dev_handle = pymultimedia.py_open_device("/dev/video0")
+    device = camera_device()
+    dev_handle = pymultimedia.py_open_device(device)
     width, height = pymultimedia.py_get_resolution(dev_handle)
     pymultimedia.py_close_device(dev_handle)
-    image_ndarray = pymultimedia.py_grab_frame_grayscale("/dev/video0", width, height)
+    image_ndarray = pymultimedia.py_grab_frame_grayscale(device, width, height)
     assert image_ndarray.shape == (height, width)
     img = Image.fromarray(image_ndarray, "L")
     img.save("test.bmp")
@@ -32,3 +48,47 @@ def test_grab_frame_grayscale():
     assert new_img.size == (width, height)
 
     os.remove("test.bmp")
+
+
+def test_stage_stats():
+    device = camera_device()
+    pymultimedia.reset_stage_stats()
+    dev_handle = pymultimedia.py_open_device(device)
+    width, height = pymultimedia.py_get_resolution(dev_handle)
+    pymultimedia.py_close_device(dev_handle)
+    pymultimedia.py_grab_frame_rgb(device, width, height)
+
+    stats = pymultimedia.get_stage_stats()
+    if os.environ.get("STAGE_STATS") == "0":
+        # Built with NO_STAGE_STATS, as setup.py does for make STAGE_STATS=0.
+        assert stats == {}
+        return
+    assert stats["dequeue"]["count"] >= 1
+    assert stats["requeue"]["count"] >= 1
+    assert stats["dequeue"]["p50"] <= stats["dequeue"]["p99"] <= stats["dequeue"]["max"]
+
+
+def test_get_image_keypoints():
+    # A white square and a dimmer one: the corners of the white one are the strongest.
+    image = np.zeros((64, 96), dtype=np.uint8)
+    image[16:40, 16:40] = 255
+    image[16:40, 56:80] = 100
+
+    keypoints = pymultimedia.get_image_keypoints(image, sigma=1.0, sigma_w=1.5)
+    assert keypoints.shape == (8, 3)
+    assert np.all(np.diff(keypoints[:, 2]) <= 0)
+    assert all(x < 48 for x in keypoints[:4, 0])
+    assert all(x > 48 for x in keypoints[4:, 0])
+
+    # Corners closer than min_distance to a stronger one are dropped.
+    spaced = pymultimedia.get_image_keypoints(image, sigma=1.0, sigma_w=1.5, min_distance=30.0)
+    assert 0 < len(spaced) < len(keypoints)
+    assert np.all(np.diff(spaced[:, 2]) <= 0)
+    for a in range(len(spaced)):
+        for b in range(a + 1, len(spaced)):
+            assert np.hypot(*(spaced[a, :2] - spaced[b, :2])) >= 30.0
+
+    assert pymultimedia.get_image_keypoints(image, sigma=1.0, sigma_w=1.5, max_keypoints=3).shape == (3, 3)
+    assert pymultimedia.get_image_keypoints(image, sigma=1.0, sigma_w=1.5, measure="shi-tomasi").shape[1] == 3
+    with pytest.raises(ValueError):
+        pymultimedia.get_image_keypoints(image, measure="shi_tomasi")
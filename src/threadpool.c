@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+
+/*
+*  The pool is a set of worker threads started on first use and kept for the
+*  life of the process. A job is a count of independent tasks; the workers
+*  and the submitting thread take them one at a time until none are left.
+*  One job runs at a time: a parallelFor from inside a task, or from another
+*  thread while a job is running, simply runs its tasks on the calling
+*  thread, so nothing ever waits on the pool it is part of.
+*/
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int thread_count = 0;
+static int started_workers = 0;
+static pthread_t workers[MAX_THREAD_COUNT];
+
+static parallel_task job_task;
+static void* job_context;
+static int job_count;
+static int job_next;
+static int job_finished;
+static int job_workers;
+static unsigned int job_generation;
+
+static __thread int inside_task = 0;
+
+// Runs tasks of the current job until none are left. Called, and returns,
+// with pool_lock held.
+static void runTasks(void)
+{
+    int index;
+
+    while (job_next < job_count) {
+        index = job_next++;
+        pthread_mutex_unlock(&pool_lock);
+
+        inside_task = 1;
+        job_task(job_context, index);
+        inside_task = 0;
+
+        pthread_mutex_lock(&pool_lock);
+        if (++job_finished == job_count)
+            pthread_cond_signal(&pool_done);
+    }
+}
+
+static void* poolWorker(void* arg)
+{
+    int worker = (int)(long)arg;
+    unsigned int seen;
+
+    // Workers are started by the job they are first needed for, which is
+    // already under way by the time they get the lock.
+    pthread_mutex_lock(&pool_lock);
+    seen = job_generation - 1;
+    for(;;) {
+        while (job_generation == seen)
+            pthread_cond_wait(&pool_work, &pool_lock);
+        seen = job_generation;
+
+        // Workers beyond the current thread count sit the job out.
+        if (worker < job_workers)
+            runTasks();
+    }
+
+    return NULL;
+}
+
+static int defaultThreadCount(void)
+{
+    char* value;
+    char* end;
+    long threads;
+
+    value = getenv(THREAD_COUNT_ENV);
+    if (value != NULL) {
+        threads = strtol(value, &end, 10);
+        if (end != value && *end == '\0' && threads > 0)
+            return (threads < MAX_THREAD_COUNT) ? (int)threads : MAX_THREAD_COUNT;
+    }
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (threads < 1) ? 1 : ((threads < MAX_THREAD_COUNT) ? (int)threads : MAX_THREAD_COUNT);
+}
+
+/*
+*  Function: setThreadCount
+*  ------------------------
+*
+*  threads  The number of threads parallel work is shared between, the
+*           calling thread included; 1 runs everything on the caller. 0 (or
+*           less) goes back to the default: the THREAD_COUNT_ENV environment
+*           variable if it is set, or else one thread per online CPU.
+*
+*  Returns the number of threads now in use, at most MAX_THREAD_COUNT.
+*/
+int setThreadCount(int threads)
+{
+    if (threads < 1)
+        threads = defaultThreadCount();
+    if (threads > MAX_THREAD_COUNT)
+        threads = MAX_THREAD_COUNT;
+
+    __atomic_store_n(&thread_count, threads, __ATOMIC_RELAXED);
+
+    return threads;
+}
+
+int getThreadCount(void)
+{
+    int threads = __atomic_load_n(&thread_count, __ATOMIC_RELAXED);
+
+    if (threads == 0)
+        threads = setThreadCount(0);
+
+    return threads;
+}
+
+/*
+*  Function: parallelFor
+*  ---------------------
+*
+*  count    The number of tasks.
+*  task     Called once for each index 0 .. count - 1, from any thread of the
+*           pool and in any order.
+*  context  Passed to every call of task.
+*
+*  Returns when every task has finished.
+*/
+void parallelFor(int count, parallel_task task, void* context)
+{
+    int index, threads;
+
+    threads = getThreadCount();
+    if (threads > count)
+        threads = count;
+
+    if (threads < 2 || inside_task || pthread_mutex_trylock(&submit_lock) != 0) {
+        for(index=0; index < count; index++)
+            task(context, index);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (started_workers < threads - 1) {
+        if (pthread_create(&workers[started_workers], NULL, poolWorker, (void*)(long)started_workers) != 0)
+            break;
+        started_workers++;
+    }
+
+    job_task = task;
+    job_context = context;
+    job_count = count;
+    job_next = 0;
+    job_finished = 0;
+    job_workers = threads - 1;
+    job_generation++;
+    pthread_cond_broadcast(&pool_work);
+
+    runTasks();
+    while (job_finished < job_count)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_mutex_unlock(&submit_lock);
+}
+
+typedef struct row_bands_ {
+    row_band_task task;
+    void* context;
+    int rows;
+    int bands;
+} row_bands;
+
+static void runRowBand(void* context, int index)
+{
+    row_bands* bands = (row_bands*)context;
+
+    bands->task(bands->context, (int)((long)bands->rows * index / bands->bands),
+                (int)((long)bands->rows * (index + 1) / bands->bands));
+}
+
+/*
+*  Function: parallelRows
+*  ----------------------
+*
+*  rows     The number of rows of the image.
+*  minRows  The fewest rows worth giving a thread.
+*  task     Called with disjoint bands of rows [startRow, endRow) that
+*           together cover 0 .. rows - 1.
+*
+*  Splits the rows into one band per thread, or fewer so that no band is
+*  shorter than minRows, and runs the bands on the pool.
+*/
+void parallelRows(int rows, int minRows, row_band_task task, void* context)
+{
+    row_bands bands;
+
+    bands.task = task;
+    bands.context = context;
+    bands.rows = rows;
+    bands.bands = getThreadCount();
+    if (minRows > 0 && bands.bands > rows / minRows)
+        bands.bands = rows / minRows;
+
+    if (bands.bands < 2) {
+        task(context, 0, rows);
+        return;
+    }
+
+    parallelFor(bands.bands, runRowBand, &bands);
+}
@@ -0,0 +1,20 @@
+#ifndef THREADPOOL_H_   /* Include guard */
+#define THREADPOOL_H_
+
+
+/* The environment variable giving the default number of threads. */
+#define THREAD_COUNT_ENV          "MULTIMEDIA_THREADS"
+#define MAX_THREAD_COUNT          (256)
+
+/* The fewest rows parallelRows gives a band. */
+#define MIN_BAND_ROWS             (16)
+
+typedef void (*parallel_task)(void* context, int index);
+typedef void (*row_band_task)(void* context, int startRow, int endRow);
+
+int setThreadCount(int threads);
+int getThreadCount(void);
+void parallelFor(int count, parallel_task task, void* context);
+void parallelRows(int rows, int minRows, row_band_task task, void* context);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "workspace.h"
+
+
+static workspace_block* newBlock(size_t size)
+{
+    workspace_block* block;
+
+    block = (workspace_block*)malloc(sizeof(workspace_block));
+    if (block == NULL)
+        return NULL;
+
+    if (posix_memalign((void**)&block->memory, WORKSPACE_ALIGNMENT, size) != 0) {
+        free(block);
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+/*
+*  Function: initWorkspace
+*  -----------------------
+*
+*  width, height  The resolution the workspace is for. It starts with one
+*                 double plane of that size and grows by at least a plane
+*                 at a time, as the kernels that run need it. 0 x 0 gives an
+*                 empty workspace that grows by what each request needs.
+*
+*  Returns 0, or -1 if the block cannot be allocated.
+*/
+int initWorkspace(ip_workspace* ws, int width, int height)
+{
+    size_t size = (size_t)width * height * sizeof(double);
+
+    ws->width = width;
+    ws->height = height;
+    ws->first = NULL;
+    ws->current = NULL;
+    ws->growths = 0;
+
+    if (size == 0)
+        return 0;
+
+    ws->first = newBlock(size + WORKSPACE_MIN_BLOCK);
+    ws->current = ws->first;
+
+    return (ws->first == NULL) ? -1 : 0;
+}
+
+void freeWorkspace(ip_workspace* ws)
+{
+    workspace_block* block;
+    workspace_block* next;
+
+    for(block=ws->first; block != NULL; block=next) {
+        next = block->next;
+        free(block->memory);
+        free(block);
+    }
+
+    ws->first = NULL;
+    ws->current = NULL;
+}
+
+/*
+*  Function: workspaceAlloc
+*  ------------------------
+*
+*  Returns size bytes, WORKSPACE_ALIGNMENT aligned, valid until the
+*  workspace is released to a mark taken before this call; or NULL if the
+*  workspace has to grow and cannot.
+*/
+void* workspaceAlloc(ip_workspace* ws, size_t size)
+{
+    workspace_block* block;
+    workspace_block* last;
+    void* memory;
+    size_t grow;
+
+    size = (size + WORKSPACE_ALIGNMENT - 1) & ~(size_t)(WORKSPACE_ALIGNMENT - 1);
+
+    // The blocks after the current one hold nothing live, so the first of
+    // them with room is started afresh.
+    block = ws->current;
+    if (block == NULL) {
+        block = ws->first;
+        if (block != NULL)
+            block->used = 0;
+    }
+    while (block != NULL && block->size - block->used < size) {
+        block = block->next;
+        if (block != NULL)
+            block->used = 0;
+    }
+
+    // A plane at a time, so the planes a kernel takes one after another
+    // share blocks rather than each adding its own.
+    if (block == NULL) {
+        grow = (size_t)ws->width * ws->height * sizeof(double);
+        if (grow < WORKSPACE_MIN_BLOCK)
+            grow = WORKSPACE_MIN_BLOCK;
+        block = newBlock((size > grow) ? size : grow);
+        if (block == NULL)
+            return NULL;
+
+        if (ws->first == NULL) {
+            ws->first = block;
+        } else {
+            for(last=ws->first; last->next != NULL; last=last->next);
+            last->next = block;
+        }
+        ws->growths++;
+    }
+
+    memory = block->memory + block->used;
+    block->used += size;
+    ws->current = block;
+
+    return memory;
+}
+
+void* workspaceCalloc(ip_workspace* ws, size_t size)
+{
+    void* memory = workspaceAlloc(ws, size);
+
+    if (memory != NULL)
+        memset(memory, 0, size);
+
+    return memory;
+}
+
+workspace_mark workspaceMark(ip_workspace* ws)
+{
+    workspace_mark mark;
+
+    mark.block = ws->current;
+    mark.used = (ws->current != NULL) ? ws->current->used : 0;
+
+    return mark;
+}
+
+/*
+*  Function: workspaceRelease
+*  --------------------------
+*
+*  Gives back everything allocated since mark was taken.
+*/
+void workspaceRelease(ip_workspace* ws, workspace_mark mark)
+{
+    ws->current = mark.block;
+    if (mark.block != NULL)
+        mark.block->used = mark.used;
+}
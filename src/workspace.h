@@ -0,0 +1,51 @@
+#ifndef WORKSPACE_H_   /* Include guard */
+#define WORKSPACE_H_
+
+#include <stddef.h>
+
+
+/* Every allocation starts on a cache line. */
+#define WORKSPACE_ALIGNMENT   (64)
+
+/* The smallest block a workspace grows by. */
+#define WORKSPACE_MIN_BLOCK   (64 * 1024)
+
+typedef struct workspace_block_ {
+    struct workspace_block_* next;
+    size_t size;
+    size_t used;
+    unsigned char* memory;
+} workspace_block;
+
+/*
+*  Scratch memory for the image kernels, taken and given back in stack
+*  order. A kernel marks the workspace on entry, takes what it needs with
+*  workspaceAlloc and releases back to the mark on return, so every call
+*  reuses the same memory. A request that does not fit adds a block of at
+*  least one double plane of the resolution, which is kept: once every
+*  kernel has run once, nothing more is allocated, and the workspace holds
+*  about what the kernels that ran need at most.
+*
+*  A workspace is used by one thread at a time.
+*/
+typedef struct ip_workspace_ {
+    int width;                  /* The resolution it was sized for. */
+    int height;
+    workspace_block* first;
+    workspace_block* current;   /* The block allocations come from. */
+    long growths;               /* Blocks added since initWorkspace. */
+} ip_workspace;
+
+typedef struct workspace_mark_ {
+    workspace_block* block;
+    size_t used;
+} workspace_mark;
+
+int initWorkspace(ip_workspace* ws, int width, int height);
+void freeWorkspace(ip_workspace* ws);
+void* workspaceAlloc(ip_workspace* ws, size_t size);
+void* workspaceCalloc(ip_workspace* ws, size_t size);
+workspace_mark workspaceMark(ip_workspace* ws);
+void workspaceRelease(ip_workspace* ws, workspace_mark mark);
+
+#endif